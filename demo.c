@@ -0,0 +1,75 @@
+// ライブラリ (libwasmvm.a) を公開ヘッダだけで使うデモ。
+// ファイルから Wasm モジュールを読み込み、ホスト関数を登録してエクスポート関数を呼び出す。
+//
+//   ./demo                          main.wasm・data.wasm・hello-wat.wasm を順に実行する
+//   ./demo <file.wasm> <export> [i32 の引数...]
+//
+// .wasm は同じディレクトリの .wat から wat2wasm で作る (NOTE.md)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wasmvm.h"
+
+int32_t imported_add(int32_t *args, int argc) {
+    if (argc != 2) return -1;
+    return args[0] + args[1];
+}
+
+int32_t print_i32(int32_t *args, int argc) {
+    if (argc != 1) return -1;
+    printf("print_i32: %d\n", args[0]);
+    return 0;
+}
+
+// path を読み込んで export_name を args で呼び出す
+int run_file(const char *path, const char *export_name, const int32_t *args, int argc) {
+    printf("--- %s: %s ---\n", path, export_name);
+    wasmvm_module *m = wasmvm_module_load_file(path);
+    if (m == NULL) return 1;
+    wasmvm_instance *inst = wasmvm_instantiate(m, WASMVM_JIT);
+    if (inst == NULL) {
+        wasmvm_module_free(m);
+        return 1;
+    }
+    // モジュールがインポートしていない名前の登録は -1 で無視される
+    wasmvm_register_host(inst, "env", "add", imported_add);
+    wasmvm_register_host(inst, "env", "print_i32", print_i32);
+    // WASI (fd_write など) はライブラリのものを使う。path_open はカレントディレクトリの下だけを開ける
+    wasmvm_wasi_enable(inst, ".");
+
+    int status = 1;
+    int32_t result;
+    int results;
+    wasmvm_export *f = wasmvm_find_export(inst, export_name);
+    if (f == NULL) {
+        printf("Export function '%s' not found.\n", export_name);
+    } else if (wasmvm_invoke(inst, f, args, argc, &result) < 0) {
+        printf("'%s' trapped (or takes a different number of arguments)\n", export_name);
+    } else {
+        wasmvm_export_signature(inst, f, NULL, &results);
+        if (results > 0) printf("result: %d\n", result);
+        printf("Execution finished.\n");
+        status = 0;
+    }
+    wasmvm_instance_free(inst);
+    wasmvm_module_free(m);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3) {
+        int32_t args[16];
+        int n = argc - 3 < 16 ? argc - 3 : 16;
+        for (int i = 0; i < n; i++) args[i] = (int32_t)strtol(argv[3 + i], NULL, 0);
+        return run_file(argv[1], argv[2], args, n);
+    }
+    if (argc == 2) {
+        printf("Usage: %s [<file.wasm> <export> [args...]]\n", argv[0]);
+        return 1;
+    }
+    int failed = 0;
+    failed += run_file("main.wasm", "main_add", NULL, 0);
+    failed += run_file("data.wasm", "read_and_print", NULL, 0);
+    failed += run_file("hello-wat.wasm", "_start", NULL, 0);
+    return failed ? 1 : 0;
+}
@@ -1,12 +1,95 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
-
-#define MAX_IMPORT_FUNCS 64
-#define MAX_EXPORT_FUNCS 64
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include "wasmvm.h"
+
+// ビルド時オプション (make の -D で切り替える)
+#ifndef VM_TRACE
+#define VM_TRACE 1   // 1: パース・実行の詳細をprintfで出力する
+#endif
+#ifndef VM_PROFILE
+#define VM_PROFILE 0 // 1: SIGPROFによるサンプリングプロファイラを有効にする
+#endif
+#ifndef VM_BENCH
+#define VM_BENCH 0   // 1: main() の代わりにベンチマークを実行する (命令数も数える)
+#endif
+#ifndef VM_OPSTATS
+#define VM_OPSTATS 0 // 1: opcode・opcodeペア・関数ごとの実行回数を数える
+#endif
+#ifndef VM_FLIGHT_DECODE
+#define VM_FLIGHT_DECODE 0 // 1: main() の代わりにフライトレコーダーの書き出しをテキストにする
+#endif
+#ifndef VM_JIT
+#if defined(__x86_64__)
+#define VM_JIT 1     // 1: ホットな関数を x86-64 のネイティブコードにコンパイルする層を組み込む (vm->jit で有効にする)
+#else
+#define VM_JIT 0
+#endif
+#endif
+#ifndef VM_LIBRARY
+#define VM_LIBRARY 0 // 1: テスト・ベンチマークと main() を除き、wasmvm.h の API を持つライブラリとしてビルドする
+#endif
+#ifndef VM_FLIGHT
+#define VM_FLIGHT 1  // 1: flight_enable したインスタンスで実行の出来事をリングバッファに記録できるようにする
+#endif
+#ifndef VM_IO_URING
+#define VM_IO_URING 1 // 1: ワーカープールで WASI の I/O を io_uring に出せるようにする (WASMVM_POOL_IO_URING)
+#endif
+
+#if VM_PROFILE
+#include <signal.h>
+#include <sys/time.h>
+#endif
+#if defined(__BMI2__)
+#include <immintrin.h> // _pext_u64 (read_LEB128_long)
+#endif
+#if VM_JIT
+#include <setjmp.h>
+#include <signal.h>
+#include <ucontext.h>
+#endif
+#if VM_FLIGHT
+#include <signal.h>
+#endif
+#include <sys/uio.h>
+#include <linux/openat2.h> // struct open_how (WASI の path_open)
+#if VM_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <ucontext.h>
+#endif
+
+// デバッグ出力。VM_TRACE=0 のときはコンパイラが呼び出しごと取り除く
+#define TRACE(...) do { if (VM_TRACE) printf(__VA_ARGS__); } while (0)
+
+#define MAX_GLOBALS 64
+#ifndef VM_MEMORY_SIZE
+#define VM_MEMORY_SIZE 65536 // 線形メモリの大きさ (64KB 固定。make bench-tlb などで -D で大きくできる)
+#endif
+#define VM_ARENA_BLOCK 4096 // モジュールのメタデータ用アリーナのブロックの最小の大きさ
+#define VM_HUGE_PAGE_SIZE (2u << 20) // x86-64 のヒュージページ (THP・hugetlbfs)
+
+// 線形メモリの確保方針 (vm->mem_policy に OR で指定し、parse_sections より前に設定する)
+#define VM_MEM_THP        1 // madvise(MADV_HUGEPAGE) で透過的ヒュージページを使う
+#define VM_MEM_HUGETLB    2 // MAP_HUGETLB で予約済みのヒュージページを使う (足りなければ THP か通常のページ)
+#define VM_MEM_NUMA_LOCAL 4 // 実行するスレッドの NUMA ノードにページを置く (mbind)
+#define VM_MEM_GUARD      8 // 線形メモリの後ろをガードページとして予約し、ネイティブコードの境界検査を省く
+// ガードページを含めた予約の大きさ。i32 のアドレス + VM_MEMORY_SIZE 未満の offset が届く範囲をすべて覆う
+#define VM_GUARD_RESERVE ((((size_t)1 << 32) + VM_MEMORY_SIZE + 4095) & ~(size_t)4095)
+#define VM_JIT_HOT_CALLS 1000 // この回数呼ばれた関数をネイティブコードにコンパイルする (vm->jit == 1)
 
 typedef struct {
     uint8_t param_types[16];
@@ -36,6 +119,124 @@ typedef struct {
     uint32_t memory_idx;
 } MemoryExport;
 
+// グローバル変数の型情報。値そのものは WasmVM.globals に連続して並ぶ
+typedef struct {
+    uint8_t type;        // 値型 (0x7F = i32 のみサポート)
+    uint8_t mutable_;    // 1 = mut
+    char *mod_name;      // インポートされたグローバルのみ
+    char *field_name;
+} GlobalInfo;
+
+typedef struct {
+    const char *name;
+    uint32_t global_idx;
+} GlobalExport;
+
+// 共有メモリで memory.atomic.wait32 しているスレッド (待っているスレッドのスタック上に置く)
+typedef struct Waiter {
+    uint32_t addr;           // 待っているアドレス
+    int woken;               // notify で起こされたか
+    struct Waiter *next;
+} Waiter;
+
+// 複数のインスタンスが別々のスレッドから使う共有線形メモリ (threads proposal の shared memory)
+typedef struct {
+    uint8_t *data;           // VM_MEMORY_SIZE バイト
+    int refcount;            // 参照しているインスタンス・ホストの数
+    pthread_mutex_t lock;    // 待ち行列を守る
+    pthread_cond_t cond;
+    Waiter *waiters;         // wait している順に並ぶ
+    int waiter_count;
+} SharedMemory;
+
+// vm_snapshot で保存するインスタンスの初期状態。
+// 線形メモリの中身は memfd のテンプレートに置き、メモリはその MAP_PRIVATE なビューにする
+typedef struct {
+    int active;                   // スナップショットがあるか
+    int memfd;                    // 線形メモリのテンプレート
+    int32_t globals[MAX_GLOBALS];
+    uint32_t memory_pages;
+} VMSnapshot;
+
+// WASI のゲストの fd の表 (vm_wasi_init で作り、vm_teardown で閉じる)
+#define VM_WASI_MAX_FDS 32
+typedef struct {
+    int enabled;
+    int fds[VM_WASI_MAX_FDS]; // ゲストの fd → ホストの fd (-1 = 閉じている)。0〜2 は標準入出力、3 は path_open の起点
+} WasiCtx;
+
+#if VM_FLIGHT
+// フライトレコーダーのイベント。16バイト固定で、種類ごとに arg/aux の意味が決まっている
+enum {
+    FL_ENTER = 1,  // 関数に入った (arg = 関数 idx, aux = 0: インタプリタ, 1: ネイティブコード, 2: 末尾呼び出し)
+    FL_EXIT,       // 関数から戻った (arg = 戻り先 PC, aux = 0: 呼び出し元へ, 1: ネイティブコードから, 2: トップレベルから)
+    FL_HOST,       // ホスト関数を呼んだ (arg = 関数 idx)
+    FL_TRAP,       // トラップ (arg = PC (ネイティブコードなら 0), aux = 関数 idx (不明なら 0xFFFF))
+    FL_MEMORY,     // 線形メモリを確保した (arg = 新しいページ数, aux = 前のページ数)
+    FL_SAMPLE,     // 一定命令数ごとの PC (arg = PC, aux = opcode)
+    FL_KIND_COUNT
+};
+
+typedef struct {
+    uint64_t time;           // flight_clock() の値
+    uint8_t kind;            // FL_*
+    uint8_t depth;           // 関数の深さ (トップレベルが 0。enter と exit で同じ値になる)
+    uint16_t aux;
+    uint32_t arg;
+} FlightEvent;
+
+// インスタンスごとのリングバッファ。書くのはインスタンスを実行しているスレッドだけなので、
+// イベントを書いてから head を release で進めれば、ロックなしで他のスレッドやシグナルハンドラから読める
+// (読む側は写してから head を読み直し、その間に上書きされたかもしれない分を捨てる)
+typedef struct {
+    uint64_t head;           // これまでに記録したイベントの数
+    uint32_t mask;           // 容量 - 1 (容量は2の冪)
+    uint32_t sample_interval; // PC を記録する間隔 (命令数, 0 = 記録しない)
+    int trap_fd;             // トラップのたびに書き出す先 (-1 = 書き出さない)
+    int dumping;             // 1: flight_dump が snapshot を使っている
+    uint64_t start_time, start_ns; // 記録を始めた時点の flight_clock() と CLOCK_MONOTONIC
+    FlightEvent *snapshot;   // flight_dump が書き出す前に写す先 (events の後ろの同じ件数)
+    FlightEvent events[];
+} FlightRecorder;
+#endif
+
+// funcref テーブルの要素。type_id は正規化済みの型IDなので、
+// call_indirect のシグネチャ検査は整数比較1回で済む
+typedef struct {
+    uint32_t func_idx;   // 呼び出す関数 (未初期化なら UINT32_MAX)
+    uint32_t type_id;    // 関数型の正規化ID (未初期化なら UINT32_MAX)
+} TableEntry;
+
+// ロード時に作る関数ごとのフレーム情報。呼び出し時にローカル変数宣言を読み直さずに済む
+typedef struct {
+    size_t body_pc;          // 最初の命令のPC (ローカル変数宣言の次)
+    uint16_t param_count;
+    uint16_t result_count;
+    uint16_t local_count;    // パラメータを除くローカル変数の数
+    uint16_t local_types[4]; // 値型ごとのローカル変数の数 (i32, i64, f32, f64 の順)
+    uint32_t max_stack;      // 本体の最大スタック高さ (フレームの底からの相対値)
+    uint32_t calls;          // 呼び出し回数 (ホットな関数の検出用)
+    uint8_t jit_state;       // 0: 未コンパイル, 1: ネイティブコードあり, 2: コンパイルできない
+    uint32_t native_size;
+    void *native;            // ネイティブコード (NULL ならインタプリタで実行する)
+    uint8_t lazy;            // 1: まだ準備していない (vm->lazy), 2: 準備に失敗した
+    size_t body_end;         // 本体の終わり (準備するまでの間だけ使う)
+} FuncFrame;
+
+// モジュールのメタデータ (型・インポート・エクスポート・関数ごとの表と名前) の置き場所。
+// 各セクションのパースで要素数がわかった時点で表を切り出す。ブロックは VM_ARENA_BLOCK 以上の
+// 大きさで確保してつなぎ、vm_teardown でまとめて解放する
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t total;            // 確保したブロックの大きさの合計
+} Arena;
+
 typedef struct {
     size_t return_pc;    // 呼び出し元に戻るためのPC
     int local_base;      // このフレームのローカル変数の開始インデックス
@@ -43,12 +244,37 @@ typedef struct {
     int sp_base;         // このフレームのスタックポインタのベース
 } CallFrame;
 
+// ロード時に解決した分岐先。分岐時はスタックを height まで巻き戻し、
+// 上位 arity 個の値を持ち越してから target_pc へ飛ぶ
+typedef struct {
+    size_t target_pc;    // 分岐先PC
+    uint32_t height;     // 分岐先でのスタック高さ (関数フレームの底からの相対値)
+    uint32_t arity;      // 分岐先へ持ち越す値の数
+} BranchTarget;
+
+// br_table の分岐表。branches[first] から count+1 個 (最後が default) が並ぶ
+typedef struct {
+    uint32_t count;
+    uint32_t first;
+} BranchTable;
+
+#if VM_OPSTATS
+// 命令実行回数の統計。モジュールに依存しない部分はインスタンス間で足し合わせられる
+typedef struct {
+    char *name;
+    uint64_t count;
+} FuncStat;
+
 typedef struct {
-    size_t start_pc; // loop/ifの開始位置
-    size_t end_pc;   // endの次の位置
-    size_t else_pc;  // elseの次の位置 (ifブロック専用)
-    uint8_t type;    // 2=block, 3=loop, 4=if
-} Block;
+    uint64_t op[256];          // opcode ごとの実行回数
+    uint64_t pair[256][256];   // [直前のopcode][opcode] の実行回数
+    uint64_t br_if[2];         // br_if: [0]=分岐しない, [1]=分岐する
+    uint64_t if_[2];           // if: [0]=else側へ, [1]=then側へ
+    int prev_op;               // 直前に実行したopcode (-1 = なし)
+    FuncStat *funcs;           // 関数名ごとの実行命令数 (集計用)
+    size_t func_stat_count;
+} OpStats;
+#endif
 
 typedef struct {
     uint8_t *code;
@@ -60,35 +286,359 @@ typedef struct {
 
     int32_t locals[16];
 
-    Block block_stack[64];
-    int block_sp;
-
     CallFrame call_stack[64];
     int call_sp;
-
-    char string_buffer[4096];
-    size_t string_buffer_ptr;
-
-    uint8_t memory[65536]; // 線形メモリ (64KB)
+    int frame_base;          // 実行中の関数フレームのスタックの底
+    int returned;            // トップレベルの関数から戻ったら 1 (トラップで止まったときは変えない)
+    int invoke_depth;        // 実行中の vm_invoke_batch の数 (ホスト関数が同じインスタンスを呼び直すと 2 以上)
+
+    // ロード時に作る制御フロー表 (vm_teardown で解放)
+    // ctrl_map[pc] は制御命令ごとの表のインデックスで、0 は「なし」
+    //   if/else/br/br_if/return/関数末尾のend → branches
+    //   br_table                              → br_tables
+    uint32_t *ctrl_map;
+    BranchTarget *branches;
+    uint32_t branch_count, branch_cap;
+    BranchTable *br_tables;
+    uint32_t br_table_count, br_table_cap;
+
+    Arena arena;             // 以下の表と名前の置き場所 (vm_teardown で解放)
+
+    uint8_t *memory;         // 線形メモリ (VM_MEMORY_SIZE バイトを mmap する。vm_teardown で解放)
     uint32_t memory_pages;   // 確保されているメモリのページ数
+    size_t memory_map_size;  // memory のマッピングの大きさ (ヒュージページの単位に切り上げることがある)
+    size_t memory_reserve_size; // ガードページを含めて予約した大きさ (0 = ガードページなし。ネイティブコードも境界検査をする)
+    int mem_policy;          // VM_MEM_* の組み合わせ
+    int memory_backing;      // 実際に使えたページ: 0 = 通常, 1 = THP, 2 = hugetlbfs
+    SharedMemory *shared;    // 共有メモリなら memory はその data (NULL = このインスタンス専用)
+    int data_fd;             // code と同じ内容のモジュールファイル (data_fd_valid のとき。閉じるのは持ち主)
+    int data_fd_valid;       // 1: ページ境界にそろった data セグメントをこのファイルから直接マップする
+    uint32_t data_pages_mapped; // ファイルからマップした data セグメントのページ数
 
-    ImportFunc import_funcs[MAX_IMPORT_FUNCS]; // Wasmモジュールが要求するインポート
-    size_t import_func_count;
+    ImportFunc *import_funcs; // Wasmモジュールが要求するインポート
+    size_t import_func_count, import_func_cap;
 
-    FuncType func_types[64];
-    size_t func_type_count;
+    FuncType *func_types;
+    uint32_t *canon_type_ids; // 型インデックス → 構造が同じ型の中で最小のインデックス
+    size_t func_type_count, func_type_cap;
 
-    ExportFunc export_funcs[MAX_EXPORT_FUNCS];
-    size_t export_func_count;
+    ExportFunc *export_funcs;
+    size_t export_func_count, export_func_cap;
 
     MemoryExport memory_exports[1]; // メモリのエクスポートは1つまで
     size_t memory_export_count;
 
+    TableEntry *table;       // テーブル0 (vm_teardown で解放)
+    uint32_t table_size;
+
+    int32_t globals[MAX_GLOBALS];        // グローバル変数の値 (インポート分が先頭に並ぶ)
+    GlobalInfo global_info[MAX_GLOBALS];
+    size_t global_count;
+    size_t import_global_count;
+    GlobalExport global_exports[MAX_GLOBALS];
+    size_t global_export_count;
+
+    VMSnapshot snapshot;
+    WasiCtx wasi;
+
+    int optimize;            // 1: parse_sections で関数本体に最適化パスをかける (パース前に設定する)
+    int lazy;                // 1: 関数の準備 (検証・分岐表・フレーム情報) を最初の呼び出しまで遅らせる (パース前に設定する)
+    uint32_t lazy_pending;   // まだ準備していない関数の数
+    int tos_cache;           // 1: run() でスタックトップをレジスタに置く命令ループ (run_loop_tos) を使う
+    size_t opt_insns_before; // 最適化した関数の命令数 (最適化前・後の合計)
+    size_t opt_insns_after;
+
+#if VM_JIT
+    int jit;                 // 0: インタプリタのみ, 1: ホットな関数をコンパイル, 2: パース時に全関数をコンパイル
+    int jit_depth;           // ネイティブコードの呼び出しの深さ (call_sp と合わせて 64 まで)
+    sigjmp_buf *jit_trap;    // ネイティブコードのトラップの戻り先 (jit_invoke)
+    volatile sig_atomic_t jit_trap_code; // トラップの種類 (JIT_TRAP_*。-1 ならメッセージは出力済み)
+    uint32_t jit_compiled;   // コンパイルした関数の数
+    uint32_t jit_hoisted;    // ループの外へ移した演算の数
+    uint32_t jit_checks, jit_checks_removed; // 線形メモリのアクセス数と、省いた境界検査の数
+    uint32_t jit_loops_versioned; // 境界検査を省いた版を作ったループの数
+#endif
+#if VM_FLIGHT
+    FlightRecorder *flight;  // NULL = 記録しない (flight_enable で確保し、vm_teardown で解放)
+    uint32_t flight_countdown; // 次に PC を記録するまでの命令数 (0 = 記録しない)
+#endif
+
     size_t func_count;       // module 内関数数
-    size_t func_pcs[256];    // index → code 上の PC
-    uint32_t func_type_indices[256]; // index -> type_index
+    size_t func_cap;         // 以下の表の要素数 (インポートを含む)
+    size_t *func_pcs;        // index → code 上の PC
+    uint32_t *func_type_indices; // index -> type_index
+    FuncFrame *func_frames;  // index → フレーム情報 (内部関数のみ)
+
+#if VM_PROFILE
+    volatile size_t prof_pc; // 実行中の命令のPC (プロファイラのシグナルハンドラが読む)
+#endif
+#if VM_BENCH
+    uint64_t insn_count;     // 実行した命令数
+#endif
+#if VM_OPSTATS
+    OpStats *opstats;        // このインスタンスの統計 (run() で確保する)
+    uint64_t *pc_counts;     // PC ごとの実行回数 (関数ごとの集計に使う)
+#endif
 } WasmVM;
 
+// ホスト関数を呼んでいるインスタンス (WASI の関数が線形メモリと fd の表を見つけるのに使う)
+static __thread WasmVM *host_caller;
+void vm_wasi_free(WasmVM *vm); // 後で定義
+
+// VM内部のヒープ確保はここを通す (ベンチマークで確保回数を数えるため)。
+// ワーカープールでは複数のスレッドがインスタンスを作るので、数えるのはアトミックにする
+size_t vm_alloc_count;
+
+void *vm_malloc(size_t size) {
+    __atomic_fetch_add(&vm_alloc_count, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *vm_calloc(size_t n, size_t size) {
+    __atomic_fetch_add(&vm_alloc_count, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+void *vm_realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&vm_alloc_count, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+// 先頭のブロックに size バイト以上の空きがなければ、新しいブロックをつなぐ。
+// 名前のように細かく切り出すものは、セクションの大きさの分を先に取っておくと1ブロックに収まる
+int arena_reserve(Arena *a, size_t size) {
+    if (a->head && a->head->size - a->head->used >= size) return 0;
+    size_t cap = size > VM_ARENA_BLOCK ? size : VM_ARENA_BLOCK;
+    ArenaBlock *b = vm_malloc(sizeof(ArenaBlock) + cap);
+    if (b == NULL) return -1;
+    b->next = a->head;
+    b->used = 0;
+    b->size = cap;
+    a->head = b;
+    a->total += cap;
+    return 0;
+}
+
+// アリーナから size バイト (ゼロ初期化) を align バイト境界で切り出す。
+// 先頭のブロックに収まらなければ新しいブロックをつなぐ
+void *arena_alloc(Arena *a, size_t size, size_t align) {
+    ArenaBlock *b = a->head;
+    size_t off = b ? (b->used + align - 1) & ~(align - 1) : 0;
+    if (b == NULL || off > b->size || size > b->size - off) {
+        if (arena_reserve(a, size) < 0) return NULL;
+        b = a->head;
+        off = 0;
+    }
+    b->used = off + size;
+    memset(b->data + off, 0, size);
+    return b->data + off;
+}
+
+void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->total = 0;
+}
+
+#if VM_FLIGHT
+// イベントの時刻。x86-64 では数 ns で読める TSC を使い、ns への換算はデコーダに任せる
+static inline uint64_t flight_clock(void) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// イベントを深さ depth で1件記録する。記録していないインスタンスではポインタの検査だけで戻る
+static inline void flight_record_at(WasmVM *vm, uint8_t kind, uint32_t arg, uint16_t aux, int depth) {
+    FlightRecorder *fr = vm->flight;
+    if (fr == NULL) return;
+    uint64_t head = fr->head;
+    FlightEvent *e = &fr->events[head & fr->mask];
+    e->time = flight_clock();
+    e->kind = kind;
+    e->depth = (uint8_t)depth;
+    e->aux = aux;
+    e->arg = arg;
+    __atomic_store_n(&fr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// 実行中の関数の深さ (call_sp) で記録する
+static inline void flight_record(WasmVM *vm, uint8_t kind, uint32_t arg, uint16_t aux) {
+    flight_record_at(vm, kind, arg, aux, vm->call_sp);
+}
+
+void flight_trap(WasmVM *vm, long func_idx, size_t pc); // 後で定義
+void flight_sample(WasmVM *vm, size_t pc, uint8_t op); // 後で定義
+void flight_disable(WasmVM *vm); // 後で定義
+#endif
+#if VM_JIT
+int jit_install_fault_handler(void); // 後で定義
+#endif
+
+// ヒュージページを使うマッピングを作る。hugetlbfs → THP → 通常のページの順に試し、
+// 使えたものを *backing に返す。大きさはヒュージページの単位に切り上げる
+static void *vm_map_huge(size_t *size, int policy, int *backing) {
+    *size = (*size + VM_HUGE_PAGE_SIZE - 1) & ~(size_t)(VM_HUGE_PAGE_SIZE - 1);
+    if (policy & VM_MEM_HUGETLB) {
+        void *p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *backing = 2;
+            return p;
+        }
+    }
+    // THP はヒュージページの境界にそろった範囲にしか使われないので、余分に取ってから切りそろえる
+    size_t span = *size + VM_HUGE_PAGE_SIZE;
+    uint8_t *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+    uint8_t *p = (uint8_t *)(((uintptr_t)raw + VM_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(VM_HUGE_PAGE_SIZE - 1));
+    if (p > raw) munmap(raw, p - raw);
+    if (raw + span > p + *size) munmap(p + *size, raw + span - (p + *size));
+    *backing = madvise(p, *size, MADV_HUGEPAGE) == 0 ? 1 : 0;
+    return p;
+}
+
+#if VM_JIT
+// 線形メモリを VM_GUARD_RESERVE の予約の先頭に置く。残りは PROT_NONE のままにして、範囲外の
+// アクセスをフォルトにする (ネイティブコードのトラップになる)。RLIMIT_AS などで予約できなければ
+// MAP_FAILED を返し、呼び出し側は境界検査をする普通のマッピングに戻る
+static void *vm_map_guarded(size_t *size, int policy, int *backing) {
+    size_t align = (policy & VM_MEM_THP) ? VM_HUGE_PAGE_SIZE : 4096;
+    size_t span = VM_GUARD_RESERVE + align;
+    uint8_t *raw = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+    uint8_t *p = (uint8_t *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    if (p > raw) munmap(raw, p - raw);
+    munmap(p + VM_GUARD_RESERVE, raw + span - (p + VM_GUARD_RESERVE));
+    // 読み書きできるのはちょうど VM_MEMORY_SIZE まで (その直後からフォルトする)
+    *size = (*size + 4095) & ~(size_t)4095;
+    if (mprotect(p, *size, PROT_READ | PROT_WRITE) != 0 || jit_install_fault_handler() != 0) {
+        munmap(p, VM_GUARD_RESERVE);
+        return MAP_FAILED;
+    }
+    *backing = (policy & VM_MEM_THP) && madvise(p, *size, MADV_HUGEPAGE) == 0 ? 1 : 0;
+    return p;
+}
+#endif
+
+static void vm_unmap_memory(WasmVM *vm) {
+    munmap(vm->memory, vm->memory_reserve_size ? vm->memory_reserve_size : vm->memory_map_size);
+    vm->memory = NULL;
+    vm->memory_reserve_size = 0;
+}
+
+// 線形メモリを、呼び出したスレッドが動いている CPU の NUMA ノードに置く。
+// すでに触ったページも MPOL_MF_MOVE で移す。NUMA でない環境では何もせず -1 を返す
+int vm_bind_memory_local(WasmVM *vm) {
+    unsigned cpu, node;
+    unsigned long mask[16] = {0}; // 1024 ノード分
+    if (vm->memory == NULL || vm->shared) return -1;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= sizeof(mask) * 8) return -1;
+    mask[node / 64] |= 1ul << (node % 64);
+    // MPOL_BIND = 2, MPOL_MF_MOVE = 1 << 1 (<numaif.h> がなくてもビルドできるように直接書く)
+    if (syscall(SYS_mbind, vm->memory, vm->memory_map_size, 2, mask, sizeof(mask) * 8, 1 << 1) != 0) return -1;
+    TRACE("[memory] bound to NUMA node %u (cpu %u)\n", node, cpu);
+    return 0;
+}
+
+// 線形メモリを確保する (確保済みなら何もしない)。ゼロ初期化された無名マッピングを使い、
+// vm->mem_policy に従ってガードページ・ヒュージページ・NUMA ノードを選ぶ
+int vm_init_memory(WasmVM *vm) {
+    if (vm->memory != NULL) return 0;
+    size_t size = VM_MEMORY_SIZE;
+    int backing = 0;
+    void *p = MAP_FAILED;
+#if VM_JIT
+    // hugetlbfs のページは PROT_NONE の予約と混ぜられないので、ガードページは通常のページと THP だけ
+    if ((vm->mem_policy & VM_MEM_GUARD) && !(vm->mem_policy & VM_MEM_HUGETLB)) {
+        p = vm_map_guarded(&size, vm->mem_policy, &backing);
+        if (p != MAP_FAILED) vm->memory_reserve_size = VM_GUARD_RESERVE;
+        else size = VM_MEMORY_SIZE; // 予約できなければ、境界検査をする普通のマッピングにする
+    }
+#endif
+    if (p == MAP_FAILED) {
+        if (vm->mem_policy & (VM_MEM_THP | VM_MEM_HUGETLB)) {
+            p = vm_map_huge(&size, vm->mem_policy, &backing);
+        } else {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+    }
+    if (p == MAP_FAILED) {
+        perror("mmap linear memory");
+        return -1;
+    }
+    vm->memory = p;
+    vm->memory_map_size = size;
+    vm->memory_backing = backing;
+    if (vm->mem_policy & VM_MEM_NUMA_LOCAL) vm_bind_memory_local(vm);
+#if VM_FLIGHT
+    flight_record(vm, FL_MEMORY, VM_MEMORY_SIZE / 65536, 0);
+#endif
+    return 0;
+}
+
+// 共有メモリを作る。参照カウントは1 (作った側の参照) から始まる
+SharedMemory *shared_memory_new(void) {
+    SharedMemory *sm = vm_calloc(1, sizeof(SharedMemory));
+    if (sm == NULL) return NULL;
+    void *p = mmap(NULL, VM_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap shared memory");
+        free(sm);
+        return NULL;
+    }
+    sm->data = p;
+    sm->refcount = 1;
+    pthread_mutex_init(&sm->lock, NULL);
+    pthread_cond_init(&sm->cond, NULL);
+    return sm;
+}
+
+void shared_memory_release(SharedMemory *sm) {
+    if (__atomic_sub_fetch(&sm->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    munmap(sm->data, VM_MEMORY_SIZE);
+    pthread_mutex_destroy(&sm->lock);
+    pthread_cond_destroy(&sm->cond);
+    free(sm);
+}
+
+// 共有メモリをインスタンスの線形メモリにする。parse_sections より前に呼ぶ
+void vm_attach_shared_memory(WasmVM *vm, SharedMemory *sm) {
+    if (vm->shared) shared_memory_release(vm->shared);
+    else if (vm->memory) vm_unmap_memory(vm);
+    __atomic_add_fetch(&sm->refcount, 1, __ATOMIC_ACQ_REL);
+    vm->shared = sm;
+    vm->memory = sm->data;
+}
+
+// モジュールが shared メモリを宣言・インポートしたのに共有メモリが渡されていなければ、
+// このインスタンスの共有メモリを作る (wait/notify は共有メモリでしか使えないため)
+int vm_make_memory_shared(WasmVM *vm) {
+    if (vm->shared) return 0;
+    SharedMemory *sm = shared_memory_new();
+    if (sm == NULL) return -1;
+    if (vm->memory) {
+        memcpy(sm->data, vm->memory, VM_MEMORY_SIZE);
+        vm_unmap_memory(vm);
+    }
+    vm->shared = sm; // 作った参照をそのままインスタンスが持つ
+    vm->memory = sm->data;
+    return 0;
+}
+
+int shared_memory_waiters(SharedMemory *sm) {
+    pthread_mutex_lock(&sm->lock);
+    int n = sm->waiter_count;
+    pthread_mutex_unlock(&sm->lock);
+    return n;
+}
+
 // ホスト関数をVMに登録する。Wasmモジュールのインポートと名前でマッチングする。
 void vm_register_import(WasmVM *vm, const char *mod_name, const char *field_name, ImportFuncPtr func) {
     for (size_t i = 0; i < vm->import_func_count; i++) {
@@ -100,16 +650,26 @@ void vm_register_import(WasmVM *vm, const char *mod_name, const char *field_name
     }
 }
 
-// VMの内部バッファに文字列を追加し、そのポインタを返す
-char *add_string_to_buffer(WasmVM *vm, const char *str) {
-    size_t len = strlen(str);
-    if (vm->string_buffer_ptr + len + 1 > sizeof(vm->string_buffer)) {
-        printf("String buffer overflow\n");
+// インポートされるグローバル変数に値を設定する。
+// インポートされた値はロード時にはわからないので、定数に畳み込まれることはない
+void vm_register_global_import(WasmVM *vm, const char *mod_name, const char *field_name, int32_t value) {
+    for (size_t i = 0; i < vm->import_global_count; i++) {
+        if (strcmp(vm->global_info[i].mod_name, mod_name) == 0 &&
+            strcmp(vm->global_info[i].field_name, field_name) == 0) {
+            vm->globals[i] = value;
+            return;
+        }
+    }
+}
+
+// 長さ len の文字列 (NUL 終端なし) をVMのアリーナに写し、そのポインタを返す
+char *add_string_to_buffer(WasmVM *vm, const char *str, size_t len) {
+    char *ptr = arena_alloc(&vm->arena, len + 1, 1);
+    if (ptr == NULL) {
+        printf("Failed to allocate name (%zu bytes)\n", len);
         return NULL;
     }
-    strcpy(vm->string_buffer + vm->string_buffer_ptr, str);
-    char *ptr = vm->string_buffer + vm->string_buffer_ptr;
-    vm->string_buffer_ptr += len + 1;
+    memcpy(ptr, str, len);
     return ptr;
 }
 
@@ -146,109 +706,319 @@ int32_t read_sLEB128(uint8_t *buf, size_t *pc) {
     return result;
 }
 
+// ロード時 (セクション・関数本体の解析) 用の LEB128 デコード。値が end を越えるか5バイトより長ければ
+// "Malformed LEB128" を出して 0 を返し、*pc を end にする (呼び出し側のループは *pc < end を見て止まる)。
+// ほとんどの値 (個数・インデックス・小さな定数) は1〜2バイトなので、そこはインラインで読む。
+// end はセクションの解析ではセクションの末尾、関数本体の解析では本体の末尾で、どちらも parse_sections と
+// parse_code_section がモジュールの中に収まることを確かめてある
+
+// 3バイト以上の値: 8バイト読めるなら、継続ビットの立っていない最初のバイトを ctz で探し、
+// 7ビットずつの組を分岐なしで詰める (BMI2 があれば pext 1命令)。末尾の近くでは1バイトずつ読む
+static uint32_t read_LEB128_long(const uint8_t *buf, size_t *pc, size_t end, int sign) {
+    size_t p = *pc;
+    uint64_t v = 0;
+    unsigned len;
+    if (p <= end && end - p >= 8) {
+        uint64_t x;
+        memcpy(&x, buf + p, 8);
+        uint64_t stops = ~x & 0x8080808080808080ull;
+        len = stops ? (unsigned)__builtin_ctzll(stops) / 8 + 1 : 9;
+        if (len > 5) goto malformed;
+        x &= ~0ull >> (64 - 8 * len);
+#if defined(__BMI2__)
+        v = _pext_u64(x, 0x7F7F7F7F7Full);
+#else
+        v = (x & 0x7F) | (x >> 1 & 0x3F80) | (x >> 2 & 0x1FC000) | (x >> 3 & 0xFE00000) | (x >> 4 & 0x7F0000000ull);
+#endif
+    } else {
+        for (len = 0;; len++) {
+            if (len == 5 || p + len >= end) goto malformed;
+            v |= (uint64_t)(buf[p + len] & 0x7F) << (7 * len);
+            if ((buf[p + len] & 0x80) == 0) break;
+        }
+        len++;
+    }
+    *pc = p + len;
+    if (sign && len < 5) {
+        unsigned unused = 64 - 7 * len; // 符号ビット (最後の組の 0x40) を 64 ビットの最上位へ移して戻す
+        v = (uint64_t)((int64_t)(v << unused) >> unused);
+    }
+    return (uint32_t)v;
+malformed:
+    printf("Malformed LEB128 at pc=%zu\n", p);
+    *pc = end;
+    return 0;
+}
+
+static inline uint32_t read_uLEB128_bounded(const uint8_t *buf, size_t *pc, size_t end) {
+    size_t p = *pc;
+    if (p < end && buf[p] < 0x80) {
+        *pc = p + 1;
+        return buf[p];
+    }
+    if (p + 1 < end && buf[p + 1] < 0x80) {
+        *pc = p + 2;
+        return (buf[p] & 0x7Fu) | (uint32_t)buf[p + 1] << 7;
+    }
+    return read_LEB128_long(buf, pc, end, 0);
+}
+
+// 値を使わずに読み飛ばし、次の位置を返す。終端のバイトを探すだけでよいので、8バイト読めれば
+// ctz 1回で長さが決まる。i64.const もあるので10バイトまで許す
+static inline size_t skip_LEB128_bounded(const uint8_t *buf, size_t pc, size_t end) {
+    if (pc < end && buf[pc] < 0x80) return pc + 1;
+    if (pc <= end && end - pc >= 8) {
+        uint64_t x;
+        memcpy(&x, buf + pc, 8);
+        uint64_t stops = ~x & 0x8080808080808080ull;
+        if (stops) return pc + (unsigned)__builtin_ctzll(stops) / 8 + 1;
+    }
+    for (size_t n = 0; n < 10 && pc + n < end; n++) {
+        if (buf[pc + n] < 0x80) return pc + n + 1;
+    }
+    printf("Malformed LEB128 at pc=%zu\n", pc);
+    return end;
+}
+
+static inline int32_t read_sLEB128_bounded(const uint8_t *buf, size_t *pc, size_t end) {
+    size_t p = *pc;
+    if (p < end && buf[p] < 0x80) {
+        *pc = p + 1;
+        return (int32_t)((uint32_t)buf[p] << 25) >> 25;
+    }
+    if (p + 1 < end && buf[p + 1] < 0x80) {
+        *pc = p + 2;
+        return (int32_t)(((buf[p] & 0x7Fu) | (uint32_t)buf[p + 1] << 7) << 18) >> 18;
+    }
+    return (int32_t)read_LEB128_long(buf, pc, end, 1);
+}
+
+// ロード時に1バイト読む。end に達していれば 0 を返し、*pc を end にする (LEB128 と同じ)
+static inline uint8_t read_byte_bounded(const uint8_t *buf, size_t *pc, size_t end) {
+    if (*pc >= end) {
+        printf("Section ends before pc=%zu\n", *pc);
+        *pc = end;
+        return 0;
+    }
+    return buf[(*pc)++];
+}
+
+// 名前 (長さ + バイト列) を読んでアリーナに写す。セクションの残りに収まらない長さなら NULL を返す
+static char *read_name_bounded(WasmVM *vm, size_t *pc, size_t end_pc) {
+    uint32_t len = read_uLEB128_bounded(vm->code, pc, end_pc);
+    if (len > end_pc - *pc) {
+        printf("Name at pc=%zu (length %u) extends past the end of the section\n", *pc, len);
+        return NULL;
+    }
+    char *name = add_string_to_buffer(vm, (const char *)(vm->code + *pc), len);
+    *pc += len;
+    return name;
+}
+
 void parse_type_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t type_count = read_uLEB128(vm->code, pc);
-printf("  type_count=%u\n", type_count);
-    for (uint32_t i = 0; i < type_count; i++) {
-        uint8_t form = vm->code[(*pc)++]; // 0x60 for func
+    uint32_t type_count = read_uLEB128_bounded(vm->code, pc, vm->size);
+TRACE("  type_count=%u\n", type_count);
+    vm->func_types = arena_alloc(&vm->arena, (size_t)type_count * sizeof(FuncType), sizeof(int));
+    vm->canon_type_ids = arena_alloc(&vm->arena, (size_t)type_count * sizeof(uint32_t), sizeof(uint32_t));
+    if (vm->func_types == NULL || vm->canon_type_ids == NULL) {
+        printf("Failed to allocate %u types\n", type_count);
+        *pc = end_pc;
+        return;
+    }
+    vm->func_type_cap = type_count;
+    for (uint32_t i = 0; i < type_count && *pc < end_pc; i++) {
+        uint8_t form = read_byte_bounded(vm->code, pc, end_pc); // 0x60 for func
         if (form != 0x60) continue;
 
         FuncType ftype = {0};
 
         // パラメータ
-        ftype.param_count = read_uLEB128(vm->code, pc);
-printf("    type[%u]: params=%d, ", i, ftype.param_count);
+        uint32_t param_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+        if (param_count > 16) {
+            printf("Too many params in type[%u]: %u\n", i, param_count);
+            *pc = end_pc;
+            return;
+        }
+        ftype.param_count = (int)param_count;
+TRACE("    type[%u]: params=%d, ", i, ftype.param_count);
         for (int j = 0; j < ftype.param_count; j++) {
-            ftype.param_types[j] = vm->code[(*pc)++];
+            ftype.param_types[j] = read_byte_bounded(vm->code, pc, end_pc);
         }
 
         // 戻り値
-        ftype.result_count = read_uLEB128(vm->code, pc);
-printf("results=%d\n", ftype.result_count);
+        uint32_t result_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+        if (result_count > 16) {
+            printf("Too many results in type[%u]: %u\n", i, result_count);
+            *pc = end_pc;
+            return;
+        }
+        ftype.result_count = (int)result_count;
+TRACE("results=%d\n", ftype.result_count);
         for (int j = 0; j < ftype.result_count; j++) {
-            ftype.result_types[j] = vm->code[(*pc)++];
+            ftype.result_types[j] = read_byte_bounded(vm->code, pc, end_pc);
         }
 
-        if (vm->func_type_count < 64) {
+        if (vm->func_type_count < vm->func_type_cap) {
+            // 構造が同じ型には同じIDを割り当てる (call_indirect の型検査用)
+            uint32_t canon = vm->func_type_count;
+            for (size_t k = 0; k < vm->func_type_count; k++) {
+                if (memcmp(&vm->func_types[k], &ftype, sizeof(ftype)) == 0) {
+                    canon = k;
+                    break;
+                }
+            }
+            vm->canon_type_ids[vm->func_type_count] = canon;
             vm->func_types[vm->func_type_count++] = ftype;
         }
     }
 }
 
+// テーブル0を size 要素で作る。要素はすべて未初期化
+void create_table(WasmVM *vm, uint32_t size) {
+    if (vm->table != NULL) return; // テーブルは1つまで
+    vm->table = vm_malloc(sizeof(TableEntry) * (size ? size : 1));
+    if (vm->table == NULL) {
+        printf("Failed to allocate table\n");
+        return;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        vm->table[i] = (TableEntry){ UINT32_MAX, UINT32_MAX };
+    }
+    vm->table_size = size;
+}
+
 void parse_import_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t import_count = read_uLEB128(vm->code, pc);
-    printf("  import_count=%d\n", import_count);
-    for (uint32_t i = 0; i < import_count; i++) {
-        uint32_t mlen = read_uLEB128(vm->code, pc);
-        char mod_name[256];
-        if (mlen < sizeof(mod_name)) {
-            memcpy(mod_name, (char*)(vm->code + *pc), mlen);
-            mod_name[mlen] = '\0';
-        }
-        *pc += mlen;
-
-        uint32_t flen = read_uLEB128(vm->code, pc);
-        char field_name[256];
-        if (flen < sizeof(field_name)) {
-            memcpy(field_name, (char*)(vm->code + *pc), flen);
-            field_name[flen] = '\0';
-        }
-        *pc += flen;
-
-        uint8_t kind = vm->code[(*pc)++];
-        printf("  import[%d]: mod='%s', field='%s', kind=%d\n", i, mod_name, field_name, kind);
+    uint32_t import_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  import_count=%d\n", import_count);
+    // 表は関数以外のインポートの分も取る。名前の合計はセクションの大きさを超えないので、
+    // 表と名前をまとめて1ブロックに置く
+    size_t names = end_pc > *pc ? end_pc - *pc : 0;
+    if (arena_reserve(&vm->arena, (size_t)import_count * sizeof(ImportFunc) + names + 16) == 0) {
+        vm->import_funcs = arena_alloc(&vm->arena, (size_t)import_count * sizeof(ImportFunc), sizeof(void *));
+    }
+    if (vm->import_funcs == NULL) {
+        printf("Failed to allocate %u imports\n", import_count);
+        *pc = end_pc;
+        return;
+    }
+    vm->import_func_cap = import_count;
+    for (uint32_t i = 0; i < import_count && *pc < end_pc; i++) {
+        char *mod_name = read_name_bounded(vm, pc, end_pc);
+        char *field_name = mod_name ? read_name_bounded(vm, pc, end_pc) : NULL;
+        if (mod_name == NULL || field_name == NULL) {
+            *pc = end_pc;
+            return;
+        }
+
+        uint8_t kind = read_byte_bounded(vm->code, pc, end_pc);
+        TRACE("  import[%d]: mod='%s', field='%s', kind=%d\n", i, mod_name, field_name, kind);
         if (kind == 0x00) { // function import
-            uint32_t type_index = read_uLEB128(vm->code, pc);
-            printf("    type_index=%d\n", type_index);
-            if (vm->import_func_count < MAX_IMPORT_FUNCS) {
-                vm->import_funcs[vm->import_func_count++] = (ImportFunc){ add_string_to_buffer(vm, mod_name), add_string_to_buffer(vm, field_name), type_index, 0, NULL };
+            uint32_t type_index = read_uLEB128_bounded(vm->code, pc, end_pc);
+            TRACE("    type_index=%d\n", type_index);
+            if (type_index >= vm->func_type_count) {
+                printf("Import %s.%s has an unknown type index %u\n", mod_name, field_name, type_index);
+                *pc = end_pc;
+                return;
+            }
+            if (vm->import_func_count < vm->import_func_cap) {
+                vm->import_funcs[vm->import_func_count++] = (ImportFunc){ mod_name, field_name, type_index, 0, NULL };
             }
         } else if (kind == 0x02) { // memory import
-            // メモリインポートのパース (現在はスキップするだけ)
-            uint8_t flags = vm->code[(*pc)++];
-            (void)read_uLEB128(vm->code, pc); // initial pages
+            // メモリはホストが vm_attach_shared_memory で渡す。それ以外は専用のメモリを使う
+            uint8_t flags = read_byte_bounded(vm->code, pc, end_pc);
+            (void)read_uLEB128_bounded(vm->code, pc, end_pc); // initial pages
+            if (flags & 0x01) {
+                (void)read_uLEB128_bounded(vm->code, pc, end_pc); // max pages
+            }
+            if (flags & 0x02) { // shared
+                vm_make_memory_shared(vm);
+            }
+        } else if (kind == 0x01) { // table import
+            // ホストからテーブルを受け取る仕組みはないので、空のテーブルとして作る
+            (void)read_byte_bounded(vm->code, pc, end_pc); // reftype
+            uint8_t flags = read_byte_bounded(vm->code, pc, end_pc);
+            uint32_t min = read_uLEB128_bounded(vm->code, pc, end_pc);
             if (flags & 0x01) {
-                (void)read_uLEB128(vm->code, pc); // max pages
+                (void)read_uLEB128_bounded(vm->code, pc, end_pc); // max
+            }
+            create_table(vm, min);
+        } else if (kind == 0x03) { // global import
+            uint8_t type = read_byte_bounded(vm->code, pc, end_pc);
+            uint8_t mut = read_byte_bounded(vm->code, pc, end_pc);
+            TRACE("    global type=0x%02X, mut=%u\n", type, mut);
+            // グローバル変数のインデックスはインポート分が先なので、グローバルセクションより前に並ぶ
+            if (vm->global_count < MAX_GLOBALS) {
+                vm->global_info[vm->global_count] = (GlobalInfo){ type, mut, mod_name, field_name };
+                vm->globals[vm->global_count++] = 0;
+                vm->import_global_count = vm->global_count;
             }
         } else { /* other imports */ }
     }
 }
 
 void parse_function_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t func_count = read_uLEB128(vm->code, pc);
-    printf("  function_count=%u\n", func_count);
-    vm->func_count = vm->import_func_count + func_count;
-    for (uint32_t i = 0; i < func_count; i++) {
-        uint32_t type_index = read_uLEB128(vm->code, pc);
+    uint32_t func_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  function_count=%u\n", func_count);
+    // 関数ごとの表はインポートした関数の分も含めて、関数インデックスで引く
+    size_t n = vm->import_func_count + func_count;
+    vm->func_pcs = arena_alloc(&vm->arena, n * sizeof(size_t), sizeof(size_t));
+    vm->func_type_indices = arena_alloc(&vm->arena, n * sizeof(uint32_t), sizeof(uint32_t));
+    vm->func_frames = arena_alloc(&vm->arena, n * sizeof(FuncFrame), sizeof(void *));
+    if (vm->func_pcs == NULL || vm->func_type_indices == NULL || vm->func_frames == NULL) {
+        printf("Failed to allocate %u functions\n", func_count);
+        *pc = end_pc;
+        return;
+    }
+    vm->func_cap = n;
+    // 型インデックスを読めた関数だけを数える (途中で切れたセクションの残りは存在しないものとして扱う)
+    vm->func_count = vm->import_func_count;
+    for (uint32_t i = 0; i < func_count && *pc < end_pc; i++) {
+        uint32_t type_index = read_uLEB128_bounded(vm->code, pc, end_pc);
         size_t func_idx = vm->import_func_count + i;
-        printf("    func[%zu] has type_index %u\n", func_idx, type_index);
-        if (func_idx < 256) {
-            vm->func_type_indices[func_idx] = type_index;
+        TRACE("    func[%zu] has type_index %u\n", func_idx, type_index);
+        if (type_index >= vm->func_type_count) {
+            printf("func[%zu] has an unknown type index %u\n", func_idx, type_index);
+            *pc = end_pc;
+            return;
         }
+        vm->func_type_indices[func_idx] = type_index;
+        vm->func_count = func_idx + 1;
     }
 }
 
 void parse_export_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t export_count = read_uLEB128(vm->code, pc);
-printf("  export_count=%u\n", export_count);
-    for (uint32_t i = 0; i < export_count; i++) {
-        uint32_t nlen = read_uLEB128(vm->code, pc);
-        char name[256];
-        if (nlen < sizeof(name)) {
-            memcpy(name, (char *)(vm->code + *pc), nlen);
-            name[nlen] = '\0';
-        }
-        *pc += nlen;
-        uint8_t kind = vm->code[(*pc)++];
-        uint32_t index = read_uLEB128(vm->code, pc);
-printf("  export[%u]: name='%s', kind=%u, index=%u\n", i, name, kind, index);
+    uint32_t export_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+TRACE("  export_count=%u\n", export_count);
+    size_t names = end_pc > *pc ? end_pc - *pc : 0;
+    if (arena_reserve(&vm->arena, (size_t)export_count * sizeof(ExportFunc) + names + 16) == 0) {
+        vm->export_funcs = arena_alloc(&vm->arena, (size_t)export_count * sizeof(ExportFunc), sizeof(void *));
+    }
+    if (vm->export_funcs == NULL) {
+        printf("Failed to allocate %u exports\n", export_count);
+        *pc = end_pc;
+        return;
+    }
+    vm->export_func_cap = export_count;
+    for (uint32_t i = 0; i < export_count && *pc < end_pc; i++) {
+        char *name = read_name_bounded(vm, pc, end_pc);
+        if (name == NULL) {
+            *pc = end_pc;
+            return;
+        }
+        uint8_t kind = read_byte_bounded(vm->code, pc, end_pc);
+        uint32_t index = read_uLEB128_bounded(vm->code, pc, end_pc);
+TRACE("  export[%u]: name='%s', kind=%u, index=%u\n", i, name, kind, index);
         if (kind == 0x00) { // function export
-            if (vm->export_func_count < MAX_EXPORT_FUNCS) {
-                vm->export_funcs[vm->export_func_count++] = (ExportFunc){ add_string_to_buffer(vm, name), index, 0 };
+            if (vm->export_func_count < vm->export_func_cap) {
+                vm->export_funcs[vm->export_func_count++] = (ExportFunc){ name, index, 0 };
             }
         } else if (kind == 0x02) { // memory export
             if (vm->memory_export_count < 1) {
-                vm->memory_exports[vm->memory_export_count++] = (MemoryExport){ add_string_to_buffer(vm, name), index };
+                vm->memory_exports[vm->memory_export_count++] = (MemoryExport){ name, index };
+            }
+        } else if (kind == 0x03) { // global export
+            if (vm->global_export_count < MAX_GLOBALS) {
+                vm->global_exports[vm->global_export_count++] = (GlobalExport){ name, index };
             }
         } else {
             // 他のエクスポート種別は未サポート
@@ -256,85 +1026,239 @@ printf("  export[%u]: name='%s', kind=%u, index=%u\n", i, name, kind, index);
     }
 }
 
+void parse_table_section(WasmVM *vm, size_t *pc, size_t end_pc) {
+    uint32_t count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  table_count=%u\n", count);
+    for (uint32_t i = 0; i < count && *pc < end_pc; i++) {
+        uint8_t reftype = read_byte_bounded(vm->code, pc, end_pc); // 0x70 = funcref
+        uint8_t flags = read_byte_bounded(vm->code, pc, end_pc);
+        uint32_t min = read_uLEB128_bounded(vm->code, pc, end_pc);
+        if (flags & 0x01) {
+            (void)read_uLEB128_bounded(vm->code, pc, end_pc); // max
+        }
+        TRACE("    table[%u]: reftype=0x%02X, min=%u\n", i, reftype, min);
+        if (i == 0 && reftype == 0x70) {
+            create_table(vm, min);
+        }
+    }
+}
+
+// 関数インデックス → 関数型の正規化ID
+uint32_t func_type_id(WasmVM *vm, uint32_t func_idx) {
+    uint32_t type_index = func_idx < vm->import_func_count
+        ? vm->import_funcs[func_idx].type_index
+        : vm->func_type_indices[func_idx];
+    return vm->canon_type_ids[type_index];
+}
+
+void parse_element_section(WasmVM *vm, size_t *pc, size_t end_pc) {
+    uint32_t count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  element_segment_count=%u\n", count);
+    for (uint32_t i = 0; i < count && *pc < end_pc; i++) {
+        uint32_t flags = read_uLEB128_bounded(vm->code, pc, end_pc);
+        if (flags != 0x00 && flags != 0x02) {
+            // passive/declarative や式による要素は未サポート
+            printf("Unsupported element segment flags: %u\n", flags);
+            *pc = end_pc;
+            return;
+        }
+        if (flags == 0x02) {
+            (void)read_uLEB128_bounded(vm->code, pc, end_pc); // table index (テーブル0のみ)
+        }
+        // オフセット式 (i32.const + end)
+        (void)read_byte_bounded(vm->code, pc, end_pc);
+        int32_t offset = read_sLEB128_bounded(vm->code, pc, end_pc);
+        (void)read_byte_bounded(vm->code, pc, end_pc); // end opcode
+        if (flags == 0x02) {
+            (void)read_byte_bounded(vm->code, pc, end_pc); // elemkind (0x00 = funcref)
+        }
+        uint32_t n = read_uLEB128_bounded(vm->code, pc, end_pc);
+        TRACE("    elem[%u]: offset=%d, count=%u\n", i, offset, n);
+        for (uint32_t j = 0; j < n && *pc < end_pc; j++) {
+            uint32_t func_idx = read_uLEB128_bounded(vm->code, pc, end_pc);
+            uint32_t slot = (uint32_t)offset + j;
+            if (slot >= vm->table_size || func_idx >= vm->func_count) {
+                printf("Element segment out of range: table[%u] = func %u\n", slot, func_idx);
+                continue;
+            }
+            vm->table[slot] = (TableEntry){ func_idx, func_type_id(vm, func_idx) };
+        }
+    }
+}
+
+void parse_global_section(WasmVM *vm, size_t *pc, size_t end_pc) {
+    uint32_t count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  global_count=%u\n", count);
+    for (uint32_t i = 0; i < count && *pc < end_pc; i++) {
+        uint8_t type = read_byte_bounded(vm->code, pc, end_pc);
+        uint8_t mut = read_byte_bounded(vm->code, pc, end_pc);
+        // 初期化式 (i32.const + end)
+        uint8_t op = read_byte_bounded(vm->code, pc, end_pc);
+        if (type != 0x7F || op != 0x41) {
+            // i32 以外や、i32.const 以外の初期化式は未サポート
+            printf("Unsupported global: type=0x%02X, init opcode=0x%02X\n", type, op);
+            *pc = end_pc;
+            return;
+        }
+        int32_t value = read_sLEB128_bounded(vm->code, pc, end_pc);
+        (void)read_byte_bounded(vm->code, pc, end_pc); // end opcode
+        TRACE("    global[%zu]: %s i32 = %d\n", vm->global_count, mut ? "mut" : "const", value);
+        if (vm->global_count < MAX_GLOBALS) {
+            vm->global_info[vm->global_count] = (GlobalInfo){ type, mut, NULL, NULL };
+            vm->globals[vm->global_count++] = value;
+        }
+    }
+}
+
 void parse_memory_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t count = read_uLEB128(vm->code, pc);
-    printf("  memory_count=%u\n", count);
-    for (uint32_t i = 0; i < count; i++) {
+    uint32_t count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  memory_count=%u\n", count);
+    for (uint32_t i = 0; i < count && *pc < end_pc; i++) {
         // 1つ目のメモリ定義のみサポート
-        uint8_t flags = vm->code[(*pc)++];
+        uint8_t flags = read_byte_bounded(vm->code, pc, end_pc);
         if (flags & 0x80) { // export flag
-            uint32_t nlen = read_uLEB128(vm->code, pc);
-            char name[256];
-            if (nlen < sizeof(name)) {
-                memcpy(name, (char *)(vm->code + *pc), nlen);
-                name[nlen] = '\0';
-            }
-            *pc += nlen;
-            printf("    memory[%u] is exported as '%s'\n", i, name);
+            char *name = read_name_bounded(vm, pc, end_pc);
+            if (name == NULL) {
+                *pc = end_pc;
+                return;
+            }
+            TRACE("    memory[%u] is exported as '%s'\n", i, name);
             if (vm->memory_export_count < 1) {
-                vm->memory_exports[vm->memory_export_count++] = (MemoryExport){ add_string_to_buffer(vm, name), i };
+                vm->memory_exports[vm->memory_export_count++] = (MemoryExport){ name, i };
             }
         }
-        uint32_t initial_pages = read_uLEB128(vm->code, pc);
+        if (flags & 0x02) { // shared
+            vm_make_memory_shared(vm);
+        }
+        uint32_t initial_pages = read_uLEB128_bounded(vm->code, pc, end_pc);
         vm->memory_pages = initial_pages;
-        printf("    memory[0]: initial_pages=%u", initial_pages);
+        TRACE("    memory[0]: initial_pages=%u", initial_pages);
         if (flags & 0x01) { // max指定あり
-            uint32_t max_pages = read_uLEB128(vm->code, pc);
-            printf(", max_pages=%u\n", max_pages);
+            uint32_t max_pages = read_uLEB128_bounded(vm->code, pc, end_pc);
+            TRACE(", max_pages=%u\n", max_pages);
         } else {
-            printf("\n");
+            TRACE("\n");
         }
         // 現在の実装ではメモリは64KB固定なので、この値は情報として保持するのみ
     }
 }
 
+// data セグメント (code の [file_off, file_off + size)) の先頭から、ページ単位で置ける分を
+// モジュールファイルから線形メモリの offset へ MAP_PRIVATE | MAP_FIXED でマップし、マップしたバイト数を返す。
+// コピーせずに済み、書き込まれないページはページキャッシュをインスタンスの間で共有する
+// (書き込むとそのページだけコピーされる)。ファイルの位置とメモリの offset がどちらもページ境界に
+// そろっていなければ 0 を返し、呼び出し側がコピーする。セグメントの末尾の端数もコピーする
+size_t vm_map_data_segment(WasmVM *vm, int32_t offset, size_t file_off, uint32_t size) {
+    const size_t page = 4096;
+    if (!vm->data_fd_valid || vm->shared || vm->memory_backing == 2) return 0; // 共有メモリ・hugetlbfs は張り替えられない
+    if (offset < 0 || (size_t)offset % page != 0 || file_off % page != 0) return 0;
+    if ((uint64_t)offset + size > VM_MEMORY_SIZE) return 0;
+    // ファイルの末尾を越えたページは触ると SIGBUS になるので、モジュールに収まらないセグメントはマップしない
+    if (file_off > vm->size || size > vm->size - file_off) return 0;
+    size_t len = size & ~(page - 1);
+    if (len == 0) return 0;
+    if (mmap(vm->memory + offset, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, vm->data_fd, (off_t)file_off) == MAP_FAILED) {
+        perror("mmap data segment");
+        // MAP_FIXED が失敗したときに元のページが残っている保証はないので、無名のページを張り直してコピーさせる
+        if (mmap(vm->memory + offset, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            perror("mmap");
+        }
+        return 0;
+    }
+    vm->data_pages_mapped += (uint32_t)(len / page);
+    TRACE("      mapped %zu bytes from file offset %zu\n", len, file_off);
+    return len;
+}
+
 void parse_data_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t count = read_uLEB128(vm->code, pc);
-    printf("  data_segment_count=%u\n", count);
-    for (uint32_t i = 0; i < count; i++) {
-        uint32_t mem_idx = read_uLEB128(vm->code, pc); // 0x00のはず
+    uint32_t count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  data_segment_count=%u\n", count);
+    for (uint32_t i = 0; i < count && *pc < end_pc; i++) {
+        uint32_t mem_idx = read_uLEB128_bounded(vm->code, pc, end_pc); // 0x00のはず
         (void)mem_idx;
         // オフセット式 (i32.const + end)
-        uint8_t op = vm->code[(*pc)++];
+        uint8_t op = read_byte_bounded(vm->code, pc, end_pc);
         (void)op;
-        int32_t offset = read_sLEB128(vm->code, pc);
-        (*pc)++; // end opcode
-        uint32_t data_size = read_uLEB128(vm->code, pc);
-        printf("    data[%u]: offset=%d, size=%u\n", i, offset, data_size);
-        memcpy(vm->memory + offset, vm->code + *pc, data_size);
+        int32_t offset = read_sLEB128_bounded(vm->code, pc, end_pc);
+        (void)read_byte_bounded(vm->code, pc, end_pc); // end opcode
+        uint32_t data_size = read_uLEB128_bounded(vm->code, pc, end_pc);
+        TRACE("    data[%u]: offset=%d, size=%u\n", i, offset, data_size);
+        if (data_size > end_pc - *pc) {
+            printf("Data segment %u (size %u) extends past the end of the data section\n", i, data_size);
+            *pc = end_pc;
+            return;
+        }
+        if (offset < 0 || (uint64_t)offset + data_size > VM_MEMORY_SIZE) {
+            printf("Data segment %u (offset %d, size %u) is outside linear memory\n", i, offset, data_size);
+            *pc = end_pc;
+            return;
+        }
+        size_t mapped = vm_map_data_segment(vm, offset, *pc, data_size);
+        memcpy(vm->memory + offset + mapped, vm->code + *pc + mapped, data_size - mapped);
         // --- DEBUG PRINT ---
-        printf("      data content written to memory: \"");
+        TRACE("      data content written to memory: \"");
         for(uint32_t j=0; j<data_size; j++) {
-            printf("%c", vm->memory[offset+j]);
+            TRACE("%c", vm->memory[offset+j]);
         }
-        printf("\"\n");
+        TRACE("\"\n");
         // --- END DEBUG PRINT ---
         *pc += data_size;
     }
 }
 
+int prepare_function(WasmVM *vm, uint32_t func_idx, size_t body_end); // 後で定義
+int optimize_function(WasmVM *vm, uint32_t func_idx, size_t body_end); // 後で定義
+#if VM_JIT
+int jit_compile(WasmVM *vm, uint32_t idx); // 後で定義
+void jit_free(WasmVM *vm); // 後で定義
+#endif
+
 void parse_code_section(WasmVM *vm, size_t *pc, size_t end_pc) {
-    uint32_t func_count = read_uLEB128(vm->code, pc);
-    printf("  code_body_count=%u\n", func_count);
-    for (uint32_t i = 0; i < func_count; i++) {
-        uint32_t body_size = read_uLEB128(vm->code, pc);
+    uint32_t func_count = read_uLEB128_bounded(vm->code, pc, end_pc);
+    TRACE("  code_body_count=%u\n", func_count);
+    if (vm->import_func_count + func_count > vm->func_count) {
+        printf("Too many function bodies: %u\n", func_count);
+        *pc = end_pc;
+        return;
+    }
+    for (uint32_t i = 0; i < func_count && *pc < end_pc; i++) {
+        uint32_t body_size = read_uLEB128_bounded(vm->code, pc, end_pc);
         size_t func_start_pc = *pc;
         size_t func_idx = vm->import_func_count + i;
-        printf("    body[%u] (func_idx %zu): size=%u, start_pc=%zu\n", i, func_idx, body_size, func_start_pc);
-        if (func_idx < 256) {
-            vm->func_pcs[vm->import_func_count + i] = func_start_pc;
+        TRACE("    body[%u] (func_idx %zu): size=%u, start_pc=%zu\n", i, func_idx, body_size, func_start_pc);
+        if (body_size > end_pc - func_start_pc) {
+            // 本体の解析 (prepare・optimize・遅延準備) は本体の末尾を境界にするので、セクションの外を指す本体は読まない
+            printf("Function body %u (size %u) extends past the end of the code section\n", i, body_size);
+            *pc = end_pc;
+            return;
+        }
+        vm->func_pcs[func_idx] = func_start_pc;
+        if (vm->lazy) {
+            // 本体の範囲だけ覚えておく。準備するまでは関数の先頭 (ローカル変数宣言) が入口になる
+            vm->func_frames[func_idx] = (FuncFrame){
+                .body_pc = func_start_pc, .lazy = 1, .body_end = func_start_pc + body_size };
+            vm->lazy_pending++;
+            *pc += body_size;
+            continue;
         }
+        if (vm->optimize) optimize_function(vm, func_idx, func_start_pc + body_size);
+        prepare_function(vm, func_idx, func_start_pc + body_size);
         *pc += body_size;
     }
 }
 
 void parse_sections(WasmVM *vm) {
     size_t pc = 8; // magic + version
+    if (vm_init_memory(vm) < 0) return;
     while (pc < vm->size) {
         uint8_t sec_id = vm->code[pc++];
-        uint32_t sec_size = read_uLEB128(vm->code, &pc);
+        uint32_t sec_size = read_uLEB128_bounded(vm->code, &pc, vm->size);
+        if (sec_size > vm->size - pc) {
+            printf("Section %u (size %u) extends past the end of the module\n", sec_id, sec_size);
+            break;
+        }
         size_t next_sec_start = pc + sec_size;
-printf("sec_id=%d, sec_size=%d, pc=%zu, next_pc=%zu\n", sec_id, sec_size, pc, next_sec_start);
+TRACE("sec_id=%d, sec_size=%d, pc=%zu, next_pc=%zu\n", sec_id, sec_size, pc, next_sec_start);
         switch (sec_id) {
             case 1: // Type Section
                 parse_type_section(vm, &pc, next_sec_start);
@@ -345,12 +1269,21 @@ printf("sec_id=%d, sec_size=%d, pc=%zu, next_pc=%zu\n", sec_id, sec_size, pc, ne
             case 3: // Function Section
                 parse_function_section(vm, &pc, next_sec_start);
                 break;
+            case 4: // Table Section
+                parse_table_section(vm, &pc, next_sec_start);
+                break;
             case 5: // Memory Section
                 parse_memory_section(vm, &pc, next_sec_start);
                 break;
+            case 6: // Global Section
+                parse_global_section(vm, &pc, next_sec_start);
+                break;
             case 7: // Export Section
                 parse_export_section(vm, &pc, next_sec_start);
                 break;
+            case 9: // Element Section
+                parse_element_section(vm, &pc, next_sec_start);
+                break;
             case 10: // Code Section
                 parse_code_section(vm, &pc, next_sec_start);
                 break;
@@ -358,10 +1291,28 @@ printf("sec_id=%d, sec_size=%d, pc=%zu, next_pc=%zu\n", sec_id, sec_size, pc, ne
                 parse_data_section(vm, &pc, next_sec_start);
                 break;
             default: // 未知または未実装のセクションはスキップ
-                pc = next_sec_start; // 次のセクションの開始位置にpcを正しく設定
                 break;
         }
+        if (pc != next_sec_start && sec_id >= 1 && sec_id <= 11) {
+            printf("Section %u size mismatch: parsed up to pc=%zu, section ends at pc=%zu\n", sec_id, pc, next_sec_start);
+        }
+        pc = next_sec_start; // どのセクションも宣言された大きさで区切る
+    }
+    // 本体を読めなかった関数 (コードセクションが無い・壊れている) は準備に失敗したものとして、呼ばれたらエラーにする
+    for (size_t i = vm->import_func_count; i < vm->func_count; i++) {
+        if (vm->func_pcs[i] != 0) continue;
+        vm->func_frames[i] = (FuncFrame){ .lazy = 2 };
+#if VM_JIT
+        vm->func_frames[i].jit_state = 2;
+#endif
+    }
+#if VM_JIT
+    if (vm->jit == 2) {
+        for (size_t i = vm->import_func_count; i < vm->func_count; i++) {
+            if (vm->func_frames[i].native == NULL && vm->func_frames[i].jit_state == 0) jit_compile(vm, (uint32_t)i);
+        }
     }
+#endif
 }
 
 // import関数をモジュール名＋フィールド名で検索
@@ -384,563 +1335,5693 @@ ExportFunc *find_export(WasmVM *vm, const char *name) {
     return NULL;
 }
 
-// 簡易的に WebAssembly の命令のオペランド長を判定してスキップする関数
-size_t skip_operands(uint8_t op, uint8_t *code, size_t pc) {
-    switch (op) {
-        case 0x20: // local.get
-        case 0x21: // local.set
-        case 0x22: // local.tee
-        case 0x23: // global.get
-        case 0x24: // global.set
-        case 0x10: // call
-            (void)read_uLEB128(code, &pc);
-            break;
-        case 0x41: // i32.const
-        case 0x42: // i64.const
-            (void)read_sLEB128(code, &pc);
-            break;
-        case 0x28: case 0x29: case 0x2A: case 0x2B: // load
-        case 0x36: case 0x37: case 0x38: case 0x39: // store
-            (void)read_uLEB128(code, &pc); // align
-            (void)read_uLEB128(code, &pc); // offset
-            break;
-        default:
-            // その他の命令はオペランドなし
-            break;
+// exportされたグローバル変数の値へのポインタを名前で検索
+int32_t *find_global_export(WasmVM *vm, const char *name) {
+    for (size_t i = 0; i < vm->global_export_count; i++) {
+        GlobalExport *g = &vm->global_exports[i];
+        if (strcmp(g->name, name) == 0 && g->global_idx < vm->global_count)
+            return &vm->globals[g->global_idx];
     }
-    return pc;
+    return NULL;
 }
 
-// start_pc の if/block/loop の対応する end_pc を返す
-size_t find_structured_end(uint8_t *code, size_t code_size, size_t start_pc, size_t *else_pc_out) {
-    int depth = 1;
-    size_t pc = start_pc;
-    if (else_pc_out) *else_pc_out = 0;
+// PC を含む内部関数のインデックスを返す (見つからなければ -1)
+// 関数本体はコードセクションに順に並んでいるので、func_pcs の二分探索で求まる
+long find_func_by_pc(WasmVM *vm, size_t pc) {
+    size_t lo = vm->import_func_count, hi = vm->func_count;
+    if (lo >= hi || pc < vm->func_pcs[lo]) return -1;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (vm->func_pcs[mid] <= pc) lo = mid;
+        else hi = mid;
+    }
+    return (long)lo;
+}
 
-    while (depth > 0 && pc < code_size) {
-        uint8_t op = code[pc++];
-        switch (op) {
-            case 0x02: // block
-            case 0x03: // loop
-            case 0x04: // if
-                depth++;
-                pc++; // skip blocktype
-                break;
-            case 0x05: // else
-                if (depth == 1 && else_pc_out) *else_pc_out = pc;
-                break;
-            case 0x0B: // end
-                depth--;
-                if (depth == 0) return pc; // end_pc を返す
-                break;
-            default:
-                pc = skip_operands(op, code, pc);
-                break;
+// 関数の表示名を buf に書き込む (export名 → import名 → func[N] の順で決める)
+void get_func_name(WasmVM *vm, long func_idx, char *buf, size_t size) {
+    if (func_idx < 0) {
+        snprintf(buf, size, "[top]");
+        return;
+    }
+    for (size_t i = 0; i < vm->export_func_count; i++) {
+        if (vm->export_funcs[i].func_idx == (uint32_t)func_idx) {
+            snprintf(buf, size, "%s", vm->export_funcs[i].name);
+            return;
         }
     }
-    return pc;
+    if ((size_t)func_idx < vm->import_func_count) {
+        snprintf(buf, size, "%s.%s", vm->import_funcs[func_idx].mod_name, vm->import_funcs[func_idx].field_name);
+        return;
+    }
+    snprintf(buf, size, "func[%ld]", func_idx);
 }
 
-void run(WasmVM *vm) {
-    while (1) {
-        size_t current_pc = vm->pc; // 実行前のpcを保存
-        if (current_pc >= vm->size) {
-            printf("PC out of bounds\n");
+// 統計やプロファイルの表示用の命令名 (未知の命令は NULL)
+const char *opcode_name(uint8_t op) {
+    switch (op) {
+        case 0x01: return "nop";
+        case 0x02: return "block";
+        case 0x03: return "loop";
+        case 0x04: return "if";
+        case 0x05: return "else";
+        case 0x0B: return "end";
+        case 0x0C: return "br";
+        case 0x0D: return "br_if";
+        case 0x0E: return "br_table";
+        case 0x0F: return "return";
+        case 0x10: return "call";
+        case 0x11: return "call_indirect";
+        case 0x12: return "return_call";
+        case 0x13: return "return_call_indirect";
+        case 0x1A: return "drop";
+        case 0x20: return "local.get";
+        case 0x21: return "local.set";
+        case 0x22: return "local.tee";
+        case 0x23: return "global.get";
+        case 0x24: return "global.set";
+        case 0x28: return "i32.load";
+        case 0x36: return "i32.store";
+        case 0x41: return "i32.const";
+        case 0x45: return "i32.eqz";
+        case 0x48: return "i32.lt_s";
+        case 0x49: return "i32.lt_u";
+        case 0x4A: return "i32.gt_s";
+        case 0x4B: return "i32.gt_u";
+        case 0x4C: return "i32.le_s";
+        case 0x4D: return "i32.le_u";
+        case 0x4E: return "i32.ge_s";
+        case 0x4F: return "i32.ge_u";
+        case 0x67: return "i32.clz";
+        case 0x68: return "i32.ctz";
+        case 0x69: return "i32.popcnt";
+        case 0x6A: return "i32.add";
+        case 0x6B: return "i32.sub";
+        case 0x6C: return "i32.mul";
+        case 0x6D: return "i32.div_s";
+        case 0x6E: return "i32.div_u";
+        case 0x6F: return "i32.rem_s";
+        case 0x70: return "i32.rem_u";
+        case 0xFE: return "atomic";
+        default: return NULL;
+    }
+}
+
+#if VM_OPSTATS
+// --- 命令実行回数の統計 ---
+
+OpStats opstats_total; // 破棄されたインスタンスの統計の合計 (スレッドからも足し込むので opstats_total_lock で守る)
+static pthread_mutex_t opstats_total_lock = PTHREAD_MUTEX_INITIALIZER;
+
+OpStats *opstats_new(void) {
+    OpStats *st = calloc(1, sizeof(OpStats));
+    if (st) st->prev_op = -1;
+    return st;
+}
+
+void opstats_add_func(OpStats *st, const char *name, uint64_t count) {
+    for (size_t i = 0; i < st->func_stat_count; i++) {
+        if (strcmp(st->funcs[i].name, name) == 0) {
+            st->funcs[i].count += count;
             return;
         }
-        uint8_t op = vm->code[vm->pc++]; // 命令を読み込み、pcをインクリメント
-        printf("opcode: 0x%02X at pc=%zu; ", op, current_pc);
-        switch (op) {
-            case 0x20: { // local.get
-                uint32_t i = read_uLEB128(vm->code, &vm->pc);
-                vm->stack[vm->sp++] = vm->locals[i];
-                printf("[local.get] %d: %d\n", i, vm->locals[i]);
-                break;
-            }
-            case 0x21: { // local.set
-                uint32_t i = read_uLEB128(vm->code, &vm->pc);
-                vm->locals[i] = vm->stack[--vm->sp];
-                break;
-            }
-            case 0x22: { // local.tee
-                uint32_t i = read_uLEB128(vm->code, &vm->pc);  // ローカルインデックスを取得
-                vm->locals[i] = vm->stack[vm->sp - 1];        // スタックトップの値をローカルにコピー
-                // vm->sp は減らさない → スタックに値を残す
-                break;
-            }
+    }
+    FuncStat *funcs = realloc(st->funcs, sizeof(FuncStat) * (st->func_stat_count + 1));
+    if (funcs == NULL) return;
+    st->funcs = funcs;
+    st->funcs[st->func_stat_count++] = (FuncStat){ strdup(name), count };
+}
 
-            case 0x28: { // i32.load
-                (void)read_uLEB128(vm->code, &vm->pc); // align
-                uint32_t offset = read_uLEB128(vm->code, &vm->pc);
-                uint32_t addr = (uint32_t)vm->stack[--vm->sp] + offset;
-                if (addr + 4 > sizeof(vm->memory)) { printf("Memory load out of range\n"); return; }
-                int32_t val = (int32_t)(
-                    vm->memory[addr] |
-                    (vm->memory[addr + 1] << 8) |
-                    (vm->memory[addr + 2] << 16) |
-                    (vm->memory[addr + 3] << 24)
-                );
-                vm->stack[vm->sp++] = val;
-                break;
-            }
+// src の統計を dst に足し込む
+void opstats_merge(OpStats *dst, const OpStats *src) {
+    for (int i = 0; i < 256; i++) {
+        dst->op[i] += src->op[i];
+        for (int j = 0; j < 256; j++) dst->pair[i][j] += src->pair[i][j];
+    }
+    for (int i = 0; i < 2; i++) {
+        dst->br_if[i] += src->br_if[i];
+        dst->if_[i] += src->if_[i];
+    }
+    for (size_t i = 0; i < src->func_stat_count; i++) {
+        opstats_add_func(dst, src->funcs[i].name, src->funcs[i].count);
+    }
+}
 
-            case 0x36: { // i32.store
-                (void)read_uLEB128(vm->code, &vm->pc); // align
-                uint32_t offset = read_uLEB128(vm->code, &vm->pc);
-                int32_t val = vm->stack[--vm->sp];
-                uint32_t addr = (uint32_t)vm->stack[--vm->sp] + offset;
-                if (addr + 4 > sizeof(vm->memory)) { printf("Memory store out of range\n"); return; }
-                printf("[i32.store] addr=%u, val=%d (offset=%u) ", addr, val, offset);
-                vm->memory[addr]     = val & 0xFF;
-                vm->memory[addr + 1] = (val >> 8) & 0xFF;
-                vm->memory[addr + 2] = (val >> 16) & 0xFF;
-                vm->memory[addr + 3] = (val >> 24) & 0xFF;
-                uint32_t written_val = (uint32_t)(
-                    vm->memory[addr] |
-                    (vm->memory[addr + 1] << 8) |
-                    (vm->memory[addr + 2] << 16) |
-                    (vm->memory[addr + 3] << 24)
-                );
-                printf(" -> Verifying memory at addr=%u: read back value is %u\n", addr, written_val);
-                break;
+// PC ごとの実行回数を関数ごとにまとめて st に加える
+void opstats_collect_funcs(WasmVM *vm, OpStats *st) {
+    if (vm->pc_counts == NULL) return;
+    char name[128];
+    long cur = -2;
+    uint64_t count = 0;
+    for (size_t pc = 0; pc < vm->size; pc++) {
+        if (vm->pc_counts[pc] == 0) continue;
+        long f = find_func_by_pc(vm, pc);
+        if (f != cur) {
+            if (count > 0) {
+                get_func_name(vm, cur, name, sizeof(name));
+                opstats_add_func(st, name, count);
             }
+            cur = f;
+            count = 0;
+        }
+        count += vm->pc_counts[pc];
+    }
+    if (count > 0) {
+        get_func_name(vm, cur, name, sizeof(name));
+        opstats_add_func(st, name, count);
+    }
+}
 
-            case 0x41: { // i32.const
-                int32_t val = read_sLEB128(vm->code, &vm->pc);
-                printf("[i32.const] %d\n", val);
-                vm->stack[vm->sp++] = val;
-                break;
+static void format_opcode(uint8_t op, char *buf, size_t size) {
+    const char *name = opcode_name(op);
+    if (name) snprintf(buf, size, "%s", name);
+    else snprintf(buf, size, "0x%02X", op);
+}
+
+// 統計を CSV (kind,key,count) または JSON で出力する
+void opstats_write(const OpStats *st, FILE *out, int json) {
+    char a[32], b[32];
+    const char *sep = "";
+    if (json) fprintf(out, "{\n  \"ops\": {");
+    for (int i = 0; i < 256; i++) {
+        if (st->op[i] == 0) continue;
+        format_opcode(i, a, sizeof(a));
+        if (json) { fprintf(out, "%s\n    \"%s\": %llu", sep, a, (unsigned long long)st->op[i]); sep = ","; }
+        else fprintf(out, "op,%s,%llu\n", a, (unsigned long long)st->op[i]);
+    }
+    if (json) { fprintf(out, "\n  },\n  \"pairs\": {"); sep = ""; }
+    for (int i = 0; i < 256; i++) {
+        for (int j = 0; j < 256; j++) {
+            if (st->pair[i][j] == 0) continue;
+            format_opcode(i, a, sizeof(a));
+            format_opcode(j, b, sizeof(b));
+            if (json) { fprintf(out, "%s\n    \"%s %s\": %llu", sep, a, b, (unsigned long long)st->pair[i][j]); sep = ","; }
+            else fprintf(out, "pair,%s %s,%llu\n", a, b, (unsigned long long)st->pair[i][j]);
+        }
+    }
+    if (json) { fprintf(out, "\n  },\n  \"funcs\": {"); sep = ""; }
+    for (size_t i = 0; i < st->func_stat_count; i++) {
+        if (json) { fprintf(out, "%s\n    \"%s\": %llu", sep, st->funcs[i].name, (unsigned long long)st->funcs[i].count); sep = ","; }
+        else fprintf(out, "func,%s,%llu\n", st->funcs[i].name, (unsigned long long)st->funcs[i].count);
+    }
+    if (json) {
+        fprintf(out, "\n  },\n  \"branches\": {\n");
+        fprintf(out, "    \"br_if\": {\"taken\": %llu, \"not_taken\": %llu},\n",
+                (unsigned long long)st->br_if[1], (unsigned long long)st->br_if[0]);
+        fprintf(out, "    \"if\": {\"taken\": %llu, \"not_taken\": %llu}\n  }\n}\n",
+                (unsigned long long)st->if_[1], (unsigned long long)st->if_[0]);
+    } else {
+        fprintf(out, "branch,br_if.taken,%llu\nbranch,br_if.not_taken,%llu\n",
+                (unsigned long long)st->br_if[1], (unsigned long long)st->br_if[0]);
+        fprintf(out, "branch,if.taken,%llu\nbranch,if.not_taken,%llu\n",
+                (unsigned long long)st->if_[1], (unsigned long long)st->if_[0]);
+    }
+}
+
+void opstats_free(OpStats *st) {
+    for (size_t i = 0; i < st->func_stat_count; i++) free(st->funcs[i].name);
+    free(st->funcs);
+    free(st);
+}
+#endif
+
+// インスタンスの破棄。VMが確保したものを解放する
+// (VM_OPSTATS のときは統計を opstats_total に足し込む)
+void vm_teardown(WasmVM *vm) {
+    free(vm->table);
+    vm->table = NULL;
+    vm->table_size = 0;
+    free(vm->ctrl_map);
+    free(vm->branches);
+    free(vm->br_tables);
+    vm->ctrl_map = NULL;
+    vm->branches = NULL;
+    vm->br_tables = NULL;
+    vm->branch_count = vm->branch_cap = 0;
+    vm->br_table_count = vm->br_table_cap = 0;
+    if (vm->shared) shared_memory_release(vm->shared);
+    else if (vm->memory) vm_unmap_memory(vm);
+    vm->shared = NULL;
+    vm->memory = NULL;
+    if (vm->snapshot.active) close(vm->snapshot.memfd);
+    vm->snapshot.active = 0;
+    vm_wasi_free(vm);
+#if VM_JIT
+    jit_free(vm);
+#endif
+#if VM_FLIGHT
+    flight_disable(vm);
+#endif
+#if VM_OPSTATS
+    if (vm->opstats) {
+        opstats_collect_funcs(vm, vm->opstats);
+        pthread_mutex_lock(&opstats_total_lock);
+        opstats_merge(&opstats_total, vm->opstats);
+        pthread_mutex_unlock(&opstats_total_lock);
+        opstats_free(vm->opstats);
+        vm->opstats = NULL;
+    }
+    free(vm->pc_counts);
+    vm->pc_counts = NULL;
+#endif
+    // 関数ごとの統計を集めるのに名前と関数の表を使うので、アリーナは最後に解放する
+    arena_free(&vm->arena);
+    vm->func_types = NULL;
+    vm->canon_type_ids = NULL;
+    vm->import_funcs = NULL;
+    vm->export_funcs = NULL;
+    vm->func_pcs = NULL;
+    vm->func_type_indices = NULL;
+    vm->func_frames = NULL;
+    vm->func_type_cap = vm->import_func_cap = vm->export_func_cap = vm->func_cap = 0;
+    vm->func_type_count = vm->import_func_count = vm->export_func_count = vm->func_count = 0;
+}
+
+// --- スナップショットとリセット ---
+// vm_snapshot は現在の線形メモリを memfd に書き出し、メモリをその MAP_PRIVATE な
+// マッピングに張り替える。以後の書き込みはページ単位でコピーオンライトされ、
+// vm_reset の madvise(MADV_DONTNEED) で書き込んだページだけが捨てられてテンプレートに戻る。
+// リセットのコストはリクエストが触ったページ数に比例し、メモリ全体の大きさには依らない。
+
+int vm_snapshot(WasmVM *vm) {
+    if (vm_init_memory(vm) < 0) return -1;
+    if (vm->shared) {
+        printf("vm_snapshot: shared memory cannot be snapshotted\n");
+        return -1;
+    }
+    if (vm->memory_backing == 2) {
+        // hugetlbfs のマッピングはヒュージページの途中で張り替えられない
+        printf("vm_snapshot: hugetlbfs memory cannot be snapshotted\n");
+        return -1;
+    }
+    int fd = memfd_create("wasmvm-snapshot", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    size_t done = 0;
+    while (done < VM_MEMORY_SIZE) {
+        ssize_t n = pwrite(fd, vm->memory + done, VM_MEMORY_SIZE - done, done);
+        if (n <= 0) {
+            perror("pwrite snapshot");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    // 同じアドレスにテンプレートのコピーオンライトなビューを張る (memory へのポインタは変わらない)
+    if (mmap(vm->memory, VM_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap snapshot");
+        close(fd);
+        return -1;
+    }
+    if (vm->snapshot.active) close(vm->snapshot.memfd);
+    vm->snapshot.active = 1;
+    vm->snapshot.memfd = fd;
+    memcpy(vm->snapshot.globals, vm->globals, sizeof(vm->globals));
+    vm->snapshot.memory_pages = vm->memory_pages;
+    TRACE("[snapshot] memfd=%d, globals=%zu\n", fd, vm->global_count);
+    return 0;
+}
+
+// インスタンスを vm_snapshot した時点の状態に戻す
+int vm_reset(WasmVM *vm) {
+    if (!vm->snapshot.active) {
+        printf("vm_reset: no snapshot\n");
+        return -1;
+    }
+    if (madvise(vm->memory, VM_MEMORY_SIZE, MADV_DONTNEED) < 0) {
+        perror("madvise");
+        return -1;
+    }
+    memcpy(vm->globals, vm->snapshot.globals, sizeof(vm->globals));
+    vm->memory_pages = vm->snapshot.memory_pages;
+    vm->sp = 0;
+    vm->call_sp = 0;
+    vm->frame_base = 0;
+    memset(vm->locals, 0, sizeof(vm->locals));
+    return 0;
+}
+
+// 簡易的に WebAssembly の命令のオペランド長を判定してスキップする関数 (end は関数本体の末尾)
+static inline size_t skip_operands(uint8_t op, uint8_t *code, size_t pc, size_t end) {
+    switch (op) {
+        case 0x20: // local.get
+        case 0x21: // local.set
+        case 0x22: // local.tee
+        case 0x23: // global.get
+        case 0x24: // global.set
+        case 0x10: // call
+        case 0x12: // return_call
+        case 0x0C: // br
+        case 0x0D: // br_if
+            pc = skip_LEB128_bounded(code, pc, end);
+            break;
+        case 0x11: // call_indirect
+        case 0x13: // return_call_indirect
+            pc = skip_LEB128_bounded(code, pc, end); // type index
+            pc = skip_LEB128_bounded(code, pc, end); // table index
+            break;
+        case 0x0E: { // br_table
+            uint32_t count = read_uLEB128_bounded(code, &pc, end);
+            for (uint32_t i = 0; i <= count; i++) {
+                pc = skip_LEB128_bounded(code, pc, end); // label (最後は default)
+            }
+            break;
+        }
+        case 0x02: // block
+        case 0x03: // loop
+        case 0x04: // if
+            pc = skip_LEB128_bounded(code, pc, end); // blocktype (0x40, 値型, 型インデックス)
+            break;
+        case 0xFE: // atomic (サブオペコード + memarg。atomic.fence は予約バイト1つ)
+            if (read_uLEB128_bounded(code, &pc, end) == 0x03) {
+                pc++;
+            } else {
+                pc = skip_LEB128_bounded(code, pc, end); // align
+                pc = skip_LEB128_bounded(code, pc, end); // offset
             }
+            break;
+        case 0x41: // i32.const
+        case 0x42: // i64.const
+            pc = skip_LEB128_bounded(code, pc, end);
+            break;
+        case 0x28: case 0x29: case 0x2A: case 0x2B: // load
+        case 0x36: case 0x37: case 0x38: case 0x39: // store
+            pc = skip_LEB128_bounded(code, pc, end); // align
+            pc = skip_LEB128_bounded(code, pc, end); // offset
+            break;
+        default:
+            // その他の命令はオペランドなし
+            break;
+    }
+    return pc;
+}
 
-            case 0x67: { // i32.clz
-                int32_t value = vm->stack[--vm->sp];
-                if (value == 0) {
-                    vm->stack[vm->sp++] = 32;  // 全部0なら leading zeros = 32
-                    break;
+// 0xFE のサブオペコードのうち i32 のアクセス幅 (バイト数) を返す。未サポートなら 0
+// RMW 命令は add/sub/and/or/xor/xchg/cmpxchg ごとに7つずつ並び、
+// 先頭が i32、+2 が i32 の 8bit 版、+3 が 16bit 版 (残りは i64)
+int atomic_width(uint32_t sub) {
+    switch (sub) {
+        case 0x00: case 0x01: case 0x10: case 0x17: return 4; // notify, wait32, load, store
+        case 0x12: case 0x19: return 1;                       // load8_u, store8
+        case 0x13: case 0x1A: return 2;                       // load16_u, store16
+    }
+    if (sub >= 0x1E && sub <= 0x4E) {
+        switch ((sub - 0x1E) % 7) {
+            case 0: return 4;
+            case 2: return 1;
+            case 3: return 2;
+        }
+    }
+    return 0;
+}
+
+// --- ロード時の制御フロー解析 ---
+// 関数本体を一度だけ走査し、ブロックの対応とスタック高さを静的に求めて
+// 分岐先 (PC・巻き戻し先の高さ・持ち越す値の数) を表にしておく。
+// 実行時は ctrl_map[pc] を引くだけで分岐でき、ブロックのスタックは要らない。
+
+// 解析中の制御ブロック
+typedef struct {
+    uint8_t kind;        // 0=関数, 2=block, 3=loop, 4=if
+    uint32_t height;     // ブロック開始時のスタック高さ (パラメータを除く)
+    uint32_t params;     // ブロックのパラメータの数
+    uint32_t br_arity;   // このラベルへの分岐で持ち越す値の数 (loop はパラメータ、それ以外は結果の数)
+    uint32_t end_arity;  // ブロックの結果の数
+    size_t start_pc;     // loop の先頭 (blocktype の次)
+    uint32_t if_entry;   // if の偽側の分岐先 (else/end で確定する)
+    uint32_t fixups;     // このラベルへの前方分岐の連結リスト (target_pc を次へのリンクに使う)
+    int unreachable;     // br/return などの後の到達不能コードか
+} PrepBlock;
+
+uint32_t new_branch(WasmVM *vm, size_t target_pc, uint32_t height, uint32_t arity) {
+    if (vm->branch_count == vm->branch_cap) {
+        uint32_t cap = vm->branch_cap ? vm->branch_cap * 2 : 64;
+        BranchTarget *b = vm_realloc(vm->branches, sizeof(BranchTarget) * cap);
+        if (b == NULL) return 0;
+        vm->branches = b;
+        vm->branch_cap = cap;
+        if (vm->branch_count == 0) vm->branch_count = 1; // 0 は「なし」に予約
+    }
+    vm->branches[vm->branch_count] = (BranchTarget){ target_pc, height, arity };
+    return vm->branch_count++;
+}
+
+// label への分岐を表に追加する。前方分岐の PC は end で確定させる
+uint32_t new_branch_to(WasmVM *vm, PrepBlock *label) {
+    if (label->kind == 3) {
+        return new_branch(vm, label->start_pc, label->height, label->br_arity);
+    }
+    uint32_t idx = new_branch(vm, label->fixups, label->height, label->br_arity);
+    if (idx) label->fixups = idx;
+    return idx;
+}
+
+void resolve_fixups(WasmVM *vm, PrepBlock *label, size_t target_pc) {
+    uint32_t idx = label->fixups;
+    while (idx != 0) {
+        uint32_t next = (uint32_t)vm->branches[idx].target_pc;
+        vm->branches[idx].target_pc = target_pc;
+        idx = next;
+    }
+    label->fixups = 0;
+}
+
+// blocktype を読み、パラメータと結果の数を返す。
+// 0x40 = なし, 値型 = 結果1つ, 非負の整数 = 型インデックス (マルチバリュー)
+int read_blocktype(WasmVM *vm, size_t *pc, size_t end, uint32_t *params, uint32_t *results) {
+    size_t bt_pc = *pc;
+    if (bt_pc >= end) { printf("Missing blocktype at pc=%zu\n", bt_pc); return -1; }
+    uint8_t bt = vm->code[bt_pc];
+    if (bt == 0x40) { (*pc)++; *params = 0; *results = 0; return 0; }
+    if (bt >= 0x7C && bt <= 0x7F) { (*pc)++; *params = 0; *results = 1; return 0; }
+    int32_t type_idx = read_sLEB128_bounded(vm->code, pc, end);
+    if (type_idx < 0 || (size_t)type_idx >= vm->func_type_count) {
+        printf("Unsupported blocktype 0x%02X at pc=%zu\n", bt, bt_pc);
+        return -1;
+    }
+    *params = vm->func_types[type_idx].param_count;
+    *results = vm->func_types[type_idx].result_count;
+    return 0;
+}
+
+FuncType *get_func_type(WasmVM *vm, uint32_t func_idx) {
+    uint32_t type_index = func_idx < vm->import_func_count
+        ? vm->import_funcs[func_idx].type_index
+        : vm->func_type_indices[func_idx];
+    return &vm->func_types[type_index];
+}
+
+// 不変グローバル変数の global.get を、同じ長さの i32.const に書き換える。
+// 値の LEB128 がインデックスの LEB128 の長さに収まるときだけ書き換えられる
+// (継続ビット付きのバイトで詰めれば、短い値は任意の長さで表せる)
+int fold_global_get(WasmVM *vm, size_t op_pc, size_t next_pc, int32_t value) {
+    size_t width = next_pc - op_pc - 1;
+    if (width > 5 || (width < 5 && (value < -(1 << (7 * width - 1)) || value >= (1 << (7 * width - 1))))) {
+        return 0;
+    }
+    vm->code[op_pc] = 0x41; // i32.const
+    for (size_t i = 0; i < width; i++) {
+        uint8_t byte = (uint8_t)(((uint32_t)value >> (7 * i)) & 0x7F);
+        vm->code[op_pc + 1 + i] = (i + 1 < width) ? (byte | 0x80) : byte;
+    }
+    return 1;
+}
+
+// [pc, end) の命令列を解析する。ftype が NULL なら関数ではない単独の式として扱い、
+// 末尾のスタックの値をすべて結果とみなす
+// max_height が NULL でなければ、最大スタック高さを書き込む
+int prepare_body(WasmVM *vm, size_t pc, size_t end, FuncType *ftype, uint32_t *max_height) {
+    if (vm->ctrl_map == NULL) {
+        vm->ctrl_map = vm_calloc(vm->size, sizeof(uint32_t));
+        if (vm->ctrl_map == NULL) { printf("Failed to allocate control map\n"); return -1; }
+    }
+    size_t body_start = pc;
+    PrepBlock ctrl[64];
+    int csp = 0;
+    uint32_t h = 0, max_h = 0;
+    uint32_t results = ftype ? (uint32_t)ftype->result_count : 0;
+    ctrl[csp++] = (PrepBlock){ .kind = 0, .height = 0, .br_arity = results, .end_arity = results };
+
+    while (pc < end) {
+        size_t op_pc = pc;
+        uint8_t op = vm->code[pc++];
+        PrepBlock *c = &ctrl[csp - 1];
+        uint32_t pops = 0, pushes = 0;
+        switch (op) {
+            case 0x00: // unreachable
+                c->unreachable = 1;
+                h = c->height;
+                break;
+            case 0x01: // nop
+                break;
+            case 0x02: // block
+            case 0x03: // loop
+            case 0x04: { // if
+                uint32_t block_params, block_results;
+                if (op == 0x04) {
+                    if (h > c->height) h--; // 条件
                 }
-            
-                uint32_t uvalue = (uint32_t)value;
-                int32_t count = 0;
-            
-                // 上位ビットから順に0を数える
-                for (int i = 31; i >= 0; i--) {
-                    if (uvalue & (1u << i)) break; // 最初に1が見つかったら終了
-                    count++;
+                if (read_blocktype(vm, &pc, end, &block_params, &block_results) < 0) goto fail;
+                if (csp >= 64) { printf("Blocks nested too deeply at pc=%zu\n", op_pc); goto fail; }
+                // パラメータはブロックの中に持ち込まれるので、ブロックの底はその下になる
+                uint32_t base = (h - c->height >= block_params) ? h - block_params : c->height;
+                PrepBlock b = { .kind = op, .height = base, .params = block_params,
+                                .br_arity = op == 0x03 ? block_params : block_results,
+                                .end_arity = block_results, .start_pc = pc };
+                if (op == 0x04) {
+                    // 偽のときはパラメータを積んだまま else の次 (なければ end の次) へ
+                    b.if_entry = new_branch(vm, 0, h, 0);
+                    vm->ctrl_map[op_pc] = b.if_entry;
                 }
-            
-                vm->stack[vm->sp++] = count;
+                ctrl[csp++] = b;
                 break;
             }
-            case 0x68: { // i32.ctz
-                int32_t value = vm->stack[--vm->sp];  // スタックから値を取り出す
-                if (value == 0) {
-                    vm->stack[vm->sp++] = 32;       // 入力が0なら32ビット分すべてゼロ
-                    break;
-                }
-            
-                int32_t count = 0;
-                uint32_t uvalue = (uint32_t)value;   // 符号を無視してビット演算
-                while ((uvalue & 1) == 0) {           // 末尾のゼロを数える
-                    count++;
-                    uvalue >>= 1;
-                }
-                vm->stack[vm->sp++] = count;          // スタックに結果を戻す
+            case 0x05: { // else
+                if (c->kind != 0x04) { printf("else without if at pc=%zu\n", op_pc); goto fail; }
+                // then 側の終わりから end の次へ飛ぶ
+                uint32_t idx = new_branch_to(vm, c);
+                vm->ctrl_map[op_pc] = idx;
+                vm->branches[c->if_entry].target_pc = pc;
+                c->if_entry = 0;
+                c->unreachable = 0;
+                h = c->height + c->params;
                 break;
             }
-            case 0x69: { // i32.popcnt
-                uint32_t value = (uint32_t)vm->stack[--vm->sp];
-                int32_t count = 0;
-            
-                // Brian Kernighan’s Algorithm（1 を消しながら数える）
-                while (value) {
-                    value &= (value - 1); // 最下位の 1 を消す
-                    count++;
+            case 0x0B: { // end
+                if (csp == 1) {
+                    // 関数の末尾: 実行すると関数から戻る
+                    if (ftype == NULL) c->br_arity = h;
+                    resolve_fixups(vm, c, op_pc);
+                    vm->ctrl_map[op_pc] = new_branch(vm, 0, 0, c->br_arity);
+                    if (max_height) *max_height = max_h;
+                    return 0;
                 }
-            
-                vm->stack[vm->sp++] = count;
+                resolve_fixups(vm, c, pc);
+                if (c->if_entry) vm->branches[c->if_entry].target_pc = pc; // else のない if
+                h = c->height + c->end_arity;
+                csp--;
                 break;
             }
-
-            case 0x6A: { // i32.add
-                int32_t b = vm->stack[--vm->sp];
-                int32_t a = vm->stack[--vm->sp];
-                vm->stack[vm->sp++] = a + b;
+            case 0x0C:   // br
+            case 0x0D: { // br_if
+                uint32_t depth = read_uLEB128_bounded(vm->code, &pc, end);
+                if (depth >= (uint32_t)csp) { printf("Invalid branch depth %u at pc=%zu\n", depth, op_pc); goto fail; }
+                if (op == 0x0D && h > c->height) h--; // 条件
+                vm->ctrl_map[op_pc] = new_branch_to(vm, &ctrl[csp - 1 - depth]);
+                if (op == 0x0C) {
+                    c->unreachable = 1;
+                    h = c->height;
+                }
                 break;
             }
-            case 0x6B: { // i32.sub
-                int32_t b = vm->stack[--vm->sp];
-                int32_t a = vm->stack[--vm->sp];
-                printf("[i32.sub] a = %d, b = %d\n", a, b);
-                vm->stack[vm->sp++] = a - b;
+            case 0x0E: { // br_table
+                if (h > c->height) h--; // インデックス
+                uint32_t count = read_uLEB128_bounded(vm->code, &pc, end);
+                uint32_t first = 0;
+                for (uint32_t i = 0; i <= count; i++) {
+                    uint32_t depth = read_uLEB128_bounded(vm->code, &pc, end);
+                    if (depth >= (uint32_t)csp) { printf("Invalid branch depth %u at pc=%zu\n", depth, op_pc); goto fail; }
+                    uint32_t idx = new_branch_to(vm, &ctrl[csp - 1 - depth]);
+                    if (i == 0) first = idx;
+                }
+                if (vm->br_table_count == vm->br_table_cap) {
+                    uint32_t cap = vm->br_table_cap ? vm->br_table_cap * 2 : 16;
+                    BranchTable *t = vm_realloc(vm->br_tables, sizeof(BranchTable) * cap);
+                    if (t == NULL) goto fail;
+                    vm->br_tables = t;
+                    vm->br_table_cap = cap;
+                    if (vm->br_table_count == 0) vm->br_table_count = 1; // 0 は「なし」に予約
+                }
+                vm->br_tables[vm->br_table_count] = (BranchTable){ count, first };
+                vm->ctrl_map[op_pc] = vm->br_table_count++;
+                c->unreachable = 1;
+                h = c->height;
                 break;
             }
-            case 0x6C: { // i32.mul
-                int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a * b; break;
-            }
-            case 0x6D: { // i32.div_s
-                int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; if (b == 0) { return; } if (a == INT32_MIN && b == -1) { return; }
-                vm->stack[vm->sp++] = a / b;
+            case 0x0F: // return
+                vm->ctrl_map[op_pc] = new_branch(vm, 0, 0, ctrl[0].br_arity);
+                c->unreachable = 1;
+                h = c->height;
                 break;
-            }
-            case 0x6E: { // i32.div_u
-                uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; if (b == 0) { return; }
-                vm->stack[vm->sp++] = (int32_t)(a / b);
+            case 0x10:   // call
+            case 0x12: { // return_call
+                uint32_t idx = read_uLEB128_bounded(vm->code, &pc, end);
+                if (idx >= vm->func_count) { printf("Invalid function index %u at pc=%zu\n", idx, op_pc); goto fail; }
+                FuncType *t = get_func_type(vm, idx);
+                if (idx < vm->import_func_count && t->result_count > 1) {
+                    // ホスト関数の戻り値は int32_t 1つだけ
+                    printf("Multi-value import results are not supported (func %u) at pc=%zu\n", idx, op_pc);
+                    goto fail;
+                }
+                pops = t->param_count;
+                pushes = t->result_count;
+                if (op == 0x12) goto tail_call;
                 break;
             }
-            case 0x6F: { // i32.rem_s
-                int32_t b = vm->stack[--vm->sp];
-                int32_t a = vm->stack[--vm->sp];
-                if (b == 0) { return; }
-                vm->stack[vm->sp++] = a % b;
+            case 0x11:   // call_indirect
+            case 0x13: { // return_call_indirect
+                uint32_t type_idx = read_uLEB128_bounded(vm->code, &pc, end);
+                (void)read_uLEB128_bounded(vm->code, &pc, end); // table index
+                if (type_idx >= vm->func_type_count) { printf("Invalid type index %u at pc=%zu\n", type_idx, op_pc); goto fail; }
+                pops = 1 + vm->func_types[type_idx].param_count;
+                pushes = vm->func_types[type_idx].result_count;
+                if (op == 0x13) goto tail_call;
                 break;
             }
-            case 0x70: { // i32.rem_u
-                uint32_t b = (uint32_t)vm->stack[--vm->sp];
-                uint32_t a = (uint32_t)vm->stack[--vm->sp];
-                if (b == 0) { return; }
-                vm->stack[vm->sp++] = a % b;
+            tail_call:
+                // 末尾呼び出しの後は return と同じ。インポート関数を末尾呼び出ししたときは
+                // この表を使って呼び出し元へ戻る
+                if (pushes != ctrl[0].br_arity) { printf("Tail call result mismatch at pc=%zu\n", op_pc); goto fail; }
+                vm->ctrl_map[op_pc] = new_branch(vm, 0, 0, ctrl[0].br_arity);
+                c->unreachable = 1;
+                h = c->height;
+                pops = pushes = 0;
                 break;
-            }
-
-            case 0x45: { int32_t v = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (v == 0); break; }
-            case 0x48: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a < b); break; }
-            case 0x49: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a < b); break; }
-            case 0x4A: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a > b); break; }
-            case 0x4B: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a > b); break; }
-            case 0x4C: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a <= b); break; }
-            case 0x4D: { // le_u
-                uint32_t b = vm->stack[--vm->sp];
-                uint32_t a = vm->stack[--vm->sp];
-                printf("[i32.le_u] a = %d, b = %d\n", a, b);
-                vm->stack[vm->sp++] = (a <= b);
+            case 0x1A: // drop
+            case 0x21: // local.set
+                pops = 1;
+                pc = skip_operands(op, vm->code, pc, end);
                 break;
-            }
-            case 0x4E: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a >= b); break; }
-            case 0x4F: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a >= b); break; }
-
-            case 0x01: { // nop
-                printf("[nop]\n");
+            case 0x23:   // global.get
+            case 0x24: { // global.set
+                uint32_t idx = read_uLEB128_bounded(vm->code, &pc, end);
+                if (idx >= vm->global_count) { printf("Invalid global index %u at pc=%zu\n", idx, op_pc); goto fail; }
+                if (op == 0x24) {
+                    if (!vm->global_info[idx].mutable_) { printf("global.set to immutable global %u at pc=%zu\n", idx, op_pc); goto fail; }
+                    pops = 1;
+                    break;
+                }
+                // モジュール内で定義された不変グローバルは値がロード時に決まるので、定数に畳み込む
+                if (idx >= vm->import_global_count && !vm->global_info[idx].mutable_ &&
+                    fold_global_get(vm, op_pc, pc, vm->globals[idx])) {
+                    TRACE("    folded global.get %u -> i32.const %d at pc=%zu\n", idx, vm->globals[idx], op_pc);
+                }
+                pushes = 1;
                 break;
             }
-            case 0x02: { // block
-                vm->pc++;
-                size_t end = find_structured_end(vm->code, vm->size, vm->pc, NULL);
-                vm->block_stack[vm->block_sp++] = (Block){.start_pc=vm->pc, .end_pc=end, .type=2};
+            case 0x20: // local.get
+            case 0x41: // i32.const
+                pushes = 1;
+                pc = skip_operands(op, vm->code, pc, end);
                 break;
-            }
-            case 0x03: { // loop
-                vm->pc++;
-                size_t start = vm->pc;
-                size_t end = find_structured_end(vm->code, vm->size, vm->pc, NULL);
-                vm->block_stack[vm->block_sp++] = (Block){.start_pc=start, .end_pc=end, .type=3};
+            case 0x22: // local.tee
+            case 0x28: // i32.load
+                pops = 1;
+                pushes = 1;
+                pc = skip_operands(op, vm->code, pc, end);
                 break;
-            }
-
-            case 0x04: { // if
-                vm->pc++; // blocktype をスキップ
-                size_t then_start_pc = vm->pc;
-                size_t else_pc;
-                size_t end_pc = find_structured_end(vm->code, vm->size, vm->pc, &else_pc);
-                printf("[if] else_pc = %ld, end_pc = %ld; ", else_pc, end_pc);
-                int32_t cond = vm->stack[--vm->sp];
-                printf("cond = %d\n", cond);
-                
-                vm->block_stack[vm->block_sp++] = (Block){.start_pc=then_start_pc, .end_pc=end_pc, .else_pc=else_pc, .type=4};
-                
-                if (cond == 0) {
-                    if (else_pc != 0) vm->pc = else_pc;
-                    else vm->pc = end_pc;
-                }
+            case 0x36: // i32.store
+                pops = 2;
+                pc = skip_operands(op, vm->code, pc, end);
                 break;
-            }
-
-            case 0x05: { // else
-                // if(cond==true) の場合に thenブロックの終端から実行される
-                printf("[else] (pc=%zu) ", current_pc);
-                if (vm->block_sp > 0) {
-                    Block current_block = vm->block_stack[vm->block_sp - 1];
-                    // thenブロックを実行したので、対応するendまでジャンプする
-                    if (current_block.type == 4) {
-                        printf("Jumping from 'else' block. Target end_pc is %zu; ", current_block.end_pc);
-                        vm->pc = current_block.end_pc;
-                        printf("Next loop iteration will execute from pc=%zu.\n", vm->pc);
-                    } else {
-                        printf("current_block.type=%d\n", current_block.type);
-                    }
-                } else {
-                    printf("No block on stack for else. \n");
+            case 0xFE: { // atomic
+                uint32_t sub = read_uLEB128_bounded(vm->code, &pc, end);
+                if (sub == 0x03) { pc++; break; } // atomic.fence
+                if (atomic_width(sub) == 0) {
+                    printf("Unsupported atomic opcode 0xFE 0x%02X at pc=%zu (prepare)\n", sub, op_pc);
+                    goto fail;
                 }
+                (void)read_uLEB128_bounded(vm->code, &pc, end); // align
+                (void)read_uLEB128_bounded(vm->code, &pc, end); // offset
+                if (sub == 0x01) { pops = 3; pushes = 1; }                          // wait32
+                else if (sub == 0x00) { pops = 2; pushes = 1; }                     // notify
+                else if (sub >= 0x10 && sub <= 0x16) { pops = 1; pushes = 1; }      // load
+                else if (sub >= 0x17 && sub <= 0x1D) { pops = 2; }                  // store
+                else if (sub >= 0x48) { pops = 3; pushes = 1; }                     // cmpxchg
+                else { pops = 2; pushes = 1; }                                      // rmw
                 break;
             }
-
-            case 0x0B: { // end
-                printf("[end] pc=%zu. block_sp=%d, call_sp=%d\n", current_pc, vm->block_sp, vm->call_sp);
-            
-                // 現在のPCがブロックの終端を超えた場合も含めてポップ
-                while (vm->block_sp > 0 && vm->block_stack[vm->block_sp - 1].end_pc <= current_pc) {
-                    Block ended_block = vm->block_stack[--vm->block_sp];
-                    printf("  -> Block end. Popped block. New block_sp=%d. Block type=%d\n", vm->block_sp, ended_block.type);
-                }
-            
-                // ブロックスタックが空になったら関数の終端
-                if (vm->block_sp == 0) {
-                    printf("  -> Function end.\n");
-                    if (vm->call_sp > 0) {
-                        CallFrame frame = vm->call_stack[--vm->call_sp];
-                        memcpy(vm->locals, frame.locals, sizeof(vm->locals));
-                        vm->pc = frame.return_pc;
-                        printf("    [return from function] -> Set pc to %zu, call_sp=%d. Restored locals[0]=%d\n",
-                               vm->pc, vm->call_sp, vm->locals[0]);
-                    } else {
-                        printf("    [return from top level]. Final sp=%d\n", vm->sp);
-                        return;
-                    }
-                }
+            case 0x45: // i32.eqz
+            case 0x67: case 0x68: case 0x69: // i32.clz, i32.ctz, i32.popcnt
+                pops = 1;
+                pushes = 1;
                 break;
-            }
+            default:
+                if ((op >= 0x46 && op <= 0x4F) || (op >= 0x6A && op <= 0x78)) { // i32 の比較・二項演算
+                    pops = 2;
+                    pushes = 1;
+                    break;
+                }
+                printf("Unsupported opcode 0x%02X at pc=%zu (prepare)\n", op, op_pc);
+                goto fail;
+        }
+        // 到達不能コードではブロックの底より下を取り出さない
+        h = (h - c->height >= pops) ? h - pops : c->height;
+        h += pushes;
+        if (h > max_h) max_h = h;
+    }
+    if (ftype != NULL) { printf("Function body has no end (pc=%zu)\n", end); goto fail; }
+    // 末尾の end がない単独の式: 関数ラベルへの分岐は式の末尾へ
+    resolve_fixups(vm, &ctrl[0], end);
+    if (max_height) *max_height = max_h;
+    return 0;
 
-            case 0x0C: { // br
-                printf("[br]\n");
-                uint32_t depth = read_uLEB128(vm->code, &vm->pc);
-                if (depth >= vm->block_sp) { return; }
-                Block target = vm->block_stack[vm->block_sp - 1 - depth];
-                if (target.type == 3) { vm->pc = target.start_pc; } 
-                else { vm->block_sp -= (depth + 1); vm->pc = target.end_pc; }
-                break;
-            }
+fail:
+    // 途中まで作った表は使わせない (この範囲の制御命令は実行時にエラーになる)
+    memset(&vm->ctrl_map[body_start], 0, (end - body_start) * sizeof(uint32_t));
+    return -1;
+}
 
-            case 0x0D: { // br_if
-                printf("[br if]\n");
-                uint32_t depth = read_uLEB128(vm->code, &vm->pc);
-                if (vm->stack[--vm->sp] != 0) {
-                    if (depth >= vm->block_sp) { return; }
-                    Block target = vm->block_stack[vm->block_sp - 1 - depth];
-                    if (target.type == 3) { vm->pc = target.start_pc; }
-                    else { vm->block_sp -= (depth + 1); vm->pc = target.end_pc; }
-                }
-                break;
-            }
+// 関数 func_idx のローカル変数宣言を読んでフレーム情報を作り、
+// 本体 (宣言の後から body_end まで) を解析する
+int prepare_function(WasmVM *vm, uint32_t func_idx, size_t body_end) {
+    FuncType *ftype = get_func_type(vm, func_idx);
+    FuncFrame *fr = &vm->func_frames[func_idx];
+    size_t pc = vm->func_pcs[func_idx];
+    *fr = (FuncFrame){ .param_count = ftype->param_count, .result_count = ftype->result_count };
+    uint32_t local_groups = read_uLEB128_bounded(vm->code, &pc, body_end);
+    uint32_t total = ftype->param_count;
+    for (uint32_t i = 0; i < local_groups && pc < body_end; i++) {
+        uint32_t n = read_uLEB128_bounded(vm->code, &pc, body_end); // num_locals
+        uint8_t type = read_byte_bounded(vm->code, &pc, body_end);
+        total = n > 16 ? 17 : total + n;
+        if (total > 16) break; // locals[16] に収まらない
+        fr->local_count += n;
+        if (type >= 0x7C && type <= 0x7F) fr->local_types[0x7F - type] += n;
+    }
+    fr->body_pc = pc;
+    if (total > 16) {
+        printf("Too many locals in func[%u] (%u > 16)\n", func_idx, total);
+        return -1;
+    }
+    if (prepare_body(vm, pc, body_end, ftype, &fr->max_stack) < 0) {
+        printf("Failed to prepare func[%u]\n", func_idx);
+        return -1;
+    }
+    TRACE("    func[%u] frame: params=%u, locals=%u, results=%u, max_stack=%u, body_pc=%zu\n", func_idx,
+          fr->param_count, fr->local_count, fr->result_count, fr->max_stack, fr->body_pc);
+    return 0;
+}
 
-            case 0x0F: { // return
-                printf("return; (at pc=%zu) ", current_pc);
-                        printf("\n--- DEBUG: Returning from fib(1) ---\n");
-                        printf("    Return value on stack: %d, locals[0]: %d\n\n", vm->stack[vm->sp-1], vm->locals[0]);
-                if (vm->call_sp > 0) {
-                    CallFrame frame = vm->call_stack[--vm->call_sp];
-                    // --- ADD: ローカル変数をCallFrameから復元 ---
-                    memcpy(vm->locals, frame.locals, sizeof(vm->locals));
-                    vm->pc = frame.return_pc;
-                    printf("  [return from function] -> Set pc to %zu, call_sp=%d. Restored locals[0] = %d\n", vm->pc, vm->call_sp, vm->locals[0]);
-                } else {
-                    return;
-                }
-                break;
-            }
+// 遅延準備 (vm->lazy): パース時に飛ばした関数を、最初の呼び出しの直前に準備する。
+// 失敗した関数は入口を関数の先頭に戻したままにして、呼ばれるたびにエラーにする
+int prepare_lazy_function(WasmVM *vm, uint32_t func_idx) {
+    FuncFrame *fr = &vm->func_frames[func_idx];
+    if (fr->lazy == 2) {
+        printf("func[%u] failed to prepare\n", func_idx);
+        return -1;
+    }
+    size_t end = fr->body_end;
+    TRACE("    lazy prepare func[%u]\n", func_idx);
+    if (vm->optimize) optimize_function(vm, func_idx, end);
+    if (prepare_function(vm, func_idx, end) < 0) {
+        fr->lazy = 2;
+        fr->body_pc = vm->func_pcs[func_idx];
+        fr->body_end = end;
+        return -1;
+    }
+    vm->lazy_pending--;
+    return 0;
+}
 
-            case 0x10: { // call
-                printf("[call] pc=%zu. block_sp=%d, call_sp=%d; ", current_pc, vm->block_sp, vm->call_sp);
-                uint32_t idx = read_uLEB128(vm->code, &vm->pc);
+// 内部関数 idx を呼べる状態にする (準備済みなら何もしない)
+static inline int ensure_prepared(WasmVM *vm, uint32_t func_idx) {
+    if (vm->func_frames[func_idx].lazy == 0) return 0;
+    return prepare_lazy_function(vm, func_idx);
+}
 
-                if (idx < vm->import_func_count) {
-                    // --- インポート関数の呼び出し ---
-                    ImportFunc *f = &vm->import_funcs[idx];
-                    if (f->func == NULL) {
-                        printf("Unresolved import function: %s.%s\n", f->mod_name, f->field_name);
-                        return;
-                    }
-                    FuncType *ftype = &vm->func_types[f->type_index];
-                    int param_count = ftype->param_count;
+// --- ロード時の最適化 ---
+// 関数本体を命令列にデコードし、覗き穴最適化をかけてから同じ場所に書き戻す。
+// 制御構造 (block/loop/if/else/end) は命令列に残したままなので、分岐先は
+// 書き換え後の prepare_function で改めて解決される。
+// 覗き穴は出力済みの命令列の末尾だけを見るので、制御命令をまたいで値を畳み込むことはない。
+//   - 定数畳み込み: i32.const a; i32.const b; 二項演算 → i32.const (a op b)
+//   - 単位元の除去: i32.const 0; i32.add など
+//   - local.set x; local.get x → local.tee x
+//   - 使われない値の除去: (i32.const|local.get|global.get); drop → なし, local.tee x; drop → local.set x
+//   - br/br_table/return/unreachable/末尾呼び出しの後の到達不能コードの除去
+//   - モジュール内で定義された不変グローバルの global.get を定数として扱う
 
-                    printf("{call import} func_idx=%u, name='%s.%s', params=%d\n", idx, f->mod_name, f->field_name, param_count);
-                    vm->sp -= param_count;
-                    int32_t ret = f->func(&vm->stack[vm->sp], param_count);
+typedef struct {
+    uint8_t op;
+    int32_t imm;             // i32.const の値、local.* のインデックス
+    uint32_t off, len;       // 元のバイト列 (off == UINT32_MAX なら op と imm から符号化し直す)
+} OptInsn;
+
+// オペランドの長さを skip_operands で正しく求められる命令か
+int opt_known_opcode(uint8_t op) {
+    if (op <= 0x05 || (op >= 0x0B && op <= 0x13) || op == 0x1A) return 1;
+    if ((op >= 0x20 && op <= 0x24) || op == 0x28 || op == 0x36 || op == 0x41 || op == 0xFE) return 1;
+    return op >= 0x45 && op <= 0x78 && op != 0x50 && (op <= 0x4F || op >= 0x67);
+}
 
-                    if (ftype->result_count > 0) {
-                        vm->stack[vm->sp++] = ret;
-                    }
-                } else {
-                    // --- 内部関数の呼び出し ---
-                    uint32_t type_idx = vm->func_type_indices[idx];
-                    FuncType *ftype = &vm->func_types[type_idx];
-                    int param_count = ftype->param_count;
-
-                    printf("{call internal} func_idx=%u, type_idx=%u, params=%d, vm->call_sp=%d; ", idx, type_idx, param_count, vm->call_sp);
-
-                    // 関数呼び出しスタックに現在の状態を保存
-                    if (vm->call_sp >= 64) { printf("Call stack overflow\n"); return; }
-                    // --- ADD: ローカル変数をCallFrameに保存 ---
-                    printf("Current locals[0] = %d; ", vm->locals[0]);
-                    memcpy(vm->call_stack[vm->call_sp].locals, vm->locals, sizeof(vm->locals));
-                    printf("Saved locals[0] = %d; ", vm->call_stack[vm->call_sp].locals[0]);
-                    // vm->call_stack[vm->call_sp++] = (CallFrame){ .return_pc = vm->pc };
-                    vm->call_stack[vm->call_sp++].return_pc = vm->pc;
-
-                    // 新しい関数のPCにジャンプ
-                    vm->pc = vm->func_pcs[idx];
-
-                    // --- 関数のプロローグ (runの先頭にあった処理をここに移動) ---
-                    // スタックから引数をローカル変数にコピー
-                    for (int i = param_count - 1; i >= 0; i--) {
-                        vm->locals[i] = vm->stack[--vm->sp];
-                    }
-                    // デバッグ出力
-                    for (int i = 0; i < param_count; i++) {
-                        printf("arg[%d] = %d; ", i, vm->locals[i]);
-                    }
-                    printf("\n");
-                    // ローカル変数宣言をパース
-                    uint32_t local_groups = read_uLEB128(vm->code, &vm->pc);
-                    for (uint32_t i = 0; i < local_groups; i++) {
-                        (void)read_uLEB128(vm->code, &vm->pc); // num_locals
-                        (void)vm->code[vm->pc++]; // type
-                    }
-                    // --- 関数のプロローグここまで ---
+// i32 の二項演算を畳み込む。トラップする組み合わせなどで畳み込めなければ 0 を返す
+int opt_fold_binop(uint8_t op, int32_t a, int32_t b, int32_t *r) {
+    uint32_t ua = (uint32_t)a, ub = (uint32_t)b;
+    switch (op) {
+        case 0x46: *r = a == b; return 1;
+        case 0x47: *r = a != b; return 1;
+        case 0x48: *r = a < b; return 1;
+        case 0x49: *r = ua < ub; return 1;
+        case 0x4A: *r = a > b; return 1;
+        case 0x4B: *r = ua > ub; return 1;
+        case 0x4C: *r = a <= b; return 1;
+        case 0x4D: *r = ua <= ub; return 1;
+        case 0x4E: *r = a >= b; return 1;
+        case 0x4F: *r = ua >= ub; return 1;
+        case 0x6A: *r = (int32_t)(ua + ub); return 1;
+        case 0x6B: *r = (int32_t)(ua - ub); return 1;
+        case 0x6C: *r = (int32_t)(ua * ub); return 1;
+        case 0x6D: if (b == 0 || b == -1) return 0; *r = a / b; return 1;
+        case 0x6E: if (ub == 0) return 0; *r = (int32_t)(ua / ub); return 1;
+        case 0x6F: if (b == 0 || b == -1) return 0; *r = a % b; return 1;
+        case 0x70: if (ub == 0) return 0; *r = (int32_t)(ua % ub); return 1;
+        case 0x71: *r = a & b; return 1;
+        case 0x72: *r = a | b; return 1;
+        case 0x73: *r = a ^ b; return 1;
+        case 0x74: *r = (int32_t)(ua << (ub & 31)); return 1;
+        case 0x75: *r = a >> (ub & 31); return 1;
+        case 0x76: *r = (int32_t)(ua >> (ub & 31)); return 1;
+        case 0x77: *r = (int32_t)((ua << (ub & 31)) | (ua >> ((32 - (ub & 31)) & 31))); return 1;
+        case 0x78: *r = (int32_t)((ua >> (ub & 31)) | (ua << ((32 - (ub & 31)) & 31))); return 1;
+        default: return 0;
+    }
+}
+
+// 末尾に追加した命令を起点に、覗き穴の規則を当てはまらなくなるまで適用する
+void opt_peephole(OptInsn *out, size_t *n) {
+    for (;;) {
+        size_t k = *n;
+        if (k >= 1 && out[k-1].op == 0x01) { // nop
+            *n = k - 1;
+            continue;
+        }
+        if (k >= 2 && out[k-1].op == 0x1A) { // drop
+            uint8_t prev = out[k-2].op;
+            if (prev == 0x41 || prev == 0x20 || prev == 0x23) { // 副作用のない値を捨てるだけ
+                *n = k - 2;
+                continue;
+            }
+            if (prev == 0x22) { // local.tee x; drop → local.set x
+                out[k-2] = (OptInsn){ 0x21, out[k-2].imm, UINT32_MAX, 0 };
+                *n = k - 1;
+                continue;
+            }
+        }
+        if (k >= 2 && out[k-2].op == 0x21 && out[k-1].op == 0x20 && out[k-2].imm == out[k-1].imm) {
+            out[k-2] = (OptInsn){ 0x22, out[k-2].imm, UINT32_MAX, 0 }; // local.tee x
+            *n = k - 1;
+            continue;
+        }
+        if (k >= 2 && out[k-2].op == 0x41 && out[k-1].op == 0x45) { // i32.const a; i32.eqz
+            out[k-2] = (OptInsn){ 0x41, out[k-2].imm == 0, UINT32_MAX, 0 };
+            *n = k - 1;
+            continue;
+        }
+        if (k >= 3 && out[k-3].op == 0x41 && out[k-2].op == 0x41) {
+            int32_t r;
+            if (opt_fold_binop(out[k-1].op, out[k-3].imm, out[k-2].imm, &r)) {
+                out[k-3] = (OptInsn){ 0x41, r, UINT32_MAX, 0 };
+                *n = k - 2;
+                continue;
+            }
+        }
+        if (k >= 2 && out[k-2].op == 0x41) { // x op 単位元 → x
+            int32_t c = out[k-2].imm;
+            uint8_t op = out[k-1].op;
+            if ((c == 0 && (op == 0x6A || op == 0x6B || (op >= 0x72 && op <= 0x78))) ||
+                (c == 1 && (op == 0x6C || op == 0x6D || op == 0x6E)) ||
+                (c == -1 && op == 0x71)) {
+                *n = k - 2;
+                continue;
+            }
+        }
+        return;
+    }
+}
+
+// 関数 func_idx の本体を最適化して書き戻す。本体が短くなった分は nop で埋める
+int optimize_function(WasmVM *vm, uint32_t func_idx, size_t body_end) {
+    size_t pc = vm->func_pcs[func_idx];
+    uint32_t local_groups = read_uLEB128_bounded(vm->code, &pc, body_end);
+    for (uint32_t i = 0; i < local_groups && pc < body_end; i++) {
+        (void)read_uLEB128_bounded(vm->code, &pc, body_end); // num_locals
+        (void)read_byte_bounded(vm->code, &pc, body_end); // type
+    }
+    size_t start = pc, len = body_end - start;
+    uint8_t *src = vm_malloc(len);
+    uint8_t *enc = vm_malloc(len + 8);
+    OptInsn *in = vm_malloc(sizeof(OptInsn) * len);
+    OptInsn *out = vm_malloc(sizeof(OptInsn) * len);
+    int ret = -1;
+    if (!src || !enc || !in || !out) goto done;
+    memcpy(src, vm->code + start, len);
+
+    // 1. デコード
+    size_t n_in = 0;
+    for (size_t p = 0; p < len; ) {
+        uint8_t op = src[p];
+        if (!opt_known_opcode(op)) {
+            TRACE("    func[%u]: not optimized (opcode 0x%02X)\n", func_idx, op);
+            goto done;
+        }
+        OptInsn insn = { op, 0, (uint32_t)p, 0 };
+        size_t q = p + 1;
+        if (op == 0x41) {
+            insn.imm = read_sLEB128_bounded(src, &q, len);
+        } else if (op >= 0x20 && op <= 0x23) {
+            insn.imm = (int32_t)read_uLEB128_bounded(src, &q, len);
+            if (op == 0x23) { // 不変グローバルは定数として扱う
+                uint32_t g = (uint32_t)insn.imm;
+                if (g < vm->global_count && g >= vm->import_global_count && !vm->global_info[g].mutable_) {
+                    insn = (OptInsn){ 0x41, vm->globals[g], UINT32_MAX, 0 };
                 }
-                break;
             }
+        } else {
+            q = skip_operands(op, src, q, len);
+        }
+        if (insn.off != UINT32_MAX) insn.len = (uint32_t)(q - p);
+        if (q > len) goto done;
+        in[n_in++] = insn;
+        p = q;
+    }
 
-            case 0x1A: { // drop
-                printf("[drop]\n");
-                vm->sp--;
-                break;
+    // 2. 覗き穴最適化と到達不能コードの除去
+    size_t n_out = 0;
+    for (size_t i = 0; i < n_in; i++) {
+        out[n_out++] = in[i];
+        uint8_t op = in[i].op;
+        if (op == 0x00 || op == 0x0C || op == 0x0E || op == 0x0F || op == 0x12 || op == 0x13) {
+            // 同じブロックの else/end までは到達しない
+            int depth = 0;
+            while (i + 1 < n_in) {
+                uint8_t next = in[i + 1].op;
+                if (depth == 0 && (next == 0x05 || next == 0x0B)) break;
+                if (next >= 0x02 && next <= 0x04) depth++;
+                if (next == 0x0B) depth--;
+                i++;
             }
+            continue;
+        }
+        opt_peephole(out, &n_out);
+    }
 
-            default:
-                printf("Unknown or unimplemented opcode: 0x%02X at pc=%zu\n", op, vm->pc - 1);
-                return; // ここで終了
+    // 3. 符号化して書き戻す (長くなるなら元のまま)
+    size_t m = 0;
+    for (size_t i = 0; i < n_out; i++) {
+        // そのまま写す命令は元の長さ、符号化し直す命令は opcode と最大 5 バイトの LEB128
+        size_t need = out[i].off != UINT32_MAX ? out[i].len : 6;
+        if (m + need > len + 8) {
+            TRACE("    func[%u]: not optimized (code would grow beyond %zu bytes)\n", func_idx, len + 8);
+            goto done;
+        }
+        if (out[i].off != UINT32_MAX) {
+            memcpy(enc + m, src + out[i].off, out[i].len);
+            m += out[i].len;
+            continue;
         }
+        enc[m++] = out[i].op;
+        if (out[i].op == 0x41) {
+            int32_t v = out[i].imm;
+            for (;;) {
+                uint8_t byte = v & 0x7F;
+                v >>= 7;
+                if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) { enc[m++] = byte; break; }
+                enc[m++] = byte | 0x80;
+            }
+        } else {
+            uint32_t v = (uint32_t)out[i].imm;
+            do {
+                uint8_t byte = v & 0x7F;
+                v >>= 7;
+                enc[m++] = v ? (byte | 0x80) : byte;
+            } while (v);
+        }
+    }
+    if (m > len) {
+        TRACE("    func[%u]: not optimized (code would grow %zu -> %zu bytes)\n", func_idx, len, m);
+        goto done;
     }
+    memcpy(vm->code + start, enc, m);
+    memset(vm->code + start + m, 0x01, len - m); // 関数末尾の end より後ろは実行されない
+    vm->opt_insns_before += n_in;
+    vm->opt_insns_after += n_out;
+    TRACE("    func[%u] optimized: %zu -> %zu instructions, %zu -> %zu bytes\n", func_idx, n_in, n_out, len, m);
+    ret = 0;
+done:
+    free(src);
+    free(enc);
+    free(in);
+    free(out);
+    return ret;
 }
 
-int32_t print_i32(int32_t *args, int argc __attribute__((unused))) {
-    printf("print_i32: %d\n", args[0]);
+// 分岐: スタックを分岐先の高さまで巻き戻し、上位 arity 個の値を持ち越す
+static inline void branch_to(WasmVM *vm, const BranchTarget *t) {
+    int dst = vm->frame_base + (int)t->height;
+    if (vm->sp != dst + (int)t->arity) {
+        memmove(&vm->stack[dst], &vm->stack[vm->sp - t->arity], t->arity * sizeof(int32_t));
+        vm->sp = dst + t->arity;
+    }
+    vm->pc = t->target_pc;
+}
+
+// 関数から戻る (t は return/関数末尾の end の表)。
+// トップレベルの関数から戻ったときは 1 を返す
+static inline int return_from_function(WasmVM *vm, const BranchTarget *t) {
+    branch_to(vm, t);
+    if (vm->call_sp == 0) {
+        TRACE("    [return from top level]. Final sp=%d\n", vm->sp);
+        vm->returned = 1;
+#if VM_FLIGHT
+        flight_record(vm, FL_EXIT, 0, 2);
+#endif
+        return 1;
+    }
+    CallFrame *frame = &vm->call_stack[--vm->call_sp];
+    memcpy(vm->locals, frame->locals, sizeof(vm->locals));
+    vm->pc = frame->return_pc;
+    vm->frame_base = frame->sp_base;
+#if VM_FLIGHT
+    flight_record_at(vm, FL_EXIT, (uint32_t)vm->pc, 0, vm->call_sp + 1);
+#endif
+    TRACE("    [return from function] -> Set pc to %zu, call_sp=%d. Restored locals[0]=%d\n",
+          vm->pc, vm->call_sp, vm->locals[0]);
     return 0;
 }
 
-int32_t imported_add(int32_t *args, int argc) {
-    if (argc != 2) return -1;
-printf("imported_add\n");
-    return args[0] + args[1];
+// call_indirect: テーブルの elem 番目の関数を型 type_idx として引く。
+// トラップしたときは -1 を返す
+long table_lookup(WasmVM *vm, uint32_t type_idx, uint32_t elem) {
+    if (elem >= vm->table_size) { printf("Undefined element: table[%u]\n", elem); return -1; }
+    TableEntry *entry = &vm->table[elem];
+    // 未初期化要素の type_id は UINT32_MAX なので、この比較で一緒に弾かれる
+    if (entry->type_id != vm->canon_type_ids[type_idx]) {
+        if (entry->func_idx == UINT32_MAX) printf("Uninitialized element: table[%u]\n", elem);
+        else printf("Indirect call type mismatch: table[%u]\n", elem);
+        return -1;
+    }
+    return entry->func_idx;
 }
 
-// WASIのfd_writeをシミュレートするホスト関数
-int32_t wasi_fd_write(int32_t *args, int argc) {
-    if (argc != 4) return -1; // __WASI_ERRNO_INVAL
+#if VM_JIT
+// --- 最適化ネイティブ層 (x86-64) ---
+// ホットな関数 (呼び出し回数が VM_JIT_HOT_CALLS に達したもの。vm->jit == 2 ならパース時に全関数) を
+// x86-64 の機械語にコンパイルする。
+//   1. 持ち上げ: スタック型のバイトコードを抽象的に実行し、値スタックの一時値を SSA 値
+//      (定義は1か所だけ) にした線形の IR を作る。ローカル変数とブロックの結果だけは
+//      複数回代入される可変の仮想レジスタとして残す。制御フローは構造化されているので
+//      φ は置かず、ループをまたぐ値は生存区間をループの末尾まで延ばして扱う
+//   2. 最適化: 定数の即値化、local.get のコピー伝播、代入先の書き換え、不要な定義の削除、
+//      ループ不変式のループ前への移動、境界検査のループの版分け・支配される検査の削除・
+//      同じ base のアクセスの検査の1回へのまとめ (線形メモリにガードページがあれば検査そのものを省く)
+//   3. レジスタ割り当て: 生存区間の線形スキャンで callee-saved の rbx, rbp, r12-r14 に割り当て、
+//      あふれた値はスタックフレームに置く。r15 は線形メモリの先頭を指す
+//   4. コード生成: 比較と条件分岐は cmp + jcc に融合する
+// ネイティブコードはインタプリタに戻らないので、対象はインポート関数か、同じくコンパイルできる
+// 関数だけを呼ぶ関数に限る (call_indirect・末尾呼び出し・マルチバリュー・アトミック命令は対象外)。
+// トラップは jit_invoke の sigsetjmp へ siglongjmp で戻る (ガードページへのアクセスは SIGSEGV のハンドラから)。
+
+typedef int32_t (*JitEntry)(WasmVM *vm, int32_t *args);
+
+enum {
+    J_NOP, J_CONST, J_COPY, J_BIN, J_CMP, J_EQZ, J_LOAD, J_STORE, J_GGET, J_GSET,
+    J_BLOCK, J_LABEL, J_LOOP, J_LOOP_END, J_JMP, J_BRIF, J_BRZ, J_BRTABLE, J_CALL, J_RET, J_TRAP
+};
+
+enum {
+    JIT_TRAP_UNREACHABLE, JIT_TRAP_LOAD, JIT_TRAP_STORE, JIT_TRAP_DIV, JIT_TRAP_OVERFLOW,
+    JIT_TRAP_STACK, JIT_TRAP_IMPORT, JIT_TRAP_COUNT
+};
 
-    int32_t fd = args[0];
-    int32_t iovs_ptr = args[1];
-    int32_t iovs_len = args[2];
-    int32_t nwritten_ptr = args[3];
+static const char *const jit_trap_messages[JIT_TRAP_COUNT] = {
+    "Unreachable executed", "Memory load out of range", "Memory store out of range",
+    "Integer divide by zero", "Integer overflow", "Call stack overflow", "Unresolved import function",
+};
 
-    // --- DEBUG PRINT ---
-    printf("  [wasi_fd_write called]\n");
-    printf("    fd: %d, iovs_ptr: %d, iovs_len: %d, nwritten_ptr: %d\n", fd, iovs_ptr, iovs_len, nwritten_ptr);
-    // --- END DEBUG PRINT ---
+// ネイティブコードのトラップ。種類を記録して jit_invoke の sigsetjmp へ戻る。
+// SIGSEGV のハンドラからも呼ぶので printf は使わない (メッセージは戻った先の jit_trap_report で出す)
+static void __attribute__((noreturn)) jit_trap(WasmVM *vm, int code) {
+    vm->jit_trap_code = code;
+    siglongjmp(*vm->jit_trap, 1);
+}
 
-    WasmVM *original_vm_ptr = (WasmVM*)((char*)args - offsetof(WasmVM, stack));
-    // --- DEBUG PRINT ---
-    // This is just for debugging. We know this pointer is likely incorrect.
-    // We will compare it with a hypothetically correct pointer if we had one.
-    printf("      -> Reconstructed vm pointer: %p\n", (void*)original_vm_ptr);
-    // --- END DEBUG PRINT ---
-    WasmVM *vm = original_vm_ptr;
+static void jit_trap_report(WasmVM *vm) {
+    if (vm->jit_trap_code >= 0) printf("%s (native code)\n", jit_trap_messages[vm->jit_trap_code]);
+}
 
-    if (fd != 1) { // stdout以外は未サポート
-        return -1; // __WASI_ERRNO_BADF
+static __thread WasmVM *jit_running; // このスレッドでネイティブコードを実行中のインスタンス
+static struct sigaction jit_old_segv;
+
+// ガードページへのアクセス: 実行中のインスタンスの予約の中ならトラップにする。
+// それ以外は元のハンドラに戻して、同じ命令をもう一度実行させる
+static void jit_fault_handler(int sig, siginfo_t *si, void *ctx) {
+    WasmVM *vm = jit_running;
+    uint8_t *addr = si->si_addr;
+    if (vm != NULL && vm->memory_reserve_size && addr >= vm->memory && addr < vm->memory + vm->memory_reserve_size) {
+        int write = (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+        jit_trap(vm, write ? JIT_TRAP_STORE : JIT_TRAP_LOAD);
     }
+    sigaction(sig, &jit_old_segv, NULL);
+}
 
-    uint32_t bytes_written = 0;
-    for (int i = 0; i < iovs_len; i++) {
-        uint32_t iov_base = *(uint32_t*)&vm->memory[iovs_ptr + i * 8];
-        uint32_t iov_len = *(uint32_t*)&vm->memory[iovs_ptr + i * 8 + 4];
-        // --- DEBUG PRINT ---
-        printf("    iov[%d]: base=%u, len=%u, content=\"", i, iov_base, iov_len);
-        fwrite(&vm->memory[iov_base], 1, iov_len, stdout);
-        printf("\"\n");
-        // --- END DEBUG PRINT ---
-        fwrite(&vm->memory[iov_base], 1, iov_len, stdout);
-        bytes_written += iov_len;
+// SIGSEGV のハンドラをプロセスに1回だけ入れる
+int jit_install_fault_handler(void) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static int installed;
+    pthread_mutex_lock(&lock);
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = jit_fault_handler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER; // siglongjmp で抜けるので、シグナルをマスクしたままにしない
+        sigemptyset(&sa.sa_mask);
+        installed = sigaction(SIGSEGV, &sa, &jit_old_segv) == 0;
     }
+    pthread_mutex_unlock(&lock);
+    return installed ? 0 : -1;
+}
 
-    *(uint32_t*)&vm->memory[nwritten_ptr] = bytes_written;
-    return 0; // __WASI_ERRNO_SUCCESS
+// ネイティブコードからのインポート関数の呼び出し
+static int32_t jit_call_import(WasmVM *vm, uint32_t idx, int32_t *args) {
+    ImportFunc *f = &vm->import_funcs[idx];
+    if (f->func == NULL) {
+        printf("Unresolved import function: %s.%s\n", f->mod_name, f->field_name);
+        jit_trap(vm, -1);
+    }
+#if VM_FLIGHT
+    flight_record(vm, FL_HOST, idx, 0);
+#endif
+    WasmVM *prev = host_caller;
+    host_caller = vm;
+    int32_t ret = f->func(args, vm->func_types[f->type_index].param_count);
+    host_caller = prev;
+    return ret;
 }
 
-// Wasmバイナリを16進数でダンプする関数
-void dump_wasm_code(const uint8_t *code, size_t size) {
-    printf("--- Wasm Code Dump (size: %zu bytes) ---\n", size);
-    for (size_t i = 0; i < size; i += 16) {
-        // オフセット表示
-        printf("%08zx: ", i);
+// IR の命令。仮想レジスタ 0..nlocals-1 はローカル変数
+typedef struct {
+    uint8_t op;          // J_*
+    uint8_t sub;         // J_BIN/J_CMP: wasm の opcode, J_LABEL: 1 = else の区切り,
+                         // J_LOAD/J_STORE: 1 = ループの版分けで範囲内と確かめた
+    uint8_t b_imm;       // J_BIN/J_CMP: 1 = b の代わりに imm を使う
+    uint8_t checked;     // J_LOAD/J_STORE: 1 = 境界検査が必要
+    int32_t dst, a, b;   // 仮想レジスタ (-1 = なし)
+    int32_t imm;         // 定数, offset, ラベル, 関数・グローバルのインデックス, トラップの種類
+    uint32_t extra;      // J_CALL: 引数, J_BRTABLE: ラベル列 (pool の先頭)
+    uint32_t nextra;
+    uint32_t need;       // J_LOAD/J_STORE: 境界検査で確かめる範囲の末尾 (base からの距離。まとめた検査はこれより広い)
+} JitInsn;
 
-        // 16進数表示
-        for (size_t j = 0; j < 16; j++) {
-            if (i + j < size) {
-                printf("%02x ", code[i + j]);
-            } else {
-                printf("   ");
-            }
-            if (j == 7) {
-                printf(" ");
-            }
+typedef struct {
+    uint8_t mutable_;    // 1: ローカル変数・ブロックの結果 (複数回代入される)
+    int8_t reg;          // 物理レジスタ (-1 = スタックスロット)
+    int32_t slot;
+    int32_t def;         // SSA 値の定義位置
+    int32_t start, end;  // 生存区間 (start < 0 なら使われない)
+    uint32_t uses;
+} JitVreg;
+
+typedef struct {
+    size_t pos;          // rel32 の位置
+    uint32_t label;
+} JitFixup;
+
+typedef struct {
+    WasmVM *vm;
+    uint32_t func_idx;
+    JitInsn *ir;
+    size_t n, cap;
+    JitVreg *v;
+    size_t nv, vcap;
+    int32_t *pool;
+    size_t npool, pool_cap;
+    uint32_t nlabels;
+    uint32_t nlocals;
+    int32_t nslots;
+    int32_t frame_size, arg_off;
+    uint8_t *code;
+    size_t len, code_cap;
+    int32_t *label_pos;
+    JitFixup *fixups;
+    size_t nfix, fix_cap;
+    uint32_t trap_label[JIT_TRAP_COUNT]; // ラベル + 1 (0 = 未使用)
+    uint32_t epilogue;
+    uint32_t hoisted, checks, checks_removed, versioned;
+    int guarded;         // 線形メモリにガードページがある (範囲外のアクセスはフォルトになる)
+    int failed;          // メモリ不足
+} JitCompiler;
+
+// x86-64 のレジスタ番号
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+static const int8_t jit_regs[] = { RBX, RBP, R12, R13, R14 }; // 割り当てに使う callee-saved レジスタ
+#define JIT_NREGS 5
+
+// 配列を少なくとも need 要素に広げる。失敗したら c->failed を立てる
+static int jit_grow(JitCompiler *c, void **p, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap * 2 : 64;
+    while (n < need) n *= 2;
+    void *q = vm_realloc(*p, n * elem);
+    if (q == NULL) { c->failed = 1; return -1; }
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+static int32_t jit_new_vreg(JitCompiler *c, int mutable_) {
+    if (jit_grow(c, (void **)&c->v, &c->vcap, c->nv + 1, sizeof(JitVreg)) < 0) return 0;
+    c->v[c->nv] = (JitVreg){ .mutable_ = (uint8_t)mutable_, .reg = -1, .def = -1, .start = -1, .end = -1 };
+    return (int32_t)c->nv++;
+}
+
+static JitInsn *jit_ir(JitCompiler *c, uint8_t op, int32_t dst, int32_t a, int32_t b, int32_t imm) {
+    static JitInsn dummy;
+    if (jit_grow(c, (void **)&c->ir, &c->cap, c->n + 1, sizeof(JitInsn)) < 0) return &dummy;
+    c->ir[c->n] = (JitInsn){ .op = op, .dst = dst, .a = a, .b = b, .imm = imm };
+    return &c->ir[c->n++];
+}
+
+static uint32_t jit_pool_add(JitCompiler *c, int32_t x) {
+    if (jit_grow(c, (void **)&c->pool, &c->pool_cap, c->npool + 1, sizeof(int32_t)) < 0) return 0;
+    c->pool[c->npool] = x;
+    return (uint32_t)c->npool++;
+}
+
+static int jit_reject(JitCompiler *c, const char *why, size_t pc) {
+    TRACE("    jit: func[%u] not compiled (%s at pc=%zu)\n", c->func_idx, why, pc);
+    (void)c; (void)why; (void)pc;
+    return -1;
+}
+
+// --- 1. 持ち上げ ---
+
+typedef struct {
+    uint8_t kind;        // 0=関数, 2=block, 3=loop, 4=if (PrepBlock と同じ)
+    uint8_t has_else;
+    uint8_t targeted;    // end のラベルへの分岐があるか
+    uint32_t label;      // 分岐先 (loop は先頭、それ以外は end)
+    uint32_t else_label;
+    int32_t result;      // 結果を受け取る可変の仮想レジスタ (-1 = 結果なし、loop の結果は値スタックに残す)
+    uint32_t height;     // ブロック開始時の抽象スタックの高さ
+} JitBlock;
+
+// label への分岐: 結果があれば分岐先の可変レジスタへ写してから飛ぶ
+static void jit_branch_value(JitCompiler *c, JitBlock *b, int32_t top) {
+    if (b->kind != 3 && b->result >= 0) jit_ir(c, J_COPY, b->result, top, -1, 0);
+    if (b->kind != 3) b->targeted = 1;
+}
+
+int jit_lift(JitCompiler *c) {
+    WasmVM *vm = c->vm;
+    FuncFrame *fr = &vm->func_frames[c->func_idx];
+    if (fr->result_count > 1) return jit_reject(c, "multi-value result", fr->body_pc);
+    c->nlocals = fr->param_count + fr->local_count;
+    for (uint32_t i = 0; i < c->nlocals; i++) jit_new_vreg(c, 1);
+
+    JitBlock ctrl[64];
+    int csp = 0;
+    int32_t stack[256];
+    uint32_t h = 0;
+    int unreachable = 0, skip = 0; // skip: 読み飛ばしている到達不能コードの入れ子の深さ
+    int32_t result = fr->result_count ? jit_new_vreg(c, 1) : -1;
+    ctrl[csp++] = (JitBlock){ .kind = 0, .label = c->nlabels++, .result = result };
+
+    size_t pc = fr->body_pc;
+    while (!c->failed) {
+        if (pc >= vm->size) return jit_reject(c, "unterminated body", pc);
+        size_t op_pc = pc;
+        uint8_t op = vm->code[pc++];
+        if (unreachable && !((op == 0x05 || op == 0x0B) && skip == 0)) {
+            if (op >= 0x02 && op <= 0x04) skip++;
+            if (op == 0x0B) skip--;
+            pc = skip_operands(op, vm->code, pc, vm->size);
+            continue;
         }
-        printf(" |");
+        JitBlock *top = &ctrl[csp - 1];
+        // 抽象スタックの検査はロード時の prepare で済んでいるが、念のため底を割らないようにする
+        uint32_t pops = 0;
+        switch (op) {
+            case 0x00: case 0x02: case 0x03: case 0x04: case 0x05: case 0x0B: case 0x0C: case 0x0F:
+            case 0x01: case 0x10: case 0x20: case 0x23: case 0x41: break;
+            case 0x0D: case 0x0E: case 0x1A: case 0x21: case 0x22: case 0x24: case 0x28: case 0x45: pops = 1; break;
+            case 0x36: pops = 2; break;
+            default: if ((op >= 0x46 && op <= 0x4F) || (op >= 0x6A && op <= 0x78)) pops = 2; break;
+        }
+        if (h < top->height + pops) return jit_reject(c, "stack underflow", op_pc);
+        if (h + 1 >= 256) return jit_reject(c, "stack too deep", op_pc);
 
-        // ASCII表示
-        for (size_t j = 0; j < 16; j++) {
-            if (i + j < size) {
-                uint8_t c = code[i + j];
-                printf("%c", (c >= 32 && c <= 126) ? c : '.');
+        switch (op) {
+            case 0x00: // unreachable
+                jit_ir(c, J_TRAP, -1, -1, -1, JIT_TRAP_UNREACHABLE);
+                unreachable = 1;
+                h = top->height;
+                break;
+            case 0x01: // nop
+                break;
+            case 0x02: case 0x03: case 0x04: { // block, loop, if
+                uint32_t params, results;
+                if (read_blocktype(vm, &pc, vm->size, &params, &results) < 0) return -1;
+                if (params > 0 || results > 1) return jit_reject(c, "multi-value block", op_pc);
+                if (csp == 64) return jit_reject(c, "nesting too deep", op_pc);
+                JitBlock b = { .kind = op, .label = c->nlabels++, .result = -1 };
+                if (op == 0x04) {
+                    int32_t cond = stack[--h];
+                    b.else_label = c->nlabels++;
+                    jit_ir(c, J_BLOCK, -1, -1, -1, b.label);
+                    jit_ir(c, J_BRZ, -1, cond, -1, b.else_label);
+                } else if (op == 0x03) {
+                    jit_ir(c, J_LOOP, -1, -1, -1, b.label);
+                } else {
+                    jit_ir(c, J_BLOCK, -1, -1, -1, b.label);
+                }
+                if (op != 0x03 && results) b.result = jit_new_vreg(c, 1);
+                b.height = h;
+                ctrl[csp++] = b;
+                break;
+            }
+            case 0x05: { // else
+                if (!unreachable) {
+                    jit_branch_value(c, top, h > top->height ? stack[h - 1] : -1);
+                    jit_ir(c, J_JMP, -1, -1, -1, top->label);
+                }
+                jit_ir(c, J_LABEL, -1, -1, -1, top->else_label)->sub = 1;
+                top->has_else = 1;
+                h = top->height;
+                unreachable = 0;
+                break;
+            }
+            case 0x0B: { // end
+                int reachable = !unreachable;
+                if (reachable && top->result >= 0) jit_ir(c, J_COPY, top->result, stack[--h], -1, 0);
+                if (top->kind == 3) {
+                    jit_ir(c, J_LOOP_END, -1, -1, -1, top->label);
+                } else {
+                    if (top->kind == 4 && !top->has_else) {
+                        jit_ir(c, J_LABEL, -1, -1, -1, top->else_label)->sub = 1;
+                        reachable = 1;
+                    }
+                    jit_ir(c, J_LABEL, -1, -1, -1, top->label);
+                    if (top->targeted) reachable = 1;
+                }
+                if (csp == 1) {
+                    jit_ir(c, J_RET, -1, top->result, -1, 0);
+                    return c->failed ? -1 : 0;
+                }
+                csp--;
+                unreachable = !reachable;
+                skip = 0;
+                if (top->kind == 3 && reachable) break; // loop の結果は値スタックに残っている
+                h = top->height;
+                if (reachable && top->result >= 0) {
+                    int32_t t = jit_new_vreg(c, 0);
+                    jit_ir(c, J_COPY, t, top->result, -1, 0);
+                    stack[h++] = t;
+                }
+                break;
+            }
+            case 0x0C: case 0x0D: { // br, br_if
+                uint32_t depth = read_uLEB128(vm->code, &pc);
+                if (depth >= (uint32_t)csp) return jit_reject(c, "invalid branch depth", op_pc);
+                JitBlock *b = &ctrl[csp - 1 - depth];
+                int32_t cond = op == 0x0D ? stack[--h] : -1;
+                if (b->result >= 0 && h <= top->height) return jit_reject(c, "stack underflow", op_pc);
+                jit_branch_value(c, b, b->result >= 0 ? stack[h - 1] : -1);
+                if (op == 0x0D) {
+                    jit_ir(c, J_BRIF, -1, cond, -1, b->label);
+                } else {
+                    jit_ir(c, J_JMP, -1, -1, -1, b->label);
+                    unreachable = 1;
+                    h = top->height;
+                }
+                break;
+            }
+            case 0x0E: { // br_table
+                uint32_t count = read_uLEB128(vm->code, &pc);
+                int32_t index = stack[--h];
+                uint32_t first = (uint32_t)c->npool;
+                for (uint32_t i = 0; i <= count; i++) {
+                    uint32_t depth = read_uLEB128(vm->code, &pc);
+                    if (depth >= (uint32_t)csp) return jit_reject(c, "invalid branch depth", op_pc);
+                    JitBlock *b = &ctrl[csp - 1 - depth];
+                    if (b->result >= 0 && h <= top->height) return jit_reject(c, "stack underflow", op_pc);
+                    jit_branch_value(c, b, b->result >= 0 ? stack[h - 1] : -1);
+                    jit_pool_add(c, (int32_t)b->label);
+                }
+                JitInsn *t = jit_ir(c, J_BRTABLE, -1, index, -1, 0);
+                t->extra = first;
+                t->nextra = count + 1;
+                unreachable = 1;
+                h = top->height;
+                break;
+            }
+            case 0x0F: // return
+                if (ctrl[0].result >= 0 && h <= top->height) return jit_reject(c, "stack underflow", op_pc);
+                jit_branch_value(c, &ctrl[0], ctrl[0].result >= 0 ? stack[h - 1] : -1);
+                jit_ir(c, J_JMP, -1, -1, -1, ctrl[0].label);
+                unreachable = 1;
+                h = top->height;
+                break;
+            case 0x10: { // call
+                uint32_t idx = read_uLEB128(vm->code, &pc);
+                if (idx >= vm->func_count) return jit_reject(c, "invalid call", op_pc);
+                FuncType *ft = get_func_type(vm, idx);
+                uint32_t n = (uint32_t)ft->param_count;
+                if (ft->result_count > 1 || n > 16) return jit_reject(c, "multi-value call", op_pc);
+                if (h < top->height + n) return jit_reject(c, "stack underflow", op_pc);
+                h -= n;
+                uint32_t first = (uint32_t)c->npool;
+                for (uint32_t i = 0; i < n; i++) jit_pool_add(c, stack[h + i]);
+                int32_t dst = ft->result_count ? jit_new_vreg(c, 0) : -1;
+                JitInsn *t = jit_ir(c, J_CALL, dst, -1, -1, (int32_t)idx);
+                t->extra = first;
+                t->nextra = n;
+                if (dst >= 0) stack[h++] = dst;
+                break;
+            }
+            case 0x1A: // drop
+                h--;
+                break;
+            case 0x20: case 0x21: case 0x22: { // local.get, local.set, local.tee
+                uint32_t i = read_uLEB128(vm->code, &pc);
+                if (i >= c->nlocals) return jit_reject(c, "invalid local", op_pc);
+                if (op == 0x20) {
+                    int32_t t = jit_new_vreg(c, 0);
+                    jit_ir(c, J_COPY, t, (int32_t)i, -1, 0);
+                    stack[h++] = t;
+                } else {
+                    jit_ir(c, J_COPY, (int32_t)i, stack[h - 1], -1, 0);
+                    if (op == 0x21) h--;
+                }
+                break;
+            }
+            case 0x23: case 0x24: { // global.get, global.set
+                uint32_t i = read_uLEB128(vm->code, &pc);
+                if (i >= vm->global_count) return jit_reject(c, "invalid global", op_pc);
+                if (op == 0x23) {
+                    int32_t t = jit_new_vreg(c, 0);
+                    jit_ir(c, J_GGET, t, -1, -1, (int32_t)i);
+                    stack[h++] = t;
+                } else {
+                    jit_ir(c, J_GSET, -1, stack[--h], -1, (int32_t)i);
+                }
+                break;
+            }
+            case 0x28: { // i32.load
+                (void)read_uLEB128(vm->code, &pc); // align
+                uint32_t offset = read_uLEB128(vm->code, &pc);
+                int32_t t = jit_new_vreg(c, 0);
+                jit_ir(c, J_LOAD, t, stack[h - 1], -1, (int32_t)offset);
+                stack[h - 1] = t;
+                break;
+            }
+            case 0x36: { // i32.store
+                (void)read_uLEB128(vm->code, &pc); // align
+                uint32_t offset = read_uLEB128(vm->code, &pc);
+                h -= 2;
+                jit_ir(c, J_STORE, -1, stack[h], stack[h + 1], (int32_t)offset);
+                break;
+            }
+            case 0x41: { // i32.const
+                int32_t t = jit_new_vreg(c, 0);
+                jit_ir(c, J_CONST, t, -1, -1, read_sLEB128(vm->code, &pc));
+                stack[h++] = t;
+                break;
             }
+            case 0x45: { // i32.eqz
+                int32_t t = jit_new_vreg(c, 0);
+                jit_ir(c, J_EQZ, t, stack[h - 1], -1, 0);
+                stack[h - 1] = t;
+                break;
+            }
+            default:
+                if ((op >= 0x46 && op <= 0x4F) || (op >= 0x6A && op <= 0x78)) { // i32 の比較・二項演算
+                    int32_t t = jit_new_vreg(c, 0);
+                    h--;
+                    jit_ir(c, op <= 0x4F ? J_CMP : J_BIN, t, stack[h - 1], stack[h], 0)->sub = op;
+                    stack[h - 1] = t;
+                    break;
+                }
+                return jit_reject(c, "unsupported opcode", op_pc);
         }
-        printf("|\n");
     }
-    printf("----------------------------------------\n");
+    return -1;
 }
 
-// ファイルからWasmバイナリを読み込む関数
-// 成功した場合、bufferに確保したメモリのポインタ、sizeにファイルサイズを格納し、0を返す
-// 失敗した場合、-1を返す
-int read_wasm_file(const char *filepath, uint8_t **buffer, size_t *size) {
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        perror("Failed to open wasm file");
-        return -1;
+// --- 2. 最適化 ---
+
+// 命令が読む仮想レジスタへのポインタを ops に並べ、その数を返す
+static int jit_operands(JitCompiler *c, JitInsn *t, int32_t **ops) {
+    int n = 0;
+    switch (t->op) {
+        case J_BIN: case J_CMP:
+            ops[n++] = &t->a;
+            if (!t->b_imm) ops[n++] = &t->b;
+            break;
+        case J_STORE:
+            ops[n++] = &t->a;
+            ops[n++] = &t->b;
+            break;
+        case J_COPY: case J_EQZ: case J_LOAD: case J_GSET: case J_BRIF: case J_BRZ: case J_BRTABLE:
+            ops[n++] = &t->a;
+            break;
+        case J_RET:
+            if (t->a >= 0) ops[n++] = &t->a;
+            break;
+        case J_CALL:
+            for (uint32_t i = 0; i < t->nextra; i++) ops[n++] = &c->pool[t->extra + i];
+            break;
     }
+    return n;
+}
 
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+// 定義位置と使用回数を数え直す
+static void jit_analyze(JitCompiler *c) {
+    for (size_t i = 0; i < c->nv; i++) {
+        c->v[i].def = -1;
+        c->v[i].uses = 0;
+    }
+    for (size_t i = 0; i < c->n; i++) {
+        int32_t *ops[18];
+        int n = jit_operands(c, &c->ir[i], ops);
+        for (int k = 0; k < n; k++) c->v[*ops[k]].uses++;
+        if (c->ir[i].dst >= 0) c->v[c->ir[i].dst].def = (int32_t)i;
+    }
+}
 
-    *buffer = (uint8_t *)malloc(*size);
-    if (!*buffer) {
-        fprintf(stderr, "Failed to allocate memory for wasm file\n");
-        fclose(file);
-        return -1;
+// J_NOP を取り除く
+static void jit_compact(JitCompiler *c) {
+    size_t m = 0;
+    for (size_t i = 0; i < c->n; i++) {
+        if (c->ir[i].op != J_NOP) c->ir[m++] = c->ir[i];
     }
+    c->n = m;
+}
 
-    if (fread(*buffer, 1, *size, file) != *size) {
-        fprintf(stderr, "Failed to read wasm file\n");
-        fclose(file);
-        free(*buffer);
-        return -1;
+// loop の先頭 s に対応する J_LOOP_END の位置
+static size_t jit_loop_end(JitCompiler *c, size_t s) {
+    for (size_t i = s + 1; i < c->n; i++) {
+        if (c->ir[i].op == J_LOOP_END && c->ir[i].imm == c->ir[s].imm) return i;
     }
+    return c->n;
+}
 
-    fclose(file);
+static int jit_defines_in(JitCompiler *c, int32_t v, size_t from, size_t to) {
+    for (size_t i = from; i < to && i < c->n; i++) {
+        if (c->ir[i].dst == v) return 1;
+    }
     return 0;
 }
 
-// variable
-void test1() {
-    // --- テストケース1: 基本的な演算とローカル変数 ---
-    uint8_t code[] = {
-        0x41, 0x05,       // i32.const 5      ; 定数 5 をスタックに積む
-        0x21, 0x00,       // local.set 0      ; スタックの値をローカル変数0に格納
-        0x41, 0x07,       // i32.const 7      ; 定数 7 をスタックに積む
-        0x21, 0x01,       // local.set 1      ; スタックの値をローカル変数1に格納
-        0x20, 0x00,       // local.get 0      ; ローカル変数0の値をスタックに積む
-        0x20, 0x01,       // local.get 1      ; ローカル変数1の値をスタックに積む
-        0x6A,             // i32.add          ; スタックの2つの値を加算
+// 位置 d の値を位置 p で可変レジスタ m から読んでよいか (その間とループの周回で m が書き換わらないか)
+static int jit_unchanged(JitCompiler *c, int32_t m, size_t d, size_t p) {
+    if (jit_defines_in(c, m, d + 1, p)) return 0;
+    for (size_t i = d + 1; i < p; i++) {
+        if (c->ir[i].op != J_LOOP) continue;
+        size_t e = jit_loop_end(c, i);
+        if (e > p) return !jit_defines_in(c, m, i, e);
+        i = e;
+    }
+    return 1;
+}
+
+static int jit_is_const(JitCompiler *c, int32_t v, int32_t *value) {
+    if (v < 0 || c->v[v].mutable_ || c->v[v].def < 0 || c->ir[c->v[v].def].op != J_CONST) return 0;
+    *value = c->ir[c->v[v].def].imm;
+    return 1;
+}
+
+static int jit_pure(const JitInsn *t) {
+    switch (t->op) {
+        case J_CONST: case J_COPY: case J_CMP: case J_EQZ: case J_GGET: return 1;
+        case J_BIN: return t->sub < 0x6D || t->sub > 0x70; // div/rem はトラップしうる
+        default: return 0;
+    }
+}
+
+// 比較の左右を入れ替えた opcode
+static uint8_t jit_swap_cmp(uint8_t op) {
+    switch (op) {
+        case 0x48: return 0x4A; case 0x4A: return 0x48; case 0x49: return 0x4B; case 0x4B: return 0x49;
+        case 0x4C: return 0x4E; case 0x4E: return 0x4C; case 0x4D: return 0x4F; case 0x4F: return 0x4D;
+        default: return op;
+    }
+}
+
+// 定数オペランドを命令の即値にする
+static void jit_fold_immediates(JitCompiler *c) {
+    jit_analyze(c);
+    for (size_t i = 0; i < c->n; i++) {
+        JitInsn *t = &c->ir[i];
+        if ((t->op != J_BIN && t->op != J_CMP) || t->b_imm) continue;
+        int32_t value;
+        int commutes = t->op == J_CMP || t->sub == 0x6A || t->sub == 0x6C || (t->sub >= 0x71 && t->sub <= 0x73);
+        if (jit_is_const(c, t->b, &value)) {
+            t->b_imm = 1;
+            t->imm = value;
+        } else if (commutes && jit_is_const(c, t->a, &value)) {
+            t->a = t->b;
+            t->b_imm = 1;
+            t->imm = value;
+            if (t->op == J_CMP) t->sub = jit_swap_cmp(t->sub);
+        }
+    }
+}
+
+// local.get のコピー伝播: t = COPY L の使用を、L が書き換わっていなければ L で置き換える
+static void jit_forward_copies(JitCompiler *c) {
+    jit_analyze(c);
+    for (size_t p = 0; p < c->n; p++) {
+        int32_t *ops[18];
+        int n = jit_operands(c, &c->ir[p], ops);
+        for (int k = 0; k < n; k++) {
+            int32_t t = *ops[k];
+            if (c->v[t].mutable_ || c->v[t].def < 0) continue;
+            JitInsn *d = &c->ir[c->v[t].def];
+            if (d->op == J_COPY && c->v[d->a].mutable_ && jit_unchanged(c, d->a, (size_t)c->v[t].def, p)) {
+                *ops[k] = d->a;
+            }
+        }
+    }
+}
+
+// 代入先の書き換え: t = op ...; COPY L = t なら op の結果を直接 L に書き、
+// t の残りの使用も (L が書き換わらない範囲なら) L で置き換える (local.set/local.tee)
+static void jit_retarget(JitCompiler *c) {
+    jit_analyze(c);
+    for (size_t p = 1; p < c->n; p++) {
+        JitInsn *cp = &c->ir[p];
+        if (cp->op != J_COPY || !c->v[cp->dst].mutable_ || c->v[cp->a].mutable_) continue;
+        int32_t t = cp->a, m = cp->dst;
+        if (c->v[t].def != (int32_t)p - 1) continue;
+        int ok = 1;
+        size_t last = p;
+        for (uint32_t seen = 1; last + 1 < c->n && seen < c->v[t].uses && ok;) {
+            int32_t *ops[18];
+            int n = jit_operands(c, &c->ir[++last], ops);
+            for (int k = 0; k < n; k++) {
+                if (*ops[k] != t) continue;
+                seen++;
+                if (!jit_unchanged(c, m, p, last)) ok = 0;
+            }
+        }
+        if (!ok) continue;
+        for (size_t q = p + 1; q <= last; q++) {
+            int32_t *ops[18];
+            int n = jit_operands(c, &c->ir[q], ops);
+            for (int k = 0; k < n; k++) {
+                if (*ops[k] == t) *ops[k] = m;
+            }
+        }
+        c->ir[p - 1].dst = m;
+        cp->op = J_NOP;
+        cp->dst = -1;
+    }
+    jit_compact(c);
+}
+
+// 使われない純粋な定義を取り除く
+static void jit_dce(JitCompiler *c) {
+    for (int changed = 1; changed;) {
+        changed = 0;
+        jit_analyze(c);
+        for (size_t i = 0; i < c->n; i++) {
+            JitInsn *t = &c->ir[i];
+            if (t->op == J_COPY && t->dst == t->a) {
+                t->op = J_NOP;
+                changed = 1;
+            } else if (t->dst >= 0 && !c->v[t->dst].mutable_ && c->v[t->dst].uses == 0) {
+                if (jit_pure(t)) {
+                    t->op = J_NOP;
+                    changed = 1;
+                } else if (t->op == J_CALL) {
+                    t->dst = -1;
+                }
+            }
+        }
+        jit_compact(c);
+    }
+}
+
+// ループ不変式の移動: ループ内で値の変わらない純粋な演算をループの直前へ移す。
+// 移すのはトラップしない演算だけなので、ループ本体が一度も実行されなくても結果は変わらない
+static void jit_hoist_loop(JitCompiler *c, int32_t label) {
+    size_t s = 0;
+    while (s < c->n && !(c->ir[s].op == J_LOOP && c->ir[s].imm == label)) s++;
+    if (s == c->n) return;
+    size_t e = jit_loop_end(c, s);
+    jit_analyze(c);
+    uint8_t *mdef = vm_calloc(c->nv, 1);
+    uint8_t *inv = vm_calloc(c->n, 1);
+    uint8_t *want = vm_calloc(c->n, 1);
+    JitInsn *out = vm_malloc(sizeof(JitInsn) * (c->n ? c->n : 1));
+    if (!mdef || !inv || !want || !out) {
+        c->failed = 1;
+        goto done;
+    }
+    for (size_t i = s; i < e; i++) {
+        if (c->ir[i].dst >= 0 && c->v[c->ir[i].dst].mutable_) mdef[c->ir[i].dst] = 1;
+    }
+    for (size_t i = s + 1; i < e; i++) {
+        JitInsn *t = &c->ir[i];
+        if (!jit_pure(t) || t->op == J_GGET || t->dst < 0 || c->v[t->dst].mutable_) continue;
+        int32_t *ops[18];
+        int n = jit_operands(c, t, ops), ok = 1;
+        for (int k = 0; k < n; k++) {
+            JitVreg *o = &c->v[*ops[k]];
+            if (o->mutable_ ? mdef[*ops[k]] : (o->def >= (int32_t)s && !inv[o->def])) ok = 0;
+        }
+        inv[i] = (uint8_t)ok;
+    }
+    // 演算と、それが使うループ内の定数・コピーを移す
+    for (size_t i = e; i-- > s + 1;) {
+        JitInsn *t = &c->ir[i];
+        if (inv[i] && (t->op == J_BIN || t->op == J_CMP || t->op == J_EQZ)) {
+            want[i] = 1;
+            c->hoisted++;
+        }
+        if (!want[i]) continue;
+        int32_t *ops[18];
+        int n = jit_operands(c, t, ops);
+        for (int k = 0; k < n; k++) {
+            int32_t d = c->v[*ops[k]].def;
+            if (!c->v[*ops[k]].mutable_ && d > (int32_t)s) want[d] = 1;
+        }
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < s; i++) out[m++] = c->ir[i];
+    for (size_t i = s + 1; i < e; i++) {
+        if (want[i]) out[m++] = c->ir[i];
+    }
+    for (size_t i = s; i < c->n; i++) {
+        if (!want[i]) out[m++] = c->ir[i];
+    }
+    memcpy(c->ir, out, sizeof(JitInsn) * m);
+done:
+    free(mdef);
+    free(inv);
+    free(want);
+    free(out);
+}
+
+// v がループ [s, e) の中でループ変数 iv のアフィン式 iv * scale + add (scale >= 1, add >= 0) なら 1 を返す。
+// 可変レジスタはループ内の定義が1つで、関数の入れ子の外側 (ループの直下) にあり、ループ内の使用より
+// 前にあるときだけ辿る (どの周回でも使う前にその周回の値が入っている)
+static int jit_affine(JitCompiler *c, int32_t v, int32_t iv, size_t s, size_t e, int64_t *scale, int64_t *add, int depth) {
+    if (v == iv) {
+        *scale = 1;
+        *add = 0;
+        return 1;
+    }
+    if (depth == 4) return 0;
+    size_t d = 0;
+    if (c->v[v].mutable_) {
+        int defs = 0, nest = 0, ok = 1;
+        for (size_t i = s + 1; i < e; i++) {
+            JitInsn *t = &c->ir[i];
+            int32_t *ops[18];
+            int n = jit_operands(c, t, ops);
+            for (int k = 0; k < n; k++) {
+                if (*ops[k] == v && defs == 0) ok = 0; // 定義より前の使用 (前の周回の値)
+            }
+            if (t->dst == v) {
+                if (nest != 0) ok = 0;
+                defs++;
+                d = i;
+            }
+            if (t->op == J_BLOCK) nest++;
+            if (t->op == J_LABEL && !t->sub) nest--;
+        }
+        if (!ok || defs != 1) return 0;
+    } else {
+        if (c->v[v].def <= (int32_t)s || c->v[v].def >= (int32_t)e) return 0;
+        d = (size_t)c->v[v].def;
+    }
+    JitInsn *t = &c->ir[d];
+    if (t->op == J_COPY) return jit_affine(c, t->a, iv, s, e, scale, add, depth + 1);
+    if (t->op != J_BIN || !t->b_imm || !jit_affine(c, t->a, iv, s, e, scale, add, depth + 1)) return 0;
+    if (t->sub == 0x6C && t->imm >= 1 && t->imm <= 65536) { // mul
+        *scale *= t->imm;
+        *add *= t->imm;
+    } else if (t->sub == 0x74 && t->imm >= 0 && t->imm <= 16) { // shl
+        *scale <<= t->imm;
+        *add <<= t->imm;
+    } else if (t->sub == 0x6A && t->imm >= 0 && t->imm <= VM_MEMORY_SIZE) { // add
+        *add += t->imm;
+    } else {
+        return 0;
+    }
+    return *scale <= VM_MEMORY_SIZE && *add <= VM_MEMORY_SIZE;
+}
+
+// アクセスが必ず範囲外になるなら VM_MEMORY_SIZE + 1 (base から offset + 4 バイトを読み書きする)
+static uint32_t jit_access_need(const JitInsn *t) {
+    uint64_t need = (uint64_t)(uint32_t)t->imm + 4;
+    return need > VM_MEMORY_SIZE ? VM_MEMORY_SIZE + 1 : (uint32_t)need;
+}
+
+// 境界検査のループの版分け。先頭が「iv >= n (または iv > n) なら抜ける」で、iv が一定の正の数ずつ
+// 増えるだけの最も内側のループについて、添字が iv のアフィン式のアクセスがすべて範囲内に収まる条件
+// (ループに入るときの iv >= 0 と n の上限) をループの前で1回だけ確かめ、成り立てばそれらのアクセスの
+// 検査を省いた複製を、成り立たなければ元のループを実行する。元のループはそのまま残すので、
+// 途中の周回でトラップするときも、それまでの store は元どおり行われる
+static void jit_version_loop(JitCompiler *c, size_t s) {
+    size_t e = jit_loop_end(c, s);
+    if (e == c->n || s + 3 >= e) return;
+    JitInsn *cmp = &c->ir[s + 1], *exit = &c->ir[s + 2];
+    if (cmp->op != J_CMP || (cmp->sub != 0x4E && cmp->sub != 0x4A) || exit->op != J_BRIF || exit->a != cmp->dst) return;
+    int32_t iv = cmp->a;
+    if (!c->v[iv].mutable_) return;
+    // ループ変数の更新、ループの出口、ループ内で定義した値のループ外での使用を調べる
+    int64_t step = 0;
+    for (size_t i = s + 1; i < e; i++) {
+        JitInsn *t = &c->ir[i];
+        if (t->op == J_LOOP) return; // 最も内側のループだけ
+        if ((t->op == J_LABEL || t->op == J_BLOCK) && t->imm == exit->imm) return;
+        if (t->dst == iv) {
+            if (step != 0 || t->op != J_BIN || t->sub != 0x6A || !t->b_imm || t->a != iv || t->imm < 1 || t->imm > 65536) return;
+            step = t->imm;
+        }
+    }
+    if (step == 0 || exit->imm == c->ir[s].imm) return;
+    for (size_t i = e + 1; i < c->n; i++) {
+        int32_t *ops[18];
+        int n = jit_operands(c, &c->ir[i], ops);
+        for (int k = 0; k < n; k++) {
+            int32_t d = c->v[*ops[k]].def;
+            if (!c->v[*ops[k]].mutable_ && d > (int32_t)s && d < (int32_t)e) return;
+        }
+    }
+    int32_t bound = -1, n_const = 0;
+    if (cmp->b_imm) {
+        n_const = cmp->imm;
+    } else {
+        bound = cmp->b;
+        if (c->v[bound].mutable_ ? jit_defines_in(c, bound, s, e) : c->v[bound].def >= (int32_t)s) return;
+    }
+    // ループ内で iv <= nmax + step。アクセスごとに nmax の上限を求め、いちばん小さいものを使う
+    int64_t limit = INT32_MAX;
+    uint8_t *safe = vm_calloc(e - s, 1);
+    if (safe == NULL) { c->failed = 1; return; }
+    int found = 0;
+    for (size_t i = s + 1; i < e; i++) {
+        JitInsn *t = &c->ir[i];
+        int64_t scale, add;
+        if ((t->op != J_LOAD && t->op != J_STORE) || !jit_affine(c, t->a, iv, s, e, &scale, &add, 0)) continue;
+        int64_t room = (int64_t)VM_MEMORY_SIZE - jit_access_need(t) - add;
+        if (room < 0) continue;
+        int64_t l = room / scale - step;
+        if (l < 0) continue;
+        if (l < limit) limit = l;
+        safe[i - s] = 1;
+        found = 1;
+    }
+    int64_t nmax = cmp->sub == 0x4E ? (int64_t)n_const - 1 : n_const;
+    if (!found || (bound < 0 && nmax > limit)) {
+        free(safe);
+        return;
+    }
+
+    // [0, s) ガード 複製 [s, e] else 元 [s, e] end (e, n)
+    size_t len = e - s + 1, nv = c->nv;
+    uint32_t nl = c->nlabels;
+    uint32_t join = c->nlabels++, slow = c->nlabels++;
+    int32_t *vmap = vm_malloc(sizeof(int32_t) * (nv ? nv : 1));
+    uint32_t *lmap = vm_malloc(sizeof(uint32_t) * (nl ? nl : 1));
+    size_t out_cap = c->n + len + 8;
+    JitInsn *out = vm_malloc(sizeof(JitInsn) * out_cap);
+    if (!vmap || !lmap || !out) {
+        c->failed = 1;
+        goto done;
+    }
+    for (size_t i = 0; i < nv; i++) vmap[i] = (int32_t)i;
+    for (uint32_t i = 0; i < nl; i++) lmap[i] = i;
+    for (size_t i = s; i <= e; i++) {
+        JitInsn *t = &c->ir[i];
+        if (t->dst >= 0 && !c->v[t->dst].mutable_) vmap[t->dst] = jit_new_vreg(c, 0);
+        if (t->op == J_LOOP || t->op == J_BLOCK || t->op == J_LABEL) {
+            if (lmap[t->imm] == (uint32_t)t->imm) lmap[t->imm] = c->nlabels++;
+        }
+    }
+    size_t m = 0;
+    memcpy(out, c->ir, sizeof(JitInsn) * s);
+    m = s;
+    out[m++] = (JitInsn){ .op = J_BLOCK, .dst = -1, .a = -1, .b = -1, .imm = (int32_t)join };
+    int32_t g = jit_new_vreg(c, 0);
+    out[m++] = (JitInsn){ .op = J_CMP, .sub = 0x48, .b_imm = 1, .dst = g, .a = iv, .b = -1, .imm = 0 }; // iv < 0
+    out[m++] = (JitInsn){ .op = J_BRIF, .dst = -1, .a = g, .b = -1, .imm = (int32_t)slow };
+    if (bound >= 0) {
+        g = jit_new_vreg(c, 0);
+        int64_t max_n = cmp->sub == 0x4E ? limit + 1 : limit;
+        out[m++] = (JitInsn){ .op = J_CMP, .sub = 0x4A, .b_imm = 1, .dst = g, .a = bound, .b = -1, .imm = (int32_t)max_n }; // n > max_n
+        out[m++] = (JitInsn){ .op = J_BRIF, .dst = -1, .a = g, .b = -1, .imm = (int32_t)slow };
+    }
+    for (size_t i = s; i <= e && !c->failed; i++) {
+        JitInsn t = c->ir[i];
+        if (t.op == J_CALL || t.op == J_BRTABLE) {
+            uint32_t first = (uint32_t)c->npool;
+            for (uint32_t k = 0; k < t.nextra; k++) {
+                int32_t x = c->pool[t.extra + k];
+                jit_pool_add(c, t.op == J_CALL ? vmap[x] : (int32_t)lmap[x]);
+            }
+            t.extra = first;
+            if (t.op == J_BRTABLE) t.a = vmap[t.a];
+        } else {
+            int32_t *ops[18];
+            int n = jit_operands(c, &t, ops);
+            for (int k = 0; k < n; k++) *ops[k] = vmap[*ops[k]];
+        }
+        if (t.dst >= 0) t.dst = vmap[t.dst];
+        switch (t.op) {
+            case J_LOOP: case J_LOOP_END: case J_BLOCK: case J_LABEL: case J_JMP: case J_BRIF: case J_BRZ:
+                t.imm = (int32_t)lmap[t.imm];
+                break;
+            case J_LOAD: case J_STORE:
+                t.sub = safe[i - s]; // 1: ガードで範囲内と確かめた
+                break;
+        }
+        out[m++] = t;
+    }
+    out[m++] = (JitInsn){ .op = J_JMP, .dst = -1, .a = -1, .b = -1, .imm = (int32_t)join };
+    out[m++] = (JitInsn){ .op = J_LABEL, .sub = 1, .dst = -1, .a = -1, .b = -1, .imm = (int32_t)slow };
+    memcpy(&out[m], &c->ir[s], sizeof(JitInsn) * len);
+    m += len;
+    out[m++] = (JitInsn){ .op = J_LABEL, .dst = -1, .a = -1, .b = -1, .imm = (int32_t)join };
+    memcpy(&out[m], &c->ir[e + 1], sizeof(JitInsn) * (c->n - e - 1));
+    m += c->n - e - 1;
+    free(c->ir);
+    c->ir = out;
+    c->n = m;
+    c->cap = out_cap; // 後から jit_ir で足すときに、確保した大きさを超えて書かないように
+    out = NULL;
+    c->versioned++;
+done:
+    free(safe);
+    free(vmap);
+    free(lmap);
+    free(out);
+}
+
+// 版分けはループごとに1回だけ (複製したループのラベルは新しいので、元のループのラベルで探す)
+static void jit_version_loops(JitCompiler *c) {
+    size_t nloops = 0;
+    for (size_t i = 0; i < c->n; i++) nloops += c->ir[i].op == J_LOOP;
+    int32_t *labels = vm_malloc(sizeof(int32_t) * (nloops ? nloops : 1));
+    if (labels == NULL) { c->failed = 1; return; }
+    nloops = 0;
+    for (size_t i = 0; i < c->n; i++) {
+        if (c->ir[i].op == J_LOOP) labels[nloops++] = c->ir[i].imm;
+    }
+    for (size_t k = 0; k < nloops && !c->failed; k++) {
+        size_t s = 0;
+        while (s < c->n && !(c->ir[s].op == J_LOOP && c->ir[s].imm == labels[k])) s++;
+        if (s == c->n) continue;
+        jit_analyze(c);
+        jit_version_loop(c, s);
+    }
+    free(labels);
+}
+
+// 支配される境界検査の削除。アクセスが [base + offset, base + offset + 4) に収まることを
+// 確かめた base ごとに検査済みの範囲を覚えておき、それに含まれるアクセスの検査を省く。
+// 検査済みの事実は、それを確かめたブロックの中 (と、ブロックを抜けた後の支配される位置) でだけ使う。
+// load の検査は、同じ基本ブロックでその後に続く同じ base のアクセスの最大の offset までまとめて確かめる
+// (間に store や他の副作用があると、トラップの前に起きるはずのことが起きなくなるので、そこで止める)
+static void jit_eliminate_checks(JitCompiler *c) {
+    uint64_t *known = vm_calloc(c->nv, sizeof(uint64_t)); // 検査済みのアクセスの末尾 (base からの距離)
+    int32_t *depth = vm_calloc(c->nv, sizeof(int32_t));   // 事実を確かめたブロックの深さ
+    if (!known || !depth) {
+        c->failed = 1;
+        goto done;
+    }
+    jit_analyze(c);
+    int32_t cur = 0;
+    for (size_t i = 0; i < c->n; i++) {
+        JitInsn *t = &c->ir[i];
+        switch (t->op) {
+            case J_BLOCK:
+                cur++;
+                break;
+            case J_LOOP: {
+                // ループの先頭へは後ろ向きの分岐でも来るので、ループ内で書き換わる可変レジスタの事実は捨てる
+                size_t e = jit_loop_end(c, i);
+                for (size_t k = i; k < e; k++) {
+                    int32_t d = c->ir[k].dst;
+                    if (d >= 0 && c->v[d].mutable_) known[d] = 0;
+                }
+                cur++;
+                break;
+            }
+            case J_LOOP_END:
+                // loop の end へは前から流れ落ちるだけなので、事実はそのまま外側で使える
+                cur--;
+                for (size_t k = 0; k < c->nv; k++) {
+                    if (depth[k] > cur) depth[k] = cur;
+                }
+                break;
+            case J_LABEL:
+                // 合流点: このブロックの中で確かめた事実は、他の経路では成り立たない
+                for (size_t k = 0; k < c->nv; k++) {
+                    if (known[k] && depth[k] >= cur) known[k] = 0;
+                }
+                if (!t->sub) cur--;
+                break;
+            case J_LOAD: case J_STORE: {
+                uint32_t need = jit_access_need(t);
+                int32_t base;
+                c->checks++;
+                t->need = need;
+                t->checked = 1;
+                if (c->guarded) {
+                    t->checked = need > VM_MEMORY_SIZE; // 範囲外が確定しているものだけ (offset がガードページを越える)
+                } else if (t->sub == 1) {
+                    t->checked = 0;
+                } else if (jit_is_const(c, t->a, &base)) {
+                    if ((uint64_t)(uint32_t)base + need <= VM_MEMORY_SIZE) t->checked = 0;
+                } else if (known[t->a] >= need) {
+                    t->checked = 0;
+                } else {
+                    for (size_t k = i + 1; t->op == J_LOAD && need <= VM_MEMORY_SIZE && k < c->n; k++) {
+                        JitInsn *u = &c->ir[k];
+                        if ((u->op == J_LOAD || u->op == J_STORE) && u->a == t->a && u->sub != 1) {
+                            uint32_t n = jit_access_need(u);
+                            if (n <= VM_MEMORY_SIZE && n > need) need = n;
+                        }
+                        if (u->op >= J_BLOCK || u->op == J_STORE || u->op == J_GSET || u->dst == t->a ||
+                            (u->op == J_BIN && !jit_pure(u))) break;
+                    }
+                    t->need = need;
+                    known[t->a] = need;
+                    depth[t->a] = cur;
+                }
+                if (!t->checked) c->checks_removed++;
+                break;
+            }
+        }
+        if (t->dst >= 0 && c->v[t->dst].mutable_) known[t->dst] = 0;
+    }
+done:
+    free(known);
+    free(depth);
+}
+
+void jit_optimize(JitCompiler *c) {
+    jit_fold_immediates(c);
+    jit_forward_copies(c);
+    jit_retarget(c);
+    jit_dce(c);
+    // 内側のループから順に (J_LOOP_END の並び順に) 不変式を移す
+    for (size_t i = 0; i < c->n && !c->failed; i++) {
+        if (c->ir[i].op == J_LOOP_END) jit_hoist_loop(c, c->ir[i].imm);
+    }
+    if (!c->guarded) jit_version_loops(c);
+    jit_eliminate_checks(c);
+}
+
+// --- 3. レジスタ割り当て ---
+
+static __thread JitVreg *jit_sort_v; // qsort の比較関数へ渡す (プールのワーカーが同時にコンパイルする)
+static int jit_compare_start(const void *x, const void *y) {
+    const JitVreg *a = &jit_sort_v[*(const int32_t *)x], *b = &jit_sort_v[*(const int32_t *)y];
+    if (a->start != b->start) return a->start < b->start ? -1 : 1;
+    return (*(const int32_t *)x > *(const int32_t *)y) - (*(const int32_t *)x < *(const int32_t *)y);
+}
+
+void jit_allocate(JitCompiler *c) {
+    jit_analyze(c);
+    // 生存区間: SSA 値は定義から最後の使用まで、ローカル変数は関数の先頭から
+    for (size_t i = 0; i < c->n; i++) {
+        int32_t *ops[18];
+        int n = jit_operands(c, &c->ir[i], ops);
+        int32_t regs[19];
+        for (int k = 0; k < n; k++) regs[k] = *ops[k];
+        if (c->ir[i].dst >= 0) regs[n++] = c->ir[i].dst;
+        for (int k = 0; k < n; k++) {
+            JitVreg *r = &c->v[regs[k]];
+            if (r->start < 0) r->start = (regs[k] < (int32_t)c->nlocals) ? 0 : (int32_t)i;
+            r->end = (int32_t)i;
+        }
+    }
+    // ループの中で使われ、ループより前から生きている値は、次の周回のためにループの末尾まで生かす
+    for (size_t s = 0; s < c->n; s++) {
+        if (c->ir[s].op != J_LOOP) continue;
+        size_t e = jit_loop_end(c, s);
+        for (size_t i = s; i < e; i++) {
+            int32_t *ops[18];
+            int n = jit_operands(c, &c->ir[i], ops);
+            int32_t regs[19];
+            for (int k = 0; k < n; k++) regs[k] = *ops[k];
+            if (c->ir[i].dst >= 0) regs[n++] = c->ir[i].dst;
+            for (int k = 0; k < n; k++) {
+                JitVreg *r = &c->v[regs[k]];
+                if (r->start < (int32_t)s && r->end < (int32_t)e) r->end = (int32_t)e;
+            }
+        }
+    }
+
+    int32_t *order = vm_malloc(sizeof(int32_t) * (c->nv ? c->nv : 1));
+    if (order == NULL) { c->failed = 1; return; }
+    size_t m = 0;
+    for (size_t i = 0; i < c->nv; i++) {
+        if (c->v[i].start >= 0) order[m++] = (int32_t)i;
+    }
+    jit_sort_v = c->v;
+    qsort(order, m, sizeof(int32_t), jit_compare_start);
+
+    int32_t active[JIT_NREGS];
+    int nactive = 0;
+    uint8_t used[JIT_NREGS] = {0};
+    for (size_t k = 0; k < m; k++) {
+        JitVreg *cur = &c->v[order[k]];
+        // 終わった区間のレジスタを空ける (最後の使用と同じ命令で定義する値とは共有してよい。
+        // ローカル変数は先頭の命令より前 (プロローグ) から生きているので共有しない)
+        int defined_here = order[k] >= (int32_t)c->nlocals && cur->def == cur->start;
+        for (int j = 0; j < nactive;) {
+            JitVreg *a = &c->v[active[j]];
+            if (a->end < cur->start || (a->end == cur->start && defined_here)) {
+                for (int r = 0; r < JIT_NREGS; r++) {
+                    if (jit_regs[r] == a->reg) used[r] = 0;
+                }
+                active[j] = active[--nactive];
+            } else {
+                j++;
+            }
+        }
+        int free_reg = -1;
+        for (int r = 0; r < JIT_NREGS; r++) {
+            if (!used[r]) { free_reg = r; break; }
+        }
+        if (free_reg >= 0) {
+            used[free_reg] = 1;
+            cur->reg = jit_regs[free_reg];
+            active[nactive++] = order[k];
+            continue;
+        }
+        // 空きがなければ、最も遠くまで生きる区間をスタックへ追い出す
+        int far = 0;
+        for (int j = 1; j < nactive; j++) {
+            if (c->v[active[j]].end > c->v[active[far]].end) far = j;
+        }
+        JitVreg *victim = &c->v[active[far]];
+        if (victim->end > cur->end) {
+            cur->reg = victim->reg;
+            victim->reg = -1;
+            victim->slot = c->nslots++;
+            active[far] = order[k];
+        } else {
+            cur->slot = c->nslots++;
+        }
+    }
+    free(order);
+    // フレーム: [rsp] = vm, スピル領域, 呼び出しの引数領域 (16 x i32)
+    c->arg_off = 8 + 8 * c->nslots;
+    c->frame_size = c->arg_off + 64;
+    if (c->frame_size % 16 != 8) c->frame_size += 8; // 6 回の push と合わせて rsp を 16 バイト境界に揃える
+}
+
+// --- 4. コード生成 ---
+
+static void jit_byte(JitCompiler *c, uint8_t b) {
+    if (jit_grow(c, (void **)&c->code, &c->code_cap, c->len + 1, 1) < 0) return;
+    c->code[c->len++] = b;
+}
+
+static void jit_u32(JitCompiler *c, uint32_t v) {
+    for (int i = 0; i < 4; i++) jit_byte(c, (uint8_t)(v >> (8 * i)));
+}
+
+static void jit_u64(JitCompiler *c, uint64_t v) {
+    for (int i = 0; i < 8; i++) jit_byte(c, (uint8_t)(v >> (8 * i)));
+}
+
+static void jit_rex(JitCompiler *c, int w, int reg, int index, int base) {
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40) jit_byte(c, rex);
+}
+
+static void jit_opcode(JitCompiler *c, uint16_t op) {
+    if (op > 0xFF) jit_byte(c, (uint8_t)(op >> 8));
+    jit_byte(c, (uint8_t)op);
+}
+
+// op reg, rm (どちらもレジスタ)。w = 1 なら 64 ビット
+static void jit_rr(JitCompiler *c, int w, uint16_t op, int reg, int rm) {
+    jit_rex(c, w, reg, 0, rm);
+    jit_opcode(c, op);
+    jit_byte(c, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+// op reg, [base + disp32]
+static void jit_rm(JitCompiler *c, int w, uint16_t op, int reg, int base, int32_t disp) {
+    jit_rex(c, w, reg, 0, base);
+    jit_opcode(c, op);
+    jit_byte(c, (uint8_t)(0x80 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) jit_byte(c, 0x24);
+    jit_u32(c, (uint32_t)disp);
+}
+
+// op reg, [r15 + index + disp32] (線形メモリ)
+static void jit_rm_mem(JitCompiler *c, uint16_t op, int reg, int index, int32_t disp) {
+    jit_rex(c, 0, reg, index, R15);
+    jit_opcode(c, op);
+    jit_byte(c, (uint8_t)(0x80 | (reg & 7) << 3 | 4));
+    jit_byte(c, (uint8_t)((index & 7) << 3 | (R15 & 7)));
+    jit_u32(c, (uint32_t)disp);
+}
+
+// グループ命令 (81 /ext など) を即値で。imm8 に収まれば短い形を使う
+static void jit_alu_imm(JitCompiler *c, int w, int ext, int rm, int32_t imm) {
+    if (imm >= -128 && imm <= 127) {
+        jit_rr(c, w, 0x83, ext, rm);
+        jit_byte(c, (uint8_t)imm);
+    } else {
+        jit_rr(c, w, 0x81, ext, rm);
+        jit_u32(c, (uint32_t)imm);
+    }
+}
+
+static void jit_mov_rr(JitCompiler *c, int dst, int src) {
+    if (dst != src) jit_rr(c, 0, 0x89, src, dst);
+}
+
+static void jit_mov_ri(JitCompiler *c, int r, int32_t imm) {
+    if (imm == 0) {
+        jit_rr(c, 0, 0x31, r, r); // xor r, r
+        return;
+    }
+    jit_rex(c, 0, 0, 0, r);
+    jit_byte(c, (uint8_t)(0xB8 | (r & 7)));
+    jit_u32(c, (uint32_t)imm);
+}
+
+static void jit_label_here(JitCompiler *c, uint32_t label) {
+    c->label_pos[label] = (int32_t)c->len;
+}
+
+// rel32 を後でラベルの位置に合わせる
+static void jit_rel32(JitCompiler *c, uint32_t label) {
+    if (jit_grow(c, (void **)&c->fixups, &c->fix_cap, c->nfix + 1, sizeof(JitFixup)) == 0) {
+        c->fixups[c->nfix++] = (JitFixup){ c->len, label };
+    }
+    jit_u32(c, 0);
+}
+
+static void jit_jmp(JitCompiler *c, uint32_t label) {
+    jit_byte(c, 0xE9);
+    jit_rel32(c, label);
+}
+
+static void jit_jcc(JitCompiler *c, int cc, uint32_t label) {
+    jit_opcode(c, (uint16_t)(0x0F80 | cc));
+    jit_rel32(c, label);
+}
+
+static uint32_t jit_trap_label(JitCompiler *c, int code) {
+    if (c->trap_label[code] == 0) c->trap_label[code] = c->nlabels++ + 1;
+    return c->trap_label[code] - 1;
+}
+
+static int32_t jit_slot_disp(JitCompiler *c, int32_t v) {
+    return 8 + 8 * c->v[v].slot;
+}
+
+// v の値が入っているレジスタ (スタックにあれば scratch に読み込む)
+static int jit_use(JitCompiler *c, int32_t v, int scratch) {
+    if (c->v[v].reg >= 0) return c->v[v].reg;
+    jit_rm(c, 0, 0x8B, scratch, RSP, jit_slot_disp(c, v));
+    return scratch;
+}
+
+// v の値をレジスタ r から書き込む
+static void jit_def(JitCompiler *c, int32_t v, int r) {
+    if (c->v[v].reg >= 0) jit_mov_rr(c, c->v[v].reg, r);
+    else jit_rm(c, 0, 0x89, r, RSP, jit_slot_disp(c, v));
+}
+
+// v を計算するレジスタ (スタックにあるなら scratch で計算して jit_def で書き戻す)
+static int jit_def_reg(JitCompiler *c, int32_t v, int scratch) {
+    return c->v[v].reg >= 0 ? c->v[v].reg : scratch;
+}
+
+// 比較の opcode → x86 の条件コード
+static int jit_cc(uint8_t op) {
+    static const uint8_t cc[10] = { 0x4, 0x5, 0xC, 0x2, 0xF, 0x7, 0xE, 0x6, 0xD, 0x3 };
+    return cc[op - 0x46];
+}
+
+static void jit_lower_bin(JitCompiler *c, JitInsn *t) {
+    uint8_t op = t->sub;
+    if (op >= 0x6D && op <= 0x70) { // div/rem: edx:eax / ecx
+        int is_signed = op == 0x6D || op == 0x6F, is_rem = op >= 0x6F;
+        int may_zero = 1, may_neg1 = is_signed;
+        if (t->b_imm) {
+            if (t->imm == 0) { jit_jmp(c, jit_trap_label(c, JIT_TRAP_DIV)); return; }
+            may_zero = 0;
+            may_neg1 = is_signed && t->imm == -1;
+            jit_mov_ri(c, RCX, t->imm);
+        } else {
+            jit_mov_rr(c, RCX, jit_use(c, t->b, RCX));
+        }
+        jit_mov_rr(c, RAX, jit_use(c, t->a, RAX));
+        if (may_zero) {
+            jit_rr(c, 0, 0x85, RCX, RCX); // test ecx, ecx
+            jit_jcc(c, 0x4, jit_trap_label(c, JIT_TRAP_DIV));
+        }
+        size_t skip = 0, done = 0;
+        if (may_neg1) {
+            // INT32_MIN / -1 はオーバーフロー、INT32_MIN % -1 は 0 (idiv は例外になるので避ける)
+            jit_alu_imm(c, 0, 7, RCX, -1);
+            jit_byte(c, 0x75); // jne
+            skip = c->len;
+            jit_byte(c, 0);
+            if (is_rem) {
+                jit_rr(c, 0, 0x31, RDX, RDX);
+                jit_byte(c, 0xEB); // jmp
+                done = c->len;
+                jit_byte(c, 0);
+            } else {
+                jit_byte(c, 0x3D); // cmp eax, INT32_MIN
+                jit_u32(c, 0x80000000u);
+                jit_jcc(c, 0x4, jit_trap_label(c, JIT_TRAP_OVERFLOW));
+            }
+            c->code[skip] = (uint8_t)(c->len - skip - 1);
+        }
+        if (is_signed) {
+            jit_byte(c, 0x99);              // cdq
+            jit_rr(c, 0, 0xF7, 7, RCX);     // idiv ecx
+        } else {
+            jit_rr(c, 0, 0x31, RDX, RDX);
+            jit_rr(c, 0, 0xF7, 6, RCX);     // div ecx
+        }
+        if (done) c->code[done] = (uint8_t)(c->len - done - 1);
+        jit_def(c, t->dst, is_rem ? RDX : RAX);
+        return;
+    }
+    if (op >= 0x74) { // shl, shr_s, shr_u, rotl, rotr
+        static const uint8_t ext[5] = { 4, 7, 5, 0, 1 };
+        if (!t->b_imm) jit_mov_rr(c, RCX, jit_use(c, t->b, RCX));
+        int rd = jit_def_reg(c, t->dst, RAX);
+        jit_mov_rr(c, rd, jit_use(c, t->a, rd));
+        if (t->b_imm) {
+            jit_rr(c, 0, 0xC1, ext[op - 0x74], rd);
+            jit_byte(c, (uint8_t)(t->imm & 31));
+        } else {
+            jit_rr(c, 0, 0xD3, ext[op - 0x74], rd);
+        }
+        jit_def(c, t->dst, rd);
+        return;
+    }
+    // add, sub, mul, and, or, xor: rd = a; rd op= b
+    int rb = t->b_imm ? -1 : jit_use(c, t->b, RCX);
+    int rd = jit_def_reg(c, t->dst, RAX);
+    if (rd == rb) rd = RAX;
+    jit_mov_rr(c, rd, jit_use(c, t->a, rd));
+    if (op == 0x6C) {
+        if (t->b_imm) {
+            jit_rr(c, 0, 0x69, rd, rd);
+            jit_u32(c, (uint32_t)t->imm);
+        } else {
+            jit_rr(c, 0, 0x0FAF, rd, rb);
+        }
+    } else {
+        int ext = op == 0x6A ? 0 : op == 0x6B ? 5 : op == 0x71 ? 4 : op == 0x72 ? 1 : 6;
+        if (t->b_imm) jit_alu_imm(c, 0, ext, rd, t->imm);
+        else jit_rr(c, 0, (uint16_t)(ext << 3 | 1), rb, rd);
+    }
+    jit_def(c, t->dst, rd);
+}
+
+// 線形メモリのアクセスの境界検査 (必要なら) をして、アドレスの入ったレジスタを返す
+static int jit_mem_addr(JitCompiler *c, JitInsn *t, int trap) {
+    int ra = jit_use(c, t->a, RAX); // 32 ビットの値なので上位 32 ビットは 0
+    if (t->checked) {
+        int64_t limit = (int64_t)VM_MEMORY_SIZE - (int64_t)t->need;
+        if (limit < 0) {
+            jit_jmp(c, jit_trap_label(c, trap));
+            return -1;
+        }
+        jit_rr(c, 1, 0x81, 7, ra); // cmp ra, limit
+        jit_u32(c, (uint32_t)limit);
+        jit_jcc(c, 0x7, jit_trap_label(c, trap)); // ja
+    }
+    return ra;
+}
+
+static void jit_lower(JitCompiler *c, int32_t off_memory, int32_t off_depth, int32_t off_globals, int32_t off_frames) {
+    WasmVM *vm = c->vm;
+    FuncFrame *fr = &vm->func_frames[c->func_idx];
+    c->epilogue = c->nlabels++;
+    // --- プロローグ ---
+    static const uint8_t pushes[] = { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 };
+    for (size_t i = 0; i < sizeof(pushes); i++) jit_byte(c, pushes[i]); // push rbx, rbp, r12-r15
+    jit_rr(c, 1, 0x81, 5, RSP); // sub rsp, frame_size
+    jit_u32(c, (uint32_t)c->frame_size);
+    jit_rm(c, 1, 0x89, RDI, RSP, 0);             // [rsp] = vm
+    jit_rm(c, 1, 0x8B, R15, RDI, off_memory);    // r15 = vm->memory
+    jit_rm(c, 0, 0x8B, RAX, RDI, off_depth);     // 呼び出しの深さ (インタプリタの call_sp と同じ上限)
+    jit_alu_imm(c, 0, 0, RAX, 1);
+    jit_rm(c, 0, 0x89, RAX, RDI, off_depth);
+    jit_alu_imm(c, 0, 7, RAX, 64);
+    jit_jcc(c, 0xF, jit_trap_label(c, JIT_TRAP_STACK)); // jg
+    for (uint32_t i = 0; i < c->nlocals; i++) {
+        if (c->v[i].start < 0) continue;
+        if (i < fr->param_count) {
+            int r = jit_def_reg(c, (int32_t)i, RAX);
+            jit_rm(c, 0, 0x8B, r, RSI, (int32_t)(4 * i));
+            jit_def(c, (int32_t)i, r);
+        } else if (c->v[i].reg >= 0) {
+            jit_mov_ri(c, c->v[i].reg, 0);
+        } else {
+            jit_rm(c, 0, 0xC7, 0, RSP, jit_slot_disp(c, (int32_t)i)); // mov dword [slot], 0
+            jit_u32(c, 0);
+        }
+    }
+
+    for (size_t i = 0; i < c->n && !c->failed; i++) {
+        JitInsn *t = &c->ir[i];
+        JitInsn *next = i + 1 < c->n ? &c->ir[i + 1] : NULL;
+        switch (t->op) {
+            case J_CONST: {
+                if (c->v[t->dst].reg >= 0) {
+                    jit_mov_ri(c, c->v[t->dst].reg, t->imm);
+                } else {
+                    jit_rm(c, 0, 0xC7, 0, RSP, jit_slot_disp(c, t->dst));
+                    jit_u32(c, (uint32_t)t->imm);
+                }
+                break;
+            }
+            case J_COPY: {
+                if (c->v[t->dst].reg >= 0 && c->v[t->dst].reg == c->v[t->a].reg) break;
+                jit_def(c, t->dst, jit_use(c, t->a, RAX));
+                break;
+            }
+            case J_BIN:
+                jit_lower_bin(c, t);
+                break;
+            case J_CMP: case J_EQZ: {
+                int ra = jit_use(c, t->a, RAX);
+                int cc;
+                if (t->op == J_EQZ) {
+                    jit_rr(c, 0, 0x85, ra, ra); // test
+                    cc = 0x4;
+                } else {
+                    if (t->b_imm) jit_alu_imm(c, 0, 7, ra, t->imm);
+                    else jit_rr(c, 0, 0x39, jit_use(c, t->b, RCX), ra);
+                    cc = jit_cc(t->sub);
+                }
+                // 直後の条件分岐だけが結果を使うなら、フラグのまま分岐する
+                if (next && (next->op == J_BRIF || next->op == J_BRZ) && next->a == t->dst &&
+                    !c->v[t->dst].mutable_ && c->v[t->dst].uses == 1) {
+                    jit_jcc(c, next->op == J_BRIF ? cc : cc ^ 1, (uint32_t)next->imm);
+                    i++;
+                    break;
+                }
+                jit_opcode(c, (uint16_t)(0x0F90 | cc)); // setcc al
+                jit_byte(c, 0xC0);
+                int rd = jit_def_reg(c, t->dst, RAX);
+                jit_rr(c, 0, 0x0FB6, rd, RAX);          // movzx rd, al
+                jit_def(c, t->dst, rd);
+                break;
+            }
+            case J_LOAD: {
+                int ra = jit_mem_addr(c, t, JIT_TRAP_LOAD);
+                if (ra < 0) break;
+                int rd = jit_def_reg(c, t->dst, RAX);
+                jit_rm_mem(c, 0x8B, rd, ra, t->imm);
+                jit_def(c, t->dst, rd);
+                break;
+            }
+            case J_STORE: {
+                int ra = jit_mem_addr(c, t, JIT_TRAP_STORE);
+                if (ra < 0) break;
+                jit_rm_mem(c, 0x89, jit_use(c, t->b, RCX), ra, t->imm);
+                break;
+            }
+            case J_GGET: {
+                jit_rm(c, 1, 0x8B, RAX, RSP, 0);
+                int rd = jit_def_reg(c, t->dst, RCX);
+                jit_rm(c, 0, 0x8B, rd, RAX, off_globals + 4 * t->imm);
+                jit_def(c, t->dst, rd);
+                break;
+            }
+            case J_GSET: {
+                int rv = jit_use(c, t->a, RCX);
+                jit_rm(c, 1, 0x8B, RAX, RSP, 0);
+                jit_rm(c, 0, 0x89, rv, RAX, off_globals + 4 * t->imm);
+                break;
+            }
+            case J_LABEL: case J_LOOP:
+                jit_label_here(c, (uint32_t)t->imm);
+                break;
+            case J_BLOCK: case J_LOOP_END:
+                break;
+            case J_JMP:
+                if (next && next->op == J_LABEL && next->imm == t->imm) break;
+                jit_jmp(c, (uint32_t)t->imm);
+                break;
+            case J_BRIF: case J_BRZ: {
+                int ra = jit_use(c, t->a, RAX);
+                jit_rr(c, 0, 0x85, ra, ra);
+                jit_jcc(c, t->op == J_BRIF ? 0x5 : 0x4, (uint32_t)t->imm);
+                break;
+            }
+            case J_BRTABLE: {
+                int ra = jit_use(c, t->a, RAX);
+                for (uint32_t k = 0; k + 1 < t->nextra; k++) {
+                    jit_alu_imm(c, 0, 7, ra, (int32_t)k);
+                    jit_jcc(c, 0x4, (uint32_t)c->pool[t->extra + k]);
+                }
+                jit_jmp(c, (uint32_t)c->pool[t->extra + t->nextra - 1]);
+                break;
+            }
+            case J_CALL: {
+                for (uint32_t k = 0; k < t->nextra; k++) {
+                    jit_rm(c, 0, 0x89, jit_use(c, c->pool[t->extra + k], RAX), RSP, c->arg_off + 4 * (int32_t)k);
+                }
+                jit_rm(c, 1, 0x8B, RDI, RSP, 0);              // rdi = vm
+                if ((size_t)t->imm < vm->import_func_count) {
+                    jit_mov_ri(c, RSI, t->imm);
+                    jit_rm(c, 1, 0x8D, RDX, RSP, c->arg_off);  // rdx = args
+                    jit_byte(c, 0x48);                         // mov rax, jit_call_import
+                    jit_byte(c, 0xB8);
+                    jit_u64(c, (uint64_t)(uintptr_t)jit_call_import);
+                } else {
+                    jit_rm(c, 1, 0x8D, RSI, RSP, c->arg_off);  // rsi = args
+                    // 呼び出し先のネイティブコードは同時にコンパイルされ、func_frames から読む
+                    jit_rm(c, 1, 0x8B, RAX, RDI, off_frames);  // rax = vm->func_frames
+                    jit_rm(c, 1, 0x8B, RAX, RAX, (int32_t)(t->imm * sizeof(FuncFrame) + offsetof(FuncFrame, native)));
+                }
+                jit_rr(c, 0, 0xFF, 2, RAX); // call rax
+                if (t->dst >= 0) jit_def(c, t->dst, RAX);
+                break;
+            }
+            case J_RET:
+                if (t->a >= 0) jit_mov_rr(c, RAX, jit_use(c, t->a, RAX));
+                if (i + 1 < c->n) jit_jmp(c, c->epilogue);
+                break;
+            case J_TRAP:
+                jit_jmp(c, jit_trap_label(c, t->imm));
+                break;
+        }
+    }
+
+    // --- エピローグ ---
+    jit_label_here(c, c->epilogue);
+    jit_rm(c, 1, 0x8B, RDI, RSP, 0);
+    jit_rm(c, 0, 0xFF, 1, RDI, off_depth); // dec dword [rdi + depth]
+    jit_rr(c, 1, 0x81, 0, RSP);            // add rsp, frame_size
+    jit_u32(c, (uint32_t)c->frame_size);
+    static const uint8_t pops[] = { 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 };
+    for (size_t i = 0; i < sizeof(pops); i++) jit_byte(c, pops[i]); // pop r15-r12, rbp, rbx; ret
+
+    // トラップ: jit_trap(vm, code) は戻らない
+    for (int code = 0; code < JIT_TRAP_COUNT; code++) {
+        if (c->trap_label[code] == 0) continue;
+        jit_label_here(c, c->trap_label[code] - 1);
+        jit_rm(c, 1, 0x8B, RDI, RSP, 0);
+        jit_mov_ri(c, RSI, code);
+        jit_byte(c, 0x48);
+        jit_byte(c, 0xB8);
+        jit_u64(c, (uint64_t)(uintptr_t)jit_trap);
+        jit_rr(c, 0, 0xFF, 2, RAX);
+    }
+
+    for (size_t i = 0; i < c->nfix && !c->failed; i++) {
+        int32_t rel = c->label_pos[c->fixups[i].label] - (int32_t)(c->fixups[i].pos + 4);
+        memcpy(&c->code[c->fixups[i].pos], &rel, 4);
+    }
+}
+
+// 1つの関数をコンパイルする。成功したら機械語 (vm_malloc したバッファ) を *out に返す
+int jit_compile_one(WasmVM *vm, uint32_t idx, uint8_t **out, size_t *out_len, uint32_t *callees, size_t *ncallees) {
+    if (ensure_prepared(vm, idx) < 0) return -1;
+    // ガードページの有無でコードが変わるので、線形メモリを先に確保する
+    if (vm_init_memory(vm) < 0) return -1;
+    JitCompiler c = { .vm = vm, .func_idx = idx, .guarded = vm->memory_reserve_size != 0 };
+    int ret = -1;
+    if (jit_lift(&c) < 0 || c.failed) goto done;
+    size_t before = c.n;
+    jit_optimize(&c);
+    jit_allocate(&c);
+    c.label_pos = vm_calloc(c.nlabels + JIT_TRAP_COUNT + 1, sizeof(int32_t));
+    if (c.failed || c.label_pos == NULL) goto done;
+    jit_lower(&c, (int32_t)offsetof(WasmVM, memory), (int32_t)offsetof(WasmVM, jit_depth),
+              (int32_t)offsetof(WasmVM, globals),
+              (int32_t)offsetof(WasmVM, func_frames));
+    if (c.failed) goto done;
+    *ncallees = 0;
+    for (size_t i = 0; i < c.n; i++) {
+        if (c.ir[i].op != J_CALL || (size_t)c.ir[i].imm < vm->import_func_count) continue;
+        size_t k = 0;
+        while (k < *ncallees && callees[k] != (uint32_t)c.ir[i].imm) k++;
+        if (k == *ncallees) callees[(*ncallees)++] = (uint32_t)c.ir[i].imm;
+    }
+    vm->jit_hoisted += c.hoisted;
+    vm->jit_checks += c.checks;
+    vm->jit_checks_removed += c.checks_removed;
+    vm->jit_loops_versioned += c.versioned;
+    TRACE("    jit: func[%u] compiled: %zu -> %zu IR insns, %u hoisted, %u loops versioned, %u/%u bounds checks removed, %d spill slots, %zu bytes\n",
+          idx, before, c.n, c.hoisted, c.versioned, c.checks_removed, c.checks, c.nslots, c.len);
+    *out = c.code;
+    *out_len = c.len;
+    c.code = NULL;
+    ret = 0;
+done:
+    free(c.ir);
+    free(c.v);
+    free(c.pool);
+    free(c.code);
+    free(c.label_pos);
+    free(c.fixups);
+    return ret;
+}
+
+#if VM_PROFILE
+// perf が JIT したコードを関数名で表示できるように /tmp/perf-<pid>.map に追記する
+void jit_perf_map(WasmVM *vm, uint32_t idx, void *code, size_t size) {
+    char path[64], name[128];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE *f = fopen(path, "a");
+    if (f == NULL) return;
+    get_func_name(vm, idx, name, sizeof(name));
+    fprintf(f, "%lx %zx wasm:%s\n", (unsigned long)(uintptr_t)code, size, name);
+    fclose(f);
+}
+#endif
+
+// 関数 idx と、そこから呼ばれる内部関数をまとめてコンパイルする。
+// ネイティブコードは呼び出し先もネイティブであることを前提にするので、全部そろったときだけ公開する
+int jit_compile(WasmVM *vm, uint32_t idx) {
+    // 作業用の表はどれも関数の数だけあれば足りるので、まとめて1回で確保する
+    size_t nf = vm->func_count;
+    uint8_t **code = vm_calloc(nf, sizeof(uint8_t *) + sizeof(size_t) + 2 * sizeof(uint32_t) + 1);
+    if (code == NULL) return -1;
+    size_t *len = (size_t *)(code + nf);
+    uint32_t *batch = (uint32_t *)(len + nf);
+    uint32_t *callees = batch + nf;
+    uint8_t *in_batch = (uint8_t *)(callees + nf);
+    size_t n = 0, done = 0;
+    batch[n++] = idx;
+    in_batch[idx] = 1;
+    for (; done < n; done++) {
+        uint32_t f = batch[done];
+        size_t ncallees = 0;
+        if (jit_compile_one(vm, f, &code[done], &len[done], callees, &ncallees) < 0) {
+            vm->func_frames[f].jit_state = 2;
+            goto fail;
+        }
+        for (size_t k = 0; k < ncallees; k++) {
+            uint32_t g = callees[k];
+            if (in_batch[g] || vm->func_frames[g].native) continue;
+            if (vm->func_frames[g].jit_state == 2) { done++; goto fail; }
+            in_batch[g] = 1;
+            batch[n++] = g;
+        }
+    }
+    // 実行可能なページに写して公開する
+    for (size_t i = 0; i < n; i++) {
+        size_t size = (len[i] + 4095) & ~(size_t)4095;
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            memcpy(p, code[i], len[i]);
+            // 実行を許さないポリシー (SELinux の execmem など) では失敗する。そのときはインタプリタで続ける
+            if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(p, size);
+                p = MAP_FAILED;
+            }
+        }
+        if (p == MAP_FAILED) {
+            for (size_t k = 0; k < i; k++) {
+                munmap(vm->func_frames[batch[k]].native, vm->func_frames[batch[k]].native_size);
+                vm->func_frames[batch[k]].native = NULL;
+            }
+            goto fail;
+        }
+        vm->func_frames[batch[i]].native = p;
+        vm->func_frames[batch[i]].native_size = (uint32_t)size;
+    }
+    for (size_t i = 0; i < n; i++) {
+        vm->func_frames[batch[i]].jit_state = 1;
+#if VM_PROFILE
+        jit_perf_map(vm, batch[i], vm->func_frames[batch[i]].native, len[i]);
+#endif
+        free(code[i]);
+    }
+    vm->jit_compiled += (uint32_t)n;
+    free(code);
+    return 0;
+fail:
+    for (size_t i = 0; i < done; i++) free(code[i]);
+    free(code);
+    vm->func_frames[idx].jit_state = 2;
+    return -1;
+}
+
+// ネイティブコードの関数 idx を args で呼び出す。トラップしたら -1 を返す
+int jit_invoke(WasmVM *vm, uint32_t idx, int32_t *args, int32_t *result) {
+    sigjmp_buf env;
+    if (vm_init_memory(vm) < 0) return -1;
+    WasmVM *volatile prev = jit_running; // ホスト関数から別のインスタンスを呼ぶことがある
+    sigjmp_buf *volatile prev_trap = vm->jit_trap; // 同じインスタンスを呼び直すこともある
+    vm->jit_trap = &env;
+    vm->jit_depth = vm->call_sp;
+    // シグナルマスクは保存しない (ハンドラは SA_NODEFER なので、抜けてもマスクは変わらない)
+    if (sigsetjmp(env, 0) != 0) {
+        jit_running = prev;
+        vm->jit_trap = prev_trap;
+        jit_trap_report(vm);
+#if VM_FLIGHT
+        flight_trap(vm, idx, 0);
+#endif
+        return -1;
+    }
+    jit_running = vm;
+    *result = ((JitEntry)vm->func_frames[idx].native)(vm, args);
+    jit_running = prev;
+    vm->jit_trap = prev_trap;
+    return 0;
+}
+
+// 関数 idx のネイティブコードがあれば 1 を返す。
+// なければ呼び出し回数を数え、VM_JIT_HOT_CALLS 回目でコンパイルする
+static inline int jit_ready(WasmVM *vm, uint32_t idx) {
+    FuncFrame *fr = &vm->func_frames[idx];
+    if (fr->native) return 1;
+    if (vm->jit == 0 || fr->jit_state != 0 || ++fr->calls < VM_JIT_HOT_CALLS) return 0;
+    return jit_compile(vm, idx) == 0;
+}
+
+void jit_free(WasmVM *vm) {
+    for (size_t i = vm->import_func_count; i < vm->func_count; i++) {
+        FuncFrame *fr = &vm->func_frames[i];
+        if (fr->native) munmap(fr->native, fr->native_size);
+        fr->native = NULL;
+        fr->jit_state = 0;
+        fr->calls = 0;
+    }
+}
+#endif
+
+// 関数 idx を呼び出す。引数は vm->stack に積まれている。
+// 内部関数なら呼び出しフレームを積んで vm->pc を関数本体へ移し、
+// インポート関数ならその場で実行して戻り値を積む。エラー時は -1 を返す
+int call_function(WasmVM *vm, uint32_t idx) {
+    if (idx < vm->import_func_count) {
+        // --- インポート関数の呼び出し ---
+        ImportFunc *f = &vm->import_funcs[idx];
+        if (f->func == NULL) {
+            printf("Unresolved import function: %s.%s\n", f->mod_name, f->field_name);
+            return -1;
+        }
+        FuncType *ftype = &vm->func_types[f->type_index];
+        int param_count = ftype->param_count;
+
+        TRACE("{call import} func_idx=%u, name='%s.%s', params=%d\n", idx, f->mod_name, f->field_name, param_count);
+#if VM_FLIGHT
+        flight_record(vm, FL_HOST, idx, 0);
+#endif
+        vm->sp -= param_count;
+        WasmVM *prev = host_caller;
+        host_caller = vm;
+        int32_t ret = f->func(&vm->stack[vm->sp], param_count);
+        host_caller = prev;
+
+        if (ftype->result_count > 0) {
+            vm->stack[vm->sp++] = ret;
+        }
+    } else {
+        // --- 内部関数の呼び出し ---
+        if (ensure_prepared(vm, idx) < 0) return -1;
+        const FuncFrame *fr = &vm->func_frames[idx];
+        int param_count = fr->param_count;
+
+#if VM_JIT
+        if (jit_ready(vm, idx)) {
+            int32_t ret;
+            TRACE("{call native} func_idx=%u, params=%d\n", idx, param_count);
+#if VM_FLIGHT
+            flight_record_at(vm, FL_ENTER, idx, 1, vm->call_sp + 1);
+#endif
+            vm->sp -= param_count;
+            if (jit_invoke(vm, idx, &vm->stack[vm->sp], &ret) < 0) return -1;
+            if (fr->result_count > 0) vm->stack[vm->sp++] = ret;
+#if VM_FLIGHT
+            flight_record_at(vm, FL_EXIT, (uint32_t)vm->pc, 1, vm->call_sp + 1);
+#endif
+            return 0;
+        }
+#endif
+        TRACE("{call internal} func_idx=%u, params=%d, vm->call_sp=%d; ", idx, param_count, vm->call_sp);
+#if VM_FLIGHT
+        flight_record_at(vm, FL_ENTER, idx, 0, vm->call_sp + 1);
+#endif
+
+        // 関数呼び出しスタックに現在の状態を保存
+        if (vm->call_sp >= 64) { printf("Call stack overflow\n"); return -1; }
+        // 本体の最大スタック高さはロード時にわかっているので、ここで1回だけ検査する
+        if (vm->sp - param_count + (int)fr->max_stack > 256) { printf("Value stack overflow\n"); return -1; }
+        // --- ADD: ローカル変数をCallFrameに保存 ---
+        TRACE("Current locals[0] = %d; ", vm->locals[0]);
+        memcpy(vm->call_stack[vm->call_sp].locals, vm->locals, sizeof(vm->locals));
+        TRACE("Saved locals[0] = %d; ", vm->call_stack[vm->call_sp].locals[0]);
+        vm->call_stack[vm->call_sp].sp_base = vm->frame_base;
+        vm->call_stack[vm->call_sp++].return_pc = vm->pc;
+
+        // 新しい関数の本体 (ローカル変数宣言の次) にジャンプ
+        vm->pc = fr->body_pc;
+
+        // --- 関数のプロローグ ---
+        // スタックから引数をローカル変数にコピーし、残りのローカル変数を0で初期化
+        for (int i = param_count - 1; i >= 0; i--) {
+            vm->locals[i] = vm->stack[--vm->sp];
+        }
+        memset(&vm->locals[param_count], 0, fr->local_count * sizeof(int32_t));
+        vm->frame_base = vm->sp;
+        // デバッグ出力
+        for (int i = 0; i < param_count; i++) {
+            TRACE("arg[%d] = %d; ", i, vm->locals[i]);
+        }
+        TRACE("\n");
+        // --- 関数のプロローグここまで ---
+    }
+    return 0;
+}
+
+// 末尾呼び出し: 実行中の関数のフレームをそのまま再利用して関数 idx へ移る。
+// call_stack は積まず、呼び出し元の locals の退避・復元もしないので、
+// 末尾再帰はいくら深くても call_stack・値スタックを消費しない。
+// ret は return_call 命令の表 (インポート関数から戻るときに使う)。
+// エラー時は -1、トップレベルの関数から戻ったときは 1 を返す
+int tail_call_function(WasmVM *vm, uint32_t idx, const BranchTarget *ret) {
+    if (idx < vm->import_func_count) {
+        // ホスト関数には再利用するフレームがないので、普通に呼んでからすぐ戻る
+        if (call_function(vm, idx) < 0) return -1;
+        return return_from_function(vm, ret);
+    }
+    if (ensure_prepared(vm, idx) < 0) return -1;
+    const FuncFrame *fr = &vm->func_frames[idx];
+    int param_count = fr->param_count;
+    TRACE("{tail call} func_idx=%u, params=%d, call_sp=%d\n", idx, param_count, vm->call_sp);
+#if VM_FLIGHT
+    flight_record(vm, FL_ENTER, idx, 2);
+#endif
+    for (int i = param_count - 1; i >= 0; i--) {
+        vm->locals[i] = vm->stack[--vm->sp];
+    }
+    memset(&vm->locals[param_count], 0, fr->local_count * sizeof(int32_t));
+    // 実行中の関数がスタックに残した値は捨てる (frame_base は呼び出し元と共有したまま)
+    vm->sp = vm->frame_base;
+    if (vm->sp + (int)fr->max_stack > 256) { printf("Value stack overflow\n"); return -1; }
+    vm->pc = fr->body_pc;
+    return 0;
+}
+
+// --- アトミック命令 (threads proposal) ---
+// 共有メモリを複数のスレッドが同時に読み書きするので、RMW はホストのアトミック命令で行う。
+// wait/notify は共有メモリごとの待ち行列と条件変数で実装する。
+
+// memory.atomic.wait32: memory[addr] == expected の間、notify されるまで待つ。
+// 0 = 起こされた, 1 = 値が expected でなかった, 2 = タイムアウト。
+// 値スタックが i32 だけなので、タイムアウトは i32 のナノ秒 (負なら無期限)
+int memory_atomic_wait32(WasmVM *vm, uint32_t addr, int32_t expected, int32_t timeout_ns) {
+    SharedMemory *sm = vm->shared;
+    pthread_mutex_lock(&sm->lock);
+    if ((int32_t)__atomic_load_n((uint32_t *)&sm->data[addr], __ATOMIC_SEQ_CST) != expected) {
+        pthread_mutex_unlock(&sm->lock);
+        return 1;
+    }
+    Waiter w = { addr, 0, NULL };
+    Waiter **tail = &sm->waiters;
+    while (*tail) tail = &(*tail)->next;
+    *tail = &w;
+    sm->waiter_count++;
+
+    struct timespec deadline;
+    if (timeout_ns >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += timeout_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+    }
+    while (!w.woken) {
+        if (timeout_ns < 0) {
+            pthread_cond_wait(&sm->cond, &sm->lock);
+        } else if (pthread_cond_timedwait(&sm->cond, &sm->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    for (Waiter **p = &sm->waiters; *p; p = &(*p)->next) {
+        if (*p == &w) { *p = w.next; break; }
+    }
+    sm->waiter_count--;
+    pthread_mutex_unlock(&sm->lock);
+    return w.woken ? 0 : 2;
+}
+
+// memory.atomic.notify: addr で待っているスレッドを古い順に最大 count 個起こし、起こした数を返す
+uint32_t memory_atomic_notify(WasmVM *vm, uint32_t addr, uint32_t count) {
+    SharedMemory *sm = vm->shared;
+    if (sm == NULL) return 0; // 共有でないメモリでは誰も待っていない
+    uint32_t woken = 0;
+    pthread_mutex_lock(&sm->lock);
+    for (Waiter *w = sm->waiters; w && woken < count; w = w->next) {
+        if (w->addr == addr && !w->woken) {
+            w->woken = 1;
+            woken++;
+        }
+    }
+    if (woken) pthread_cond_broadcast(&sm->cond);
+    pthread_mutex_unlock(&sm->lock);
+    return woken;
+}
+
+// 幅 width のアトミック RMW。fn は __atomic_fetch_add などの組み込み関数
+#define ATOMIC_RMW(fn, p, v, width) \
+    ((width) == 1 ? (uint32_t)fn((uint8_t *)(p), (uint8_t)(v), __ATOMIC_SEQ_CST) : \
+     (width) == 2 ? (uint32_t)fn((uint16_t *)(p), (uint16_t)(v), __ATOMIC_SEQ_CST) : \
+                    (uint32_t)fn((uint32_t *)(p), (uint32_t)(v), __ATOMIC_SEQ_CST))
+
+// 0xFE プレフィックスの命令を1つ実行する (vm->pc はサブオペコードを指す)。トラップしたら -1
+int exec_atomic(WasmVM *vm) {
+    uint32_t sub = read_uLEB128(vm->code, &vm->pc);
+    if (sub == 0x03) { // atomic.fence
+        vm->pc++;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return 0;
+    }
+    int width = atomic_width(sub);
+    (void)read_uLEB128(vm->code, &vm->pc); // align
+    uint32_t offset = read_uLEB128(vm->code, &vm->pc);
+    // オペランド: addr, (値 | expected, 置換値 | expected, timeout | count)
+    int nargs = (sub >= 0x10 && sub <= 0x16) ? 0 : (sub == 0x01 || sub >= 0x48) ? 2 : 1;
+    vm->sp -= nargs;
+    int32_t *args = &vm->stack[vm->sp];
+    uint64_t ea = (uint64_t)(uint32_t)vm->stack[--vm->sp] + offset;
+    if (ea + width > VM_MEMORY_SIZE) { printf("Atomic access out of range\n"); return -1; }
+    if (ea & (width - 1)) { printf("Unaligned atomic access at %llu\n", (unsigned long long)ea); return -1; }
+    uint8_t *p = &vm->memory[ea];
+    uint32_t v = (uint32_t)args[0];
+    uint32_t result;
+    TRACE("[atomic 0x%02X] addr=%llu\n", sub, (unsigned long long)ea);
+    switch (sub) {
+        case 0x00: // memory.atomic.notify
+            vm->stack[vm->sp++] = (int32_t)memory_atomic_notify(vm, (uint32_t)ea, v);
+            return 0;
+        case 0x01: // memory.atomic.wait32
+            if (vm->shared == NULL) { printf("memory.atomic.wait32 on unshared memory\n"); return -1; }
+            vm->stack[vm->sp++] = memory_atomic_wait32(vm, (uint32_t)ea, args[0], args[1]);
+            return 0;
+        case 0x10: result = __atomic_load_n((uint32_t *)p, __ATOMIC_SEQ_CST); break;
+        case 0x12: result = __atomic_load_n(p, __ATOMIC_SEQ_CST); break;
+        case 0x13: result = __atomic_load_n((uint16_t *)p, __ATOMIC_SEQ_CST); break;
+        case 0x17: __atomic_store_n((uint32_t *)p, v, __ATOMIC_SEQ_CST); return 0;
+        case 0x19: __atomic_store_n(p, (uint8_t)v, __ATOMIC_SEQ_CST); return 0;
+        case 0x1A: __atomic_store_n((uint16_t *)p, (uint16_t)v, __ATOMIC_SEQ_CST); return 0;
+        default:
+            switch ((sub - 0x1E) / 7) {
+                case 0: result = ATOMIC_RMW(__atomic_fetch_add, p, v, width); break;
+                case 1: result = ATOMIC_RMW(__atomic_fetch_sub, p, v, width); break;
+                case 2: result = ATOMIC_RMW(__atomic_fetch_and, p, v, width); break;
+                case 3: result = ATOMIC_RMW(__atomic_fetch_or, p, v, width); break;
+                case 4: result = ATOMIC_RMW(__atomic_fetch_xor, p, v, width); break;
+                case 5: result = ATOMIC_RMW(__atomic_exchange_n, p, v, width); break;
+                default: { // cmpxchg: 読んだ値を返す (一致したときだけ置き換える)
+                    uint32_t replacement = (uint32_t)args[1];
+                    if (width == 1) {
+                        uint8_t exp = (uint8_t)v;
+                        __atomic_compare_exchange_n(p, &exp, (uint8_t)replacement, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                        result = exp;
+                    } else if (width == 2) {
+                        uint16_t exp = (uint16_t)v;
+                        __atomic_compare_exchange_n((uint16_t *)p, &exp, (uint16_t)replacement, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                        result = exp;
+                    } else {
+                        uint32_t exp = v;
+                        __atomic_compare_exchange_n((uint32_t *)p, &exp, replacement, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                        result = exp;
+                    }
+                    break;
+                }
+            }
+            break;
+    }
+    vm->stack[vm->sp++] = (int32_t)result;
+    return 0;
+}
+
+static void run_loop(WasmVM *vm) {
+    // モジュールとして読み込まれていない命令列は、単独の式としてここで解析する
+    if (vm->ctrl_map == NULL && prepare_body(vm, vm->pc, vm->size, NULL, NULL) < 0) return;
+    if (vm_init_memory(vm) < 0) return;
+#if VM_OPSTATS
+    if (vm->opstats == NULL) vm->opstats = opstats_new();
+    if (vm->pc_counts == NULL) vm->pc_counts = calloc(vm->size, sizeof(uint64_t));
+    if (vm->opstats == NULL || vm->pc_counts == NULL) { printf("Failed to allocate opstats\n"); return; }
+    vm->opstats->prev_op = -1; // 前の呼び出しの最後の命令とはペアにしない
+#endif
+    while (1) {
+        size_t current_pc = vm->pc; // 実行前のpcを保存
+        if (current_pc >= vm->size) {
+            printf("PC out of bounds\n");
+            return;
+        }
+        uint8_t op = vm->code[vm->pc++]; // 命令を読み込み、pcをインクリメント
+#if VM_PROFILE
+        vm->prof_pc = current_pc;
+#endif
+#if VM_BENCH
+        vm->insn_count++;
+#endif
+#if VM_FLIGHT
+        if (vm->flight_countdown && --vm->flight_countdown == 0) flight_sample(vm, current_pc, op);
+#endif
+#if VM_OPSTATS
+        vm->opstats->op[op]++;
+        if (vm->opstats->prev_op >= 0) vm->opstats->pair[vm->opstats->prev_op][op]++;
+        vm->opstats->prev_op = op;
+        vm->pc_counts[current_pc]++;
+#endif
+        TRACE("opcode: 0x%02X at pc=%zu; ", op, current_pc);
+        switch (op) {
+            case 0x20: { // local.get
+                uint32_t i = read_uLEB128(vm->code, &vm->pc);
+                vm->stack[vm->sp++] = vm->locals[i];
+                TRACE("[local.get] %d: %d\n", i, vm->locals[i]);
+                break;
+            }
+            case 0x21: { // local.set
+                uint32_t i = read_uLEB128(vm->code, &vm->pc);
+                vm->locals[i] = vm->stack[--vm->sp];
+                break;
+            }
+            case 0x22: { // local.tee
+                uint32_t i = read_uLEB128(vm->code, &vm->pc);  // ローカルインデックスを取得
+                vm->locals[i] = vm->stack[vm->sp - 1];        // スタックトップの値をローカルにコピー
+                // vm->sp は減らさない → スタックに値を残す
+                break;
+            }
+            case 0x23: { // global.get
+                // インデックスはロード時に検査済み。不変グローバルの多くは i32.const に畳み込まれている
+                uint32_t i = read_uLEB128(vm->code, &vm->pc);
+                vm->stack[vm->sp++] = vm->globals[i];
+                TRACE("[global.get] %u: %d\n", i, vm->globals[i]);
+                break;
+            }
+            case 0x24: { // global.set
+                uint32_t i = read_uLEB128(vm->code, &vm->pc);
+                vm->globals[i] = vm->stack[--vm->sp];
+                TRACE("[global.set] %u: %d\n", i, vm->globals[i]);
+                break;
+            }
+
+            case 0x28: { // i32.load
+                (void)read_uLEB128(vm->code, &vm->pc); // align
+                uint32_t offset = read_uLEB128(vm->code, &vm->pc);
+                uint64_t addr = (uint64_t)(uint32_t)vm->stack[--vm->sp] + offset; // 32 ビットで折り返さない
+                if (addr + 4 > VM_MEMORY_SIZE) { printf("Memory load out of range\n"); return; }
+                int32_t val = (int32_t)(
+                    vm->memory[addr] |
+                    (vm->memory[addr + 1] << 8) |
+                    (vm->memory[addr + 2] << 16) |
+                    (vm->memory[addr + 3] << 24)
+                );
+                vm->stack[vm->sp++] = val;
+                break;
+            }
+
+            case 0x36: { // i32.store
+                (void)read_uLEB128(vm->code, &vm->pc); // align
+                uint32_t offset = read_uLEB128(vm->code, &vm->pc);
+                int32_t val = vm->stack[--vm->sp];
+                uint64_t addr = (uint64_t)(uint32_t)vm->stack[--vm->sp] + offset;
+                if (addr + 4 > VM_MEMORY_SIZE) { printf("Memory store out of range\n"); return; }
+                TRACE("[i32.store] addr=%u, val=%d (offset=%u) ", (uint32_t)addr, val, offset);
+                vm->memory[addr]     = val & 0xFF;
+                vm->memory[addr + 1] = (val >> 8) & 0xFF;
+                vm->memory[addr + 2] = (val >> 16) & 0xFF;
+                vm->memory[addr + 3] = (val >> 24) & 0xFF;
+                uint32_t written_val = (uint32_t)(
+                    vm->memory[addr] |
+                    (vm->memory[addr + 1] << 8) |
+                    (vm->memory[addr + 2] << 16) |
+                    (vm->memory[addr + 3] << 24)
+                );
+                TRACE(" -> Verifying memory at addr=%u: read back value is %u\n", (uint32_t)addr, written_val);
+                break;
+            }
+
+            case 0x41: { // i32.const
+                int32_t val = read_sLEB128(vm->code, &vm->pc);
+                TRACE("[i32.const] %d\n", val);
+                vm->stack[vm->sp++] = val;
+                break;
+            }
+
+            case 0x67: { // i32.clz
+                int32_t value = vm->stack[--vm->sp];
+                if (value == 0) {
+                    vm->stack[vm->sp++] = 32;  // 全部0なら leading zeros = 32
+                    break;
+                }
+            
+                uint32_t uvalue = (uint32_t)value;
+                int32_t count = 0;
+            
+                // 上位ビットから順に0を数える
+                for (int i = 31; i >= 0; i--) {
+                    if (uvalue & (1u << i)) break; // 最初に1が見つかったら終了
+                    count++;
+                }
+            
+                vm->stack[vm->sp++] = count;
+                break;
+            }
+            case 0x68: { // i32.ctz
+                int32_t value = vm->stack[--vm->sp];  // スタックから値を取り出す
+                if (value == 0) {
+                    vm->stack[vm->sp++] = 32;       // 入力が0なら32ビット分すべてゼロ
+                    break;
+                }
+            
+                int32_t count = 0;
+                uint32_t uvalue = (uint32_t)value;   // 符号を無視してビット演算
+                while ((uvalue & 1) == 0) {           // 末尾のゼロを数える
+                    count++;
+                    uvalue >>= 1;
+                }
+                vm->stack[vm->sp++] = count;          // スタックに結果を戻す
+                break;
+            }
+            case 0x69: { // i32.popcnt
+                uint32_t value = (uint32_t)vm->stack[--vm->sp];
+                int32_t count = 0;
+            
+                // Brian Kernighan’s Algorithm（1 を消しながら数える）
+                while (value) {
+                    value &= (value - 1); // 最下位の 1 を消す
+                    count++;
+                }
+            
+                vm->stack[vm->sp++] = count;
+                break;
+            }
+
+            case 0x6A: { // i32.add
+                int32_t b = vm->stack[--vm->sp];
+                int32_t a = vm->stack[--vm->sp];
+                vm->stack[vm->sp++] = a + b;
+                break;
+            }
+            case 0x6B: { // i32.sub
+                int32_t b = vm->stack[--vm->sp];
+                int32_t a = vm->stack[--vm->sp];
+                TRACE("[i32.sub] a = %d, b = %d\n", a, b);
+                vm->stack[vm->sp++] = a - b;
+                break;
+            }
+            case 0x6C: { // i32.mul
+                int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a * b; break;
+            }
+            case 0x6D: { // i32.div_s
+                int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; if (b == 0) { return; } if (a == INT32_MIN && b == -1) { return; }
+                vm->stack[vm->sp++] = a / b;
+                break;
+            }
+            case 0x6E: { // i32.div_u
+                uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; if (b == 0) { return; }
+                vm->stack[vm->sp++] = (int32_t)(a / b);
+                break;
+            }
+            case 0x6F: { // i32.rem_s
+                int32_t b = vm->stack[--vm->sp];
+                int32_t a = vm->stack[--vm->sp];
+                if (b == 0) { return; }
+                vm->stack[vm->sp++] = b == -1 ? 0 : a % b; // INT32_MIN % -1 は 0 (C の % では SIGFPE になる)
+                break;
+            }
+            case 0x70: { // i32.rem_u
+                uint32_t b = (uint32_t)vm->stack[--vm->sp];
+                uint32_t a = (uint32_t)vm->stack[--vm->sp];
+                if (b == 0) { return; }
+                vm->stack[vm->sp++] = a % b;
+                break;
+            }
+            case 0x71: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a & b; break; } // i32.and
+            case 0x72: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a | b; break; } // i32.or
+            case 0x73: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a ^ b; break; } // i32.xor
+            case 0x74: { // i32.shl
+                uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (int32_t)(a << (b & 31)); break;
+            }
+            case 0x75: { // i32.shr_s
+                uint32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = a >> (b & 31); break;
+            }
+            case 0x76: { // i32.shr_u
+                uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (int32_t)(a >> (b & 31)); break;
+            }
+            case 0x77: { // i32.rotl
+                uint32_t b = vm->stack[--vm->sp] & 31; uint32_t a = vm->stack[--vm->sp];
+                vm->stack[vm->sp++] = (int32_t)((a << b) | (a >> ((32 - b) & 31)));
+                break;
+            }
+            case 0x78: { // i32.rotr
+                uint32_t b = vm->stack[--vm->sp] & 31; uint32_t a = vm->stack[--vm->sp];
+                vm->stack[vm->sp++] = (int32_t)((a >> b) | (a << ((32 - b) & 31)));
+                break;
+            }
+
+            case 0x45: { int32_t v = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (v == 0); break; }
+            case 0x46: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a == b); break; }
+            case 0x47: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a != b); break; }
+            case 0x48: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a < b); break; }
+            case 0x49: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a < b); break; }
+            case 0x4A: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a > b); break; }
+            case 0x4B: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a > b); break; }
+            case 0x4C: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a <= b); break; }
+            case 0x4D: { // le_u
+                uint32_t b = vm->stack[--vm->sp];
+                uint32_t a = vm->stack[--vm->sp];
+                TRACE("[i32.le_u] a = %d, b = %d\n", a, b);
+                vm->stack[vm->sp++] = (a <= b);
+                break;
+            }
+            case 0x4E: { int32_t b = vm->stack[--vm->sp]; int32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a >= b); break; }
+            case 0x4F: { uint32_t b = vm->stack[--vm->sp]; uint32_t a = vm->stack[--vm->sp]; vm->stack[vm->sp++] = (a >= b); break; }
+
+            case 0x01: { // nop
+                TRACE("[nop]\n");
+                break;
+            }
+            case 0x02: // block
+            case 0x03: // loop
+                // 分岐先とスタック高さはロード時に解決済みなので、blocktype を読み飛ばすだけ
+                (void)read_sLEB128(vm->code, &vm->pc);
+                break;
+
+            case 0x04: { // if
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared if at pc=%zu\n", current_pc); return; }
+                int32_t cond = vm->stack[--vm->sp];
+                TRACE("[if] cond = %d, else/end pc = %zu\n", cond, vm->branches[entry].target_pc);
+#if VM_OPSTATS
+                vm->opstats->if_[cond != 0]++;
+#endif
+                if (cond == 0) {
+                    vm->pc = vm->branches[entry].target_pc; // else の次 (なければ end の次)
+                } else {
+                    (void)read_sLEB128(vm->code, &vm->pc); // blocktype をスキップ
+                }
+                break;
+            }
+
+            case 0x05: { // else
+                // then 側を実行し終えたので end の次へ飛ぶ
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared else at pc=%zu\n", current_pc); return; }
+                vm->pc = vm->branches[entry].target_pc;
+                TRACE("[else] jump to pc=%zu\n", vm->pc);
+                break;
+            }
+
+            case 0x0B: { // end
+                uint32_t entry = vm->ctrl_map[current_pc];
+                TRACE("[end] pc=%zu. call_sp=%d%s\n", current_pc, vm->call_sp, entry ? " (function end)" : "");
+                if (entry == 0) break; // ブロックの終端では何もしない
+                if (return_from_function(vm, &vm->branches[entry])) return;
+                break;
+            }
+
+            case 0x0C: { // br
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br at pc=%zu\n", current_pc); return; }
+                branch_to(vm, &vm->branches[entry]);
+                TRACE("[br] jump to pc=%zu, sp=%d\n", vm->pc, vm->sp);
+                break;
+            }
+
+            case 0x0D: { // br_if
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br_if at pc=%zu\n", current_pc); return; }
+#if VM_OPSTATS
+                vm->opstats->br_if[vm->stack[vm->sp - 1] != 0]++;
+#endif
+                if (vm->stack[--vm->sp] != 0) {
+                    branch_to(vm, &vm->branches[entry]);
+                    TRACE("[br_if] taken, jump to pc=%zu\n", vm->pc);
+                } else {
+                    (void)read_uLEB128(vm->code, &vm->pc); // depth
+                    TRACE("[br_if] not taken\n");
+                }
+                break;
+            }
+
+            case 0x0E: { // br_table
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br_table at pc=%zu\n", current_pc); return; }
+                BranchTable *bt = &vm->br_tables[entry];
+                uint32_t i = (uint32_t)vm->stack[--vm->sp];
+                if (i > bt->count) i = bt->count; // 範囲外は default
+                branch_to(vm, &vm->branches[bt->first + i]);
+                TRACE("[br_table] index=%u, jump to pc=%zu\n", i, vm->pc);
+                break;
+            }
+
+            case 0x0F: { // return
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared return at pc=%zu\n", current_pc); return; }
+                TRACE("return; (at pc=%zu) ", current_pc);
+                if (return_from_function(vm, &vm->branches[entry])) return;
+                break;
+            }
+
+            case 0x10: { // call
+                TRACE("[call] pc=%zu. call_sp=%d; ", current_pc, vm->call_sp);
+                uint32_t idx = read_uLEB128(vm->code, &vm->pc);
+                if (call_function(vm, idx) < 0) return;
+                break;
+            }
+
+            case 0x11: { // call_indirect
+                uint32_t type_idx = read_uLEB128(vm->code, &vm->pc);
+                (void)read_uLEB128(vm->code, &vm->pc); // table index (テーブル0のみ)
+                uint32_t elem = (uint32_t)vm->stack[--vm->sp];
+                TRACE("[call_indirect] pc=%zu. type_idx=%u, elem=%u; ", current_pc, type_idx, elem);
+                long func_idx = table_lookup(vm, type_idx, elem);
+                if (func_idx < 0) return;
+                if (call_function(vm, (uint32_t)func_idx) < 0) return;
+                break;
+            }
+
+            case 0x12: { // return_call
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared return_call at pc=%zu\n", current_pc); return; }
+                uint32_t idx = read_uLEB128(vm->code, &vm->pc);
+                TRACE("[return_call] pc=%zu. func_idx=%u; ", current_pc, idx);
+                if (tail_call_function(vm, idx, &vm->branches[entry]) != 0) return;
+                break;
+            }
+
+            case 0x13: { // return_call_indirect
+                uint32_t entry = vm->ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared return_call_indirect at pc=%zu\n", current_pc); return; }
+                uint32_t type_idx = read_uLEB128(vm->code, &vm->pc);
+                (void)read_uLEB128(vm->code, &vm->pc); // table index (テーブル0のみ)
+                uint32_t elem = (uint32_t)vm->stack[--vm->sp];
+                TRACE("[return_call_indirect] pc=%zu. type_idx=%u, elem=%u; ", current_pc, type_idx, elem);
+                long func_idx = table_lookup(vm, type_idx, elem);
+                if (func_idx < 0) return;
+                if (tail_call_function(vm, (uint32_t)func_idx, &vm->branches[entry]) != 0) return;
+                break;
+            }
+
+            case 0x1A: { // drop
+                TRACE("[drop]\n");
+                vm->sp--;
+                break;
+            }
+
+            case 0xFE: // atomic (サブオペコードは exec_atomic で読む)
+                if (exec_atomic(vm) < 0) return;
+                break;
+
+            default:
+                printf("Unknown or unimplemented opcode: 0x%02X at pc=%zu\n", op, vm->pc - 1);
+                return; // ここで終了
+        }
+    }
+}
+
+// --- スタックトップをレジスタに置く命令ループ ---
+// run_loop と同じ命令を実行するが、pc・sp・スタックトップの値 (tos)・線形メモリの先頭をローカル変数に持ち、
+// 命令ごとに vm を経由して読み書きしない。スタックの上から2番目より下は vm->stack にあり、
+// トップの値は tos にだけある (stack[sp - 1] は古いまま)。二項演算は stack[sp - 2] を1回読むだけで済む。
+// 関数の呼び出し・戻り・アトミック命令の前に vm へ書き戻し (TOS_SPILL)、戻ってから読み直す (TOS_RELOAD)。
+// 関数内の分岐はここで処理する。持ち越す値が tos の1個だけなら書き戻さない
+
+#define TOS_SPILL() do { if (sp > 0) stack[sp - 1] = tos; vm->sp = sp; vm->pc = pc; } while (0)
+// 呼び出し先で準備した関数の分岐表は branches を realloc しうるので、表も読み直す
+#define TOS_RELOAD() do { \
+        pc = vm->pc; sp = vm->sp; fb = vm->frame_base; tos = sp > 0 ? stack[sp - 1] : 0; \
+        ctrl_map = vm->ctrl_map; branches = vm->branches; \
+    } while (0)
+#define TOS_PUSH(v) do { int32_t v_ = (v); if (sp > 0) stack[sp - 1] = tos; tos = v_; sp++; } while (0)
+#define TOS_POP() do { if (--sp > 0) tos = stack[sp - 1]; } while (0) // tos を捨てて1つ下を tos にする
+#define TOS_BINOP(type, expr) do { type a = (type)stack[sp - 2], b = (type)tos; tos = (int32_t)(expr); sp--; } while (0)
+
+// branch_to の TOS 版。dst より上で stack にあるのは tos の下の値なので、
+// 高さを変えずに分岐するときは tos を読み直さない
+static inline void tos_branch_to(const BranchTarget *t, int32_t *stack, int fb, int *sp, int32_t *tos, size_t *pc) {
+    int dst = fb + (int)t->height;
+    if (t->arity == 1) {
+        *sp = dst + 1; // 持ち越す値は tos のまま
+    } else if (t->arity == 0) {
+        if (*sp != dst) {
+            *sp = dst;
+            if (dst > 0) *tos = stack[dst - 1];
+        }
+    } else if (*sp != dst + (int)t->arity) {
+        stack[*sp - 1] = *tos;
+        memmove(&stack[dst], &stack[*sp - t->arity], t->arity * sizeof(int32_t));
+        *sp = dst + t->arity;
+        *tos = stack[*sp - 1];
+    }
+    *pc = t->target_pc;
+}
+
+// 即値の LEB128。ほとんどは1バイトなのでその場で読み、長いものだけ read_uLEB128 に任せる。
+// 呼び出し先には pc の写しを渡し、ループの pc はアドレスを取られずにレジスタに残るようにする
+static inline uint32_t tos_read_u32(uint8_t *code, size_t *pc) {
+    uint8_t b = code[*pc];
+    if (b < 0x80) { (*pc)++; return b; }
+    size_t p = *pc;
+    uint32_t v = read_uLEB128(code, &p);
+    *pc = p;
+    return v;
+}
+
+static inline int32_t tos_read_s32(uint8_t *code, size_t *pc) {
+    uint8_t b = code[*pc];
+    if (b < 0x80) { (*pc)++; return (b & 0x40) ? (int32_t)b - 0x80 : b; }
+    size_t p = *pc;
+    int32_t v = read_sLEB128(code, &p);
+    *pc = p;
+    return v;
+}
+
+static void run_loop_tos(WasmVM *vm) {
+    if (vm->ctrl_map == NULL && prepare_body(vm, vm->pc, vm->size, NULL, NULL) < 0) return;
+    if (vm_init_memory(vm) < 0) return;
+    uint8_t *code = vm->code;
+    size_t size = vm->size;
+    int32_t *stack = vm->stack;
+    int32_t *locals = vm->locals;
+    uint8_t *mem = vm->memory;
+    const uint32_t *ctrl_map;
+    const BranchTarget *branches;
+    size_t pc;
+    int sp, fb;
+    int32_t tos;
+#if VM_BENCH
+    uint64_t insns = 0;
+#endif
+    TOS_RELOAD();
+    while (1) {
+        size_t current_pc = pc;
+        if (current_pc >= size) {
+            printf("PC out of bounds\n");
+            goto spill;
+        }
+        uint8_t op = code[pc++];
+#if VM_PROFILE
+        vm->prof_pc = current_pc;
+#endif
+#if VM_BENCH
+        insns++;
+#endif
+#if VM_FLIGHT
+        if (vm->flight_countdown && --vm->flight_countdown == 0) flight_sample(vm, current_pc, op);
+#endif
+        switch (op) {
+            case 0x20: { // local.get
+                uint32_t i = tos_read_u32(code, &pc);
+                TOS_PUSH(locals[i]);
+                break;
+            }
+            case 0x21: { // local.set
+                uint32_t i = tos_read_u32(code, &pc);
+                locals[i] = tos;
+                TOS_POP();
+                break;
+            }
+            case 0x22: { // local.tee
+                uint32_t i = tos_read_u32(code, &pc);
+                locals[i] = tos;
+                break;
+            }
+            case 0x23: { // global.get
+                uint32_t i = tos_read_u32(code, &pc);
+                TOS_PUSH(vm->globals[i]);
+                break;
+            }
+            case 0x24: { // global.set
+                uint32_t i = tos_read_u32(code, &pc);
+                vm->globals[i] = tos;
+                TOS_POP();
+                break;
+            }
+
+            case 0x28: { // i32.load
+                (void)tos_read_u32(code, &pc); // align
+                uint32_t offset = tos_read_u32(code, &pc);
+                uint64_t addr = (uint64_t)(uint32_t)tos + offset; // 32 ビットで折り返さない
+                if (addr + 4 > VM_MEMORY_SIZE) { printf("Memory load out of range\n"); goto spill; }
+                tos = (int32_t)(mem[addr] | (mem[addr + 1] << 8) | (mem[addr + 2] << 16) | ((uint32_t)mem[addr + 3] << 24));
+                break;
+            }
+            case 0x36: { // i32.store
+                (void)tos_read_u32(code, &pc); // align
+                uint32_t offset = tos_read_u32(code, &pc);
+                int32_t val = tos;
+                uint64_t addr = (uint64_t)(uint32_t)stack[sp - 2] + offset;
+                if (addr + 4 > VM_MEMORY_SIZE) { printf("Memory store out of range\n"); goto spill; }
+                mem[addr]     = val & 0xFF;
+                mem[addr + 1] = (val >> 8) & 0xFF;
+                mem[addr + 2] = (val >> 16) & 0xFF;
+                mem[addr + 3] = (val >> 24) & 0xFF;
+                sp -= 2;
+                if (sp > 0) tos = stack[sp - 1];
+                break;
+            }
+
+            case 0x41: // i32.const
+                TOS_PUSH(tos_read_s32(code, &pc));
+                break;
+
+            case 0x67: tos = tos ? __builtin_clz((uint32_t)tos) : 32; break; // i32.clz
+            case 0x68: tos = tos ? __builtin_ctz((uint32_t)tos) : 32; break; // i32.ctz
+            case 0x69: tos = __builtin_popcount((uint32_t)tos); break;       // i32.popcnt
+
+            case 0x6A: TOS_BINOP(int32_t, a + b); break; // i32.add
+            case 0x6B: TOS_BINOP(int32_t, a - b); break; // i32.sub
+            case 0x6C: TOS_BINOP(int32_t, a * b); break; // i32.mul
+            case 0x6D: // i32.div_s
+                if (tos == 0 || (tos == -1 && stack[sp - 2] == INT32_MIN)) goto spill;
+                TOS_BINOP(int32_t, a / b);
+                break;
+            case 0x6E: // i32.div_u
+                if (tos == 0) goto spill;
+                TOS_BINOP(uint32_t, a / b);
+                break;
+            case 0x6F: // i32.rem_s
+                if (tos == 0) goto spill;
+                TOS_BINOP(int32_t, b == -1 ? 0 : a % b); // INT32_MIN % -1 は 0
+                break;
+            case 0x70: // i32.rem_u
+                if (tos == 0) goto spill;
+                TOS_BINOP(uint32_t, a % b);
+                break;
+            case 0x71: TOS_BINOP(int32_t, a & b); break;                  // i32.and
+            case 0x72: TOS_BINOP(int32_t, a | b); break;                  // i32.or
+            case 0x73: TOS_BINOP(int32_t, a ^ b); break;                  // i32.xor
+            case 0x74: TOS_BINOP(uint32_t, a << (b & 31)); break;         // i32.shl
+            case 0x75: TOS_BINOP(int32_t, a >> ((uint32_t)b & 31)); break; // i32.shr_s
+            case 0x76: TOS_BINOP(uint32_t, a >> (b & 31)); break;         // i32.shr_u
+            case 0x77: TOS_BINOP(uint32_t, (a << (b & 31)) | (a >> ((32 - (b & 31)) & 31))); break; // i32.rotl
+            case 0x78: TOS_BINOP(uint32_t, (a >> (b & 31)) | (a << ((32 - (b & 31)) & 31))); break; // i32.rotr
+
+            case 0x45: tos = (tos == 0); break;                // i32.eqz
+            case 0x46: TOS_BINOP(int32_t, a == b); break;      // i32.eq
+            case 0x47: TOS_BINOP(int32_t, a != b); break;      // i32.ne
+            case 0x48: TOS_BINOP(int32_t, a < b); break;       // i32.lt_s
+            case 0x49: TOS_BINOP(uint32_t, a < b); break;      // i32.lt_u
+            case 0x4A: TOS_BINOP(int32_t, a > b); break;       // i32.gt_s
+            case 0x4B: TOS_BINOP(uint32_t, a > b); break;      // i32.gt_u
+            case 0x4C: TOS_BINOP(int32_t, a <= b); break;      // i32.le_s
+            case 0x4D: TOS_BINOP(uint32_t, a <= b); break;     // i32.le_u
+            case 0x4E: TOS_BINOP(int32_t, a >= b); break;      // i32.ge_s
+            case 0x4F: TOS_BINOP(uint32_t, a >= b); break;     // i32.ge_u
+
+            case 0x01: // nop
+                break;
+            case 0x02: // block
+            case 0x03: // loop
+                (void)tos_read_s32(code, &pc);
+                break;
+
+            case 0x04: { // if
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared if at pc=%zu\n", current_pc); goto spill; }
+                int32_t cond = tos;
+                TOS_POP();
+                if (cond == 0) pc = branches[entry].target_pc;
+                else (void)tos_read_s32(code, &pc);
+                break;
+            }
+            case 0x05: { // else
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared else at pc=%zu\n", current_pc); goto spill; }
+                pc = branches[entry].target_pc;
+                break;
+            }
+
+            case 0x0B: // end
+            case 0x0F: { // return
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) {
+                    if (op == 0x0B) break; // ブロックの終端では何もしない
+                    printf("Unprepared return at pc=%zu\n", current_pc);
+                    goto spill;
+                }
+                TOS_SPILL();
+                if (return_from_function(vm, &branches[entry])) goto done;
+                TOS_RELOAD();
+                break;
+            }
+
+            case 0x0C: { // br
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br at pc=%zu\n", current_pc); goto spill; }
+                tos_branch_to(&branches[entry], stack, fb, &sp, &tos, &pc);
+                break;
+            }
+            case 0x0D: { // br_if
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br_if at pc=%zu\n", current_pc); goto spill; }
+                int32_t cond = tos;
+                TOS_POP();
+                if (cond != 0) tos_branch_to(&branches[entry], stack, fb, &sp, &tos, &pc);
+                else (void)tos_read_u32(code, &pc); // depth
+                break;
+            }
+            case 0x0E: { // br_table
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared br_table at pc=%zu\n", current_pc); goto spill; }
+                BranchTable *bt = &vm->br_tables[entry];
+                uint32_t i = (uint32_t)tos;
+                TOS_POP();
+                if (i > bt->count) i = bt->count; // 範囲外は default
+                tos_branch_to(&branches[bt->first + i], stack, fb, &sp, &tos, &pc);
+                break;
+            }
+
+            case 0x10: { // call
+                uint32_t idx = tos_read_u32(code, &pc);
+                TOS_SPILL();
+                if (call_function(vm, idx) < 0) goto done;
+                TOS_RELOAD();
+                break;
+            }
+            case 0x11: { // call_indirect
+                uint32_t type_idx = tos_read_u32(code, &pc);
+                (void)tos_read_u32(code, &pc); // table index (テーブル0のみ)
+                uint32_t elem = (uint32_t)tos;
+                TOS_POP();
+                TOS_SPILL();
+                long func_idx = table_lookup(vm, type_idx, elem);
+                if (func_idx < 0 || call_function(vm, (uint32_t)func_idx) < 0) goto done;
+                TOS_RELOAD();
+                break;
+            }
+            case 0x12: { // return_call
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared return_call at pc=%zu\n", current_pc); goto spill; }
+                uint32_t idx = tos_read_u32(code, &pc);
+                TOS_SPILL();
+                if (tail_call_function(vm, idx, &branches[entry]) != 0) goto done;
+                TOS_RELOAD();
+                break;
+            }
+            case 0x13: { // return_call_indirect
+                uint32_t entry = ctrl_map[current_pc];
+                if (entry == 0) { printf("Unprepared return_call_indirect at pc=%zu\n", current_pc); goto spill; }
+                uint32_t type_idx = tos_read_u32(code, &pc);
+                (void)tos_read_u32(code, &pc); // table index (テーブル0のみ)
+                uint32_t elem = (uint32_t)tos;
+                TOS_POP();
+                TOS_SPILL();
+                long func_idx = table_lookup(vm, type_idx, elem);
+                if (func_idx < 0 || tail_call_function(vm, (uint32_t)func_idx, &branches[entry]) != 0) goto done;
+                TOS_RELOAD();
+                break;
+            }
+
+            case 0x1A: // drop
+                TOS_POP();
+                break;
+
+            case 0xFE: // atomic (サブオペコードは exec_atomic で読む)
+                TOS_SPILL();
+                if (exec_atomic(vm) < 0) goto done;
+                TOS_RELOAD();
+                break;
+
+            default:
+                printf("Unknown or unimplemented opcode: 0x%02X at pc=%zu\n", op, pc - 1);
+                goto spill;
+        }
+    }
+spill:
+    // トラップで止まった。run() とフライトレコーダが見るので pc と値スタックを vm に戻す
+    TOS_SPILL();
+done:
+#if VM_BENCH
+    vm->insn_count += insns;
+#endif
+    return;
+}
+
+#undef TOS_SPILL
+#undef TOS_RELOAD
+#undef TOS_PUSH
+#undef TOS_POP
+#undef TOS_BINOP
+
+// vm->pc から実行する。トップレベルの関数から戻るか、トラップで止まるまで続ける
+void run(WasmVM *vm) {
+    // まだ準備していない関数の入口 (関数の先頭) から始めるなら、ここで準備して本体へ進む
+    if (vm->lazy_pending > 0) {
+        long f = find_func_by_pc(vm, vm->pc);
+        if (f >= 0 && vm->func_frames[f].lazy && vm->pc == vm->func_pcs[f]) {
+            if (prepare_lazy_function(vm, (uint32_t)f) < 0) return;
+            vm->pc = vm->func_frames[f].body_pc;
+        }
+    }
+    // 命令ごとの統計は run_loop だけが取る
+    void (*loop)(WasmVM *) = vm->tos_cache && !VM_OPSTATS ? run_loop_tos : run_loop;
+#if VM_FLIGHT
+    if (vm->flight == NULL) {
+        loop(vm);
+        return;
+    }
+    flight_record(vm, FL_ENTER, (uint32_t)find_func_by_pc(vm, vm->pc), 0);
+    loop(vm);
+    // トップレベルから戻ったのでもネイティブコードのトラップ (記録済み) でもなければ、
+    // インタプリタがトラップで止まった
+    FlightRecorder *fr = vm->flight;
+    FlightEvent *last = &fr->events[(fr->head - 1) & fr->mask];
+    if (!(last->kind == FL_EXIT && last->aux == 2) && last->kind != FL_TRAP) {
+        flight_trap(vm, find_func_by_pc(vm, vm->pc), vm->pc);
+    }
+#else
+    loop(vm);
+#endif
+}
+
+// --- スレッド ---
+// 1つのインスタンスは1つのスレッドからしか使えない。共有メモリを vm_attach_shared_memory した
+// インスタンスを複数作り、それぞれを vm_thread_start で別の pthread で実行する
+
+typedef struct {
+    WasmVM *vm;
+    uint32_t func_idx;       // 実行する内部関数
+    int32_t args[16];
+    int argc;
+    int32_t result;          // 戻り値 (スタックトップ。戻り値がなければ 0)
+    pthread_t thread;
+} VMThread;
+
+void *vm_thread_main(void *arg) {
+    VMThread *t = arg;
+    WasmVM *vm = t->vm;
+    // 作ったスレッドと違うノードで動いているかもしれないので、ここで置き直す
+    if (vm->mem_policy & VM_MEM_NUMA_LOCAL) vm_bind_memory_local(vm);
+    vm->sp = 0;
+    vm->call_sp = 0;
+    vm->frame_base = 0;
+    memset(vm->locals, 0, sizeof(vm->locals));
+    memcpy(vm->locals, t->args, t->argc * sizeof(int32_t));
+    vm->pc = vm->func_frames[t->func_idx].body_pc;
+    run(vm);
+    t->result = vm->sp > 0 ? vm->stack[vm->sp - 1] : 0;
+    return NULL;
+}
+
+int vm_thread_start(VMThread *t) {
+    int err = pthread_create(&t->thread, NULL, vm_thread_main, t);
+    if (err != 0) {
+        printf("pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int32_t vm_thread_join(VMThread *t) {
+    pthread_join(t->thread, NULL);
+    return t->result;
+}
+
+// --- まとめて呼び出す ---
+// 同じエクスポート関数を count 組の引数で続けて呼び出し、戻り値を results[i] に書く。
+// 引数は1組ずつ関数のパラメータ数だけ詰めて並べる (args[i * param_count + k])。
+// 関数の準備・ネイティブコードの有無・トラップの戻り先の設定は最初に1回だけ行い、
+// 1回ごとにはレジスタの設定と実行だけをする。トラップした組の戻り値は 0 にし、その数を返す。
+// 呼び出せない関数なら -1 を返す
+static int vm_invoke_batch_run(WasmVM *vm, ExportFunc *f, const int32_t *args, int32_t *results, size_t count) {
+    uint32_t idx = f->func_idx;
+    if (idx < vm->import_func_count || idx >= vm->func_count) {
+        printf("vm_invoke_batch: func[%u] is not an internal function\n", idx);
+        return -1;
+    }
+    if (ensure_prepared(vm, idx) < 0) return -1;
+    if (vm_init_memory(vm) < 0) return -1;
+    FuncFrame *fr = &vm->func_frames[idx];
+    int argc = fr->param_count;
+    if (argc > (int)(sizeof(vm->locals) / sizeof(vm->locals[0]))) {
+        printf("vm_invoke_batch: too many params: %d\n", argc);
+        return -1;
+    }
+    volatile int failed = 0;
+#if VM_JIT
+    // まとめて呼び出し回数に数え、しきい値に届くなら最初にコンパイルしておく
+    if (vm->jit == 1 && fr->native == NULL && fr->jit_state == 0) {
+        fr->calls += count < VM_JIT_HOT_CALLS ? (uint32_t)count : VM_JIT_HOT_CALLS;
+        if (fr->calls >= VM_JIT_HOT_CALLS) jit_compile(vm, idx);
+    }
+    if (fr->native) {
+        JitEntry entry = (JitEntry)fr->native;
+        sigjmp_buf env;
+        volatile size_t i = 0;
+        WasmVM *volatile prev = jit_running;
+        sigjmp_buf *volatile prev_trap = vm->jit_trap;
+        vm->jit_trap = &env;
+        jit_running = vm;
+        if (sigsetjmp(env, 0) != 0) {
+            jit_trap_report(vm);
+#if VM_FLIGHT
+            flight_trap(vm, idx, 0);
+#endif
+            results[i++] = 0;
+            failed++;
+        }
+        for (; i < count; i++) {
+            int32_t a[16];
+            memcpy(a, args + i * argc, argc * sizeof(int32_t));
+            vm->jit_depth = vm->call_sp;
+            results[i] = entry(vm, a);
+        }
+        jit_running = prev;
+        vm->jit_trap = prev_trap;
+        return failed;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        vm->sp = 0;
+        vm->frame_base = 0;
+        vm->call_sp = 0;
+        vm->returned = 0;
+        memset(vm->locals, 0, sizeof(vm->locals));
+        memcpy(vm->locals, args + i * argc, argc * sizeof(int32_t));
+        vm->pc = fr->body_pc;
+        run(vm);
+        if (!vm->returned) {
+            results[i] = 0;
+            failed++;
+        } else {
+            results[i] = fr->result_count > 0 ? vm->stack[vm->sp - 1] : 0;
+        }
+    }
+    return failed;
+}
+
+// インタプリタの実行状態。ホスト関数から同じインスタンスを呼び直す間、外側の呼び出しの分を退避する
+typedef struct {
+    int32_t stack[256];
+    int32_t locals[16];
+    CallFrame call_stack[64];
+    size_t pc;
+    int sp, call_sp, frame_base, returned;
+} InterpState;
+
+int vm_invoke_batch(WasmVM *vm, ExportFunc *f, const int32_t *args, int32_t *results, size_t count) {
+    if (vm->invoke_depth == 0) {
+        vm->invoke_depth++;
+        int ret = vm_invoke_batch_run(vm, f, args, results, count);
+        vm->invoke_depth--;
+        return ret;
+    }
+    // 入れ子の呼び出しはスタックの底から実行し直すので、外側のスタック・フレーム・pc を戻せるようにしておく
+    // (1つの呼び出しで数 KB なので、再入したときだけ写す)
+    InterpState *saved = vm_malloc(sizeof(*saved));
+    if (saved == NULL) return -1;
+    memcpy(saved->stack, vm->stack, sizeof(saved->stack));
+    memcpy(saved->locals, vm->locals, sizeof(saved->locals));
+    memcpy(saved->call_stack, vm->call_stack, (size_t)vm->call_sp * sizeof(CallFrame));
+    saved->pc = vm->pc;
+    saved->sp = vm->sp;
+    saved->call_sp = vm->call_sp;
+    saved->frame_base = vm->frame_base;
+    saved->returned = vm->returned;
+    vm->invoke_depth++;
+    int ret = vm_invoke_batch_run(vm, f, args, results, count);
+    vm->invoke_depth--;
+    memcpy(vm->stack, saved->stack, sizeof(saved->stack));
+    memcpy(vm->locals, saved->locals, sizeof(saved->locals));
+    memcpy(vm->call_stack, saved->call_stack, (size_t)saved->call_sp * sizeof(CallFrame));
+    vm->pc = saved->pc;
+    vm->sp = saved->sp;
+    vm->call_sp = saved->call_sp;
+    vm->frame_base = saved->frame_base;
+    vm->returned = saved->returned;
+    free(saved);
+    return ret;
+}
+
+// vm_invoke_batch_pool が1つのインスタンスに割り当てる塊
+typedef struct {
+    WasmVM *vm;
+    ExportFunc f;
+    const int32_t *args;
+    int32_t *results;
+    size_t count;
+    int failed;              // vm_invoke_batch の戻り値
+    int threaded;            // 1: 別スレッドで実行中 (join する)
+    pthread_t thread;
+} BatchJob;
+
+void *vm_batch_thread_main(void *arg) {
+    BatchJob *job = arg;
+    // vm_thread_main と同じく、動いているノードにメモリを置き直す
+    if (job->vm->mem_policy & VM_MEM_NUMA_LOCAL) vm_bind_memory_local(job->vm);
+    job->failed = vm_invoke_batch(job->vm, &job->f, job->args, job->results, job->count);
+    return NULL;
+}
+
+// 同じモジュールのインスタンスを nvms 個使って、count 組を連続した塊に分けて並列に呼び出す。
+// 最初の塊は呼び出したスレッドで実行する。f はどのインスタンスのものでもよい
+// (関数インデックスだけを使う)。戻り値は vm_invoke_batch と同じで、トラップの数を合計する
+int vm_invoke_batch_pool(WasmVM **vms, int nvms, ExportFunc *f, const int32_t *args, int32_t *results, size_t count) {
+    if (nvms < 1) return -1;
+    if (nvms == 1 || count < (size_t)nvms) return vm_invoke_batch(vms[0], f, args, results, count);
+    if (f->func_idx < vms[0]->import_func_count || f->func_idx >= vms[0]->func_count ||
+        ensure_prepared(vms[0], f->func_idx) < 0) return -1;
+    int argc = vms[0]->func_frames[f->func_idx].param_count;
+    BatchJob *jobs = vm_calloc(nvms, sizeof(BatchJob));
+    if (jobs == NULL) return -1;
+    size_t chunk = (count + nvms - 1) / nvms;
+    for (int k = 0; k < nvms; k++) {
+        size_t start = chunk * k < count ? chunk * k : count;
+        size_t n = count - start < chunk ? count - start : chunk;
+        jobs[k] = (BatchJob){ vms[k], *f, args + start * argc, results + start, n, 0, 0 };
+        if (k == 0 || n == 0) continue;
+        int err = pthread_create(&jobs[k].thread, NULL, vm_batch_thread_main, &jobs[k]);
+        if (err == 0) jobs[k].threaded = 1;
+        else printf("pthread_create: %s\n", strerror(err));
+    }
+    int failed = 0;
+    for (int k = 0; k < nvms; k++) {
+        if (jobs[k].threaded) pthread_join(jobs[k].thread, NULL);
+        else if (jobs[k].count > 0) vm_batch_thread_main(&jobs[k]); // スレッドを作れなかった塊もここで実行する
+        if (jobs[k].failed < 0 || failed < 0) failed = -1;
+        else failed += jobs[k].failed;
+    }
+    free(jobs);
+    return failed;
+}
+
+// ファイルからWasmバイナリを読み込む関数
+// 成功した場合、bufferに確保したメモリのポインタ、sizeにファイルサイズを格納し、0を返す
+// 失敗した場合、-1を返す
+int read_wasm_file(const char *filepath, uint8_t **buffer, size_t *size) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror("Failed to open wasm file");
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    *buffer = (uint8_t *)vm_malloc(*size);
+    if (!*buffer) {
+        fprintf(stderr, "Failed to allocate memory for wasm file\n");
+        fclose(file);
+        return -1;
+    }
+
+    if (fread(*buffer, 1, *size, file) != *size) {
+        fprintf(stderr, "Failed to read wasm file\n");
+        fclose(file);
+        free(*buffer);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// --- 公開 API (wasmvm.h) ---
+// 内部の WasmVM と関数を、組み込む側に見せる形に包む。ライブラリは -fvisibility=hidden で
+// ビルドするので、外から呼べるのは WASMVM_API を付けたここの関数だけになる
+
+struct wasmvm_module {
+    uint8_t *code;
+    size_t size;
+    int fd;                  // ファイルから読んだときはそのファイル (data セグメントのマップ用。-1 = なし)
+};
+
+// WasmVM を先頭に置き、wasmvm_instance * と WasmVM * を行き来できるようにする
+struct wasmvm_instance {
+    WasmVM vm;
+    uint8_t *code;           // このインスタンス用のバイト列 (パースで定数の畳み込みや最適化が書き換えるため)
+};
+
+static __thread wasmvm_instance *api_caller; // ホスト関数を呼んでいるインスタンス (wasmvm_caller)
+
+wasmvm_module *wasmvm_module_load(const uint8_t *bytes, size_t size) {
+    if (size < 8 || memcmp(bytes, "\0asm\1\0\0\0", 8) != 0) {
+        printf("wasmvm_module_load: not a wasm module\n");
+        return NULL;
+    }
+    wasmvm_module *m = vm_malloc(sizeof(*m));
+    if (m == NULL) return NULL;
+    m->code = vm_malloc(size);
+    if (m->code == NULL) {
+        free(m);
+        return NULL;
+    }
+    memcpy(m->code, bytes, size);
+    m->size = size;
+    m->fd = -1;
+    return m;
+}
+
+wasmvm_module *wasmvm_module_load_file(const char *path) {
+    uint8_t *code;
+    size_t size;
+    if (read_wasm_file(path, &code, &size) < 0) return NULL;
+    wasmvm_module *m = wasmvm_module_load(code, size);
+    free(code);
+    // インスタンス化で data セグメントをマップできるようにファイルを開いておく。読んだ後に
+    // 書き換えられていない (大きさが同じ) ことだけ確かめる。ファイル自体を後で書き換えてはいけない
+    if (m != NULL) {
+        struct stat st;
+        m->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (m->fd >= 0 && (fstat(m->fd, &st) != 0 || (size_t)st.st_size != m->size)) {
+            close(m->fd);
+            m->fd = -1;
+        }
+    }
+    return m;
+}
+
+void wasmvm_module_free(wasmvm_module *m) {
+    if (m == NULL) return;
+    if (m->fd >= 0) close(m->fd);
+    free(m->code);
+    free(m);
+}
+
+wasmvm_instance *wasmvm_instantiate(wasmvm_module *m, int options) {
+    wasmvm_instance *inst = vm_calloc(1, sizeof(*inst));
+    if (inst == NULL) return NULL;
+    inst->code = vm_malloc(m->size);
+    if (inst->code == NULL) {
+        free(inst);
+        return NULL;
+    }
+    memcpy(inst->code, m->code, m->size);
+    WasmVM *vm = &inst->vm;
+    vm->code = inst->code;
+    vm->size = m->size;
+    vm->optimize = (options & WASMVM_OPTIMIZE) != 0;
+    vm->lazy = (options & WASMVM_LAZY) != 0;
+    vm->tos_cache = (options & WASMVM_INTERP_TOS) != 0;
+    if (options & WASMVM_MEM_THP) vm->mem_policy |= VM_MEM_THP;
+    if (options & WASMVM_MEM_NUMA) vm->mem_policy |= VM_MEM_NUMA_LOCAL;
+    if (options & WASMVM_MEM_GUARD) vm->mem_policy |= VM_MEM_GUARD;
+    vm->data_fd = m->fd;
+    vm->data_fd_valid = m->fd >= 0;
+#if VM_JIT
+    vm->jit = (options & WASMVM_JIT_EAGER) ? 2 : (options & WASMVM_JIT) ? 1 : 0;
+#endif
+    parse_sections(vm);
+    if (vm->memory == NULL) {
+        wasmvm_instance_free(inst);
+        return NULL;
+    }
+    return inst;
+}
+
+void wasmvm_instance_free(wasmvm_instance *inst) {
+    if (inst == NULL) return;
+    vm_teardown(&inst->vm);
+    free(inst->code);
+    free(inst);
+}
+
+int wasmvm_register_host(wasmvm_instance *inst, const char *mod, const char *field, wasmvm_host_func func) {
+    ImportFunc *f = find_import(&inst->vm, mod, field);
+    if (f == NULL) return -1;
+    f->func = func;
+    return 0;
+}
+
+int wasmvm_register_global(wasmvm_instance *inst, const char *mod, const char *field, int32_t value) {
+    WasmVM *vm = &inst->vm;
+    for (size_t i = 0; i < vm->import_global_count; i++) {
+        if (strcmp(vm->global_info[i].mod_name, mod) == 0 && strcmp(vm->global_info[i].field_name, field) == 0) {
+            vm->globals[i] = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+wasmvm_instance *wasmvm_caller(void) {
+    return api_caller;
+}
+
+wasmvm_export *wasmvm_find_export(wasmvm_instance *inst, const char *name) {
+    return (wasmvm_export *)find_export(&inst->vm, name);
+}
+
+int wasmvm_export_signature(wasmvm_instance *inst, wasmvm_export *f, int *param_count, int *result_count) {
+    WasmVM *vm = &inst->vm;
+    uint32_t idx = ((ExportFunc *)f)->func_idx;
+    if (idx >= vm->func_count) return -1;
+    FuncType *t = get_func_type(vm, idx);
+    if (param_count) *param_count = t->param_count;
+    if (result_count) *result_count = t->result_count;
+    return 0;
+}
+
+int wasmvm_invoke(wasmvm_instance *inst, wasmvm_export *f, const int32_t *args, int argc, int32_t *result) {
+    int params;
+    int32_t ret = 0;
+    if (wasmvm_export_signature(inst, f, &params, NULL) < 0 || argc != params) return -1;
+    wasmvm_instance *prev = api_caller;
+    api_caller = inst;
+    int failed = vm_invoke_batch(&inst->vm, (ExportFunc *)f, args, &ret, 1);
+    api_caller = prev;
+    if (failed != 0) return -1;
+    if (result) *result = ret;
+    return 0;
+}
+
+int wasmvm_invoke_batch(wasmvm_instance *inst, wasmvm_export *f, const int32_t *args, int32_t *results, size_t count) {
+    wasmvm_instance *prev = api_caller;
+    api_caller = inst;
+    int failed = vm_invoke_batch(&inst->vm, (ExportFunc *)f, args, results, count);
+    api_caller = prev;
+    return failed;
+}
+
+uint8_t *wasmvm_memory(wasmvm_instance *inst, size_t *size) {
+    if (size) *size = inst->vm.memory ? VM_MEMORY_SIZE : 0;
+    return inst->vm.memory;
+}
+
+int wasmvm_memory_read(wasmvm_instance *inst, uint32_t offset, void *dst, size_t len) {
+    if (inst->vm.memory == NULL || offset > VM_MEMORY_SIZE || len > VM_MEMORY_SIZE - offset) return -1;
+    memcpy(dst, inst->vm.memory + offset, len);
+    return 0;
+}
+
+int wasmvm_memory_write(wasmvm_instance *inst, uint32_t offset, const void *src, size_t len) {
+    if (inst->vm.memory == NULL || offset > VM_MEMORY_SIZE || len > VM_MEMORY_SIZE - offset) return -1;
+    memcpy(inst->vm.memory + offset, src, len);
+    return 0;
+}
+
+// --- ワーカープール ---
+// ワーカーはそれぞれ待ち行列と、モジュールごとのインスタンスの LRU キャッシュを持つ。インスタンスを
+// 作る・使う・捨てるのはそのワーカーのスレッドだけなので、キャッシュ自体にロックは要らない
+// (線形メモリも最初に触るワーカーの NUMA ノードに置かれる)。振り分けはキャッシュの slots[].m を
+// ロックなしで覗くだけの目安で、外れてもそのワーカーでインスタンスを作り直すだけになる。
+// WASMVM_POOL_IO_URING のワーカーは呼び出しをスロットごとのファイバー (ucontext) で実行し、
+// WASI の I/O を出したファイバーを完了まで止めて、その間に別の呼び出しを進める
+
+#define VM_POOL_SPILL 2 // 温まったワーカーの待ちが一番空いているワーカーよりこれだけ多ければ、空いている方へ送る
+#define VM_FIBER_STACK (256u << 10) // ファイバーのスタック (先頭の1ページはガード)
+
+typedef struct PoolRequest {
+    wasmvm_module *m;
+    const char *export_name;
+    const int32_t *args;
+    int argc;
+    int32_t result;
+    int status;              // wasmvm_invoke の戻り値
+    int done;                // 1: ワーカーが実行し終えた (ワーカーのロックの下で書く)
+    struct PoolRequest *next;
+} PoolRequest;
+
+typedef struct IoFiber IoFiber;
+
+typedef struct {
+    wasmvm_module *m;        // NULL = 空き
+    wasmvm_instance *inst;
+    uint64_t last_used;      // ワーカーの呼び出しの通し番号 (一番小さいものを捨てる)
+    int busy;                // 1: ファイバーが I/O を待っている途中 (捨てない・別の呼び出しに使わない)
+    IoFiber *fiber;          // このスロットで呼び出しを実行するファイバー (WASMVM_POOL_IO_URING のとき)
+} PoolSlot;
+
+#if VM_IO_URING
+// io_uring の SQ・CQ (liburing を使わずシステムコールで直接扱う)
+typedef struct {
+    int fd;                  // -1 = 使わない
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;       // 次に埋める SQE (sq_tail までは出した分)
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+} IoRing;
+#endif
+
+typedef struct {
+    wasmvm_pool *pool;
+    int cpu;                 // 固定した CPU (-1 = 固定していない)
+    pthread_t thread;
+    pthread_mutex_t lock;    // 待ち行列を守る
+    pthread_cond_t cond;     // 要求が来た・要求が終わった
+    PoolRequest *head, *tail;
+    int queued;              // 待ち行列と実行中の要求の数 (振り分けのためにロックなしでも読む)
+    int stop;
+    PoolSlot *slots;         // cache_size 個
+    uint64_t clock;
+    size_t hits, misses;
+#if VM_IO_URING
+    IoRing ring;             // ring.fd >= 0 ならファイバーで実行する
+    int wake_fd;             // 要求が来た・止めることを知らせる eventfd (ring で読みを待つ)
+    uint64_t wake_buf;
+    ucontext_t sched;        // スケジューラ (ワーカーのスレッドのもとのスタック)
+    size_t io_ops;           // ring に出した WASI の I/O の数
+#endif
+} PoolWorker;
+
+struct wasmvm_pool {
+    PoolWorker *workers;
+    int nworkers;
+    int cache_size;
+    int flags;
+    int options;
+    wasmvm_instance_setup setup;
+    unsigned next;           // 温まったワーカーがないときの送り先 (順番に回す)
+    int cpus[CPU_SETSIZE];   // 使ってよい CPU (ワーカー i は cpus[i % ncpus] に固定する)
+    int ncpus;
+};
+
+// m のインスタンスを持つスロットを返す。なければ空きか一番長く使われていないスロットに作る。
+// I/O を待っているスロットは使わず、全部そうなら *busy = 1 で NULL を返す (作れなくても NULL)
+static PoolSlot *pool_slot(PoolWorker *w, wasmvm_module *m, int *busy) {
+    wasmvm_pool *p = w->pool;
+    PoolSlot *victim = NULL;
+    *busy = 0;
+    for (int i = 0; i < p->cache_size; i++) {
+        PoolSlot *s = &w->slots[i];
+        if (s->busy) continue;
+        if (s->m == m) {
+            w->hits++;
+            return s;
+        }
+        if (victim == NULL || (victim->m != NULL && (s->m == NULL || s->last_used < victim->last_used))) victim = s;
+    }
+    if (victim == NULL) {
+        *busy = 1;
+        return NULL;
+    }
+    w->misses++;
+    __atomic_store_n(&victim->m, NULL, __ATOMIC_RELAXED);
+    wasmvm_instance_free(victim->inst);
+    victim->inst = wasmvm_instantiate(m, p->options);
+    if (victim->inst == NULL) return NULL;
+    if (p->setup) p->setup(victim->inst);
+    __atomic_store_n(&victim->m, m, __ATOMIC_RELAXED);
+    return victim;
+}
+
+// スロットのインスタンスで r を実行する
+static void pool_exec(PoolWorker *w, PoolSlot *slot, PoolRequest *r) {
+    slot->last_used = ++w->clock;
+    wasmvm_export *f = wasmvm_find_export(slot->inst, r->export_name);
+    r->status = f ? wasmvm_invoke(slot->inst, f, r->args, r->argc, &r->result) : -1;
+}
+
+// r が終わったことを呼び出し元に知らせる
+static void pool_complete(PoolWorker *w, PoolRequest *r) {
+    pthread_mutex_lock(&w->lock);
+    r->done = 1;
+    __atomic_fetch_sub(&w->queued, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// 待ち行列の先頭を外す (ワーカーのスレッドだけが外すので、先頭は覗いたときのまま)
+static void pool_pop(PoolWorker *w) {
+    pthread_mutex_lock(&w->lock);
+    w->head = w->head->next;
+    if (w->head == NULL) w->tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+}
+
+#if VM_IO_URING
+struct IoFiber {
+    ucontext_t ctx;
+    uint8_t *stack;          // VM_FIBER_STACK バイト
+    PoolWorker *worker;
+    PoolSlot *slot;
+    PoolRequest *req;
+    int res;                 // 待っていた I/O の結果 (cqe->res)
+    int finished;            // 1: 呼び出しが終わった
+    IoFiber *next;           // 再開を待つ列
+    // 止めている間のスレッドローカル変数 (同じスレッドで別のファイバーが書き換えるため)
+    wasmvm_instance *api_caller;
+    WasmVM *host_caller;
+#if VM_JIT
+    WasmVM *jit_running;
+#endif
+};
+
+static __thread IoFiber *io_current; // このスレッドで実行中のファイバー (NULL = ファイバーの外)
+
+static int io_ring_init(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map :
+        mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("mmap io_uring");
+        if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+        if (!single && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    uint8_t *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+static void io_ring_free(IoRing *ring) {
+    if (ring->fd < 0) return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// 空いている SQE を1つ取る (出すのは次の io_ring_enter)。SQ が埋まっていれば NULL
+static struct io_uring_sqe *io_ring_sqe(IoRing *ring) {
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+    unsigned idx = ring->sqe_tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    memset(&ring->sqes[idx], 0, sizeof(ring->sqes[idx]));
+    return &ring->sqes[idx];
+}
+
+// 溜めた SQE をまとめて出し、wait なら完了が1つ以上来るまで待つ
+static void io_ring_enter(IoRing *ring, int wait) {
+    unsigned submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (submit == 0 && !wait) return;
+    if (syscall(SYS_io_uring_enter, ring->fd, submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 &&
+        errno != EINTR) {
+        perror("io_uring_enter");
+    }
+}
+
+// ファイバー f を、次に I/O で止まるか終わるまで進める (スケジューラから呼ぶ)。終わったら 1
+static int io_resume(PoolWorker *w, IoFiber *f) {
+    io_current = f;
+    api_caller = f->api_caller;
+    host_caller = f->host_caller;
+#if VM_JIT
+    jit_running = f->jit_running;
+#endif
+    swapcontext(&w->sched, &f->ctx);
+    io_current = NULL;
+    api_caller = NULL;
+    host_caller = NULL;
+#if VM_JIT
+    jit_running = NULL;
+#endif
+    if (!f->finished) return 0;
+    f->slot->busy = 0;
+    pool_complete(w, f->req);
+    return 1;
+}
+
+static void io_fiber_main(void) {
+    IoFiber *f = io_current;
+    pool_exec(f->worker, f->slot, f->req);
+    f->finished = 1;
+    swapcontext(&f->ctx, &f->worker->sched); // ここには戻らない
+}
+
+// ファイバーの中から、sqe と同じ I/O を ring に出して完了まで止まる。cqe->res を返す
+static int io_await(IoFiber *f, const struct io_uring_sqe *sqe) {
+    PoolWorker *w = f->worker;
+    struct io_uring_sqe *s = io_ring_sqe(&w->ring);
+    if (s == NULL) return -EAGAIN; // 1スロット1つまでなので、SQ の大きさ (cache_size + 1 以上) を超えることはない
+    *s = *sqe;
+    s->user_data = (uintptr_t)f;
+    w->io_ops++;
+    f->api_caller = api_caller;
+    f->host_caller = host_caller;
+#if VM_JIT
+    f->jit_running = jit_running;
+#endif
+    swapcontext(&f->ctx, &w->sched);
+    return f->res;
+}
+
+// スロットのファイバーで r を始める。止まらずに終わったら 1。ファイバーを作れなければその場で実行する
+static int io_start(PoolWorker *w, PoolSlot *slot, PoolRequest *r) {
+    IoFiber *f = slot->fiber;
+    if (f == NULL) {
+        f = vm_calloc(1, sizeof(IoFiber));
+        void *stack = MAP_FAILED;
+        if (f != NULL) stack = mmap(NULL, VM_FIBER_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+            free(f);
+            pool_exec(w, slot, r);
+            pool_complete(w, r);
+            return 1;
+        }
+        mprotect(stack, 4096, PROT_NONE); // スタックのあふれをフォルトにする
+        f->stack = stack;
+        slot->fiber = f;
+    }
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = f->stack;
+    f->ctx.uc_stack.ss_size = VM_FIBER_STACK;
+    f->ctx.uc_link = NULL;
+    makecontext(&f->ctx, io_fiber_main, 0);
+    f->worker = w;
+    f->slot = slot;
+    f->req = r;
+    f->finished = 0;
+    f->api_caller = NULL;
+    f->host_caller = NULL;
+#if VM_JIT
+    f->jit_running = NULL;
+#endif
+    slot->busy = 1;
+    return io_resume(w, f);
+}
+
+// WASMVM_POOL_IO_URING のワーカー。待ち行列の先頭から空いたスロットのファイバーで実行を始め、
+// 進めるものがなくなったら溜めた SQE を出して、I/O の完了か新しい要求 (wake_fd) を待つ。
+// 完了したファイバーはまとめて再開する
+static void pool_worker_uring(PoolWorker *w) {
+    IoRing *ring = &w->ring;
+    int waiting = 0;         // I/O の完了を待っているファイバーの数
+    int wake_armed = 0;      // wake_fd の読みを ring に出してある
+    for (;;) {
+        for (;;) {
+            pthread_mutex_lock(&w->lock);
+            PoolRequest *r = w->head;
+            int stop = w->stop;
+            pthread_mutex_unlock(&w->lock);
+            if (r == NULL) {
+                if (stop && waiting == 0) return; // 止めるのは待ち行列が空で、待っている I/O もなくなってから
+                break;
+            }
+            int busy;
+            PoolSlot *slot = pool_slot(w, r->m, &busy);
+            if (busy) break; // どれかのファイバーが終わってスロットが空くまで待つ
+            pool_pop(w);
+            if (slot == NULL) {
+                r->status = -1;
+                pool_complete(w, r);
+            } else if (!io_start(w, slot, r)) {
+                waiting++;
+            }
+        }
+        if (!wake_armed) {
+            struct io_uring_sqe *s = io_ring_sqe(ring);
+            if (s != NULL) {
+                s->opcode = IORING_OP_READ;
+                s->fd = w->wake_fd;
+                s->addr = (uintptr_t)&w->wake_buf;
+                s->len = sizeof(w->wake_buf);
+                s->user_data = 0;
+                wake_armed = 1;
+            }
+        }
+        io_ring_enter(ring, 1);
+        // 完了を全部取ってから、待っていたファイバーを順に再開する (再開中に出した I/O は次の enter でまとめて出る)
+        IoFiber *ready = NULL;
+        unsigned head = *ring->cq_head, tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == 0) {
+                wake_armed = 0;
+                continue;
+            }
+            IoFiber *f = (IoFiber *)(uintptr_t)cqe->user_data;
+            f->res = cqe->res;
+            f->next = ready;
+            ready = f;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        while (ready != NULL) {
+            IoFiber *f = ready;
+            ready = f->next;
+            if (io_resume(w, f)) waiting--;
+        }
+    }
+}
+#endif
+
+// 呼び出し元から: 要求が来たこと (または止めること) をワーカーに知らせる。ロックを持って呼ぶ
+static void pool_wake(PoolWorker *w) {
+    pthread_cond_broadcast(&w->cond);
+#if VM_IO_URING
+    if (w->ring.fd >= 0) {
+        uint64_t one = 1;
+        if (write(w->wake_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+    }
+#endif
+}
+
+static void *pool_worker_main(void *arg) {
+    PoolWorker *w = arg;
+    wasmvm_pool *p = w->pool;
+    if ((p->flags & WASMVM_POOL_PIN) && p->ncpus > 0) {
+        int cpu = p->cpus[(w - p->workers) % p->ncpus];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) printf("pthread_setaffinity_np: %s\n", strerror(err));
+        pthread_mutex_lock(&w->lock);
+        w->cpu = err == 0 ? cpu : -1;
+        pthread_mutex_unlock(&w->lock);
+    }
+#if VM_IO_URING
+    if (w->ring.fd >= 0) {
+        pool_worker_uring(w);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&w->lock);
+        for (;;) {
+            while (w->head == NULL && !w->stop) pthread_cond_wait(&w->cond, &w->lock);
+            PoolRequest *r = w->head;
+            if (r == NULL) break; // 止めるのは待ち行列が空になってから
+            pthread_mutex_unlock(&w->lock);
+            int busy;
+            PoolSlot *slot = pool_slot(w, r->m, &busy);
+            if (slot != NULL) pool_exec(w, slot, r);
+            else r->status = -1;
+            pool_pop(w);
+            pool_complete(w, r);
+            pthread_mutex_lock(&w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    // インスタンスは作ったスレッドで解放する
+    for (int i = 0; i < p->cache_size; i++) {
+        wasmvm_instance_free(w->slots[i].inst);
+#if VM_IO_URING
+        if (w->slots[i].fiber) munmap(w->slots[i].fiber->stack, VM_FIBER_STACK);
+#endif
+        free(w->slots[i].fiber);
+    }
+    return NULL;
+}
+
+wasmvm_pool *wasmvm_pool_create(int workers, int cache_size, int flags, int options, wasmvm_instance_setup setup) {
+    if (workers < 1 || cache_size < 1) return NULL;
+    wasmvm_pool *p = vm_calloc(1, sizeof(*p));
+    if (p == NULL) return NULL;
+    p->workers = vm_calloc(workers, sizeof(PoolWorker));
+    if (p->workers == NULL) {
+        free(p);
+        return NULL;
+    }
+    p->cache_size = cache_size;
+    p->flags = flags;
+    p->options = options;
+    p->setup = setup;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) p->cpus[p->ncpus++] = cpu;
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        PoolWorker *w = &p->workers[i];
+        w->pool = p;
+        w->cpu = -1;
+        w->slots = vm_calloc(cache_size, sizeof(PoolSlot));
+#if VM_IO_URING
+        // ファイバーごとに I/O は1つまでなので、SQ はスロットの数と wake_fd の読みの分あればよい。
+        // io_uring を使えない (seccomp など) なら、I/O をその場で待つワーカーにする
+        w->ring.fd = -1;
+        w->wake_fd = -1;
+        if (flags & WASMVM_POOL_IO_URING) {
+            if (io_ring_init(&w->ring, (unsigned)cache_size + 1) < 0) {
+                perror("io_uring_setup");
+            } else if ((w->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+                perror("eventfd");
+                io_ring_free(&w->ring);
+            }
+        }
+#endif
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        int err = w->slots ? pthread_create(&w->thread, NULL, pool_worker_main, w) : ENOMEM;
+        if (err != 0) {
+            printf("wasmvm_pool_create: %s\n", strerror(err));
+            free(w->slots);
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->cond);
+#if VM_IO_URING
+            io_ring_free(&w->ring);
+            if (w->wake_fd >= 0) close(w->wake_fd);
+#endif
+            wasmvm_pool_free(p); // 立てたワーカーだけ止める
+            return NULL;
+        }
+        p->nworkers = i + 1;
+    }
+    return p;
+}
+
+void wasmvm_pool_free(wasmvm_pool *p) {
+    if (p == NULL) return;
+    for (int i = 0; i < p->nworkers; i++) {
+        PoolWorker *w = &p->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pool_wake(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int i = 0; i < p->nworkers; i++) {
+        PoolWorker *w = &p->workers[i];
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w->slots);
+#if VM_IO_URING
+        io_ring_free(&w->ring);
+        if (w->wake_fd >= 0) close(w->wake_fd);
+#endif
+    }
+    free(p->workers);
+    free(p);
+}
+
+// m の呼び出しの送り先。WASMVM_POOL_ROUTE なら m のインスタンスを持つワーカーのうち待ちの一番短いものへ
+// 送る (そこが混んでいれば空いているワーカーへ。そこにも m のインスタンスができる)。
+// 持っているワーカーがなければ、順番に回した位置から見て一番空いているワーカーへ送る
+static PoolWorker *pool_route(wasmvm_pool *p, wasmvm_module *m) {
+    int n = p->nworkers;
+    if (!(p->flags & WASMVM_POOL_ROUTE)) return &p->workers[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % n];
+    PoolWorker *warm = NULL;
+    int warm_q = INT_MAX, idle_q = INT_MAX;
+    for (int i = 0; i < n; i++) {
+        PoolWorker *w = &p->workers[i];
+        int q = __atomic_load_n(&w->queued, __ATOMIC_RELAXED);
+        if (q < idle_q) idle_q = q;
+        if (q >= warm_q) continue;
+        for (int k = 0; k < p->cache_size; k++) {
+            if (__atomic_load_n(&w->slots[k].m, __ATOMIC_RELAXED) == m) {
+                warm = w;
+                warm_q = q;
+                break;
+            }
+        }
+    }
+    if (warm != NULL && warm_q <= idle_q + VM_POOL_SPILL) return warm;
+    unsigned start = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) {
+        PoolWorker *w = &p->workers[(start + i) % n];
+        if (__atomic_load_n(&w->queued, __ATOMIC_RELAXED) <= idle_q) return w;
+    }
+    return &p->workers[start % n];
+}
+
+int wasmvm_pool_invoke(wasmvm_pool *p, wasmvm_module *m, const char *export_name,
+                       const int32_t *args, int argc, int32_t *result) {
+    PoolRequest r = { m, export_name, args, argc, 0, -1, 0, NULL };
+    PoolWorker *w = pool_route(p, m);
+    __atomic_fetch_add(&w->queued, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail) w->tail->next = &r;
+    else w->head = &r;
+    w->tail = &r;
+    pool_wake(w);
+    while (!r.done) pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    if (r.status == 0 && result) *result = r.result;
+    return r.status;
+}
+
+void wasmvm_pool_stats(wasmvm_pool *p, size_t *hits, size_t *misses) {
+    size_t h = 0, miss = 0;
+    for (int i = 0; i < p->nworkers; i++) {
+        PoolWorker *w = &p->workers[i];
+        pthread_mutex_lock(&w->lock); // 終わった要求の分はロックの下で見える
+        h += w->hits;
+        miss += w->misses;
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (hits) *hits = h;
+    if (misses) *misses = miss;
+}
+
+// --- WASI (preview1) ---
+// wasi_snapshot_preview1 の fd_read・fd_write・fd_pread・fd_pwrite・path_open・fd_close。
+// ゲストの iovec は線形メモリを直接指す struct iovec にして readv / writev などに渡す (コピーしない)。
+// WASMVM_POOL_IO_URING のワーカーのファイバーで動いているときは同じ操作をワーカーの io_uring に出し、
+// 完了するまでそのインスタンスを止めて、同じスレッドで別の呼び出しを進める。
+// この VM の値は i32 だけなので、i64 の引数 (オフセット・rights) は下位 32 ビットとして受け取る
+
+#define VM_WASI_MAX_IOVS 16  // 1回の読み書きで使う iovec の数 (残りは短い読み書きになり、ゲストが続きを呼ぶ)
+#define WASI_ERRNO_BADF 8
+#define WASI_ERRNO_FAULT 21
+#define WASI_ERRNO_INVAL 28
+#define WASI_ERRNO_IO 29
+#define WASI_ERRNO_MFILE 33
+#define WASI_ERRNO_NAMETOOLONG 37
+#define WASI_RIGHT_FD_READ (1u << 1)
+#define WASI_RIGHT_FD_WRITE (1u << 6)
+
+// ホストの errno を WASI の errno にする
+static int32_t wasi_errno(int err) {
+    switch (err) {
+        case EACCES: return 2;
+        case EAGAIN: return 6;
+        case EBADF: return WASI_ERRNO_BADF;
+        case EEXIST: return 20;
+        case EFAULT: return WASI_ERRNO_FAULT;
+        case EINTR: return 27;
+        case EINVAL: return WASI_ERRNO_INVAL;
+        case EISDIR: return 31;
+        case ELOOP: return 32;
+        case EMFILE: return WASI_ERRNO_MFILE;
+        case ENAMETOOLONG: return WASI_ERRNO_NAMETOOLONG;
+        case ENOENT: return 44;
+        case ENOSPC: return 51;
+        case ENOTDIR: return 54;
+        case EPERM: return 63;
+        case EPIPE: return 64;
+        case ESPIPE: return 70;
+        case EXDEV: return 76; // RESOLVE_BENEATH で起点のディレクトリの外を指した → NOTCAPABLE
+        default: return WASI_ERRNO_IO;
+    }
+}
+
+static int wasi_host_fd(WasmVM *vm, int32_t fd) {
+    if (vm == NULL || !vm->wasi.enabled || fd < 0 || fd >= VM_WASI_MAX_FDS) return -1;
+    return vm->wasi.fds[fd];
+}
+
+// ゲストの iovec の配列 (base と len の i32 の組が n 個) を、線形メモリを指す struct iovec にする。
+// 使った数を返し、範囲外を指していれば -1
+static int wasi_iovecs(WasmVM *vm, uint32_t iovs, uint32_t n, struct iovec *out) {
+    if (n > VM_WASI_MAX_IOVS) n = VM_WASI_MAX_IOVS;
+    if (iovs > VM_MEMORY_SIZE || n * 8 > VM_MEMORY_SIZE - iovs) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t iov[2]; // base, len
+        memcpy(iov, vm->memory + iovs + i * 8, sizeof(iov));
+        if (iov[0] > VM_MEMORY_SIZE || iov[1] > VM_MEMORY_SIZE - iov[0]) return -1;
+        out[i].iov_base = vm->memory + iov[0];
+        out[i].iov_len = iov[1];
+    }
+    return (int)n;
+}
+
+// 1回読み書きする (off < 0 ならファイルの現在位置から)。バイト数か -errno を返す
+static ssize_t wasi_rw(int is_write, int fd, struct iovec *iov, int n, int64_t off) {
+#if VM_IO_URING
+    if (io_current != NULL) {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe.fd = fd;
+        sqe.addr = (uintptr_t)iov;
+        sqe.len = (unsigned)n;
+        sqe.off = off < 0 ? (uint64_t)-1 : (uint64_t)off;
+        return io_await(io_current, &sqe);
+    }
+#endif
+    ssize_t r;
+    if (is_write) r = off < 0 ? writev(fd, iov, n) : pwritev(fd, iov, n, off);
+    else r = off < 0 ? readv(fd, iov, n) : preadv(fd, iov, n, off);
+    return r < 0 ? -errno : r;
+}
+
+static int wasi_openat2(int dir, const char *path, struct open_how *how) {
+#if VM_IO_URING
+    if (io_current != NULL) {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_OPENAT2;
+        sqe.fd = dir;
+        sqe.addr = (uintptr_t)path;
+        sqe.len = sizeof(*how);
+        sqe.off = (uintptr_t)how;
+        return io_await(io_current, &sqe);
+    }
+#endif
+    long r = syscall(SYS_openat2, dir, path, how, sizeof(*how));
+    return r < 0 ? -errno : (int)r;
+}
+
+static int wasi_close(int fd) {
+#if VM_IO_URING
+    if (io_current != NULL) {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_CLOSE;
+        sqe.fd = fd;
+        return io_await(io_current, &sqe);
+    }
+#endif
+    return close(fd) < 0 ? -errno : 0;
+}
+
+// fd_read・fd_write (fd, iovs, iovs_len, 結果のバイト数の置き場所) と
+// fd_pread・fd_pwrite (fd, iovs, iovs_len, offset, 結果のバイト数の置き場所) の共通部分
+static int32_t wasi_transfer(int32_t *args, int argc, int is_write, int positioned) {
+    WasmVM *vm = host_caller;
+    if (argc != (positioned ? 5 : 4)) return WASI_ERRNO_INVAL;
+    int fd = wasi_host_fd(vm, args[0]);
+    if (fd < 0) return WASI_ERRNO_BADF;
+    struct iovec iov[VM_WASI_MAX_IOVS];
+    int n = wasi_iovecs(vm, (uint32_t)args[1], (uint32_t)args[2], iov);
+    uint32_t out = (uint32_t)args[positioned ? 4 : 3];
+    if (n < 0 || out > VM_MEMORY_SIZE - 4) return WASI_ERRNO_FAULT;
+    // 標準出力はホスト側の printf とも混ざるので、先にバッファを出しておく
+    if (is_write && fd == 1) fflush(stdout);
+    if (is_write && fd == 2) fflush(stderr);
+    ssize_t r = wasi_rw(is_write, fd, iov, n, positioned ? (int64_t)(uint32_t)args[3] : -1);
+    if (r < 0) return wasi_errno((int)-r);
+    uint32_t done = (uint32_t)r;
+    memcpy(vm->memory + out, &done, sizeof(done));
+    return 0;
+}
+
+static int32_t wasi_fd_read(int32_t *args, int argc) { return wasi_transfer(args, argc, 0, 0); }
+static int32_t wasi_fd_write(int32_t *args, int argc) { return wasi_transfer(args, argc, 1, 0); }
+static int32_t wasi_fd_pread(int32_t *args, int argc) { return wasi_transfer(args, argc, 0, 1); }
+static int32_t wasi_fd_pwrite(int32_t *args, int argc) { return wasi_transfer(args, argc, 1, 1); }
+
+// path_open(dirfd, dirflags, path, path_len, oflags, rights_base, rights_inheriting, fdflags, 開いた fd の置き場所)。
+// 読み書きのどちらで開くかは rights_base の FD_READ・FD_WRITE で決め、RESOLVE_BENEATH で dirfd の外は開かない
+static int32_t wasi_path_open(int32_t *args, int argc) {
+    WasmVM *vm = host_caller;
+    if (argc != 9) return WASI_ERRNO_INVAL;
+    int dir = wasi_host_fd(vm, args[0]);
+    if (dir < 0) return WASI_ERRNO_BADF;
+    uint32_t path = (uint32_t)args[2], path_len = (uint32_t)args[3], oflags = (uint32_t)args[4];
+    uint32_t rights = (uint32_t)args[5], fdflags = (uint32_t)args[7], out = (uint32_t)args[8];
+    if (path > VM_MEMORY_SIZE || path_len > VM_MEMORY_SIZE - path || out > VM_MEMORY_SIZE - 4) return WASI_ERRNO_FAULT;
+    if (path_len >= PATH_MAX) return WASI_ERRNO_NAMETOOLONG;
+    int guest_fd = 3;
+    while (guest_fd < VM_WASI_MAX_FDS && vm->wasi.fds[guest_fd] >= 0) guest_fd++;
+    if (guest_fd == VM_WASI_MAX_FDS) return WASI_ERRNO_MFILE;
+    char name[PATH_MAX];
+    memcpy(name, vm->memory + path, path_len);
+    name[path_len] = '\0';
+    uint64_t flags = O_CLOEXEC | O_NOCTTY;
+    int rd = (rights & WASI_RIGHT_FD_READ) != 0, wr = (rights & WASI_RIGHT_FD_WRITE) != 0;
+    flags |= rd && wr ? O_RDWR : wr ? O_WRONLY : O_RDONLY;
+    if (oflags & 1) flags |= O_CREAT;
+    if (oflags & 2) flags |= O_DIRECTORY;
+    if (oflags & 4) flags |= O_EXCL;
+    if (oflags & 8) flags |= O_TRUNC;
+    if (fdflags & 1) flags |= O_APPEND;
+    if (!(args[1] & 1)) flags |= O_NOFOLLOW; // lookupflags の SYMLINK_FOLLOW がなければ最後のシンボリックリンクをたどらない
+    struct open_how how = { .flags = flags, .mode = (flags & O_CREAT) ? 0644 : 0, .resolve = RESOLVE_BENEATH };
+    int fd = wasi_openat2(dir, name, &how);
+    if (fd < 0) return wasi_errno(-fd);
+    vm->wasi.fds[guest_fd] = fd;
+    memcpy(vm->memory + out, &guest_fd, sizeof(guest_fd));
+    return 0;
+}
+
+// fd_close(fd)。標準入出力はゲストの表から外すだけでホストの fd は閉じない
+static int32_t wasi_fd_close(int32_t *args, int argc) {
+    WasmVM *vm = host_caller;
+    if (argc != 1) return WASI_ERRNO_INVAL;
+    int fd = wasi_host_fd(vm, args[0]);
+    if (fd < 0) return WASI_ERRNO_BADF;
+    vm->wasi.fds[args[0]] = -1;
+    if (fd <= 2) return 0;
+    int r = wasi_close(fd);
+    return r < 0 ? wasi_errno(-r) : 0;
+}
+
+// vm の WASI を有効にし、wasi_snapshot_preview1 の関数をインポートに登録する (parse_sections の後に呼ぶ)。
+// ゲストの fd 0〜2 はこのプロセスの標準入出力、preopen_dir (NULL = なし) は fd 3 で path_open の起点になる。
+// ディレクトリを開けなければ -1
+int vm_wasi_init(WasmVM *vm, const char *preopen_dir) {
+    vm_wasi_free(vm);
+    for (int i = 0; i < VM_WASI_MAX_FDS; i++) vm->wasi.fds[i] = i <= 2 ? i : -1;
+    if (preopen_dir != NULL) {
+        vm->wasi.fds[3] = open(preopen_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (vm->wasi.fds[3] < 0) {
+            perror("wasi preopen");
+            return -1;
+        }
+    }
+    vm->wasi.enabled = 1;
+    static const char *const mod = "wasi_snapshot_preview1";
+    vm_register_import(vm, mod, "fd_read", wasi_fd_read);
+    vm_register_import(vm, mod, "fd_write", wasi_fd_write);
+    vm_register_import(vm, mod, "fd_pread", wasi_fd_pread);
+    vm_register_import(vm, mod, "fd_pwrite", wasi_fd_pwrite);
+    vm_register_import(vm, mod, "path_open", wasi_path_open);
+    vm_register_import(vm, mod, "fd_close", wasi_fd_close);
+    return 0;
+}
+
+// ゲストが開いたままのファイルと起点のディレクトリを閉じる (vm_teardown から呼ぶ)
+void vm_wasi_free(WasmVM *vm) {
+    if (!vm->wasi.enabled) return;
+    for (int i = 3; i < VM_WASI_MAX_FDS; i++) {
+        if (vm->wasi.fds[i] >= 0) close(vm->wasi.fds[i]);
+    }
+    vm->wasi.enabled = 0;
+}
+
+int wasmvm_wasi_enable(wasmvm_instance *inst, const char *preopen_dir) {
+    return vm_wasi_init(&inst->vm, preopen_dir);
+}
+
+#if VM_PROFILE
+// --- サンプリングプロファイラ ---
+// SIGPROF のたびに実行中の PC と call_stack の戻り先 PC を記録し、
+// 停止後に関数名へ解決して flame graph 用の folded-stack 形式で出力する。
+// シグナルハンドラは事前に確保したバッファへ書き込むだけにしている。
+
+#define PROFILE_MAX_SAMPLES 65536
+#define PROFILE_MAX_DEPTH 32
+
+typedef struct {
+    size_t pc;                            // サンプル時点で実行中の命令のPC
+    int depth;                            // 記録した呼び出し元の数
+    size_t return_pcs[PROFILE_MAX_DEPTH]; // 呼び出し元の戻り先PC (外側から順)
+} ProfileSample;
+
+static WasmVM *volatile profile_vm;
+static ProfileSample *profile_samples;
+static volatile size_t profile_sample_count;
+static size_t profile_dropped;
+
+static void profile_signal_handler(int sig) {
+    (void)sig;
+    WasmVM *vm = profile_vm;
+    if (vm == NULL) return;
+    if (profile_sample_count >= PROFILE_MAX_SAMPLES) {
+        profile_dropped++;
+        return;
+    }
+    ProfileSample *s = &profile_samples[profile_sample_count];
+    int call_sp = vm->call_sp;
+    int skip = call_sp > PROFILE_MAX_DEPTH ? call_sp - PROFILE_MAX_DEPTH : 0;
+    s->pc = vm->prof_pc;
+    s->depth = call_sp - skip;
+    for (int i = 0; i < s->depth; i++) {
+        s->return_pcs[i] = vm->call_stack[skip + i].return_pc;
+    }
+    profile_sample_count++;
+}
+
+// hz 回/秒 (CPU時間) で vm のサンプリングを開始する
+int profile_start(WasmVM *vm, int hz) {
+    if (profile_samples == NULL) {
+        profile_samples = malloc(sizeof(ProfileSample) * PROFILE_MAX_SAMPLES);
+        if (profile_samples == NULL) return -1;
+    }
+    profile_sample_count = 0;
+    profile_dropped = 0;
+    profile_vm = vm;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) return -1;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / (hz > 0 ? hz : 1000);
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void profile_stop(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    profile_vm = NULL;
+}
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 記録したサンプルを "caller;callee;op_0xNN count" の folded-stack 形式で出力する。
+// 葉には実行中の opcode を置くので、関数単位・命令単位の両方で集計できる。
+// 出力した行数を返す (メモリが足りなければ -1)
+int profile_write_folded(WasmVM *vm, FILE *out) {
+    size_t n = profile_sample_count;
+    char **lines = malloc(sizeof(char *) * (n ? n : 1));
+    if (lines == NULL) return -1;
+
+    for (size_t i = 0; i < n; i++) {
+        ProfileSample *s = &profile_samples[i];
+        size_t cap = (size_t)(s->depth + 2) * 64, len = 0;
+        char name[128];
+        lines[i] = malloc(cap);
+        if (lines[i] == NULL) {
+            while (i > 0) free(lines[--i]);
+            free(lines);
+            return -1;
+        }
+        lines[i][0] = '\0';
+        for (int d = 0; d < s->depth; d++) {
+            get_func_name(vm, find_func_by_pc(vm, s->return_pcs[d]), name, sizeof(name));
+            len += snprintf(lines[i] + len, cap - len, "%s;", name);
+        }
+        get_func_name(vm, find_func_by_pc(vm, s->pc), name, sizeof(name));
+        snprintf(lines[i] + len, cap - len, "%s;op_0x%02X", name, s->pc < vm->size ? vm->code[s->pc] : 0);
+    }
+
+    qsort(lines, n, sizeof(char *), compare_lines);
+    int written = 0;
+    for (size_t i = 0; i < n;) {
+        size_t j = i;
+        while (j < n && strcmp(lines[i], lines[j]) == 0) j++;
+        fprintf(out, "%s %zu\n", lines[i], j - i);
+        written++;
+        i = j;
+    }
+    if (profile_dropped > 0) {
+        fprintf(stderr, "profile: %zu samples dropped (buffer full)\n", profile_dropped);
+    }
+
+    for (size_t i = 0; i < n; i++) free(lines[i]);
+    free(lines);
+    return written;
+}
+
+int wasmvm_profile_start(wasmvm_instance *inst, int hz) {
+    return profile_start(&inst->vm, hz);
+}
+
+void wasmvm_profile_stop(void) {
+    profile_stop();
+}
+
+int wasmvm_profile_dump(wasmvm_instance *inst, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    int written = profile_write_folded(&inst->vm, out);
+    if (fclose(out) != 0) return -1;
+    return written;
+}
+#else
+// VM_PROFILE=0 のビルドではプロファイラの API は何もしない
+int wasmvm_profile_start(wasmvm_instance *inst, int hz) {
+    (void)inst;
+    (void)hz;
+    return -1;
+}
+
+void wasmvm_profile_stop(void) {
+}
+
+int wasmvm_profile_dump(wasmvm_instance *inst, const char *path) {
+    (void)inst;
+    (void)path;
+    return -1;
+}
+#endif
+
+#if VM_FLIGHT
+// --- フライトレコーダー (書き出しと読み出し) ---
+// 書き出しは write() と clock_gettime() だけを使うので、シグナルハンドラからも呼べる。
+// ファイルはヘッダ + 古い順のイベントで、トラップのたびに追記されることもある
+
+typedef struct {
+    char magic[8];           // "WASMFLT1"
+    uint32_t event_size;     // sizeof(FlightEvent)
+    uint32_t count;          // 続くイベントの数
+    uint64_t first_seq;      // 先頭のイベントの通し番号
+    uint64_t start_time, start_ns; // flight_enable した時点の flight_clock() と CLOCK_MONOTONIC (ns)
+    uint64_t dump_time, dump_ns;   // 書き出した時点の同じ2つ (デコーダが時計の単位を求める)
+} FlightDumpHeader;
+
+static const char *const flight_event_names[FL_KIND_COUNT] = {
+    "?", "enter", "exit", "host", "trap", "memory", "sample",
+};
+
+static uint64_t flight_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// capacity 件 (2の冪に切り上げる) のリングバッファを確保して記録を始める。
+// sample_interval 命令ごとに実行中の PC を記録する (0 = 記録しない)。
+// trap_fd >= 0 ならトラップのたびにそこへ書き出す
+int flight_enable(WasmVM *vm, uint32_t capacity, uint32_t sample_interval, int trap_fd) {
+    uint32_t cap = 2;
+    while (cap < capacity && cap < (1u << 24)) cap <<= 1;
+    FlightRecorder *fr = vm_calloc(1, sizeof(FlightRecorder) + 2 * (size_t)cap * sizeof(FlightEvent));
+    if (fr == NULL) return -1;
+    fr->mask = cap - 1;
+    fr->snapshot = &fr->events[cap];
+    fr->sample_interval = sample_interval;
+    fr->trap_fd = trap_fd;
+    fr->start_time = flight_clock();
+    fr->start_ns = flight_monotonic_ns();
+    free(vm->flight);
+    vm->flight = fr;
+    vm->flight_countdown = sample_interval;
+    return 0;
+}
+
+void flight_disable(WasmVM *vm) {
+    free(vm->flight);
+    vm->flight = NULL;
+    vm->flight_countdown = 0;
+}
+
+// sample_interval 命令ごとに run() から呼ばれる
+void flight_sample(WasmVM *vm, size_t pc, uint8_t op) {
+    vm->flight_countdown = vm->flight->sample_interval;
+    flight_record(vm, FL_SAMPLE, (uint32_t)pc, op);
+}
+
+static int flight_write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// 直近のイベントを fd に書き出す。記録中のスレッドを止めずに読むので、まず snapshot へ古い順に写し、
+// head を読み直して、写している間に上書きされたかもしれない古い側を捨てる (seqlock の読み手と同じ)。
+// 写し先は1つなので、書き出し中に別の書き出し (シグナルなど) が来たらそちらは -1 で戻る
+int flight_dump(WasmVM *vm, int fd) {
+    FlightRecorder *fr = vm->flight;
+    if (fr == NULL || fd < 0) return -1;
+    if (__atomic_exchange_n(&fr->dumping, 1, __ATOMIC_ACQUIRE)) return -1;
+    uint64_t head = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+    uint64_t n = head < fr->mask ? head : fr->mask;
+    uint64_t first_seq = head - n;
+    for (uint64_t k = 0; k < n; k++) fr->snapshot[k] = fr->events[(first_seq + k) & fr->mask];
+    // head2 を読んだ時点で書きかけなのは通し番号 head2 の1件だけで、それが上書きするのは head2 - 容量。
+    // head2 - mask より前の番号は、写している間に書き換わったかもしれない
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t head2 = __atomic_load_n(&fr->head, __ATOMIC_RELAXED);
+    uint64_t intact = head2 > fr->mask ? head2 - fr->mask : 0;
+    uint64_t skip = intact > first_seq ? intact - first_seq : 0;
+    if (skip > n) skip = n;
+    FlightDumpHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "WASMFLT1", 8);
+    h.event_size = sizeof(FlightEvent);
+    h.count = (uint32_t)(n - skip);
+    h.first_seq = first_seq + skip;
+    h.start_time = fr->start_time;
+    h.start_ns = fr->start_ns;
+    h.dump_time = flight_clock();
+    h.dump_ns = flight_monotonic_ns();
+    int ret = flight_write_all(fd, &h, sizeof(h));
+    if (ret == 0) ret = flight_write_all(fd, &fr->snapshot[skip], h.count * sizeof(FlightEvent));
+    __atomic_store_n(&fr->dumping, 0, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// トラップを記録し、trap_fd があれば書き出す。PC がわからない (ネイティブコード) ときは pc = 0
+void flight_trap(WasmVM *vm, long func_idx, size_t pc) {
+    FlightRecorder *fr = vm->flight;
+    if (fr == NULL) return;
+    flight_record(vm, FL_TRAP, (uint32_t)pc, func_idx < 0 ? 0xFFFF : (uint16_t)func_idx);
+    if (fr->trap_fd >= 0) flight_dump(vm, fr->trap_fd);
+}
+
+static WasmVM *volatile flight_signal_vm;
+static volatile int flight_signal_fd = -1;
+
+static void flight_signal_handler(int sig) {
+    (void)sig;
+    WasmVM *vm = flight_signal_vm;
+    if (vm != NULL) flight_dump(vm, flight_signal_fd);
+}
+
+// シグナル sig を受けたら vm の記録を fd に書き出す (例: kill -USR1 <pid>)
+int flight_dump_on_signal(WasmVM *vm, int sig, int fd) {
+    flight_signal_vm = vm;
+    flight_signal_fd = fd;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flight_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(sig, &sa, NULL);
+}
+
+int wasmvm_flight_enable(wasmvm_instance *inst, uint32_t capacity, uint32_t sample_interval, int trap_fd) {
+    return flight_enable(&inst->vm, capacity, sample_interval, trap_fd);
+}
+
+int wasmvm_flight_dump(wasmvm_instance *inst, int fd) {
+    return flight_dump(&inst->vm, fd);
+}
+
+int wasmvm_flight_dump_on_signal(wasmvm_instance *inst, int sig, int fd) {
+    return flight_dump_on_signal(&inst->vm, sig, fd);
+}
+
+// flight_dump で書いたファイル (複数の書き出しが続いていてもよい) を読めるテキストにする。
+// 関数は番号でしか出せないので、名前は get_func_name などで読み替える
+int flight_decode(FILE *in, FILE *out) {
+    FlightDumpHeader h;
+    int dumps = 0;
+    while (fread(&h, sizeof(h), 1, in) == 1) {
+        if (memcmp(h.magic, "WASMFLT1", 8) != 0 || h.event_size != sizeof(FlightEvent)) {
+            fprintf(stderr, "flight: not a flight recorder dump\n");
+            return -1;
+        }
+        // flight_clock() の1目盛りが何 ns かを、記録開始から書き出しまでの経過時間で求める
+        double ns_per_tick = 1.0;
+        if (h.dump_time > h.start_time && h.dump_ns > h.start_ns) {
+            ns_per_tick = (double)(h.dump_ns - h.start_ns) / (double)(h.dump_time - h.start_time);
+        }
+        fprintf(out, "dump %d: %u events (seq %llu..%llu)\n", dumps++, h.count,
+                (unsigned long long)h.first_seq, (unsigned long long)(h.first_seq + h.count - 1));
+        fprintf(out, "%8s %12s %5s  %-7s %s\n", "seq", "time_us", "depth", "event", "detail");
+
+        // enter/exit の対応を取るため、深さごとに入った関数を覚えておく
+        long stack[256];
+        for (int i = 0; i < 256; i++) stack[i] = -1;
+        uint64_t t0 = 0;
+        for (uint32_t i = 0; i < h.count; i++) {
+            FlightEvent e;
+            if (fread(&e, sizeof(e), 1, in) != 1) {
+                fprintf(stderr, "flight: truncated dump\n");
+                return -1;
+            }
+            if (i == 0) t0 = e.time;
+            double us = (double)(e.time - t0) * ns_per_tick / 1000.0;
+            const char *name = e.kind < FL_KIND_COUNT ? flight_event_names[e.kind] : "?";
+            fprintf(out, "%8llu %12.3f %5u  %-7s ", (unsigned long long)(h.first_seq + i), us, e.depth, name);
+            switch (e.kind) {
+                case FL_ENTER:
+                    stack[e.depth] = e.arg == UINT32_MAX ? -1 : (long)e.arg;
+                    if (e.arg == UINT32_MAX) fprintf(out, "(expression)\n");
+                    else fprintf(out, "func[%u]%s\n", e.arg, e.aux == 1 ? " (native)" : e.aux == 2 ? " (tail call)" : "");
+                    break;
+                case FL_EXIT:
+                    if (stack[e.depth] >= 0) fprintf(out, "func[%ld]", stack[e.depth]);
+                    else fprintf(out, "func[?]");
+                    if (e.aux == 2) fprintf(out, " (top level)\n");
+                    else fprintf(out, " -> pc=%u\n", e.arg);
+                    stack[e.depth] = -1;
+                    break;
+                case FL_HOST:
+                    fprintf(out, "func[%u]\n", e.arg);
+                    break;
+                case FL_TRAP:
+                    if (e.aux == 0xFFFF) fprintf(out, "pc=%u\n", e.arg);
+                    else if (e.arg == 0) fprintf(out, "func[%u] (native)\n", e.aux);
+                    else fprintf(out, "func[%u] pc=%u\n", e.aux, e.arg);
+                    break;
+                case FL_MEMORY:
+                    fprintf(out, "%u -> %u pages\n", e.aux, e.arg);
+                    break;
+                case FL_SAMPLE:
+                    fprintf(out, "pc=%u op=0x%02X\n", e.arg, e.aux);
+                    break;
+                default:
+                    fprintf(out, "kind=%u arg=%u aux=%u\n", e.kind, e.arg, e.aux);
+                    break;
+            }
+        }
+    }
+    return dumps > 0 ? 0 : -1;
+}
+
+#if VM_FLIGHT_DECODE
+// flightdump [file]: 書き出したファイル (省略時は標準入力) をデコードする
+int flight_decode_main(int argc, char *argv[]) {
+    FILE *in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (in == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    int ret = flight_decode(in, stdout);
+    if (in != stdin) fclose(in);
+    return ret < 0 ? 1 : 0;
+}
+#endif
+#else
+// VM_FLIGHT=0 のビルドではフライトレコーダーの API は何もしない
+int wasmvm_flight_enable(wasmvm_instance *inst, uint32_t capacity, uint32_t sample_interval, int trap_fd) {
+    (void)inst;
+    (void)capacity;
+    (void)sample_interval;
+    (void)trap_fd;
+    return -1;
+}
+
+int wasmvm_flight_dump(wasmvm_instance *inst, int fd) {
+    (void)inst;
+    (void)fd;
+    return -1;
+}
+
+int wasmvm_flight_dump_on_signal(wasmvm_instance *inst, int sig, int fd) {
+    (void)inst;
+    (void)sig;
+    (void)fd;
+    return -1;
+}
+#endif
+
+#if !VM_LIBRARY
+// --- ここから下はテスト・ベンチマークと main() (ライブラリには入れない) ---
+
+int32_t print_i32(int32_t *args, int argc __attribute__((unused))) {
+    TRACE("print_i32: %d\n", args[0]);
+    return 0;
+}
+
+int32_t imported_add(int32_t *args, int argc) {
+    if (argc != 2) return -1;
+TRACE("imported_add\n");
+    return args[0] + args[1];
+}
+
+int32_t imported_seven(int32_t *args __attribute__((unused)), int argc __attribute__((unused))) {
+    return 7;
+}
+
+// 公開 API のテスト用のホスト関数: 呼び出し元の線形メモリの [args[0], args[0] + args[1]) のバイトの合計
+int32_t api_checksum(int32_t *args, int argc) {
+    uint8_t buf[64];
+    if (argc != 2 || args[1] < 0 || args[1] > (int32_t)sizeof(buf)) return -1;
+    if (wasmvm_memory_read(wasmvm_caller(), (uint32_t)args[0], buf, (size_t)args[1]) < 0) return -1;
+    int32_t sum = 0;
+    for (int32_t i = 0; i < args[1]; i++) sum += buf[i];
+    return sum;
+}
+
+// 呼び出し元のインスタンスの "inner" を args[0] + 7 で呼び直すホスト関数
+// (呼び直しから戻った後も外側の呼び出しが続き、その後のトラップが外側の戻り先に届くことのテスト用)
+int32_t api_reenter_host(int32_t *args, int argc) {
+    wasmvm_instance *inst = wasmvm_caller();
+    wasmvm_export *f = inst ? wasmvm_find_export(inst, "inner") : NULL;
+    int32_t arg = args[0] + 7, r = -1;
+    if (argc != 1 || f == NULL || wasmvm_invoke(inst, f, &arg, 1, &r) != 0) return -1;
+    return r;
+}
+
+// テストでモジュールを組み立てるための LEB128 エンコーダ。書いたバイト数を返す
+size_t put_uLEB128(uint8_t *p, uint32_t v) {
+    size_t n = 0;
+    do {
+        uint8_t byte = v & 0x7F;
+        v >>= 7;
+        p[n++] = byte | (v ? 0x80 : 0);
+    } while (v);
+    return n;
+}
+
+size_t put_sLEB128(uint8_t *p, int32_t v) {
+    size_t n = 0;
+    while (1) {
+        uint8_t byte = v & 0x7F;
+        v >>= 7;
+        if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+            p[n++] = byte;
+            return n;
+        }
+        p[n++] = byte | 0x80;
+    }
+}
+
+// セクション (ID・大きさ・中身) を out + n に書き、書き終えた位置を返す
+size_t put_section(uint8_t *out, size_t n, uint8_t id, const uint8_t *body, size_t size) {
+    out[n++] = id;
+    n += put_uLEB128(out + n, (uint32_t)size);
+    memcpy(out + n, body, size);
+    return n + size;
+}
+
+// 線形メモリの mem_offset に data[0..size) を置く data セグメントを1つ持つモジュールを out に書き、
+// 大きさを返す。data セグメントの中身がファイルの中でページ境界から始まるように、前にカスタム
+// セクション "pad" を挟む。out には size + 8192 バイト以上必要。
+// エクスポート "peek"(addr) は addr から i32 を読んで返す
+size_t put_data_module(uint8_t *out, int32_t mem_offset, const uint8_t *data, uint32_t size) {
+    static const uint8_t head[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f, // Type: (i32) -> (i32)
+        0x03, 0x02, 0x01, 0x00,                         // Function: func 0: type 0
+        0x05, 0x03, 0x01, 0x00, 0x01,                   // Memory: min 1
+        0x07, 0x08, 0x01, 0x04, 'p', 'e', 'e', 'k', 0x00, 0x00, // Export "peek" -> func 0
+        0x0a, 0x09, 0x01, 0x07, 0x00,                   // Code: body size 7, 0 locals
+        0x20, 0x00, 0x28, 0x02, 0x00, 0x0b,             //   local.get 0, i32.load, end
+    };
+    uint8_t seg[16];
+    size_t s = 0;
+    seg[s++] = 0x01; // 1 data segment
+    seg[s++] = 0x00; // memory 0
+    seg[s++] = 0x41; // i32.const mem_offset
+    s += put_sLEB128(seg + s, mem_offset);
+    seg[s++] = 0x0b; // end
+    s += put_uLEB128(seg + s, size);
+    uint8_t sec_size[5];
+    size_t data_head = 1 + put_uLEB128(sec_size, (uint32_t)(s + size)) + s;
+    // カスタムセクションの大きさで、中身の始まりを 4096 の倍数にそろえる
+    uint32_t filler = 0;
+    while ((sizeof(head) + 1 + put_uLEB128(sec_size, 4 + filler) + 4 + filler + data_head) % 4096 != 0) filler++;
+    size_t n = sizeof(head);
+    memcpy(out, head, n);
+    out[n++] = 0x00; // Custom
+    n += put_uLEB128(out + n, 4 + filler);
+    out[n++] = 3;
+    memcpy(out + n, "pad", 3);
+    n += 3;
+    memset(out + n, 0, filler);
+    n += filler;
+    out[n++] = 0x0b; // Data
+    n += put_uLEB128(out + n, (uint32_t)(s + size));
+    memcpy(out + n, seg, s);
+    n += s;
+    memcpy(out + n, data, size);
+    return n + size;
+}
+
+// ワーカープールを複数のスレッドから呼ぶテスト用のクライアント。calls 回、モジュールを順に替えて
+// peek(8192) を呼び、期待した値でなかった数を wrong に数える
+typedef struct {
+    wasmvm_pool *pool;
+    wasmvm_module **mods;    // 3つ
+    const int32_t *expected; // モジュールごとの peek(8192)
+    int seed;
+    int calls;
+    int wrong;
+    pthread_t thread;
+} PoolClient;
+
+void *pool_client_main(void *arg) {
+    PoolClient *c = arg;
+    int32_t addr = 8192;
+    for (int i = 0; i < c->calls; i++) {
+        int k = (c->seed + i) % 3;
+        int32_t r = 0;
+        if (wasmvm_pool_invoke(c->pool, c->mods[k], "peek", &addr, 1, &r) != 0 || r != c->expected[k]) c->wrong++;
+    }
+    return NULL;
+}
+
+// 同じモジュールを複数のスレッドで同時にネイティブコードへコンパイルするテスト用のクライアント。
+// calls 回インスタンスを作って (全関数をコンパイル) sum_scaled(100) を呼び、違った数を wrong に数える
+typedef struct {
+    wasmvm_module *m;
+    int calls;
+    int wrong;
+    pthread_t thread;
+} JitCompileClient;
+
+void *jit_compile_client_main(void *arg) {
+    JitCompileClient *c = arg;
+    int32_t n = 100, r;
+    for (int i = 0; i < c->calls; i++) {
+        wasmvm_instance *inst = wasmvm_instantiate(c->m, WASMVM_JIT_EAGER);
+        wasmvm_export *f = inst ? wasmvm_find_export(inst, "sum_scaled") : NULL;
+        if (f == NULL || wasmvm_invoke(inst, f, &n, 1, &r) != 0 || r != 509850) c->wrong++;
+        wasmvm_instance_free(inst);
+    }
+    return NULL;
+}
+
+#if VM_FLIGHT
+// 止めるまで FL_SAMPLE を記録し続けるスレッド。arg に通し番号 (head) を入れるので、
+// 書き出したイベントが上書きされていないことを first_seq と比べて確かめられる
+typedef struct {
+    wasmvm_instance *inst;
+    int stop;
+    pthread_t thread;
+} FlightWriter;
+
+void *flight_writer_main(void *arg) {
+    FlightWriter *w = arg;
+    WasmVM *vm = &w->inst->vm;
+    for (uint32_t seq = 0; !__atomic_load_n(&w->stop, __ATOMIC_RELAXED); seq++) flight_record(vm, FL_SAMPLE, seq, 0);
+    return NULL;
+}
+#endif
+
+// WASI の6つの関数をインポートし、それぞれを同じ引数で呼ぶだけのラッパーを read・write・pread・pwrite・
+// open・close としてエクスポートするモジュールを out (1024 バイト以上) に書き、大きさを返す。
+// "peek"(addr) は addr の i32 を返す。線形メモリには次のものを置く:
+//   100 "out.txt", 110 "fifo", 120 "../x", 200 "hello, wasi\n", 220 "HELLO",
+//   300 iovec {200, 12}, 308 iovec {220, 5}, 316 iovec {512, 64}, 324 iovec {200, 6}, 332 iovec {206, 6}
+size_t put_wasi_module(uint8_t *out) {
+    static const uint8_t types[] = {
+        0x04,                                                       // 4 types
+        0x60, 0x04, 0x7f, 0x7f, 0x7f, 0x7f, 0x01, 0x7f,             // type 0: (i32 i32 i32 i32) -> i32
+        0x60, 0x05, 0x7f, 0x7f, 0x7f, 0x7e, 0x7f, 0x01, 0x7f,       // type 1: (i32 i32 i32 i64 i32) -> i32
+        0x60, 0x09, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7e, 0x7e, 0x7f, 0x7f, 0x01, 0x7f, // type 2: path_open
+        0x60, 0x01, 0x7f, 0x01, 0x7f,                               // type 3: (i32) -> i32
+    };
+    static const char *const imports[] = {"fd_read", "fd_write", "fd_pread", "fd_pwrite", "path_open", "fd_close"};
+    static const char *const exports[] = {"read", "write", "pread", "pwrite", "open", "close", "peek"};
+    static const uint8_t func_types[] = {0, 0, 1, 1, 2, 3, 3};
+    static const uint8_t params[] = {4, 4, 5, 5, 9, 1};
+    static const uint8_t memory[] = {0x01, 0x00, 0x01}; // 1 memory, min 1
+    static const uint8_t peek[] = {0x07, 0x00, 0x20, 0x00, 0x28, 0x02, 0x00, 0x0b}; // local.get 0, i32.load, end
+    static const uint32_t iovecs[] = {200, 12, 220, 5, 512, 64, 200, 6, 206, 6};
+    static const struct { uint32_t offset; uint32_t size; const void *bytes; } data[] = {
+        {100, 7, "out.txt"}, {110, 4, "fifo"}, {120, 4, "../x"}, {200, 12, "hello, wasi\n"}, {220, 5, "HELLO"},
+        {300, sizeof(iovecs), iovecs},
+    };
+    uint8_t sec[512];
+    size_t n = 8, s = 0;
+    memcpy(out, "\0asm\1\0\0\0", 8);
+    n = put_section(out, n, 1, types, sizeof(types));
+    sec[s++] = 6; // 6 imports
+    for (int i = 0; i < 6; i++) {
+        sec[s++] = 22;
+        memcpy(sec + s, "wasi_snapshot_preview1", 22);
+        s += 22;
+        sec[s++] = (uint8_t)strlen(imports[i]);
+        memcpy(sec + s, imports[i], strlen(imports[i]));
+        s += strlen(imports[i]);
+        sec[s++] = 0x00; // func
+        sec[s++] = func_types[i];
+    }
+    n = put_section(out, n, 2, sec, s);
+    s = 0;
+    sec[s++] = 7; // 7 functions
+    for (int i = 0; i < 7; i++) sec[s++] = func_types[i];
+    n = put_section(out, n, 3, sec, s);
+    n = put_section(out, n, 5, memory, sizeof(memory));
+    s = 0;
+    sec[s++] = 7; // 7 exports
+    for (int i = 0; i < 7; i++) {
+        sec[s++] = (uint8_t)strlen(exports[i]);
+        memcpy(sec + s, exports[i], strlen(exports[i]));
+        s += strlen(exports[i]);
+        sec[s++] = 0x00;
+        sec[s++] = (uint8_t)(6 + i); // インポートの後の関数
+    }
+    n = put_section(out, n, 7, sec, s);
+    s = 0;
+    sec[s++] = 7; // 7 function bodies
+    for (int i = 0; i < 6; i++) {
+        sec[s++] = (uint8_t)(2 * params[i] + 4); // body size
+        sec[s++] = 0x00;                         // 0 locals
+        for (int k = 0; k < params[i]; k++) {
+            sec[s++] = 0x20;                     // local.get k
+            sec[s++] = (uint8_t)k;
+        }
+        sec[s++] = 0x10;                         // call i
+        sec[s++] = (uint8_t)i;
+        sec[s++] = 0x0b;                         // end
+    }
+    memcpy(sec + s, peek, sizeof(peek));
+    s += sizeof(peek);
+    n = put_section(out, n, 10, sec, s);
+    s = 0;
+    sec[s++] = sizeof(data) / sizeof(data[0]);
+    for (size_t i = 0; i < sizeof(data) / sizeof(data[0]); i++) {
+        sec[s++] = 0x00; // memory 0
+        sec[s++] = 0x41; // i32.const offset
+        s += put_sLEB128(sec + s, (int32_t)data[i].offset);
+        sec[s++] = 0x0b; // end
+        s += put_uLEB128(sec + s, data[i].size);
+        memcpy(sec + s, data[i].bytes, data[i].size);
+        s += data[i].size;
+    }
+    return put_section(out, n, 11, sec, s);
+}
+
+// エクスポート関数 name を1回呼ぶ (トラップしたら -1)
+int32_t wasi_test_call(wasmvm_instance *inst, const char *name, const int32_t *args, int argc) {
+    wasmvm_export *f = wasmvm_find_export(inst, name);
+    int32_t r = -1;
+    if (f == NULL || wasmvm_invoke(inst, f, args, argc, &r) != 0) return -1;
+    return r;
+}
+
+// ワーカープールのインスタンスの WASI を wasi_test_dir を起点に有効にする
+char wasi_test_dir[64];
+
+void wasi_test_setup(wasmvm_instance *inst) {
+    wasmvm_wasi_enable(inst, wasi_test_dir);
+}
+
+// FIFO を読む側: open・read・peek をプールで順に呼ぶ (書く側がいないと open が終わらない)
+typedef struct {
+    wasmvm_pool *pool;
+    wasmvm_module *m;
+    int32_t open_errno, read_errno, nread, head;
+    pthread_t thread;
+} WasiFifoReader;
+
+void *wasi_fifo_reader_main(void *arg) {
+    WasiFifoReader *rd = arg;
+    int32_t open_args[9] = {3, 1, 110, 4, 0, WASI_RIGHT_FD_READ, 0, 0, 0}, fd = -1, zero = 0, eight = 8, buf = 512;
+    wasmvm_pool_invoke(rd->pool, rd->m, "open", open_args, 9, &rd->open_errno);
+    wasmvm_pool_invoke(rd->pool, rd->m, "peek", &zero, 1, &fd);
+    int32_t read_args[4] = {fd, 316, 1, 8};
+    wasmvm_pool_invoke(rd->pool, rd->m, "read", read_args, 4, &rd->read_errno);
+    wasmvm_pool_invoke(rd->pool, rd->m, "peek", &eight, 1, &rd->nread);
+    wasmvm_pool_invoke(rd->pool, rd->m, "peek", &buf, 1, &rd->head);
+    return NULL;
+}
+
+// Wasmバイナリを16進数でダンプする関数
+void dump_wasm_code(const uint8_t *code, size_t size) {
+    printf("--- Wasm Code Dump (size: %zu bytes) ---\n", size);
+    for (size_t i = 0; i < size; i += 16) {
+        // オフセット表示
+        printf("%08zx: ", i);
+
+        // 16進数表示
+        for (size_t j = 0; j < 16; j++) {
+            if (i + j < size) {
+                printf("%02x ", code[i + j]);
+            } else {
+                printf("   ");
+            }
+            if (j == 7) {
+                printf(" ");
+            }
+        }
+        printf(" |");
+
+        // ASCII表示
+        for (size_t j = 0; j < 16; j++) {
+            if (i + j < size) {
+                uint8_t c = code[i + j];
+                printf("%c", (c >= 32 && c <= 126) ? c : '.');
+            }
+        }
+        printf("|\n");
+    }
+    printf("----------------------------------------\n");
+}
+
+// variable
+void test1() {
+    // --- テストケース1: 基本的な演算とローカル変数 ---
+    uint8_t code[] = {
+        0x41, 0x05,       // i32.const 5      ; 定数 5 をスタックに積む
+        0x21, 0x00,       // local.set 0      ; スタックの値をローカル変数0に格納
+        0x41, 0x07,       // i32.const 7      ; 定数 7 をスタックに積む
+        0x21, 0x01,       // local.set 1      ; スタックの値をローカル変数1に格納
+        0x20, 0x00,       // local.get 0      ; ローカル変数0の値をスタックに積む
+        0x20, 0x01,       // local.get 1      ; ローカル変数1の値をスタックに積む
+        0x6A,             // i32.add          ; スタックの2つの値を加算
         0x21, 0x02,       // local.set 2      ; 結果をローカル変数2に格納
         0x0B              // end
     };
@@ -951,506 +7032,3567 @@ void test1() {
     printf("locals[2] = %d (expected 12)\n", vm.locals[2]);
 }
 
-// numeric
-void test2() {
+// numeric
+void test2() {
+
+    WasmVM vm;
+    // --- テストケース2: 除算 ---
+    uint8_t code1[] = {
+        0x41, 0x0A,       // i32.const 10    ; 定数 10 をスタックに積む
+        0x41, 0x02,       // i32.const 2     ; 定数 2 をスタックに積む
+        0x6D,             // i32.div_s       ; スタックの2つの値を符号付き整数で割る (10 / 2)
+        0x0B              // end
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code1; vm.size = sizeof(code1);
+    vm.pc = 0;
+    run(&vm);
+    printf("10 / 2 = %d (expected 5)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+    // --- テストケース2.1: ctz ---
+    uint8_t code_ctz[] = {
+        0x41, 0x80, 0x80, 0x80, 0x04, // i32.const 8388608
+        0x68,                         // i32.ctz
+        0x0B                          // end
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_ctz; vm.size = sizeof(code_ctz);
+    vm.pc = 0;
+    run(&vm);
+    printf("ctz 8388608 = %d (expected 23)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+    // --- テストケース2.2: clz ---
+    uint8_t code_clz[] = {
+        0x41, 0x80, 0x80, 0x80, 0x04, // i32.const 8388608
+        0x67,                         // i32.clz
+        0x0B                          // end
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_clz; vm.size = sizeof(code_clz);
+    vm.pc = 0;
+    run(&vm);
+    printf("clz 8388608 = %d (expected 8)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+    // --- テストケース2.3: div_s ---
+    uint8_t code2[] = {
+        0x41, 0x7F,       // i32.const -1   ; 定数 -1 をスタックに積む（0x7F は 2の補数で -1）
+        0x41, 0x01,       // i32.const 1    ; 定数 1 をスタックに積む
+        0x6D,             // i32.div_s      ; スタックの2つの値を符号付き整数で割る (-1 / 1)
+        0x0B
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code2; vm.size = sizeof(code2);
+    vm.pc = 0;
+    run(&vm);
+    printf("-1 / 1 = %d (expected -1)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+    // --- テストケース2.4: rem_u ---
+    uint8_t code_rem_u[] = {
+        0x41, 0x0A,       // i32.const 10
+        0x41, 0x03,       // i32.const 3
+        0x70,             // i32.rem_u
+        0x0B
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_rem_u; vm.size = sizeof(code_rem_u);
+    vm.pc = 0;
+    run(&vm);
+    printf("10 %% 3 = %d (expected 1)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+    // --- テストケース2.4: popcnt ---
+    uint8_t code_popcnt[] = {
+        0x41, 0x82, 0x01,      // i32.const 130 (10000010)
+        0x69,                  // i32.popcnt
+        0x0B
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_popcnt; vm.size = sizeof(code_popcnt);
+    vm.pc = 0;
+    run(&vm);
+    printf("popcnt 130 = %d (expected 2)\n", vm.stack[0]);
+    printf("--------------------\n");
+
+}
+
+// control flow
+void test3() {
+    WasmVM vm;
+    // --- テストケース4: ループ (0から4の合計を計算) ---
+    uint8_t code_loop[] = {
+        0x41, 0x00, 0x21, 0x00,       // i32.const 0; local.set 0  → i = 0
+        0x41, 0x00, 0x21, 0x01,       // i32.const 0; local.set 1  → sum = 0
+        0x02, 0x40,                    // block (外側ブロック)
+            0x03, 0x40,                // loop (ループ開始)
+                0x20, 0x00,            // local.get 0  → i
+                0x41, 0x05,            // i32.const 5
+                0x4E,                  // i32.ge_s     → i >= 5 ?
+                0x0D, 0x01,            // br_if 1      → 外側ブロックにジャンプしてループ終了
+                0x20, 0x01,            // local.get 1  → sum
+                0x20, 0x00,            // local.get 0  → i
+                0x6A,                  // i32.add      → sum + i
+                0x21, 0x01,            // local.set 1  → sum に保存
+                0x20, 0x00,            // local.get 0  → i
+                0x41, 0x01,            // i32.const 1
+                0x6A,                  // i32.add      → i + 1
+                0x21, 0x00,            // local.set 0  → i に保存
+                0x0C, 0x00,            // br 0         → loop の先頭に戻る
+            0x0B,
+        0x0B                         // end (外側ブロック終了)
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_loop; vm.size = sizeof(code_loop);
+    vm.pc = 0;
+    run(&vm);
+    printf("sum(0..4) = %d (expected 10)\n", vm.locals[1]);
+    printf("--------------------\n");
+
+    // --- テストケース5: if/else ---
+    uint8_t code_if[] = {
+        0x20, 0x00,                 // local.get
+        0x45,                       // i32.eqz
+        0x04, 0x40,                 // if (void)
+        0x41, 0xef, 0x00,           // i32.const 111
+        0x05,                       // else
+        0x41, 0xde, 0x01,           // i32.const 222
+        0x0B
+    };
+    
+    // param = 0 のとき (cond=true)
+    memset(&vm, 0, sizeof(vm)); vm.code = code_if; vm.size = sizeof(code_if); vm.locals[0] = 0;
+    vm.pc = 0;
+    run(&vm);
+    printf("if (0==0) result = %d (expected 111)\n", vm.stack[vm.sp-1]);
+    
+    // param = 1 のとき (cond=false)
+    memset(&vm, 0, sizeof(vm)); vm.code = code_if; vm.size = sizeof(code_if); vm.locals[0] = 1;
+    vm.pc = 0;
+    run(&vm);
+    printf("if (1==0) result = %d (expected 222)\n", vm.stack[vm.sp-1]);
+    printf("--------------------\n");
+}
+
+// memory
+void test4() {
+    WasmVM vm;
+    // --- テストケース6: 線形メモリの read/write ---
+    uint8_t code_mem[] = {
+        0x41, 0x00,             // i32.const 0   -> addr = 0
+        0x41, 0xF8, 0x00,       // i32.const 120 -> val = 120 (sLEB128: 0xF8 0x00)
+        0x36, 0x02, 0x00,       // i32.store align=2 offset=0
+    
+        0x41, 0x00,             // i32.const 0   -> addr = 0
+        0x28, 0x02, 0x00,       // i32.load  align=2 offset=0
+        0x0B
+    };
+    memset(&vm, 0, sizeof(vm)); vm.code = code_mem; vm.size = sizeof(code_mem);
+    vm.pc = 0;
+    run(&vm);
+    printf("memory[0] loaded = %d (expected 120)\n", vm.stack[vm.sp-1]);
+    printf("--------------------\n");
+}
+
+#if VM_BENCH
+#include <time.h>
+#include <linux/perf_event.h>
+
+// --- ベンチマーク ---
+// make bench で VM_TRACE=0 のビルドを作って実行する。
+// 各ケースは warmup の後に repeats 回計測し、1ケース1行の JSON で出力する。
+
+#ifndef BENCH_LABEL
+#define BENCH_LABEL "default" // ディスパッチ方式などの比較用ラベル
+#endif
+
+uint8_t bench_module[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+    // Section 1: Type
+    0x01, 0x0c, // section size 12
+    0x02, // 2 types
+    0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+    0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 1: (i32 i32) -> (i32)
+    // Section 2: Import
+    0x02, 0x0b, // section size 11
+    0x01, // 1 imports
+    0x03, 0x65, 0x6e, 0x76, 0x03, 0x61, 0x64, 0x64, 0x00, 0x01, // import "env"."add" (func)
+    // Section 3: Function
+    0x03, 0x07, // section size 7
+    0x06, // 6 functions
+    0x00, // func 1: type 0
+    0x00, // func 2: type 0
+    0x00, // func 3: type 0
+    0x00, // func 4: type 0
+    0x00, // func 5: type 0
+    0x00, // func 6: type 0
+    // Section 5: Memory
+    0x05, 0x03, // section size 3
+    0x01, // 1 memory
+    0x00, 0x01, // flags 0, min 1
+    // Section 7: Export
+    0x07, 0x35, // section size 53
+    0x06, // 6 exports
+    0x03, 0x66, 0x69, 0x62, 0x00, 0x01, // export "fib" -> func 1
+    0x06, 0x6e, 0x65, 0x73, 0x74, 0x65, 0x64, 0x00, 0x02, // export "nested" -> func 2
+    0x05, 0x73, 0x77, 0x65, 0x65, 0x70, 0x00, 0x03, // export "sweep" -> func 3
+    0x08, 0x68, 0x6f, 0x73, 0x74, 0x63, 0x61, 0x6c, 0x6c, 0x00, 0x04, // export "hostcall" -> func 4
+    0x05, 0x6e, 0x61, 0x69, 0x76, 0x65, 0x00, 0x05, // export "naive" -> func 5
+    0x07, 0x73, 0x63, 0x61, 0x74, 0x74, 0x65, 0x72, 0x00, 0x06, // export "scatter" -> func 6
+    // Section 10: Code
+    0x0a, 0xc3, 0x02, // section size 323
+    0x06, // 6 function bodies
+    // func 1: fib(n)
+    0x1c, // body size 28
+    0x00, // 0 locals
+        0x20, 0x00,             // local.get 0
+        0x41, 0x02,             // i32.const 2
+        0x48,                   // i32.lt_s
+        0x04, 0x7f,             // if i32
+        0x20, 0x00,             //   local.get 0
+        0x05,                   // else
+        0x20, 0x00,             //   local.get 0
+        0x41, 0x01,             //   i32.const 1
+        0x6b,                   //   i32.sub
+        0x10, 0x01,             //   call 1
+        0x20, 0x00,             //   local.get 0
+        0x41, 0x02,             //   i32.const 2
+        0x6b,                   //   i32.sub
+        0x10, 0x01,             //   call 1
+        0x6a,                   //   i32.add
+        0x0b,                   // end
+        0x0b,                   // end
+    // func 2: nested(n) = sum(i*j) for i,j < n
+    0x40, // body size 64
+    0x01, 0x03, 0x7f, // 1 local groups
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x00,             //     local.get 0
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x41, 0x00,             //     i32.const 0
+        0x21, 0x02,             //     local.set 2
+        0x02, 0x40,             //     block
+        0x03, 0x40,             //       loop
+        0x20, 0x02,             //         local.get 2
+        0x20, 0x00,             //         local.get 0
+        0x4e,                   //         i32.ge_s
+        0x0d, 0x01,             //         br_if 1
+        0x20, 0x03,             //         local.get 3
+        0x20, 0x01,             //         local.get 1
+        0x20, 0x02,             //         local.get 2
+        0x6c,                   //         i32.mul
+        0x6a,                   //         i32.add
+        0x21, 0x03,             //         local.set 3
+        0x20, 0x02,             //         local.get 2
+        0x41, 0x01,             //         i32.const 1
+        0x6a,                   //         i32.add
+        0x21, 0x02,             //         local.set 2
+        0x0c, 0x00,             //         br 0
+        0x0b,                   //       end
+        0x0b,                   //     end
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x20, 0x03,             // local.get 3
+        0x0b,                   // end
+    // func 3: sweep(n) = store i at 4*i, then sum of loads
+    0x4d, // body size 77
+    0x01, 0x02, 0x7f, // 1 local groups
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x00,             //     local.get 0
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x04,             //     i32.const 4
+        0x6c,                   //     i32.mul
+        0x20, 0x01,             //     local.get 1
+        0x36, 0x02, 0x00,       //     i32.store
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x41, 0x00,             // i32.const 0
+        0x21, 0x01,             // local.set 1
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x00,             //     local.get 0
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x20, 0x02,             //     local.get 2
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x04,             //     i32.const 4
+        0x6c,                   //     i32.mul
+        0x28, 0x02, 0x00,       //     i32.load
+        0x6a,                   //     i32.add
+        0x21, 0x02,             //     local.set 2
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x20, 0x02,             // local.get 2
+        0x0b,                   // end
+    // func 4: hostcall(n) = fold env.add over 0..n-1
+    0x24, // body size 36
+    0x01, 0x02, 0x7f, // 1 local groups
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x00,             //     local.get 0
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x20, 0x02,             //     local.get 2
+        0x20, 0x01,             //     local.get 1
+        0x10, 0x00,             //     call 0
+        0x21, 0x02,             //     local.set 2
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x20, 0x02,             // local.get 2
+        0x0b,                   // end
+    // func 5: naive(n) = sum of i * (2 * 3) + 0 over 0..n-1 (最適化していないコンパイラ出力を模す)
+    0x32, // body size 50
+    0x01, 0x02, 0x7f, // 1 local groups
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x00,             //     local.get 0
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x20, 0x02,             //     local.get 2
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x02,             //     i32.const 2
+        0x41, 0x03,             //     i32.const 3
+        0x6c,                   //     i32.mul
+        0x6c,                   //     i32.mul
+        0x41, 0x00,             //     i32.const 0
+        0x6a,                   //     i32.add
+        0x6a,                   //     i32.add
+        0x21, 0x02,             //     local.set 2
+        0x20, 0x02,             //     local.get 2
+        0x1a,                   //     drop
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x41, 0x00,             //     i32.const 0
+        0x1a,                   //     drop
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x20, 0x02,             // local.get 2
+        0x0b,                   // end
+    // func 6: scatter(words) = 65536 回、LCG で選んだ memory[4 * (x % words)] に x を書く (最後の x を返す)
+    0x3d, // body size 61
+    0x01, 0x03, 0x7f, // 1 local groups
+        0x41, 0x80, 0x80, 0x04, // i32.const 65536
+        0x21, 0x02,             // local.set 2
+        0x02, 0x40,             // block
+        0x03, 0x40,             //   loop
+        0x20, 0x01,             //     local.get 1
+        0x20, 0x02,             //     local.get 2
+        0x4e,                   //     i32.ge_s
+        0x0d, 0x01,             //     br_if 1
+        0x20, 0x03,             //     local.get 3
+        0x41, 0xed, 0x9c, 0x99, 0x8e, 0x04, //     i32.const 1103515245
+        0x6c,                   //     i32.mul
+        0x41, 0xb9, 0xe0, 0x00, //     i32.const 12345
+        0x6a,                   //     i32.add
+        0x22, 0x03,             //     local.tee 3
+        0x20, 0x00,             //     local.get 0
+        0x70,                   //     i32.rem_u
+        0x41, 0x04,             //     i32.const 4
+        0x6c,                   //     i32.mul
+        0x20, 0x03,             //     local.get 3
+        0x36, 0x02, 0x00,       //     i32.store
+        0x20, 0x01,             //     local.get 1
+        0x41, 0x01,             //     i32.const 1
+        0x6a,                   //     i32.add
+        0x21, 0x01,             //     local.set 1
+        0x0c, 0x00,             //     br 0
+        0x0b,                   //   end
+        0x0b,                   // end
+        0x20, 0x03,             // local.get 3
+        0x0b,                   // end
+};
+
+typedef struct {
+    const char *name;
+    const char *export_name; // NULL ならモジュールの生成・破棄を計測する
+    int32_t arg;
+    int32_t expected;
+    int iters;               // 1回の計測で実行する回数
+    int reset;               // 1: 実行のたびに vm_reset でスナップショットへ戻す
+    int fresh;               // 1: 実行のたびにインスタンスを作り直す (最初の呼び出しまでの時間)
+    int batch;               // 1: iters 回を vm_invoke_batch でまとめて呼び出す
+    int parse;               // 1: 関数 arg 個の大きなモジュールを生成し、そのパースだけを計測する
+    int data;                // 1: 大きな data セグメントを持つモジュールのインスタンス化 (コピー)、2: 同 (ファイルからマップ)
+    int pool;                // 1: 複数のスレッドからワーカープールで呼び出す (順番に回す)、2: 同 (コアに固定して振り分ける)、
+                             // 3: WASI の fd_pread をプールで呼び出す (I/O はその場で待つ)、4: 同 (io_uring)
+} BenchCase;
+
+BenchCase bench_cases[] = {
+    {"fib",      "fib",      20,     6765,        20},
+    {"nested",   "nested",   100,    24502500,    20},
+    {"sweep",    "sweep",    16384,  134209536,   20},
+    {"hostcall", "hostcall", 100000, 704982704,   20},
+    {"naive",    "naive",    10000,  299970000,   20},
+    {"scatter",  "scatter",  VM_MEMORY_SIZE / 4, 556990464, 20}, // 線形メモリ全体へのランダムな書き込み (TLB)
+    {"churn",    NULL,       0,      7,           2000}, // 結果は関数数 (import 1 + 内部 6)
+    {"reset_4k", "sweep",    1024,   523776,      20,   1}, // 1ページだけ書いてリセット
+    {"reset_64k","sweep",    16384,  134209536,   20,   1}, // 16ページ書いてリセット
+    {"first_call","fib",     2,      1,           2000, 0, 1}, // インスタンス化から最初の呼び出しまで
+    {"call",     "fib",      2,      1,           100000}, // 1回ごとの呼び出しの固定費 (fib(2) は数命令)
+    {"batch",    "fib",      2,      1,           100000, 0, 0, 1}, // 同じ呼び出しを vm_invoke_batch でまとめて
+    {"parse",    NULL,       4096,   4096,        3,    0, 0, 0, 1}, // 約 3.7MB のモジュールのパース (結果は関数数)
+    {"data_copy","peek",     12288,  370083841,   200,  0, 0, 0, 0, 1}, // 56KB の data セグメントをコピーしてインスタンス化し、1語読む
+    {"data_map", "peek",     12288,  370083841,   200,  0, 0, 0, 0, 2}, // 同じものをモジュールファイルからマップ
+    {"pool_rr",  "fib",      10,     55,          2000, 0, 0, 0, 0, 0, 1}, // 4スレッド・4モジュールをワーカー2つで (p99_ns)
+    {"pool_pinned","fib",    10,     55,          2000, 0, 0, 0, 0, 0, 2}, // 同じものをコアに固定したワーカーへ振り分けて
+    {"wasi_sync","pread",    0,      0,           2000, 0, 0, 0, 0, 0, 3}, // 4KB のファイルから 64 バイト読む (結果は errno)
+    {"wasi_uring","pread",   0,      0,           2000, 0, 0, 0, 0, 0, 4}, // 同じ読み込みをワーカーの io_uring で
+    {NULL, NULL, 0, 0, 0}
+};
+
+WasmVM bench_vm;
+int bench_optimize;          // -O: ロード時の最適化パスを有効にする
+int bench_jit;               // -J: 全関数をロード時にネイティブコードへコンパイルする
+int bench_lazy;              // -L: 関数の準備を最初の呼び出しまで遅らせる
+int bench_mem_policy;        // -M thp|hugetlb|numa|guard: 線形メモリの確保方針 (VM_MEM_*)
+int bench_tos;               // -T: スタックトップをレジスタに置く命令ループ (run_loop_tos) で実行する
+size_t bench_parse_bytes;    // parse の1回でパースしたバイト数 (JSON の bytes_per_op)
+double bench_p99_ns;         // pool の1回の呼び出しの待ち時間の 99 パーセンタイル (JSON の p99_ns)
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int32_t bench_add(int32_t *args, int argc) {
+    return args[0] + args[1];
+}
+
+void bench_instantiate(WasmVM *vm) {
+    vm_teardown(vm);
+    memset(vm, 0, sizeof(*vm));
+    vm->code = bench_module;
+    vm->size = sizeof(bench_module);
+    vm->optimize = bench_optimize;
+    vm->lazy = bench_lazy;
+    vm->tos_cache = bench_tos;
+    vm->mem_policy = bench_mem_policy;
+#if VM_JIT
+    vm->jit = bench_jit;
+#endif
+    parse_sections(vm);
+    vm_register_import(vm, "env", "add", bench_add);
+}
+
+// エクスポート関数を1引数で呼び出し、戻り値を返す
+int32_t bench_invoke(WasmVM *vm, ExportFunc *f, int32_t arg) {
+    vm->sp = 0;
+    vm->frame_base = 0;
+    vm->call_sp = 0;
+    memset(vm->locals, 0, sizeof(vm->locals));
+    vm->locals[0] = arg;
+#if VM_JIT
+    if (jit_ready(vm, f->func_idx)) {
+        int32_t ret = 0;
+        jit_invoke(vm, f->func_idx, &arg, &ret);
+        return ret;
+    }
+#endif
+    vm->pc = vm->func_frames[f->func_idx].body_pc;
+    run(vm);
+    return vm->sp > 0 ? vm->stack[vm->sp - 1] : 0;
+}
+
+// 1回分の計測: iters 回実行した合計時間を返す
+// vm_invoke_batch で iters 回をまとめて呼び出す。引数と結果の配列は計測の外で用意する
+uint64_t bench_once_batch(BenchCase *c, int32_t *result) {
+    static int32_t *args, *results;
+    static int cap;
+    if (cap < c->iters) {
+        free(args);
+        free(results);
+        args = malloc(c->iters * sizeof(int32_t));
+        results = malloc(c->iters * sizeof(int32_t));
+        cap = c->iters;
+    }
+    for (int i = 0; i < c->iters; i++) args[i] = c->arg;
+    ExportFunc *f = find_export(&bench_vm, c->export_name);
+    uint64_t start = bench_now_ns();
+    vm_invoke_batch(&bench_vm, f, args, results, c->iters);
+    uint64_t elapsed = bench_now_ns() - start;
+    *result = results[c->iters - 1];
+    return elapsed;
+}
+
+// パースのベンチマーク用のモジュール: (i32) -> i32 の関数を nfuncs 個。
+// 本体は local.get / i32.const / i32.load を並べたもので、即値は1〜5バイトの LEB128 が混ざる
+
+uint8_t *bench_parse_module(uint32_t nfuncs, size_t *size) {
+    enum { STEPS = 64, BODY_MAX = 16 + STEPS * 16 };
+    uint8_t *m = malloc(64 + (size_t)nfuncs * (BODY_MAX + 8));
+    uint8_t *body = malloc(BODY_MAX);
+    if (m == NULL || body == NULL) {
+        free(m);
+        free(body);
+        return NULL;
+    }
+    static const uint8_t head[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f, // Type: (i32) -> (i32)
+    };
+    size_t n = sizeof(head);
+    memcpy(m, head, n);
+    // Function: nfuncs 個すべて type 0
+    uint8_t count[5];
+    size_t clen = put_uLEB128(count, nfuncs);
+    m[n++] = 0x03;
+    n += put_uLEB128(m + n, (uint32_t)(clen + nfuncs));
+    memcpy(m + n, count, clen);
+    n += clen;
+    memset(m + n, 0, nfuncs);
+    n += nfuncs;
+    static const uint8_t mid[] = {
+        0x05, 0x03, 0x01, 0x00, 0x01,                   // Memory: min 1
+        0x07, 0x06, 0x01, 0x02, 0x66, 0x30, 0x00, 0x00, // Export: "f0" -> func 0
+    };
+    memcpy(m + n, mid, sizeof(mid));
+    n += sizeof(mid);
+    // Code: セクションの大きさは最後に埋める (5バイトの LEB128 で場所を取っておく)
+    m[n++] = 0x0a;
+    size_t sec_size_pc = n;
+    n += 5;
+    size_t sec_start = n;
+    n += put_uLEB128(m + n, nfuncs);
+    for (uint32_t f = 0; f < nfuncs; f++) {
+        size_t b = 0;
+        body[b++] = 0x01; // 1 local group
+        body[b++] = 0x01;
+        body[b++] = 0x7f;
+        for (uint32_t k = 0; k < STEPS; k++) {
+            int32_t v = (int32_t)((k * 2654435761u + f * 40503u) >> (k % 28));
+            body[b++] = 0x20; body[b++] = 0x01;             // local.get 1
+            body[b++] = 0x41; b += put_sLEB128(body + b, v); // i32.const v
+            body[b++] = 0x6a;                               // i32.add
+            body[b++] = 0x22; body[b++] = 0x01;             // local.tee 1
+            body[b++] = 0x28; body[b++] = 0x02;             // i32.load align=2 offset=k*300
+            b += put_uLEB128(body + b, k * 300);
+            body[b++] = 0x1a;                               // drop
+        }
+        body[b++] = 0x20; body[b++] = 0x01;                 // local.get 1
+        body[b++] = 0x0b;                                   // end
+        n += put_uLEB128(m + n, (uint32_t)b);
+        memcpy(m + n, body, b);
+        n += b;
+    }
+    uint32_t sec_size = (uint32_t)(n - sec_start);
+    for (int i = 0; i < 5; i++) m[sec_size_pc + i] = (uint8_t)(((sec_size >> (7 * i)) & 0x7F) | (i < 4 ? 0x80 : 0));
+    free(body);
+    *size = n;
+    return m;
+}
+
+// 生成したモジュールを iters 回パースした時間 (コピーと解放は含めない)。最適化はバイト列を書き換えるので毎回コピーする
+uint64_t bench_once_parse(BenchCase *c, int32_t *result) {
+    static uint8_t *module, *work;
+    static size_t size;
+    if (module == NULL) {
+        module = bench_parse_module((uint32_t)c->arg, &size);
+        work = malloc(size ? size : 1);
+        if (module == NULL || work == NULL) return 0;
+    }
+    static WasmVM vm;
+    uint64_t total = 0;
+    for (int i = 0; i < c->iters; i++) {
+        memcpy(work, module, size);
+        memset(&vm, 0, sizeof(vm));
+        vm.code = work;
+        vm.size = size;
+        vm.optimize = bench_optimize;
+        vm.lazy = bench_lazy;
+        vm.mem_policy = bench_mem_policy;
+#if VM_JIT
+        vm.jit = bench_jit;
+#endif
+        uint64_t start = bench_now_ns();
+        parse_sections(&vm);
+        total += bench_now_ns() - start;
+        *result = (int32_t)vm.func_count;
+        vm_teardown(&vm);
+    }
+    bench_parse_bytes = size;
+    return total;
+}
+
+// 線形メモリの 4096 から 14 ページの data セグメントを持つモジュールを一時ファイルに書き、
+// インスタンス化・1回の呼び出し・破棄を iters 回繰り返した時間。c->data == 2 ならファイルからマップする
+uint64_t bench_once_data(BenchCase *c, int32_t *result) {
+    static uint8_t *module, *work;
+    static size_t size;
+    static int fd = -1;
+    if (module == NULL) {
+        uint32_t seg_size = 14 * 4096;
+        uint8_t *seg = malloc(seg_size);
+        module = malloc(seg_size + 8192);
+        if (seg == NULL || module == NULL) return 0;
+        for (uint32_t i = 0; i < seg_size; i++) seg[i] = (uint8_t)(i * 7 + 1);
+        size = put_data_module(module, 4096, seg, seg_size);
+        free(seg);
+        work = malloc(size);
+        char path[] = "/tmp/wasmvm-bench-data-XXXXXX";
+        fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+            if (write(fd, module, size) != (ssize_t)size) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (work == NULL) return 0;
+    }
+    static WasmVM vm;
+    uint64_t total = 0;
+    for (int i = 0; i < c->iters; i++) {
+        memcpy(work, module, size); // インスタンスごとのバイト列 (wasmvm_instantiate と同じ)
+        memset(&vm, 0, sizeof(vm));
+        vm.code = work;
+        vm.size = size;
+        vm.optimize = bench_optimize;
+        vm.tos_cache = bench_tos;
+        vm.mem_policy = bench_mem_policy;
+        vm.data_fd = fd;
+        vm.data_fd_valid = c->data == 2 && fd >= 0;
+#if VM_JIT
+        vm.jit = bench_jit;
+#endif
+        uint64_t start = bench_now_ns();
+        parse_sections(&vm);
+        ExportFunc *f = find_export(&vm, c->export_name);
+        *result = f ? bench_invoke(&vm, f, c->arg) : 0;
+        vm_teardown(&vm);
+        total += bench_now_ns() - start;
+    }
+    return total;
+}
+
+// --- ワーカープール ---
+// BENCH_POOL_CLIENTS 個のスレッドが、同じバイト列を別々に読み込んだ4つのモジュールを順に替えながら
+// ワーカー2つ (キャッシュは2つずつ) のプールで呼び出す。1回ごとの待ち時間から p99 を出す
+#define BENCH_POOL_CLIENTS 4
+
+int compare_u64(const void *a, const void *b); // 後で定義
+
+typedef struct {
+    BenchCase *c;
+    wasmvm_pool *pool;
+    wasmvm_module **mods;
+    int seed;
+    int calls;
+    uint64_t *latency;       // calls 個
+    int32_t result;
+    pthread_t thread;
+} BenchPoolClient;
+
+void bench_pool_setup(wasmvm_instance *inst) {
+    wasmvm_register_host(inst, "env", "add", bench_add);
+}
+
+// WASI の計測用のディレクトリ (4KB の out.txt を置く)。インスタンスごとに out.txt をゲストの fd 4 として開いておく
+char bench_wasi_dir[64];
+
+void bench_wasi_cleanup(void) {
+    char path[96];
+    snprintf(path, sizeof(path), "%s/out.txt", bench_wasi_dir);
+    unlink(path);
+    rmdir(bench_wasi_dir);
+}
+
+void bench_wasi_setup(wasmvm_instance *inst) {
+    int32_t open_args[9] = {3, 1, 100, 7, 0, WASI_RIGHT_FD_READ, 0, 0, 0}, r;
+    wasmvm_export *f = wasmvm_find_export(inst, "open");
+    if (wasmvm_wasi_enable(inst, bench_wasi_dir) != 0 || f == NULL || wasmvm_invoke(inst, f, open_args, 9, &r) != 0 || r != 0) {
+        printf("bench: WASI setup failed\n");
+    }
+}
+
+void *bench_pool_client(void *arg) {
+    BenchPoolClient *cl = arg;
+    int32_t a[5] = {cl->c->arg};
+    int argc = 1;
+    if (cl->c->pool >= 3) {
+        static const int32_t pread_args[5] = {4, 316, 1, 0, 8}; // fd 4 の先頭から iovec {512, 64} へ
+        memcpy(a, pread_args, sizeof(pread_args));
+        argc = 5;
+    }
+    for (int i = 0; i < cl->calls; i++) {
+        uint64_t start = bench_now_ns();
+        if (wasmvm_pool_invoke(cl->pool, cl->mods[(cl->seed + i) % 4], cl->c->export_name, a, argc, &cl->result) != 0) {
+            cl->result = -1;
+        }
+        cl->latency[i] = bench_now_ns() - start;
+    }
+    return NULL;
+}
+
+uint64_t bench_once_pool(BenchCase *c, int32_t *result) {
+    static wasmvm_module *fib_mods[4], *wasi_mods[4];
+    static wasmvm_pool *pools[5]; // c->pool ごと (計測の間ずっと使い回す)
+    static uint64_t *latency;
+    static int latency_cap;
+    wasmvm_module **mods = c->pool >= 3 ? wasi_mods : fib_mods;
+    if (mods[0] == NULL && c->pool >= 3) {
+        uint8_t wasi_bytes[1024], block[4096];
+        size_t wn = put_wasi_module(wasi_bytes);
+        char path[96];
+        strcpy(bench_wasi_dir, "/tmp/wasmvm-bench-XXXXXX");
+        if (mkdtemp(bench_wasi_dir) == NULL) return 0;
+        atexit(bench_wasi_cleanup);
+        snprintf(path, sizeof(path), "%s/out.txt", bench_wasi_dir);
+        memset(block, 'x', sizeof(block));
+        FILE *fp = fopen(path, "wb");
+        if (fp == NULL || fwrite(block, 1, sizeof(block), fp) != sizeof(block)) perror("bench: out.txt");
+        if (fp) fclose(fp);
+        for (int k = 0; k < 4; k++) mods[k] = wasmvm_module_load(wasi_bytes, wn);
+    } else if (mods[0] == NULL) {
+        for (int k = 0; k < 4; k++) mods[k] = wasmvm_module_load(bench_module, sizeof(bench_module));
+    }
+    if (pools[c->pool] == NULL) {
+        int options = (bench_optimize ? WASMVM_OPTIMIZE : 0) | (bench_jit ? WASMVM_JIT_EAGER : 0) |
+                      (bench_lazy ? WASMVM_LAZY : 0) | (bench_tos ? WASMVM_INTERP_TOS : 0) |
+                      ((bench_mem_policy & VM_MEM_GUARD) ? WASMVM_MEM_GUARD : 0);
+        int flags = c->pool == 2 ? WASMVM_POOL_PIN | WASMVM_POOL_ROUTE : c->pool == 3 ? WASMVM_POOL_ROUTE :
+                    c->pool == 4 ? WASMVM_POOL_ROUTE | WASMVM_POOL_IO_URING : 0;
+        pools[c->pool] = wasmvm_pool_create(2, 2, flags, options, c->pool >= 3 ? bench_wasi_setup : bench_pool_setup);
+    }
+    if (latency_cap < c->iters) {
+        free(latency);
+        latency = malloc(c->iters * sizeof(uint64_t));
+        latency_cap = latency ? c->iters : 0;
+    }
+    if (pools[c->pool] == NULL || latency == NULL || mods[3] == NULL) return 0;
+    BenchPoolClient clients[BENCH_POOL_CLIENTS];
+    int per_client = c->iters / BENCH_POOL_CLIENTS, started = 0;
+    uint64_t start = bench_now_ns();
+    for (int t = 0; t < BENCH_POOL_CLIENTS; t++) {
+        clients[t] = (BenchPoolClient){ c, pools[c->pool], mods, t, per_client, latency + t * per_client, 0 };
+        if (pthread_create(&clients[t].thread, NULL, bench_pool_client, &clients[t]) != 0) break;
+        started++;
+    }
+    for (int t = 0; t < started; t++) pthread_join(clients[t].thread, NULL);
+    *result = started == BENCH_POOL_CLIENTS ? clients[0].result : -1;
+    for (int t = 1; t < started; t++) {
+        if (clients[t].result != clients[0].result) *result = -1;
+    }
+    uint64_t total = bench_now_ns() - start;
+    int n = per_client * started;
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    bench_p99_ns = n ? (double)latency[n * 99 / 100] : 0.0;
+    return total;
+}
+
+uint64_t bench_once(BenchCase *c, int32_t *result) {
+    WasmVM *vm = &bench_vm;
+    if (c->batch) return bench_once_batch(c, result);
+    if (c->parse) return bench_once_parse(c, result);
+    if (c->data) return bench_once_data(c, result);
+    if (c->pool) return bench_once_pool(c, result);
+    uint64_t start = bench_now_ns();
+    if (c->export_name == NULL) {
+        for (int i = 0; i < c->iters; i++) {
+            bench_instantiate(vm);
+        }
+        *result = (int32_t)vm->func_count;
+    } else {
+        ExportFunc *f = find_export(vm, c->export_name);
+        for (int i = 0; i < c->iters; i++) {
+            if (c->fresh) {
+                bench_instantiate(vm);
+                f = find_export(vm, c->export_name);
+            }
+            *result = bench_invoke(vm, f, c->arg);
+            if (c->reset) vm_reset(vm);
+        }
+    }
+    return bench_now_ns() - start;
+}
+
+// dTLB のミス (読み込み・書き込み) を数えるカウンタを開く。使えなければ -1
+int bench_open_dtlb(int op) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t bench_read_counters(int *fds, int n) {
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t v;
+        if (fds[i] >= 0 && read(fds[i], &v, sizeof(v)) == sizeof(v)) total += v;
+    }
+    return total;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int bench_main(int argc, char *argv[]) {
+    int warmup = 2, repeats = 7;
+    int filter_start = 1;
+    for (;;) {
+        if (filter_start + 1 < argc && strcmp(argv[filter_start], "-r") == 0) {
+            repeats = atoi(argv[filter_start + 1]);
+            if (repeats < 1) repeats = 1;
+            filter_start += 2;
+        } else if (filter_start < argc && strcmp(argv[filter_start], "-O") == 0) {
+            bench_optimize = 1;
+            filter_start++;
+        } else if (filter_start < argc && strcmp(argv[filter_start], "-J") == 0) {
+            bench_jit = 2;
+            filter_start++;
+        } else if (filter_start < argc && strcmp(argv[filter_start], "-L") == 0) {
+            bench_lazy = 1;
+            filter_start++;
+        } else if (filter_start < argc && strcmp(argv[filter_start], "-T") == 0) {
+            bench_tos = 1;
+            filter_start++;
+        } else if (filter_start + 1 < argc && strcmp(argv[filter_start], "-M") == 0) {
+            const char *p = argv[filter_start + 1];
+            if (strcmp(p, "thp") == 0) bench_mem_policy |= VM_MEM_THP;
+            else if (strcmp(p, "hugetlb") == 0) bench_mem_policy |= VM_MEM_HUGETLB;
+            else if (strcmp(p, "numa") == 0) bench_mem_policy |= VM_MEM_NUMA_LOCAL;
+            else if (strcmp(p, "guard") == 0) bench_mem_policy |= VM_MEM_GUARD;
+            else { printf("unknown memory policy: %s\n", p); return 1; }
+            filter_start += 2;
+        } else {
+            break;
+        }
+    }
+
+    // dTLB のミス数 (perf_event_open が使えなければ -1 を出す)
+    int dtlb_fds[2] = {bench_open_dtlb(PERF_COUNT_HW_CACHE_OP_READ), bench_open_dtlb(PERF_COUNT_HW_CACHE_OP_WRITE)};
+    int have_dtlb = dtlb_fds[0] >= 0 || dtlb_fds[1] >= 0;
+    static const char *const backing_names[] = {"normal", "thp", "hugetlb"};
+
+    int failed = 0;
+    for (BenchCase *c = bench_cases; c->name != NULL; c++) {
+        if (filter_start < argc) {
+            int selected = 0;
+            for (int i = filter_start; i < argc; i++) {
+                if (strcmp(argv[i], c->name) == 0) selected = 1;
+            }
+            if (!selected) continue;
+        }
+
+        bench_instantiate(&bench_vm);
+        if (c->reset) vm_snapshot(&bench_vm);
+        int32_t result = 0;
+        for (int i = 0; i < warmup; i++) {
+            bench_once(c, &result);
+        }
+
+        uint64_t times[64];
+        if (repeats > 64) repeats = 64;
+        uint64_t insns = 0, dtlb = 0;
+        size_t allocs = 0;
+        for (int r = 0; r < repeats; r++) {
+            bench_vm.insn_count = 0;
+            size_t allocs_before = vm_alloc_count;
+            uint64_t dtlb_before = bench_read_counters(dtlb_fds, 2);
+            times[r] = bench_once(c, &result);
+            dtlb = bench_read_counters(dtlb_fds, 2) - dtlb_before;
+            insns = bench_vm.insn_count;
+            allocs = vm_alloc_count - allocs_before;
+        }
+        qsort(times, repeats, sizeof(times[0]), compare_u64);
+
+        double ns_per_op = (double)times[repeats / 2] / c->iters;
+        double insns_per_op = (double)insns / c->iters;
+        int ok = (result == c->expected);
+        if (!ok) failed++;
+        printf("{\"bench\":\"%s\",\"label\":\"%s\",\"opt\":%d,\"jit\":%d,\"lazy\":%d,\"tos\":%d,\"mem\":\"%s\",\"guard\":%d,"
+               "\"arg\":%d,\"iters\":%d,\"repeats\":%d,"
+               "\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f,\"insns_per_op\":%.0f,\"insns_per_sec\":%.0f,"
+               "\"allocs_per_op\":%.2f,\"dtlb_misses_per_op\":%.1f,\"bytes_per_op\":%zu,\"p99_ns\":%.0f,\"result\":%d,\"ok\":%s}\n",
+               c->name, BENCH_LABEL, bench_optimize, bench_jit, bench_lazy, bench_tos, backing_names[bench_vm.memory_backing],
+               bench_vm.memory_reserve_size != 0,
+               c->arg, c->iters, repeats,
+               ns_per_op, (double)times[0] / c->iters, insns_per_op,
+               ns_per_op > 0 ? insns_per_op * 1e9 / ns_per_op : 0.0,
+               (double)allocs / c->iters, have_dtlb ? (double)dtlb / c->iters : -1.0,
+               c->parse ? bench_parse_bytes : (size_t)0, c->pool ? bench_p99_ns : 0.0, result, ok ? "true" : "false");
+        fflush(stdout);
+    }
+    return failed ? 1 : 0;
+}
+#endif
+
+typedef struct {
+    const char *name;
+    void (*func)(void);
+} TestEntry;
+
+TestEntry tests[] = {
+    {"1", test1},
+    {"2", test2},
+    {"3", test3},
+    {"4", test4},
+    {NULL, NULL}
+};
+
+int main(int argc, char *argv[]) {
+#if VM_BENCH
+    return bench_main(argc, argv);
+#endif
+#if VM_FLIGHT && VM_FLIGHT_DECODE
+    return flight_decode_main(argc, argv);
+#endif
+
+    if (argc < 2) {
+        // printf("Usage: %s [test numbers]\n", argv[0]);
+        // return 1;
+    } else {
+        for (int i = 1; i < argc; i++) {
+            int found = 0;
+            for (int j = 0; tests[j].name != NULL; j++) {
+                if (strcmp(argv[i], tests[j].name) == 0) {
+                    tests[j].func();
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found) {
+                printf("Unknown test: %s\n", argv[i]);
+            }
+        }
+    }
+    
+    if (argc >= 2) {
+        return 0;
+    }
 
     WasmVM vm;
-    // --- テストケース2: 除算 ---
-    uint8_t code1[] = {
-        0x41, 0x0A,       // i32.const 10    ; 定数 10 をスタックに積む
-        0x41, 0x02,       // i32.const 2     ; 定数 2 をスタックに積む
-        0x6D,             // i32.div_s       ; スタックの2つの値を符号付き整数で割る (10 / 2)
-        0x0B              // end
+
+    // --- テストケース7: 型セクション、インポート/エクスポートを含むWasmモジュール ---
+    printf("--- Test Case 7: Full module parsing and execution ---\n");
+    uint8_t wasm_module[] = {
+        // Magic + Version
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+        // Section 1: Type
+        0x01, 0x0e, 0x03, // Section size 14, 3 types
+        // type 0: (i32, i32) -> i32 (for imported_add)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f,
+        // type 1: (i32) -> () (for print_i32)
+        0x60, 0x01, 0x7f, 0x00,
+        // type 2: () -> () (for main_add)
+        0x60, 0x00, 0x00,
+        // Section 2: Import
+        0x02, 0x1b, 0x02, // Section size 27, 2 imports
+        // import 0: "env"."add" (type 0)
+        0x03, 'e', 'n', 'v', 0x03, 'a', 'd', 'd', 0x00, 0x00,
+        // import 1: "env"."print_i32" (type 1)
+        0x03, 'e', 'n', 'v', 0x09, 'p', 'r', 'i', 'n', 't', '_', 'i', '3', '2', 0x00, 0x01,
+        // Section 3: Function
+        0x03, 0x02, 0x01, 0x02, // Section size 2, 1 function, type_idx 2
+        // Section 7: Export
+        0x07, 0x0c, 0x01, // Section size 12, 1 export
+        // export "main_add" -> func_idx 2 (0:import, 1:import, 2:internal)
+        0x08, 'm', 'a', 'i', 'n', '_', 'a', 'd', 'd', 0x00, 0x02,
+        // Section 10: Code
+        0x0a, 0x0f, 0x01, // Section size 15, 1 function body
+        // func body 0 (main_add): (size 13 -> 11)
+        0x0d, // body size 13
+        0x00, // 0 locals
+        0x41, 0x0a,       // i32.const 10
+        0x41, 0x14,       // i32.const 20
+        0x10, 0x00,       // call 0 (imported "add")
+        0x41, 0x05,       // i32.const 5
+        0x6a,             // i32.add
+        0x10, 0x01,       // call 1 (imported "print_i32")
+        0x0B
+    };
+
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_module;
+    vm.size = sizeof(wasm_module);
+
+    // 読み込んだバイト列をダンプ
+    dump_wasm_code(vm.code, vm.size);
+
+    // 1. モジュールをパース
+    parse_sections(&vm);
+
+    // --- ADD: 実行開始前のプロローグ処理 ---
+    ExportFunc *f_main = find_export(&vm, "main_add");
+    if (f_main) {
+        printf("Executing exported function 'main_add'...\n");
+        vm.pc = vm.func_frames[f_main->func_idx].body_pc;
+    }
+    // --- END ADD ---
+
+    // 2. ホスト関数を登録
+    vm_register_import(&vm, "env", "add", imported_add);
+    vm_register_import(&vm, "env", "print_i32", print_i32);
+
+    // 3. エクスポートされた関数を探して実行
+    ExportFunc *f = find_export(&vm, "main_add");
+    if (f) {
+        // 実行開始PCはプロローグ処理で設定済み
+        run(&vm);
+        printf("Execution finished.\n");
+        vm_teardown(&vm);
+    } else {
+        printf("Export function 'main_add' not found.\n");
+    }
+    printf("--------------------\n");
+
+    // ファイルから読み込んで実行するデモ (以前の Test Case 8〜10) は、ライブラリの API を使う demo.c に移した
+
+    // --- テストケース11: 再帰呼び出しによるフィボナッチ数の計算 ---
+    printf("--- Test Case 11: Recursive Fibonacci from file ---\n");
+    uint8_t wasm_fib_module[] = {
+        // Magic + Version
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+        // Section 1: Type
+        0x01, 0x06, 0x01, // Section size 6, 1 type
+        // type 0: (i32) -> i32
+        0x60, 0x01, 0x7f, 0x01, 0x7f,
+        // Section 3: Function
+        0x03, 0x02, 0x01, 0x00, // Section size 2, 1 function, type_idx 0
+        // Section 7: Export
+        0x07, 0x07, 0x01, // Section size 7, 1 export
+        // export "fib" -> func_idx 0
+        0x03, 'f', 'i', 'b', 0x00, 0x00,
+        // Section 10: Code
+        0x0a, 0x1e, 0x01, // Section size 30, 1 function body
+        // func body 0 (fib):
+        0x1c, // body size 28
+        0x00, // 0 locals
+        // if (n <= 1) return n;
+        0x20, 0x00,       // local.get 0
+        0x41, 0x01,       // i32.const 1
+        0x4d,             // i32.le_u (or 4c for le_s)
+        0x04, 0x7f,       // if (result i32)
+        0x20, 0x00,       //   local.get 0
+        // else return fib(n-1) + fib(n-2);
+        0x05,             // else
+        0x20, 0x00,       //   local.get 0
+        0x41, 0x01,       //   i32.const 1
+        0x6b,             //   i32.sub
+        0x10, 0x00,       //   call 0 (fib)
+        0x20, 0x00,       //   local.get 0
+        0x41, 0x02,       //   i32.const 2
+        0x6b,             //   i32.sub
+        0x10, 0x00,       //   call 0 (fib)
+        0x6a,             //   i32.add
+        0x0b,             // end
+        0x0b              // end of function
+    };
+
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_fib_module;
+    vm.size = sizeof(wasm_fib_module);
+
+    // 1. モジュールをパース
+    parse_sections(&vm);
+
+    // --- ADD: 実行開始前のプロローグ処理 ---
+    ExportFunc *f_fib_main = find_export(&vm, "fib");
+    if (f_fib_main) {
+        printf("Executing exported function 'fib(5)'...\n");
+        vm.pc = vm.func_frames[f_fib_main->func_idx].body_pc;
+        vm.stack[vm.sp++] = 5; // 引数として 5 をスタックに積む
+
+        // 関数のプロローグ: 引数をローカル変数へ
+        for (int i = vm.func_frames[f_fib_main->func_idx].param_count - 1; i >= 0; i--) {
+            vm.locals[i] = vm.stack[--vm.sp];
+        }
+    }
+    // --- END ADD ---
+
+    // 2. エクスポートされた関数を探して実行
+    ExportFunc *f_fib = find_export(&vm, "fib");
+    if (f_fib) {
+        run(&vm);
+        printf("fib(5) = %d (expected 5)\n", vm.stack[vm.sp-1]);
+        vm_teardown(&vm);
+    } else {
+        printf("Export function 'fib' not found.\n");
+    }
+#if VM_PROFILE
+    // プロファイラを公開 API から使う。fib(5) ではサンプルが取れないので、CPU 時間で数十ミリ秒かかる fib(27) を測る
+    {
+        wasmvm_module *prof_m = wasmvm_module_load(wasm_fib_module, sizeof(wasm_fib_module));
+        wasmvm_instance *prof_inst = prof_m ? wasmvm_instantiate(prof_m, 0) : NULL;
+        wasmvm_export *prof_f = prof_inst ? wasmvm_find_export(prof_inst, "fib") : NULL;
+        char prof_path[] = "/tmp/wasmvm-prof-XXXXXX";
+        int prof_fd = mkstemp(prof_path);
+        int32_t prof_n = 27, prof_r = -1;
+        int prof_lines = -1, prof_has_fib = 0;
+        if (prof_f && prof_fd >= 0 && wasmvm_profile_start(prof_inst, 1000) == 0) {
+            wasmvm_invoke(prof_inst, prof_f, &prof_n, 1, &prof_r);
+            wasmvm_profile_stop();
+            prof_lines = wasmvm_profile_dump(prof_inst, prof_path);
+            char prof_buf[256];
+            FILE *prof_in = fopen(prof_path, "r");
+            while (prof_in && fgets(prof_buf, sizeof(prof_buf), prof_in)) {
+                if (strncmp(prof_buf, "fib;", 4) == 0) prof_has_fib = 1;
+            }
+            if (prof_in) fclose(prof_in);
+        }
+        if (prof_fd >= 0) {
+            close(prof_fd);
+            unlink(prof_path);
+        }
+        printf("profiled fib(27) = %d, folded stacks: %s, fib sampled: %s (expected 196418, yes, yes)\n",
+               prof_r, prof_lines > 0 ? "yes" : "no", prof_has_fib ? "yes" : "no");
+        wasmvm_instance_free(prof_inst);
+        wasmvm_module_free(prof_m);
+    }
+#endif
+    printf("--------------------\n");
+
+    // --- テストケース12: テーブルと call_indirect ---
+    printf("--- Test Case 12: Tables and call_indirect ---\n");
+    uint8_t wasm_table_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x19, // section size 25
+        0x04, // 4 types
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 1: (i32) -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 2: (i32 i32) -> (i32)
+        0x60, 0x03, 0x7f, 0x7f, 0x7f, 0x01, 0x7f, // type 3: (i32 i32 i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x06, // section size 6
+        0x05, // 5 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        0x02, // func 2: type 2
+        0x01, // func 3: type 1
+        0x03, // func 4: type 3
+        // Section 4: Table
+        0x04, 0x04, // section size 4
+        0x01, // 1 tables
+        0x70, 0x00, 0x04, // funcref, min 4
+        // Section 7: Export
+        0x07, 0x09, // section size 9
+        0x01, // 1 exports
+        0x05, 0x61, 0x70, 0x70, 0x6c, 0x79, 0x00, 0x04, // export "apply" -> func 4
+        // Section 9: Element
+        0x09, 0x0a, // section size 10
+        0x01, // 1 element segments
+        0x00, 0x41, 0x00, 0x0b, 0x04, 0x00, 0x01, 0x02, 0x03, // table 0, offset 0, funcs [0, 1, 2, 3]
+        // Section 10: Code
+        0x0a, 0x2d, // section size 45
+        0x05, // 5 function bodies
+        // func 0: add(a, b)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6a,                   // i32.add
+            0x0b,                   // end
+        // func 1: sub(a, b)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6b,                   // i32.sub
+            0x0b,                   // end
+        // func 2: mul(a, b) (type 2 は type 0 と同じ構造)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6c,                   // i32.mul
+            0x0b,                   // end
+        // func 3: neg(a) (型が違う)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x41, 0x00,             // i32.const 0
+            0x20, 0x00,             // local.get 0
+            0x6b,                   // i32.sub
+            0x0b,                   // end
+        // func 4: apply(op, a, b) = table[op](a, b)
+        0x0b, // body size 11
+        0x00, // 0 locals
+            0x20, 0x01,             // local.get 1
+            0x20, 0x02,             // local.get 2
+            0x20, 0x00,             // local.get 0
+            0x11, 0x00, 0x00,       // call_indirect 0 0
+            0x0b,                   // end
+    };
+
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_table_module;
+    vm.size = sizeof(wasm_table_module);
+    parse_sections(&vm);
+
+    ExportFunc *f_apply = find_export(&vm, "apply");
+    if (f_apply) {
+        // {op, a, b, 期待値}。op=3 は型不一致、op=4 は範囲外でトラップする
+        int32_t apply_cases[][4] = { {0, 7, 5, 12}, {1, 7, 5, 2}, {2, 7, 5, 35}, {3, 7, 5, 0}, {4, 7, 5, 0} };
+        for (size_t k = 0; k < sizeof(apply_cases) / sizeof(apply_cases[0]); k++) {
+            vm.sp = 0; vm.call_sp = 0; vm.frame_base = 0;
+            vm.pc = vm.func_frames[f_apply->func_idx].body_pc;
+            for (int i = 0; i < 3; i++) {
+                vm.locals[i] = apply_cases[k][i];
+            }
+            vm.returned = 0;
+            run(&vm);
+            // トラップしたら returned は 0 のまま
+            char got[16], want[16];
+            if (vm.returned) snprintf(got, sizeof(got), "%d", vm.stack[vm.sp-1]);
+            else snprintf(got, sizeof(got), "trap");
+            if (apply_cases[k][0] < 3) snprintf(want, sizeof(want), "%d", apply_cases[k][3]);
+            else snprintf(want, sizeof(want), "trap");
+            printf("apply(%d, %d, %d) = %s (expected %s)\n", apply_cases[k][0], apply_cases[k][1], apply_cases[k][2], got, want);
+        }
+        vm_teardown(&vm);
+    } else {
+        printf("Export function 'apply' not found.\n");
+    }
+    printf("--------------------\n");
+
+    // --- テストケース13: br_table (ロード時に作った分岐表で分岐する) ---
+    printf("--- Test Case 13: br_table ---\n");
+    uint8_t wasm_br_table_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x06, // section size 6
+        0x01, // 1 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x03, // section size 3
+        0x02, // 2 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        // Section 7: Export
+        0x07, 0x14, // section size 20
+        0x02, // 2 exports
+        0x08, 0x63, 0x6c, 0x61, 0x73, 0x73, 0x69, 0x66, 0x79, 0x00, 0x00, // export "classify" -> func 0
+        0x05, 0x63, 0x61, 0x72, 0x72, 0x79, 0x00, 0x01, // export "carry" -> func 1
+        // Section 10: Code
+        0x0a, 0x3a, // section size 58
+        0x02, // 2 function bodies
+        // func 0: classify(x) — switch (x) { case 0: 100; case 1: 200; case 2: 300; default: 999 }
+        0x25, // body size 37
+        0x00, // 0 locals
+            0x02, 0x40,             // block
+            0x02, 0x40,             //   block
+            0x02, 0x40,             //     block
+            0x02, 0x40,             //       block
+            0x20, 0x00,             //         local.get 0
+            0x0e, 0x03, 0x00, 0x01, 0x02, 0x03, //         br_table 0 1 2 3
+            0x0b,                   //       end
+            0x41, 0xe4, 0x00,       //       i32.const 100
+            0x0f,                   //       return
+            0x0b,                   //     end
+            0x41, 0xc8, 0x01,       //     i32.const 200
+            0x0f,                   //     return
+            0x0b,                   //   end
+            0x41, 0xac, 0x02,       //   i32.const 300
+            0x0f,                   //   return
+            0x0b,                   // end
+            0x41, 0xe7, 0x07,       // i32.const 999
+            0x0b,                   // end
+        // func 1: carry(x) — 7 を捨てて 42 を持ち出し +1 する (43)
+        0x12, // body size 18
+        0x00, // 0 locals
+            0x02, 0x7f,             // block i32
+            0x41, 0x07,             //   i32.const 7
+            0x41, 0x2a,             //   i32.const 42
+            0x20, 0x00,             //   local.get 0
+            0x0e, 0x01, 0x00, 0x00, //   br_table 0 0
+            0x0b,                   // end
+            0x41, 0x01,             // i32.const 1
+            0x6a,                   // i32.add
+            0x0b,                   // end
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code1; vm.size = sizeof(code1);
-    vm.pc = 0;
-    run(&vm);
-    printf("10 / 2 = %d (expected 5)\n", vm.stack[0]);
-    printf("--------------------\n");
 
-    // --- テストケース2.1: ctz ---
-    uint8_t code_ctz[] = {
-        0x41, 0x80, 0x80, 0x80, 0x04, // i32.const 8388608
-        0x68,                         // i32.ctz
-        0x0B                          // end
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_br_table_module;
+    vm.size = sizeof(wasm_br_table_module);
+    parse_sections(&vm);
+
+    // {関数名, 引数, 期待値}。範囲外のインデックス (3, 100, -1) は default へ
+    struct { const char *name; int32_t arg; int32_t expected; } br_table_cases[] = {
+        {"classify", 0, 100}, {"classify", 1, 200}, {"classify", 2, 300},
+        {"classify", 3, 999}, {"classify", 100, 999}, {"classify", -1, 999},
+        {"carry", 0, 43}, {"carry", 5, 43},
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_ctz; vm.size = sizeof(code_ctz);
-    vm.pc = 0;
-    run(&vm);
-    printf("ctz 8388608 = %d (expected 23)\n", vm.stack[0]);
+    for (size_t k = 0; k < sizeof(br_table_cases) / sizeof(br_table_cases[0]); k++) {
+        ExportFunc *f = find_export(&vm, br_table_cases[k].name);
+        if (!f) {
+            printf("Export function '%s' not found.\n", br_table_cases[k].name);
+            continue;
+        }
+        vm.sp = 0; vm.call_sp = 0; vm.frame_base = 0;
+        vm.pc = vm.func_frames[f->func_idx].body_pc;
+        vm.locals[0] = br_table_cases[k].arg;
+        run(&vm);
+        printf("%s(%d) = %d, sp=%d (expected %d, sp=1)\n", br_table_cases[k].name, br_table_cases[k].arg,
+               vm.stack[vm.sp-1], vm.sp, br_table_cases[k].expected);
+    }
+    vm_teardown(&vm);
     printf("--------------------\n");
 
-    // --- テストケース2.2: clz ---
-    uint8_t code_clz[] = {
-        0x41, 0x80, 0x80, 0x80, 0x04, // i32.const 8388608
-        0x67,                         // i32.clz
-        0x0B                          // end
+    // --- テストケース14: グローバル変数 (__stack_pointer と不変グローバルの畳み込み) ---
+    printf("--- Test Case 14: Globals ---\n");
+    uint8_t wasm_global_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x06, // section size 6
+        0x01, // 1 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        // Section 2: Import
+        0x02, 0x0d, // section size 13
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x04, 0x62, 0x61, 0x73, 0x65, 0x03, 0x7f, 0x00, // import "env"."base" (global 0: const i32)
+        // Section 3: Function
+        0x03, 0x02, // section size 2
+        0x01, // 1 functions
+        0x00, // func 0: type 0
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
+        // Section 6: Global
+        0x06, 0x13, // section size 19
+        0x03, // 3 globals
+        0x7f, 0x00, 0x41, 0x0a, 0x0b, // global 1: const i32 = 10 (畳み込まれる)
+        0x7f, 0x00, 0x41, 0xa0, 0x8d, 0x06, 0x0b, // global 2: const i32 = 100000 (i32.const が global.get の 2 バイトに収まらないので畳み込まない)
+        0x7f, 0x01, 0x41, 0x80, 0x08, 0x0b, // global 3: mut i32 = 1024 (__stack_pointer)
+        // Section 7: Export
+        0x07, 0x1b, // section size 27
+        0x02, // 2 exports
+        0x05, 0x66, 0x72, 0x61, 0x6d, 0x65, 0x00, 0x00, // export "frame" -> func 0
+        0x0f, 0x5f, 0x5f, 0x73, 0x74, 0x61, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x69, 0x6e, 0x74, 0x65, 0x72, 0x03, 0x03, // export "__stack_pointer" -> global 3
+        // Section 10: Code
+        0x0a, 0x27, // section size 39
+        0x01, // 1 function bodies
+        // func 0: frame(n) — スタックポインタで 16 バイトのフレームを確保し n + 10 + 100000 + base を返す
+        0x25, // body size 37
+        0x00, // 0 locals
+            0x23, 0x03,             // global.get 3
+            0x41, 0x10,             // i32.const 16
+            0x6b,                   // i32.sub
+            0x24, 0x03,             // global.set 3
+            0x23, 0x03,             // global.get 3
+            0x20, 0x00,             // local.get 0
+            0x36, 0x02, 0x00,       // i32.store 0
+            0x23, 0x03,             // global.get 3
+            0x28, 0x02, 0x00,       // i32.load 0
+            0x23, 0x01,             // global.get 1
+            0x6a,                   // i32.add
+            0x23, 0x02,             // global.get 2
+            0x6a,                   // i32.add
+            0x23, 0x00,             // global.get 0
+            0x6a,                   // i32.add
+            0x23, 0x03,             // global.get 3
+            0x41, 0x10,             // i32.const 16
+            0x6a,                   // i32.add
+            0x24, 0x03,             // global.set 3
+            0x0b,                   // end
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_clz; vm.size = sizeof(code_clz);
-    vm.pc = 0;
-    run(&vm);
-    printf("clz 8388608 = %d (expected 8)\n", vm.stack[0]);
+
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_global_module;
+    vm.size = sizeof(wasm_global_module);
+    parse_sections(&vm);
+    vm_register_global_import(&vm, "env", "base", 7);
+
+    ExportFunc *f_frame = find_export(&vm, "frame");
+    int32_t *stack_pointer = find_global_export(&vm, "__stack_pointer");
+    if (f_frame && stack_pointer) {
+        size_t body_pc = vm.func_frames[f_frame->func_idx].body_pc;
+        printf("global.get 1 -> opcode 0x%02X (expected 0x41, folded)\n", vm.code[body_pc + 19]);
+        printf("global.get 2 -> opcode 0x%02X (expected 0x23, not folded)\n", vm.code[body_pc + 22]);
+        for (int32_t n = 5; n <= 6; n++) {
+            vm.sp = 0; vm.call_sp = 0; vm.frame_base = 0;
+            vm.pc = body_pc;
+            vm.locals[0] = n;
+            run(&vm);
+            printf("frame(%d) = %d (expected %d), __stack_pointer = %d (expected 1024), memory[1008] = %d (expected %d)\n",
+                   n, vm.stack[vm.sp-1], n + 10 + 100000 + 7, *stack_pointer, vm.memory[1008], n);
+        }
+    } else {
+        printf("Export 'frame' or '__stack_pointer' not found.\n");
+    }
+    vm_teardown(&vm);
     printf("--------------------\n");
 
-    // --- テストケース2.3: div_s ---
-    uint8_t code2[] = {
-        0x41, 0x7F,       // i32.const -1   ; 定数 -1 をスタックに積む（0x7F は 2の補数で -1）
-        0x41, 0x01,       // i32.const 1    ; 定数 1 をスタックに積む
-        0x6D,             // i32.div_s      ; スタックの2つの値を符号付き整数で割る (-1 / 1)
-        0x0B
+    // --- テストケース15: 末尾呼び出し (call_stack の上限 64 を超える深さの再帰) ---
+    printf("--- Test Case 15: Tail calls ---\n");
+    uint8_t wasm_tail_call_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x0c, // section size 12
+        0x02, // 2 types
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 1: (i32) -> (i32)
+        // Section 2: Import
+        0x02, 0x0b, // section size 11
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x03, 0x61, 0x64, 0x64, 0x00, 0x00, // import "env"."add" (func)
+        // Section 3: Function
+        0x03, 0x05, // section size 5
+        0x04, // 4 functions
+        0x00, // func 1: type 0
+        0x01, // func 2: type 1
+        0x01, // func 3: type 1
+        0x00, // func 4: type 0
+        // Section 4: Table
+        0x04, 0x04, // section size 4
+        0x01, // 1 tables
+        0x70, 0x00, 0x02, // funcref, min 2
+        // Section 7: Export
+        0x07, 0x25, // section size 37
+        0x04, // 4 exports
+        0x03, 0x73, 0x75, 0x6d, 0x00, 0x01, // export "sum" -> func 1
+        0x07, 0x69, 0x73, 0x5f, 0x65, 0x76, 0x65, 0x6e, 0x00, 0x02, // export "is_even" -> func 2
+        0x06, 0x69, 0x73, 0x5f, 0x6f, 0x64, 0x64, 0x00, 0x03, // export "is_odd" -> func 3
+        0x08, 0x61, 0x64, 0x64, 0x5f, 0x74, 0x61, 0x69, 0x6c, 0x00, 0x04, // export "add_tail" -> func 4
+        // Section 9: Element
+        0x09, 0x08, // section size 8
+        0x01, // 1 element segments
+        0x00, 0x41, 0x00, 0x0b, 0x02, 0x02, 0x03, // table 0, offset 0, funcs [2, 3]
+        // Section 10: Code
+        0x0a, 0x4e, // section size 78
+        0x04, // 4 function bodies
+        // func 1: sum(n, acc) — n == 0 なら acc、そうでなければ return_call sum(n - 1, acc + n)
+        0x17, // body size 23
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x45,                   // i32.eqz
+            0x04, 0x40,             // if
+            0x20, 0x01,             //   local.get 1
+            0x0f,                   //   return
+            0x0b,                   // end
+            0x20, 0x00,             // local.get 0
+            0x41, 0x01,             // i32.const 1
+            0x6b,                   // i32.sub
+            0x20, 0x01,             // local.get 1
+            0x20, 0x00,             // local.get 0
+            0x6a,                   // i32.add
+            0x12, 0x01,             // return_call 1
+            0x0b,                   // end
+        // func 2: is_even(n) — n == 0 なら 1、そうでなければ table[1] (is_odd) へ末尾呼び出し
+        0x15, // body size 21
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x45,                   // i32.eqz
+            0x04, 0x40,             // if
+            0x41, 0x01,             //   i32.const 1
+            0x0f,                   //   return
+            0x0b,                   // end
+            0x20, 0x00,             // local.get 0
+            0x41, 0x01,             // i32.const 1
+            0x6b,                   // i32.sub
+            0x41, 0x01,             // i32.const 1
+            0x13, 0x01, 0x00,       // return_call_indirect 1
+            0x0b,                   // end
+        // func 3: is_odd(n) — n == 0 なら 0、そうでなければ table[0] (is_even) へ末尾呼び出し
+        0x15, // body size 21
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x45,                   // i32.eqz
+            0x04, 0x40,             // if
+            0x41, 0x00,             //   i32.const 0
+            0x0f,                   //   return
+            0x0b,                   // end
+            0x20, 0x00,             // local.get 0
+            0x41, 0x01,             // i32.const 1
+            0x6b,                   // i32.sub
+            0x41, 0x00,             // i32.const 0
+            0x13, 0x01, 0x00,       // return_call_indirect 1
+            0x0b,                   // end
+        // func 4: add_tail(a, b) — インポート関数 env.add への末尾呼び出し
+        0x08, // body size 8
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x12, 0x00,             // return_call 0
+            0x0b,                   // end
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code2; vm.size = sizeof(code2);
-    vm.pc = 0;
-    run(&vm);
-    printf("-1 / 1 = %d (expected -1)\n", vm.stack[0]);
-    printf("--------------------\n");
 
-    // --- テストケース2.4: rem_u ---
-    uint8_t code_rem_u[] = {
-        0x41, 0x0A,       // i32.const 10
-        0x41, 0x03,       // i32.const 3
-        0x70,             // i32.rem_u
-        0x0B
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_tail_call_module;
+    vm.size = sizeof(wasm_tail_call_module);
+    parse_sections(&vm);
+    vm_register_import(&vm, "env", "add", imported_add);
+
+    // {関数名, 引数1, 引数2, 期待値}
+    struct { const char *name; int32_t a, b; int32_t expected; } tail_call_cases[] = {
+        {"sum", 1000, 0, 500500}, {"is_even", 1001, 0, 0}, {"is_odd", 1001, 0, 1}, {"add_tail", 40, 2, 42},
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_rem_u; vm.size = sizeof(code_rem_u);
-    vm.pc = 0;
-    run(&vm);
-    printf("10 %% 3 = %d (expected 1)\n", vm.stack[0]);
+    for (size_t k = 0; k < sizeof(tail_call_cases) / sizeof(tail_call_cases[0]); k++) {
+        ExportFunc *f = find_export(&vm, tail_call_cases[k].name);
+        if (!f) {
+            printf("Export function '%s' not found.\n", tail_call_cases[k].name);
+            continue;
+        }
+        vm.sp = 0; vm.call_sp = 0; vm.frame_base = 0;
+        vm.pc = vm.func_frames[f->func_idx].body_pc;
+        vm.locals[0] = tail_call_cases[k].a;
+        vm.locals[1] = tail_call_cases[k].b;
+        run(&vm);
+        printf("%s(%d, %d) = %d, sp=%d, call_sp=%d (expected %d, sp=1, call_sp=0)\n", tail_call_cases[k].name,
+               tail_call_cases[k].a, tail_call_cases[k].b, vm.stack[vm.sp-1], vm.sp, vm.call_sp, tail_call_cases[k].expected);
+    }
+    vm_teardown(&vm);
     printf("--------------------\n");
 
-    // --- テストケース2.4: popcnt ---
-    uint8_t code_popcnt[] = {
-        0x41, 0x82, 0x01,      // i32.const 130 (10000010)
-        0x69,                  // i32.popcnt
-        0x0B
+    // --- テストケース16: マルチバリュー (複数の戻り値・パラメータ付きブロック) ---
+    printf("--- Test Case 16: Multi-value ---\n");
+    uint8_t wasm_multi_value_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x13, // section size 19
+        0x03, // 3 types
+        0x60, 0x02, 0x7f, 0x7f, 0x02, 0x7f, 0x7f, // type 0: (i32 i32) -> (i32 i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 1: (i32 i32) -> (i32)
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 2: (i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x06, // section size 6
+        0x05, // 5 functions
+        0x00, // func 0: type 0
+        0x01, // func 1: type 1
+        0x00, // func 2: type 0
+        0x02, // func 3: type 2
+        0x01, // func 4: type 1
+        // Section 7: Export
+        0x07, 0x2f, // section size 47
+        0x04, // 4 exports
+        0x0e, 0x71, 0x75, 0x6f, 0x74, 0x5f, 0x6d, 0x69, 0x6e, 0x75, 0x73, 0x5f, 0x72, 0x65, 0x6d, 0x00, 0x01, // export "quot_minus_rem" -> func 1
+        0x04, 0x73, 0x77, 0x61, 0x70, 0x00, 0x02, // export "swap" -> func 2
+        0x08, 0x73, 0x75, 0x6d, 0x5f, 0x6c, 0x6f, 0x6f, 0x70, 0x00, 0x03, // export "sum_loop" -> func 3
+        0x08, 0x61, 0x62, 0x73, 0x5f, 0x64, 0x69, 0x66, 0x66, 0x00, 0x04, // export "abs_diff" -> func 4
+        // Section 10: Code
+        0x0a, 0x57, // section size 87
+        0x05, // 5 function bodies
+        // func 0: divmod(a, b) -> (a / b, a % b)
+        0x0c, // body size 12
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6d,                   // i32.div_s
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6f,                   // i32.rem_s
+            0x0b,                   // end
+        // func 1: quot_minus_rem(a, b) — divmod の2つの結果をパラメータ付きブロックで受ける
+        0x0c, // body size 12
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x10, 0x00,             // call 0
+            0x02, 0x01,             // block (type 1)
+            0x6b,                   //   i32.sub
+            0x0b,                   // end
+            0x0b,                   // end
+        // func 2: swap(a, b) -> (b, a) — br で2値を持ち出し、ブロック内の a, b, 99 は捨てる
+        0x12, // body size 18
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x02, 0x00,             // block (type 0)
+            0x41, 0xe3, 0x00,       //   i32.const 99
+            0x20, 0x01,             //   local.get 1
+            0x20, 0x00,             //   local.get 0
+            0x0c, 0x00,             //   br 0
+            0x0b,                   // end
+            0x0b,                   // end
+        // func 3: sum_loop(n) — 累計をループのパラメータとして持ち回る (n + ... + 1)
+        0x13, // body size 19
+        0x00, // 0 locals
+            0x41, 0x00,             // i32.const 0
+            0x03, 0x02,             // loop (type 2)
+            0x20, 0x00,             //   local.get 0
+            0x6a,                   //   i32.add
+            0x20, 0x00,             //   local.get 0
+            0x41, 0x01,             //   i32.const 1
+            0x6b,                   //   i32.sub
+            0x22, 0x00,             //   local.tee 0
+            0x0d, 0x00,             //   br_if 0
+            0x0b,                   // end
+            0x0b,                   // end
+        // func 4: abs_diff(a, b) — パラメータ付き if/else
+        0x14, // body size 20
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x48,                   // i32.lt_s
+            0x04, 0x01,             // if (type 1)
+            0x6b,                   //   i32.sub
+            0x41, 0x7f,             //   i32.const -1
+            0x6c,                   //   i32.mul
+            0x05,                   // else
+            0x6b,                   //   i32.sub
+            0x0b,                   // end
+            0x0b,                   // end
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_popcnt; vm.size = sizeof(code_popcnt);
-    vm.pc = 0;
-    run(&vm);
-    printf("popcnt 130 = %d (expected 2)\n", vm.stack[0]);
-    printf("--------------------\n");
 
-}
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_multi_value_module;
+    vm.size = sizeof(wasm_multi_value_module);
+    parse_sections(&vm);
 
-// control flow
-void test3() {
-    WasmVM vm;
-    // --- テストケース4: ループ (0から4の合計を計算) ---
-    uint8_t code_loop[] = {
-        0x41, 0x00, 0x21, 0x00,       // i32.const 0; local.set 0  → i = 0
-        0x41, 0x00, 0x21, 0x01,       // i32.const 0; local.set 1  → sum = 0
-        0x02, 0x40,                    // block (外側ブロック)
-            0x03, 0x40,                // loop (ループ開始)
-                0x20, 0x00,            // local.get 0  → i
-                0x41, 0x05,            // i32.const 5
-                0x4E,                  // i32.ge_s     → i >= 5 ?
-                0x0D, 0x01,            // br_if 1      → 外側ブロックにジャンプしてループ終了
-                0x20, 0x01,            // local.get 1  → sum
-                0x20, 0x00,            // local.get 0  → i
-                0x6A,                  // i32.add      → sum + i
-                0x21, 0x01,            // local.set 1  → sum に保存
-                0x20, 0x00,            // local.get 0  → i
-                0x41, 0x01,            // i32.const 1
-                0x6A,                  // i32.add      → i + 1
-                0x21, 0x00,            // local.set 0  → i に保存
-                0x0C, 0x00,            // br 0         → loop の先頭に戻る
-            0x0B,
-        0x0B                         // end (外側ブロック終了)
+    // {関数名, 引数1, 引数2, 戻り値の数, 期待値...}
+    struct { const char *name; int32_t a, b; int nresults; int32_t expected[2]; } multi_value_cases[] = {
+        {"quot_minus_rem", 17, 5, 1, {1}}, {"swap", 1, 2, 2, {2, 1}}, {"sum_loop", 10, 0, 1, {55}},
+        {"abs_diff", 3, 10, 1, {7}}, {"abs_diff", 10, 3, 1, {7}},
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_loop; vm.size = sizeof(code_loop);
-    vm.pc = 0;
-    vm.block_stack[vm.block_sp++] = (Block){.end_pc = vm.size, .type = 2};
-    run(&vm);
-    printf("sum(0..4) = %d (expected 10)\n", vm.locals[1]);
+    for (size_t k = 0; k < sizeof(multi_value_cases) / sizeof(multi_value_cases[0]); k++) {
+        ExportFunc *f = find_export(&vm, multi_value_cases[k].name);
+        if (!f) {
+            printf("Export function '%s' not found.\n", multi_value_cases[k].name);
+            continue;
+        }
+        vm.sp = 0; vm.call_sp = 0; vm.frame_base = 0;
+        vm.pc = vm.func_frames[f->func_idx].body_pc;
+        vm.locals[0] = multi_value_cases[k].a;
+        vm.locals[1] = multi_value_cases[k].b;
+        run(&vm);
+        printf("%s(%d, %d) = [", multi_value_cases[k].name, multi_value_cases[k].a, multi_value_cases[k].b);
+        for (int i = 0; i < vm.sp; i++) printf(i ? ", %d" : "%d", vm.stack[i]);
+        printf("] (expected [");
+        for (int i = 0; i < multi_value_cases[k].nresults; i++) printf(i ? ", %d" : "%d", multi_value_cases[k].expected[i]);
+        printf("])\n");
+    }
+    vm_teardown(&vm);
     printf("--------------------\n");
 
-    // --- テストケース5: if/else ---
-    uint8_t code_if[] = {
-        0x20, 0x00,                 // local.get
-        0x45,                       // i32.eqz
-        0x04, 0x40,                 // if (void)
-        0x41, 0xef, 0x00,           // i32.const 111
-        0x05,                       // else
-        0x41, 0xde, 0x01,           // i32.const 222
-        0x0B
+    // --- テストケース17: スナップショットとリセット ---
+    printf("--- Test Case 17: Snapshot and reset ---\n");
+    uint8_t wasm_snapshot_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x07, // section size 7
+        0x01, // 1 types
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x02, // section size 2
+        0x01, // 1 functions
+        0x00, // func 0: type 0
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
+        // Section 6: Global
+        0x06, 0x06, // section size 6
+        0x01, // 1 globals
+        0x7f, 0x01, 0x41, 0x00, 0x0b, // global 0: mut i32 = 0 (calls)
+        // Section 7: Export
+        0x07, 0x10, // section size 16
+        0x02, // 2 exports
+        0x04, 0x70, 0x6f, 0x6b, 0x65, 0x00, 0x00, // export "poke" -> func 0
+        0x05, 0x63, 0x61, 0x6c, 0x6c, 0x73, 0x03, 0x00, // export "calls" -> global 0
+        // Section 10: Code
+        0x0a, 0x14, // section size 20
+        0x01, // 1 function bodies
+        // func 0: poke(addr, val) — memory[addr] = val して呼び出し回数を返す
+        0x12, // body size 18
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x36, 0x02, 0x00,       // i32.store 0
+            0x23, 0x00,             // global.get 0
+            0x41, 0x01,             // i32.const 1
+            0x6a,                   // i32.add
+            0x24, 0x00,             // global.set 0
+            0x23, 0x00,             // global.get 0
+            0x0b,                   // end
+        // Section 11: Data
+        0x0b, 0x0b, // section size 11
+        0x01, // 1 data segments
+        0x00, 0x41, 0x00, 0x0b, 0x05, 0x68, 0x65, 0x6c, 0x6c, 0x6f, // data: "hello" at 0
     };
-    
-    // param = 0 のとき (cond=true)
-    memset(&vm, 0, sizeof(vm)); vm.code = code_if; vm.size = sizeof(code_if); vm.locals[0] = 0;
-    vm.pc = 0;
-    run(&vm);
-    printf("if (0==0) result = %d (expected 111)\n", vm.stack[vm.sp-1]);
-    
-    // param = 1 のとき (cond=false)
-    memset(&vm, 0, sizeof(vm)); vm.code = code_if; vm.size = sizeof(code_if); vm.locals[0] = 1;
-    vm.pc = 0;
-    run(&vm);
-    printf("if (1==0) result = %d (expected 222)\n", vm.stack[vm.sp-1]);
+
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_snapshot_module;
+    vm.size = sizeof(wasm_snapshot_module);
+    parse_sections(&vm);
+
+    ExportFunc *f_poke = find_export(&vm, "poke");
+    int32_t *calls = find_global_export(&vm, "calls");
+    if (f_poke && calls && vm_snapshot(&vm) == 0) {
+        // 1回目のリクエスト: 2つのページに書き込む
+        int32_t pokes[][2] = { {0, 0x41414141}, {40000, 7} };
+        for (int i = 0; i < 2; i++) {
+            vm.pc = vm.func_frames[f_poke->func_idx].body_pc;
+            vm.locals[0] = pokes[i][0];
+            vm.locals[1] = pokes[i][1];
+            run(&vm);
+        }
+        printf("before reset: memory[0..5] = \"%.5s\", memory[40000] = %d, calls = %d (expected \"AAAAo\", 7, 2)\n",
+               (char *)vm.memory, vm.memory[40000], *calls);
+        vm_reset(&vm);
+        printf("after reset: memory[0..5] = \"%.5s\", memory[40000] = %d, calls = %d, sp = %d (expected \"hello\", 0, 0, 0)\n",
+               (char *)vm.memory, vm.memory[40000], *calls, vm.sp);
+        // リセット後のリクエストは初期状態から始まる
+        vm.pc = vm.func_frames[f_poke->func_idx].body_pc;
+        vm.locals[0] = 1;
+        vm.locals[1] = 0x6f6c6c4a; // "Jllo"
+        run(&vm);
+        printf("next request: poke(1, \"Jllo\") = %d, memory[0..5] = \"%.5s\" (expected 1, \"hJllo\")\n",
+               vm.stack[vm.sp-1], (char *)vm.memory);
+    } else {
+        printf("Snapshot test setup failed.\n");
+    }
+    vm_teardown(&vm);
     printf("--------------------\n");
-}
 
-// memory
-void test4() {
-    WasmVM vm;
-    // --- テストケース6: 線形メモリの read/write ---
-    uint8_t code_mem[] = {
-        0x41, 0x00,             // i32.const 0   -> addr = 0
-        0x41, 0xF8, 0x00,       // i32.const 120 -> val = 120 (sLEB128: 0xF8 0x00)
-        0x36, 0x02, 0x00,       // i32.store align=2 offset=0
-    
-        0x41, 0x00,             // i32.const 0   -> addr = 0
-        0x28, 0x02, 0x00,       // i32.load  align=2 offset=0
-        0x0B
+    // --- テストケース18: 共有メモリとアトミック命令 (4スレッド) ---
+    printf("--- Test Case 18: Shared memory and atomics ---\n");
+    uint8_t wasm_atomics_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x10, // section size 16
+        0x03, // 3 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x60, 0x00, 0x01, 0x7f, // type 1: () -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 2: (i32 i32) -> (i32)
+        // Section 2: Import
+        0x02, 0x10, // section size 16
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x06, 0x6d, 0x65, 0x6d, 0x6f, 0x72, 0x79, 0x02, 0x03, 0x01, 0x01, // import "env"."memory" (shared, min 1 max 1)
+        // Section 3: Function
+        0x03, 0x05, // section size 5
+        0x04, // 4 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        0x01, // func 2: type 1
+        0x02, // func 3: type 2
+        // Section 7: Export
+        0x07, 0x22, // section size 34
+        0x04, // 4 exports
+        0x05, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x00, 0x00, // export "count" -> func 0
+        0x09, 0x77, 0x61, 0x69, 0x74, 0x5f, 0x66, 0x6c, 0x61, 0x67, 0x00, 0x01, // export "wait_flag" -> func 1
+        0x04, 0x77, 0x61, 0x6b, 0x65, 0x00, 0x02, // export "wake" -> func 2
+        0x03, 0x63, 0x61, 0x73, 0x00, 0x03, // export "cas" -> func 3
+        // Section 10: Code
+        0x0a, 0x54, // section size 84
+        0x04, // 4 function bodies
+        // func 0: count(n) — memory[0] に n 回 atomic add し、最後に読んだ値を返す
+        0x25, // body size 37
+        0x00, // 0 locals
+            0x02, 0x40,             // block
+            0x03, 0x40,             //   loop
+            0x20, 0x00,             //     local.get 0
+            0x45,                   //     i32.eqz
+            0x0d, 0x01,             //     br_if 1
+            0x41, 0x00,             //     i32.const 0
+            0x41, 0x01,             //     i32.const 1
+            0xfe, 0x1e, 0x02, 0x00, //     i32.atomic.rmw.add 0
+            0x1a,                   //     drop
+            0x20, 0x00,             //     local.get 0
+            0x41, 0x01,             //     i32.const 1
+            0x6b,                   //     i32.sub
+            0x21, 0x00,             //     local.set 0
+            0x0c, 0x00,             //     br 0
+            0x0b,                   //   end
+            0x0b,                   // end
+            0x41, 0x00,             // i32.const 0
+            0xfe, 0x10, 0x02, 0x00, // i32.atomic.load 0
+            0x0b,                   // end
+        // func 1: wait_flag(timeout_ns) — memory[16] が 0 の間待つ (0=起こされた, 1=値が違う, 2=タイムアウト)
+        0x0c, // body size 12
+        0x00, // 0 locals
+            0x41, 0x10,             // i32.const 16
+            0x41, 0x00,             // i32.const 0
+            0x20, 0x00,             // local.get 0
+            0xfe, 0x01, 0x02, 0x00, // memory.atomic.wait32 0
+            0x0b,                   // end
+        // func 2: wake() — memory[16] = 1 にして待っているスレッドを1つ起こし、起こした数を返す
+        0x12, // body size 18
+        0x00, // 0 locals
+            0x41, 0x10,             // i32.const 16
+            0x41, 0x01,             // i32.const 1
+            0xfe, 0x17, 0x02, 0x00, // i32.atomic.store 0
+            0x41, 0x10,             // i32.const 16
+            0x41, 0x01,             // i32.const 1
+            0xfe, 0x00, 0x02, 0x00, // memory.atomic.notify 0
+            0x0b,                   // end
+        // func 3: cas(expected, new) — memory[32] の compare-exchange。読んだ値を返す
+        0x0c, // body size 12
+        0x00, // 0 locals
+            0x41, 0x20,             // i32.const 32
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0xfe, 0x48, 0x02, 0x00, // i32.atomic.rmw.cmpxchg 0
+            0x0b,                   // end
     };
-    memset(&vm, 0, sizeof(vm)); vm.code = code_mem; vm.size = sizeof(code_mem);
-    vm.pc = 0;
-    run(&vm);
-    printf("memory[0] loaded = %d (expected 120)\n", vm.stack[vm.sp-1]);
-    printf("--------------------\n");
-}
 
-typedef struct {
-    const char *name;
-    void (*func)(void);
-} TestEntry;
+    SharedMemory *shm = shared_memory_new();
+    WasmVM *thread_vms = calloc(4, sizeof(WasmVM));
+    if (shm && thread_vms) {
+        for (int i = 0; i < 4; i++) {
+            vm_attach_shared_memory(&thread_vms[i], shm);
+            thread_vms[i].code = wasm_atomics_module;
+            thread_vms[i].size = sizeof(wasm_atomics_module);
+            parse_sections(&thread_vms[i]);
+        }
+        ExportFunc *f_count = find_export(&thread_vms[0], "count");
+        ExportFunc *f_wait = find_export(&thread_vms[0], "wait_flag");
+        ExportFunc *f_wake = find_export(&thread_vms[0], "wake");
+        ExportFunc *f_cas = find_export(&thread_vms[0], "cas");
+
+        // 4スレッドがそれぞれ 200 回 atomic add する
+        VMThread threads[4];
+        for (int i = 0; i < 4; i++) {
+            threads[i] = (VMThread){ .vm = &thread_vms[i], .func_idx = f_count->func_idx, .args = {200}, .argc = 1 };
+            vm_thread_start(&threads[i]);
+        }
+        for (int i = 0; i < 4; i++) vm_thread_join(&threads[i]);
+        printf("counter = %u (expected 800)\n", *(uint32_t *)&shm->data[0]);
+
+        // タイムアウト: memory[16] は 0 のままなので 1ms 待って 2 が返る
+        VMThread t_wait = { .vm = &thread_vms[0], .func_idx = f_wait->func_idx, .args = {1000000}, .argc = 1 };
+        vm_thread_start(&t_wait);
+        printf("wait_flag(1ms) = %d (expected 2, timed out)\n", vm_thread_join(&t_wait));
+
+        // 別スレッドが無期限に待ち始めたら、別のインスタンスから起こす
+        t_wait.args[0] = -1;
+        vm_thread_start(&t_wait);
+        while (shared_memory_waiters(shm) == 0) sched_yield();
+        VMThread t_wake = { .vm = &thread_vms[1], .func_idx = f_wake->func_idx };
+        vm_thread_start(&t_wake);
+        printf("wake() = %d (expected 1 woken)\n", vm_thread_join(&t_wake));
+        printf("wait_flag(-1) = %d (expected 0, woken)\n", vm_thread_join(&t_wait));
+
+        // memory[16] が 1 になったので、待たずに 1 が返る
+        vm_thread_start(&t_wait);
+        printf("wait_flag(-1) = %d (expected 1, not-equal)\n", vm_thread_join(&t_wait));
+
+        VMThread t_cas = { .vm = &thread_vms[2], .func_idx = f_cas->func_idx, .args = {0, 5}, .argc = 2 };
+        vm_thread_start(&t_cas);
+        int32_t cas1 = vm_thread_join(&t_cas);
+        t_cas.args[1] = 7;
+        vm_thread_start(&t_cas);
+        int32_t cas2 = vm_thread_join(&t_cas);
+        printf("cas(0, 5) = %d, cas(0, 7) = %d, memory[32] = %u (expected 0, 5, 5)\n",
+               cas1, cas2, *(uint32_t *)&shm->data[32]);
+
+        for (int i = 0; i < 4; i++) vm_teardown(&thread_vms[i]);
+    } else {
+        printf("Failed to set up shared memory test.\n");
+    }
+    if (shm) shared_memory_release(shm);
+    free(thread_vms);
+    printf("--------------------\n");
 
-TestEntry tests[] = {
-    {"1", test1},
-    {"2", test2},
-    {"3", test3},
-    {"4", test4},
-    {NULL, NULL}
-};
+    // --- テストケース19: ロード時の最適化パス ---
+    printf("--- Test Case 19: Load-time optimizer ---\n");
+    uint8_t wasm_opt_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x06, // section size 6
+        0x01, // 1 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x02, // section size 2
+        0x01, // 1 functions
+        0x00, // func 0: type 0
+        // Section 6: Global
+        0x06, 0x06, // section size 6
+        0x01, // 1 globals
+        0x7f, 0x00, 0x41, 0x0a, 0x0b, // global const i32 = i32.const 10
+        // Section 7: Export
+        0x07, 0x08, // section size 8
+        0x01, // 1 exports
+        0x04, 0x63, 0x61, 0x6c, 0x63, 0x00, 0x00, // export "calc" -> func 0
+        // Section 10: Code
+        0x0a, 0x2e, // section size 46
+        0x01, // 1 function bodies
+        // func 0: calc(n) — n == 0 なら 16、それ以外は 16 * n
+        0x2c, // body size 44
+        0x01, 0x01, 0x7f, // 1 local groups
+            0x41, 0x02,             // i32.const 2
+            0x41, 0x03,             // i32.const 3
+            0x6c,                   // i32.mul
+            0x23, 0x00,             // global.get 0
+            0x6a,                   // i32.add
+            0x21, 0x01,             // local.set 1
+            0x20, 0x01,             // local.get 1
+            0x20, 0x00,             // local.get 0
+            0x41, 0x00,             // i32.const 0
+            0x6a,                   // i32.add
+            0x6a,                   // i32.add
+            0x20, 0x00,             // local.get 0
+            0x1a,                   // drop
+            0x01,                   // nop
+            0x02, 0x40,             // block
+            0x20, 0x00,             //   local.get 0
+            0x45,                   //   i32.eqz
+            0x0d, 0x00,             //   br_if 0
+            0x20, 0x01,             //   local.get 1
+            0x20, 0x00,             //   local.get 0
+            0x6c,                   //   i32.mul
+            0x0f,                   //   return
+            0x41, 0xe3, 0x00,       //   i32.const 99
+            0x1a,                   //   drop
+            0x0b,                   // end
+            0x0b,                   // end
+    };
 
-int main(int argc, char *argv[]) {
+    // 最適化は code を書き換えるので、最適化なし・ありでそれぞれ別のコピーを読み込む
+    int32_t opt_results[2][2];
+    size_t opt_counts[2] = {0, 0};
+    for (int o = 0; o < 2; o++) {
+        uint8_t module_copy[sizeof(wasm_opt_module)];
+        memcpy(module_copy, wasm_opt_module, sizeof(wasm_opt_module));
+        memset(&vm, 0, sizeof(vm));
+        vm.code = module_copy;
+        vm.size = sizeof(module_copy);
+        vm.optimize = o;
+        parse_sections(&vm);
+        ExportFunc *f_calc = find_export(&vm, "calc");
+        for (int i = 0; i < 2; i++) {
+            vm.sp = 0;
+            vm.pc = f_calc ? vm.func_frames[f_calc->func_idx].body_pc : 0;
+            vm.locals[0] = i * 5;
+            vm.locals[1] = 0;
+            if (f_calc) run(&vm);
+            opt_results[o][i] = vm.sp > 0 ? vm.stack[vm.sp-1] : -1;
+        }
+        opt_counts[0] += vm.opt_insns_before;
+        opt_counts[1] += vm.opt_insns_after;
+        vm_teardown(&vm);
+    }
+    printf("calc(0) = %d / %d, calc(5) = %d / %d (expected 16 / 16, 80 / 80)\n",
+           opt_results[0][0], opt_results[1][0], opt_results[0][1], opt_results[1][1]);
+    printf("instructions: %zu -> %zu (expected 26 -> 14)\n", opt_counts[0], opt_counts[1]);
+
+    // 畳み込んだ global.get (2 バイト) は i32.const 0x7fffffff (6 バイト) に伸びる。その後ろの長い命令
+    // (LEB128 を詰め物で 5 バイトにした i32.load) を写すときに作業用のバッファをはみ出さないこと
+    uint8_t wasm_opt_grow_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x03, 0x02, 0x01, 0x00, // 1 function: type 0
+        0x05, 0x03, 0x01, 0x00, 0x01, // 1 memory, min 1
+        0x06, 0x0a, 0x01, 0x7f, 0x00, 0x41, 0xff, 0xff, 0xff, 0xff, 0x07, 0x0b, // global 0: const i32 = 0x7fffffff
+        0x07, 0x08, 0x01, 0x04, 0x67, 0x72, 0x6f, 0x77, 0x00, 0x00, // export "grow" -> func 0
+        0x0a, 0x1a, 0x01, // 1 function body
+        0x18, 0x00, // body size 24, 0 locals
+            0x20, 0x00,             // local.get 0
+            0x23, 0x00, 0x6a,       // global.get 0; i32.add
+            0x23, 0x00, 0x6a,       // global.get 0; i32.add
+            0x23, 0x00, 0x6a,       // global.get 0; i32.add
+            0x28, 0x82, 0x80, 0x80, 0x80, 0x00, 0x80, 0x80, 0x80, 0x80, 0x00, // i32.load align=2 offset=0 (5 バイトずつ)
+            0x0b,                   // end
+    };
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_opt_grow_module;
+    vm.size = sizeof(wasm_opt_grow_module);
+    vm.optimize = 1;
+    parse_sections(&vm);
+    ExportFunc *f_grow = find_export(&vm, "grow");
+    int32_t grow_arg = (int32_t)(8u - 3u * 0x7fffffffu), grow_result = -1; // 8 を読む
+    if (f_grow) {
+        vm.sp = 0;
+        vm.pc = vm.func_frames[f_grow->func_idx].body_pc;
+        vm.locals[0] = grow_arg;
+        run(&vm);
+        grow_result = vm.sp > 0 ? vm.stack[vm.sp-1] : -1;
+    }
+    printf("grown body: grow(%d) = %d, optimized: %s (expected %d, 0, no)\n",
+           grow_arg, grow_result, vm.opt_insns_after ? "yes" : "no", grow_arg);
+    vm_teardown(&vm);
+
+    // 定数畳み込みが扱う比較・ビット演算・シフトをインタプリタでも同じに計算すること
+    uint8_t wasm_bits_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x07, 0x01, 0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        0x03, 0x02, 0x01, 0x00, // 1 function: type 0
+        0x07, 0x08, 0x01, 0x04, 0x62, 0x69, 0x74, 0x73, 0x00, 0x00, // export "bits" -> func 0
+        0x0a, 0x2a, 0x01, // 1 function body
+        0x28, 0x00, // body size 40, 0 locals
+            0x20, 0x00, 0x20, 0x01, 0x71, // a & b
+            0x20, 0x00, 0x20, 0x01, 0x73, // a ^ b
+            0x72,                         // i32.or
+            0x20, 0x01, 0x77,             // i32.rotl b
+            0x20, 0x01, 0x75,             // i32.shr_s b
+            0x20, 0x01, 0x74,             // i32.shl b
+            0x20, 0x01, 0x78,             // i32.rotr b
+            0x20, 0x01, 0x76,             // i32.shr_u b
+            0x20, 0x00, 0x20, 0x01, 0x46, 0x6a, // + (a == b)
+            0x20, 0x00, 0x20, 0x01, 0x47, 0x6a, // + (a != b)
+        0x0b,
+    };
+    int32_t bits_args[6] = {(int32_t)0x8f00f00fu, 4, 7, 7, -5, 33};
+    int32_t bits_results[2][3];
+    for (int o = 0; o < 2; o++) {
+        uint8_t module_copy[sizeof(wasm_bits_module)];
+        memcpy(module_copy, wasm_bits_module, sizeof(wasm_bits_module));
+        for (int k = 0; k < 3; k++) bits_results[o][k] = -1;
+        memset(&vm, 0, sizeof(vm));
+        vm.code = module_copy;
+        vm.size = sizeof(module_copy);
+        vm.optimize = o;
+        parse_sections(&vm);
+        ExportFunc *f_bits = find_export(&vm, "bits");
+        for (int k = 0; f_bits && k < 3; k++) {
+            vm.sp = 0;
+            vm.pc = vm.func_frames[f_bits->func_idx].body_pc;
+            vm.locals[0] = bits_args[2*k];
+            vm.locals[1] = bits_args[2*k+1];
+            run(&vm);
+            bits_results[o][k] = vm.sp > 0 ? vm.stack[vm.sp-1] : -1;
+        }
+        vm_teardown(&vm);
+    }
+    printf("bits = %d, %d, %d / %d, %d, %d (expected 15732481, 1, 1073741822 / 15732481, 1, 1073741822)\n",
+           bits_results[0][0], bits_results[0][1], bits_results[0][2],
+           bits_results[1][0], bits_results[1][1], bits_results[1][2]);
+    printf("--------------------\n");
 
-    if (argc < 2) {
-        // printf("Usage: %s [test numbers]\n", argv[0]);
-        // return 1;
-    } else {
-        for (int i = 1; i < argc; i++) {
-            int found = 0;
-            for (int j = 0; tests[j].name != NULL; j++) {
-                if (strcmp(argv[i], tests[j].name) == 0) {
-                    tests[j].func();
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found) {
-                printf("Unknown test: %s\n", argv[i]);
+    printf("--- Test Case 20: Native tier (JIT) ---\n");
+#if VM_JIT
+    uint8_t wasm_jit_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x0c, // section size 12
+        0x02, // 2 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 1: (i32 i32) -> (i32)
+        // Section 2: Import
+        0x02, 0x0b, // section size 11
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x03, 0x61, 0x64, 0x64, 0x00, 0x01, // import "env"."add" (func)
+        // Section 3: Function
+        0x03, 0x05, // section size 5
+        0x04, // 4 functions
+        0x00, // func 1: type 0
+        0x00, // func 2: type 0
+        0x00, // func 3: type 0
+        0x01, // func 4: type 1
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
+        // Section 7: Export
+        0x07, 0x27, // section size 39
+        0x04, // 4 exports
+        0x03, 0x66, 0x69, 0x62, 0x00, 0x01, // export "fib" -> func 1
+        0x0a, 0x73, 0x75, 0x6d, 0x5f, 0x73, 0x63, 0x61, 0x6c, 0x65, 0x64, 0x00, 0x02, // export "sum_scaled" -> func 2
+        0x07, 0x6c, 0x6f, 0x61, 0x64, 0x5f, 0x61, 0x74, 0x00, 0x03, // export "load_at" -> func 3
+        0x06, 0x64, 0x69, 0x76, 0x6d, 0x6f, 0x64, 0x00, 0x04, // export "divmod" -> func 4
+        // Section 10: Code
+        0x0a, 0x6e, // section size 110
+        0x04, // 4 function bodies
+        // func 1: fib(n) — 再帰版
+        0x1c, // body size 28
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x41, 0x02,             // i32.const 2
+            0x48,                   // i32.lt_s
+            0x04, 0x7f,             // if i32
+            0x20, 0x00,             //   local.get 0
+            0x05,                   // else
+            0x20, 0x00,             //   local.get 0
+            0x41, 0x01,             //   i32.const 1
+            0x6b,                   //   i32.sub
+            0x10, 0x01,             //   call 1
+            0x20, 0x00,             //   local.get 0
+            0x41, 0x02,             //   i32.const 2
+            0x6b,                   //   i32.sub
+            0x10, 0x01,             //   call 1
+            0x6a,                   //   i32.add
+            0x0b,                   // end
+            0x0b,                   // end
+        // func 2: sum_scaled(n) — memory[i*4] = i * (n + 3) を書いて読み戻し、合計を返す (n + 3 はループ不変)
+        0x38, // body size 56
+        0x01, 0x03, 0x7f, // 1 local groups
+            0x02, 0x40,             // block
+            0x03, 0x40,             //   loop
+            0x20, 0x01,             //     local.get 1
+            0x20, 0x00,             //     local.get 0
+            0x4e,                   //     i32.ge_s
+            0x0d, 0x01,             //     br_if 1
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x04,             //     i32.const 4
+            0x6c,                   //     i32.mul
+            0x22, 0x02,             //     local.tee 2
+            0x20, 0x01,             //     local.get 1
+            0x20, 0x00,             //     local.get 0
+            0x41, 0x03,             //     i32.const 3
+            0x6a,                   //     i32.add
+            0x6c,                   //     i32.mul
+            0x36, 0x02, 0x00,       //     i32.store 0
+            0x20, 0x03,             //     local.get 3
+            0x20, 0x02,             //     local.get 2
+            0x28, 0x02, 0x00,       //     i32.load 0
+            0x6a,                   //     i32.add
+            0x21, 0x03,             //     local.set 3
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x01,             //     i32.const 1
+            0x6a,                   //     i32.add
+            0x21, 0x01,             //     local.set 1
+            0x0c, 0x00,             //     br 0
+            0x0b,                   //   end
+            0x0b,                   // end
+            0x20, 0x03,             // local.get 3
+            0x0b,                   // end
+        // func 3: load_at(addr)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x00,       // i32.load 0
+            0x0b,                   // end
+        // func 4: divmod(a, b) — env.add(a / b, a % b)
+        0x0e, // body size 14
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6d,                   // i32.div_s
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6f,                   // i32.rem_s
+            0x10, 0x00,             // call 0
+            0x0b,                   // end
+    };
+
+    // [0] インタプリタのみ, [1] ロード時に全関数をネイティブコードへコンパイル
+    const char *jit_names[5] = {"fib", "sum_scaled", "load_at", "divmod", "divmod"};
+    int32_t jit_args[5][2] = {{20, 0}, {100, 0}, {8, 0}, {-7, 2}, {7, -1}};
+    int32_t jit_results[2][5];
+    int jit_native = 0, jit_trapped = 0;
+    uint32_t jit_hoisted = 0, jit_checks = 0, jit_removed = 0, jit_versioned = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        memset(&vm, 0, sizeof(vm));
+        vm.code = wasm_jit_module;
+        vm.size = sizeof(wasm_jit_module);
+        vm.jit = mode * 2;
+        parse_sections(&vm);
+        vm_register_import(&vm, "env", "add", imported_add);
+        for (int i = 0; i < 5; i++) {
+            ExportFunc *f_jit = find_export(&vm, jit_names[i]);
+            jit_results[mode][i] = -1;
+            if (f_jit == NULL) continue;
+            if (vm.func_frames[f_jit->func_idx].native) {
+                jit_native++;
+                jit_invoke(&vm, f_jit->func_idx, jit_args[i], &jit_results[mode][i]);
+            } else {
+                vm.sp = 0;
+                vm.frame_base = 0;
+                vm.call_sp = 0;
+                memset(vm.locals, 0, sizeof(vm.locals));
+                vm.locals[0] = jit_args[i][0];
+                vm.locals[1] = jit_args[i][1];
+                vm.pc = vm.func_frames[f_jit->func_idx].body_pc;
+                run(&vm);
+                if (vm.sp > 0) jit_results[mode][i] = vm.stack[vm.sp - 1];
             }
         }
+        if (mode == 1) {
+            // 範囲外アクセスはネイティブコードからトラップとして戻ってくる
+            ExportFunc *f_load = find_export(&vm, "load_at");
+            int32_t ret, addr[1] = {65534};
+            jit_trapped = f_load && jit_invoke(&vm, f_load->func_idx, addr, &ret) < 0;
+            jit_hoisted = vm.jit_hoisted;
+            jit_checks = vm.jit_checks;
+            jit_removed = vm.jit_checks_removed;
+            jit_versioned = vm.jit_loops_versioned;
+        }
+        vm_teardown(&vm);
     }
-    
-    if (argc >= 2) {
-        return 0;
+    printf("fib(20) = %d / %d (expected 6765 / 6765)\n", jit_results[0][0], jit_results[1][0]);
+    printf("sum_scaled(100) = %d / %d (expected 509850 / 509850)\n", jit_results[0][1], jit_results[1][1]);
+    printf("load_at(8) = %d / %d (expected 206 / 206)\n", jit_results[0][2], jit_results[1][2]);
+    printf("divmod(-7, 2) = %d / %d, divmod(7, -1) = %d / %d (expected -4 / -4, -7 / -7)\n",
+           jit_results[0][3], jit_results[1][3], jit_results[0][4], jit_results[1][4]);
+    printf("native calls: %d, load_at(65534) trapped: %s (expected 5, yes)\n", jit_native, jit_trapped ? "yes" : "no");
+    printf("hoisted: %u, loops versioned: %u, bounds checks: %u of %u removed (expected 1, 1, 3 of 5 removed)\n",
+           jit_hoisted, jit_versioned, jit_removed, jit_checks);
+
+    // ホットな関数だけコンパイルするモード: 再帰の途中でネイティブコードに切り替わる
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_jit_module;
+    vm.size = sizeof(wasm_jit_module);
+    vm.jit = 1;
+    parse_sections(&vm);
+    ExportFunc *f_hot = find_export(&vm, "fib");
+    vm.sp = 0;
+    vm.frame_base = 0;
+    vm.call_sp = 0;
+    memset(vm.locals, 0, sizeof(vm.locals));
+    vm.locals[0] = 20;
+    vm.pc = f_hot ? vm.func_frames[f_hot->func_idx].body_pc : 0;
+    if (f_hot) run(&vm);
+    printf("hot fib(20) = %d, compiled: %s (expected 6765, yes)\n",
+           vm.sp > 0 ? vm.stack[vm.sp - 1] : -1, f_hot && vm.func_frames[f_hot->func_idx].native ? "yes" : "no");
+    vm_teardown(&vm);
+
+    // 関数の最初の命令でパラメータを全部使う: パラメータどうしが同じレジスタに割り当てられないこと
+    uint8_t wasm_params_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x08, 0x01, 0x60, 0x03, 0x7f, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32 i32) -> (i32)
+        0x03, 0x03, 0x02, 0x00, 0x00, // 2 functions: type 0
+        0x07, 0x0e, 0x01, 0x0a, 0x66, 0x69, 0x72, 0x73, 0x74, 0x5f, 0x63, 0x61, 0x6c, 0x6c, 0x00, 0x00, // export "first_call" -> func 0
+        0x0a, 0x17, 0x02, // 2 function bodies
+        0x0a, 0x00, 0x20, 0x00, 0x20, 0x01, 0x20, 0x02, 0x10, 0x01, 0x0b, // func 0: call 1 (a, b, c)
+        0x0a, 0x00, 0x20, 0x00, 0x20, 0x01, 0x6b, 0x20, 0x02, 0x6b, 0x0b, // func 1: a - b - c
+    };
+    int32_t params_args[3] = {7, 2, 1}, params_results[2] = {-1, -1};
+    for (int mode = 0; mode < 2; mode++) {
+        memset(&vm, 0, sizeof(vm));
+        vm.code = wasm_params_module;
+        vm.size = sizeof(wasm_params_module);
+        vm.jit = mode * 2;
+        parse_sections(&vm);
+        ExportFunc *f_params = find_export(&vm, "first_call");
+        if (f_params) vm_invoke_batch(&vm, f_params, params_args, &params_results[mode], 1);
+        vm_teardown(&vm);
+    }
+    printf("first_call(7, 2, 1) = %d / %d (expected 4 / 4)\n", params_results[0], params_results[1]);
+
+    // ネイティブコードが扱う比較・ビット演算・シフトをインタプリタ (両方のループ) でも同じに計算すること
+    {
+        uint8_t wasm_bits_module[] = {
+            0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+            0x01, 0x07, 0x01, 0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+            0x03, 0x02, 0x01, 0x00, // 1 function: type 0
+            0x07, 0x08, 0x01, 0x04, 0x62, 0x69, 0x74, 0x73, 0x00, 0x00, // export "bits" -> func 0
+            0x0a, 0x2a, 0x01, // 1 function body
+            0x28, 0x00, // body size 40, 0 locals
+                0x20, 0x00, 0x20, 0x01, 0x71, // a & b
+                0x20, 0x00, 0x20, 0x01, 0x73, // a ^ b
+                0x72,                         // i32.or
+                0x20, 0x01, 0x77,             // i32.rotl b
+                0x20, 0x01, 0x75,             // i32.shr_s b
+                0x20, 0x01, 0x74,             // i32.shl b
+                0x20, 0x01, 0x78,             // i32.rotr b
+                0x20, 0x01, 0x76,             // i32.shr_u b
+                0x20, 0x00, 0x20, 0x01, 0x46, 0x6a, // + (a == b)
+                0x20, 0x00, 0x20, 0x01, 0x47, 0x6a, // + (a != b)
+            0x0b,
+        };
+        int32_t bits_args[6] = {(int32_t)0x8f00f00fu, 4, 7, 7, -5, 33};
+        static const int bits_options[4] = {0, WASMVM_INTERP_TOS, WASMVM_JIT_EAGER, WASMVM_JIT};
+        int32_t bits_results[4][3];
+        int bits_changed = 0;
+        wasmvm_module *bits_m = wasmvm_module_load(wasm_bits_module, sizeof(wasm_bits_module));
+        for (int mode = 0; mode < 4; mode++) {
+            for (int k = 0; k < 3; k++) bits_results[mode][k] = -1;
+            wasmvm_instance *bi = bits_m ? wasmvm_instantiate(bits_m, bits_options[mode]) : NULL;
+            wasmvm_export *bf = bi ? wasmvm_find_export(bi, "bits") : NULL;
+            if (bf) wasmvm_invoke_batch(bi, bf, bits_args, bits_results[mode], 3);
+            // WASMVM_JIT ではホットになってコンパイルされた後も結果が変わらないこと
+            for (int round = 0; bf && mode == 3 && round < VM_JIT_HOT_CALLS / 3 + 1; round++) {
+                int32_t again[3];
+                if (wasmvm_invoke_batch(bi, bf, bits_args, again, 3) != 0 || memcmp(again, bits_results[mode], sizeof(again)) != 0)
+                    bits_changed++;
+            }
+            wasmvm_instance_free(bi);
+        }
+        wasmvm_module_free(bits_m);
+        int bits_agree = 1;
+        for (int mode = 1; mode < 4; mode++)
+            if (memcmp(bits_results[mode], bits_results[0], sizeof(bits_results[0])) != 0) bits_agree = 0;
+        printf("bits = %d, %d, %d, tiers agree: %s, changed after promotion: %d (expected 15732481, 1, 1073741822, yes, 0)\n",
+               bits_results[0][0], bits_results[0][1], bits_results[0][2], bits_agree ? "yes" : "no", bits_changed);
     }
 
-    WasmVM vm;
+    // 4スレッドが同時にコンパイルする (レジスタ割り当ての作業領域はスレッドごと)
+    wasmvm_module *jit_shared = wasmvm_module_load(wasm_jit_module, sizeof(wasm_jit_module));
+    JitCompileClient jit_clients[4];
+    int jit_wrong = 0, jit_calls = 0;
+    for (int t = 0; t < 4 && jit_shared; t++) {
+        jit_clients[t] = (JitCompileClient){ jit_shared, 25, 0, 0 };
+        if (pthread_create(&jit_clients[t].thread, NULL, jit_compile_client_main, &jit_clients[t]) != 0) jit_clients[t].calls = 0;
+    }
+    for (int t = 0; t < 4 && jit_shared; t++) {
+        if (jit_clients[t].calls) pthread_join(jit_clients[t].thread, NULL);
+        jit_wrong += jit_clients[t].wrong;
+        jit_calls += jit_clients[t].calls;
+    }
+    printf("concurrent compiles: %d, wrong: %d (expected 100, 0)\n", jit_calls, jit_wrong);
+    wasmvm_module_free(jit_shared);
+#else
+    printf("skipped (VM_JIT=0)\n");
+#endif
+    printf("--------------------\n");
 
-    // --- テストケース7: 型セクション、インポート/エクスポートを含むWasmモジュール ---
-    printf("--- Test Case 7: Full module parsing and execution ---\n");
-    uint8_t wasm_module[] = {
-        // Magic + Version
-        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    printf("--- Test Case 21: Flight recorder ---\n");
+#if VM_FLIGHT
+    uint8_t wasm_flight_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
         // Section 1: Type
-        0x01, 0x0c, 0x02, // Section size 12, 2 types
-        // type 0: (i32, i32) -> i32 (for imported_add)
-        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f,
-        // type 1: (i32) -> () (for print_i32)
-        0x60, 0x01, 0x7f, 0x00,
+        0x01, 0x0c, // section size 12
+        0x02, // 2 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 1: (i32 i32) -> (i32)
         // Section 2: Import
-        0x02, 0x19, 0x02, // Section size 25, 2 imports
-        // import 0: "env"."add" (type 0)
-        0x03, 'e', 'n', 'v', 0x03, 'a', 'd', 'd', 0x00, 0x00,
-        // import 1: "env"."print_i32" (type 1)
-        0x03, 'e', 'n', 'v', 0x09, 'p', 'r', 'i', 'n', 't', '_', 'i', '3', '2', 0x00, 0x01,
+        0x02, 0x0b, // section size 11
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x03, 0x61, 0x64, 0x64, 0x00, 0x01, // import "env"."add" (func)
         // Section 3: Function
-        0x03, 0x02, 0x01, 0x02, // Section size 2, 1 function, type_idx 2
+        0x03, 0x03, // section size 3
+        0x02, // 2 functions
+        0x00, // func 1: type 0
+        0x00, // func 2: type 0
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
         // Section 7: Export
-        0x07, 0x0b, 0x01, // Section size 11, 1 export
-        // export "main_add" -> func_idx 2 (0:import, 1:import, 2:internal)
-        0x08, 'm', 'a', 'i', 'n', '_', 'a', 'd', 'd', 0x00, 0x02,
+        0x07, 0x09, // section size 9
+        0x01, // 1 exports
+        0x05, 0x6f, 0x75, 0x74, 0x65, 0x72, 0x00, 0x01, // export "outer" -> func 1
         // Section 10: Code
-        0x0a, 0x0f, 0x01, // Section size 15, 1 function body
-        // func body 0 (main_add): (size 13 -> 11)
-        0x0d, // body size 13
+        0x0a, 0x14, // section size 20
+        0x02, // 2 function bodies
+        // func 1: outer(n) — env.add(inner(n), 1)
+        0x0a, // body size 10
         0x00, // 0 locals
-        0x41, 0x0a,       // i32.const 10
-        0x41, 0x14,       // i32.const 20
-        0x10, 0x00,       // call 0 (imported "add")
-        0x41, 0x05,       // i32.const 5
-        0x6a,             // i32.add
-        0x10, 0x01,       // call 1 (imported "print_i32")
-        0x0B
+            0x20, 0x00,             // local.get 0
+            0x10, 0x02,             // call 2
+            0x41, 0x01,             // i32.const 1
+            0x10, 0x00,             // call 0
+            0x0b,                   // end
+        // func 2: inner(addr) — memory[addr] を読む (65535 ならトラップ)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x00,       // i32.load 0
+            0x0b,                   // end
     };
 
     memset(&vm, 0, sizeof(vm));
-    vm.code = wasm_module;
-    vm.size = sizeof(wasm_module);
-
-    // 読み込んだバイト列をダンプ
-    dump_wasm_code(vm.code, vm.size);
-
-    // 1. モジュールをパース
+    vm.code = wasm_flight_module;
+    vm.size = sizeof(wasm_flight_module);
     parse_sections(&vm);
-
-    // --- ADD: 実行開始前のプロローグ処理 ---
-    ExportFunc *f_main = find_export(&vm, "main_add");
-    if (f_main) {
-        printf("Executing exported function 'main_add'...\n");
-        vm.pc = vm.func_pcs[f_main->func_idx];
-
-        // 関数のプロローグ: ローカル変数宣言をパース
-        uint32_t local_groups = read_uLEB128(vm.code, &vm.pc);
-        for (uint32_t i = 0; i < local_groups; i++) {
-            (void)read_uLEB128(vm.code, &vm.pc); // num_locals
-            (void)vm.code[vm.pc++]; // type
-        }
-    }
-    // --- END ADD ---
-
-    // 2. ホスト関数を登録
     vm_register_import(&vm, "env", "add", imported_add);
-    vm_register_import(&vm, "env", "print_i32", print_i32);
-
-    // 3. エクスポートされた関数を探して実行
-    ExportFunc *f = find_export(&vm, "main_add");
-    if (f) {
-        // 実行開始PCはプロローグ処理で設定済み
+    // 容量 8 件 (書き出すのは 7 件まで)、3 命令ごとに PC を記録し、トラップのたびに flight_trap_file へ書き出す
+    FILE *flight_trap_file = tmpfile();
+    FILE *flight_signal_file = tmpfile();
+    flight_enable(&vm, 8, 3, flight_trap_file ? fileno(flight_trap_file) : -1);
+    ExportFunc *f_outer = find_export(&vm, "outer");
+    int32_t flight_args[2] = {0, 65535};
+    int32_t flight_results[2] = {-1, -1};
+    for (int i = 0; i < 2 && f_outer; i++) {
+        vm.sp = 0;
+        vm.frame_base = 0;
+        vm.call_sp = 0;
+        memset(vm.locals, 0, sizeof(vm.locals));
+        vm.locals[0] = flight_args[i];
+        vm.pc = vm.func_frames[f_outer->func_idx].body_pc;
         run(&vm);
-        printf("Execution finished.\n");
-    } else {
-        printf("Export function 'main_add' not found.\n");
+        if (vm.sp > 0) flight_results[i] = vm.stack[vm.sp - 1];
+    }
+    FlightEvent *flight_last = &vm.flight->events[(vm.flight->head - 1) & vm.flight->mask];
+    printf("outer(0) = %d, events = %llu, last = %s in func[%u] at depth %u (expected 1, 12, trap in func[2] at depth 1)\n",
+           flight_results[0], (unsigned long long)vm.flight->head,
+           flight_event_names[flight_last->kind], flight_last->aux, flight_last->depth);
+
+    // シグナルでも書き出せる
+    if (flight_signal_file) flight_dump_on_signal(&vm, SIGUSR1, fileno(flight_signal_file));
+    raise(SIGUSR1);
+    signal(SIGUSR1, SIG_DFL);
+    vm_teardown(&vm);
+
+    FILE *flight_files[2] = {flight_trap_file, flight_signal_file};
+    for (int i = 0; i < 2; i++) {
+        char *decoded = NULL;
+        size_t decoded_size = 0;
+        FILE *mem = open_memstream(&decoded, &decoded_size);
+        int ok = -1;
+        if (flight_files[i] && mem) {
+            rewind(flight_files[i]);
+            ok = flight_decode(flight_files[i], mem);
+        }
+        if (mem) fclose(mem);
+        int lines = 0;
+        for (size_t k = 0; k < decoded_size; k++) lines += decoded[k] == '\n';
+        printf("%s dump: %s, %d lines, %s (expected ok, 9 lines, trap line found)\n", i == 0 ? "trap" : "signal",
+               ok == 0 ? "ok" : "failed", lines,
+               decoded && strstr(decoded, "trap    func[2] pc=") ? "trap line found" : "no trap line");
+        TRACE("%s", decoded ? decoded : "");
+        free(decoded);
+        if (flight_files[i]) fclose(flight_files[i]);
     }
-    printf("--------------------\n");
-
-    // --- テストケース8: ファイルからWasmモジュールを読み込んで実行 ---
-    printf("--- Test Case 8: Full module parsing and execution from file ---\n");
-    const char* wasm_file_path = "main.wasm";
-    uint8_t *wasm_code = NULL;
-    size_t wasm_size = 0;
-
-    if (read_wasm_file(wasm_file_path, &wasm_code, &wasm_size) == 0) {
-        memset(&vm, 0, sizeof(vm));
-        vm.code = wasm_code;
-        vm.size = wasm_size;
-
-        // 読み込んだバイト列をダンプ
-        dump_wasm_code(vm.code, vm.size);
-
-        // 1. モジュールをパース
-        parse_sections(&vm);
-
-        // --- ADD: 実行開始前のプロローグ処理 ---
-        ExportFunc *f_file_main = find_export(&vm, "main_add");
-        if (f_file_main) {
-            printf("Executing exported function 'main_add'...\n");
-            vm.pc = vm.func_pcs[f_file_main->func_idx];
 
-            // 関数のプロローグ: ローカル変数宣言をパース
-            uint32_t local_groups = read_uLEB128(vm.code, &vm.pc);
-            for (uint32_t i = 0; i < local_groups; i++) {
-                (void)read_uLEB128(vm.code, &vm.pc); // num_locals
-                (void)vm.code[vm.pc++]; // type
+    // 記録中のスレッドを止めずに別のスレッドから書き出す: 写している間に上書きされた分は出さない。
+    // CPU が1つでも書き出しの途中で切り替わるように、0.2 秒は続ける
+    wasmvm_module *flight_m = wasmvm_module_load(wasm_flight_module, sizeof(wasm_flight_module));
+    FlightWriter flight_writer = { flight_m ? wasmvm_instantiate(flight_m, 0) : NULL, 0, 0 };
+    int flight_pipe[2], flight_dumps = 0, flight_lapped = 0;
+    if (flight_writer.inst && wasmvm_flight_enable(flight_writer.inst, 64, 0, -1) == 0 && pipe(flight_pipe) == 0) {
+        if (pthread_create(&flight_writer.thread, NULL, flight_writer_main, &flight_writer) == 0) {
+            uint64_t flight_until = flight_monotonic_ns() + 200000000ull;
+            while (flight_dumps < 2000 || flight_monotonic_ns() < flight_until) {
+                FlightDumpHeader fh;
+                FlightEvent fe[64];
+                if (wasmvm_flight_dump(flight_writer.inst, flight_pipe[1]) != 0) break;
+                if (read(flight_pipe[0], &fh, sizeof(fh)) != (ssize_t)sizeof(fh) || fh.count > 63) break;
+                if (read(flight_pipe[0], fe, fh.count * sizeof(FlightEvent)) != (ssize_t)(fh.count * sizeof(FlightEvent))) break;
+                flight_dumps++;
+                for (uint32_t k = 0; k < fh.count; k++) {
+                    if (fe[k].arg != (uint32_t)(fh.first_seq + k)) { flight_lapped++; break; }
+                }
             }
+            __atomic_store_n(&flight_writer.stop, 1, __ATOMIC_RELAXED);
+            pthread_join(flight_writer.thread, NULL);
         }
-        // --- END ADD ---
+        close(flight_pipe[0]);
+        close(flight_pipe[1]);
+    }
+    wasmvm_instance_free(flight_writer.inst);
+    wasmvm_module_free(flight_m);
+    printf("concurrent dumps: %s, with overwritten events: %d (expected yes, 0)\n", flight_dumps >= 2000 ? "yes" : "no", flight_lapped);
+#else
+    printf("skipped (VM_FLIGHT=0)\n");
+#endif
+    printf("--------------------\n");
 
-        // 2. ホスト関数を登録
-        vm_register_import(&vm, "env", "add", imported_add);
-        vm_register_import(&vm, "env", "print_i32", print_i32);
+    printf("--- Test Case 22: Lazy function preparation ---\n");
+    uint8_t wasm_lazy_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x06, // section size 6
+        0x01, // 1 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x04, // section size 4
+        0x03, // 3 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        0x00, // func 2: type 0
+        // Section 7: Export
+        0x07, 0x11, // section size 17
+        0x02, // 2 exports
+        0x04, 0x75, 0x73, 0x65, 0x64, 0x00, 0x00, // export "used" -> func 0
+        0x06, 0x62, 0x72, 0x6f, 0x6b, 0x65, 0x6e, 0x00, 0x02, // export "broken" -> func 2
+        // Section 10: Code
+        0x0a, 0x1c, // section size 28
+        0x03, // 3 function bodies
+        // func 0: used(n) — square(n) + 1
+        0x09, // body size 9
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x10, 0x01,             // call 1
+            0x41, 0x01,             // i32.const 1
+            0x6a,                   // i32.add
+            0x0b,                   // end
+        // func 1: square(n)
+        0x09, // body size 9
+        0x01, 0x01, 0x7f, // 1 local groups
+            0x20, 0x00,             // local.get 0
+            0x20, 0x00,             // local.get 0
+            0x6c,                   // i32.mul
+            0x0b,                   // end
+        // func 2: broken(n) — 分岐の深さが不正 (呼ばれるまで検出されない)
+        0x06, // body size 6
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x0c, 0x03,             // br 3
+            0x0b,                   // end
+    };
 
-        // 3. エクスポートされた関数を探して実行
-        ExportFunc *f_file = find_export(&vm, "main_add");
-        if (f_file) {
-            // 実行開始PCはプロローグ処理で設定済み
-            run(&vm);
-            printf("Execution finished.\n");
-        } else {
-            printf("Export function 'main_add' not found.\n");
+    // [0] ロード時に全関数を準備, [1] 最初の呼び出しで準備
+    int32_t lazy_results[2] = {-1, -1};
+    uint32_t lazy_pending[3] = {0, 0, 0};
+    int lazy_broken_failed = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        memset(&vm, 0, sizeof(vm));
+        vm.code = wasm_lazy_module;
+        vm.size = sizeof(wasm_lazy_module);
+        vm.lazy = mode;
+        parse_sections(&vm); // mode 0 では broken の検証エラーがここで出る
+        if (mode == 1) lazy_pending[0] = vm.lazy_pending;
+        ExportFunc *f_used = find_export(&vm, "used");
+        vm.sp = 0;
+        vm.frame_base = 0;
+        vm.call_sp = 0;
+        memset(vm.locals, 0, sizeof(vm.locals));
+        vm.locals[0] = 4;
+        vm.pc = f_used ? vm.func_frames[f_used->func_idx].body_pc : 0;
+        if (f_used) run(&vm);
+        if (vm.sp > 0) lazy_results[mode] = vm.stack[vm.sp - 1];
+        if (mode == 1) {
+            lazy_pending[1] = vm.lazy_pending;
+            // 壊れた関数は呼ばれたときに初めて検証エラーになる
+            ExportFunc *f_broken = find_export(&vm, "broken");
+            vm.sp = 0;
+            vm.call_sp = 0;
+            vm.locals[0] = 1;
+            vm.pc = f_broken ? vm.func_frames[f_broken->func_idx].body_pc : 0;
+            if (f_broken) run(&vm);
+            lazy_broken_failed = vm.sp == 0;
+            lazy_pending[2] = vm.lazy_pending;
         }
-
-        free(wasm_code); // 読み込んだメモリを解放
+        vm_teardown(&vm);
     }
+    printf("used(4) = %d / %d (expected 17 / 17)\n", lazy_results[0], lazy_results[1]);
+    printf("unprepared: %u after parse, %u after used(4) (expected 3, 1)\n", lazy_pending[0], lazy_pending[1]);
+    printf("broken(1): %s, unprepared: %u (expected failed, 1)\n", lazy_broken_failed ? "failed" : "ran", lazy_pending[2]);
     printf("--------------------\n");
 
-    // --- テストケース9: ファイルからDataセクションを含むWasmモジュールを読み込んで実行 ---
-    printf("--- Test Case 9: Full module with data section from file ---\n");
-    const char* wasm_data_file_path = "data.wasm";
-    uint8_t *wasm_data_code = NULL;
-    size_t wasm_data_size = 0;
-
-    if (read_wasm_file(wasm_data_file_path, &wasm_data_code, &wasm_data_size) == 0) {
+    printf("--- Test Case 23: Linear memory placement policy ---\n");
+    const char *policy_names[3] = {"normal", "thp", "hugetlb+numa"};
+    int policies[3] = {0, VM_MEM_THP, VM_MEM_HUGETLB | VM_MEM_NUMA_LOCAL};
+    for (int i = 0; i < 3; i++) {
         memset(&vm, 0, sizeof(vm));
-        vm.code = wasm_data_code;
-        vm.size = wasm_data_size;
-
-        // 読み込んだバイト列をダンプ
-        dump_wasm_code(vm.code, vm.size);
-
-        // 1. モジュールをパース
-        parse_sections(&vm);
-
-        // --- ADD: 実行開始前のプロローグ処理 ---
-        ExportFunc *f_data_main = find_export(&vm, "read_and_print");
-        if (f_data_main) {
-            printf("Executing exported function 'read_and_print'...\n");
-            vm.pc = vm.func_pcs[f_data_main->func_idx];
-
-            // 関数のプロローグ: ローカル変数宣言をパース
-            uint32_t local_groups = read_uLEB128(vm.code, &vm.pc);
-            for (uint32_t i = 0; i < local_groups; i++) {
-                (void)read_uLEB128(vm.code, &vm.pc); // num_locals
-                (void)vm.code[vm.pc++]; // type
-            }
+        vm.mem_policy = policies[i];
+        if (vm_init_memory(&vm) < 0) {
+            printf("%s: mmap failed\n", policy_names[i]);
+            continue;
         }
-        // --- END ADD ---
-
-        // 2. ホスト関数を登録
-        vm_register_import(&vm, "env", "print_i32", print_i32);
-
-        // 3. エクスポートされた関数を探して実行
-        ExportFunc *f_data = find_export(&vm, "read_and_print");
-        if (f_data) {
-            // 実行開始PCはプロローグ処理で設定済み
-            run(&vm);
-            printf("Execution finished.\n");
+        vm.memory[VM_MEMORY_SIZE - 1] = 7;
+        int aligned = (uintptr_t)vm.memory % VM_HUGE_PAGE_SIZE == 0;
+        if (i == 0) {
+            printf("%s: %zu KB mapped, last byte = %d (expected 64 KB, 7)\n", policy_names[i],
+                   vm.memory_map_size / 1024, vm.memory[VM_MEMORY_SIZE - 1]);
         } else {
-            printf("Export function 'read_and_print' not found.\n");
+            printf("%s: %zu KB mapped, 2 MB aligned: %s, last byte = %d (expected 2048 KB, yes, 7)\n", policy_names[i],
+                   vm.memory_map_size / 1024, aligned ? "yes" : "no", vm.memory[VM_MEMORY_SIZE - 1]);
         }
-        free(wasm_data_code);
+        vm_teardown(&vm);
     }
     printf("--------------------\n");
 
-    // --- テストケース10: WASIのfd_writeを含むWasmモジュールを実行 ---
-    printf("--- Test Case 10: WASI fd_write from file ---\n");
-    const char* wasm_wasi_file_path = "hello-wat.wasm";
-    uint8_t *wasm_wasi_code = NULL;
-    size_t wasm_wasi_size = 0;
-
-    if (read_wasm_file(wasm_wasi_file_path, &wasm_wasi_code, &wasm_wasi_size) == 0) {
+    printf("--- Test Case 24: Modules beyond the old fixed limits ---\n");
+    // 型 70 個、関数 300 個 + 合計を返す関数、エクスポート 81 個、300 文字の名前のインポートを持つ
+    // モジュールを組み立てる (以前は型 64 個・関数 256 個・エクスポート 64 個・名前 255 文字で打ち切っていた)
+    {
+        enum { BIG_TYPES = 70, BIG_FUNCS = 300, BIG_EXPORTS = 80, BIG_NAME = 300 };
+        static uint8_t big_module[16384];
+        static uint8_t sec[8192];
+        char long_name[BIG_NAME + 1];
+        memset(long_name, 'x', BIG_NAME);
+        long_name[BIG_NAME] = '\0';
+        size_t n = 8, s;
+        memcpy(big_module, "\0asm\1\0\0\0", 8);
+        // type: () -> i32 を BIG_TYPES 個 (構造が同じなので正規化IDはすべて 0)
+        s = put_uLEB128(sec, BIG_TYPES);
+        for (int i = 0; i < BIG_TYPES; i++) {
+            sec[s++] = 0x60; sec[s++] = 0x00; sec[s++] = 0x01; sec[s++] = 0x7f;
+        }
+        n = put_section(big_module, n, 1, sec, s);
+        // import: "env"."xxx...x" () -> i32 (func 0)
+        s = put_uLEB128(sec, 1);
+        s += put_uLEB128(sec + s, 3);
+        memcpy(sec + s, "env", 3);
+        s += 3;
+        s += put_uLEB128(sec + s, BIG_NAME);
+        memcpy(sec + s, long_name, BIG_NAME);
+        s += BIG_NAME;
+        sec[s++] = 0x00; // function
+        sec[s++] = 0x00; // type 0
+        n = put_section(big_module, n, 2, sec, s);
+        // function: func 1..BIG_FUNCS と sum (func BIG_FUNCS + 1)
+        s = put_uLEB128(sec, BIG_FUNCS + 1);
+        for (int i = 0; i <= BIG_FUNCS; i++) s += put_uLEB128(sec + s, i % BIG_TYPES);
+        n = put_section(big_module, n, 3, sec, s);
+        // export: "e0".."e79" → func 1..80, "sum"
+        s = put_uLEB128(sec, BIG_EXPORTS + 1);
+        for (int i = 0; i < BIG_EXPORTS; i++) {
+            char name[8];
+            int len = snprintf(name, sizeof(name), "e%d", i);
+            s += put_uLEB128(sec + s, len);
+            memcpy(sec + s, name, len);
+            s += len;
+            sec[s++] = 0x00;
+            s += put_uLEB128(sec + s, i + 1);
+        }
+        s += put_uLEB128(sec + s, 3);
+        memcpy(sec + s, "sum", 3);
+        s += 3;
+        sec[s++] = 0x00;
+        s += put_uLEB128(sec + s, BIG_FUNCS + 1);
+        n = put_section(big_module, n, 7, sec, s);
+        // code: func k+1 は k を返す。sum はインポートと全関数を呼んで足す
+        s = put_uLEB128(sec, BIG_FUNCS + 1);
+        for (int k = 0; k < BIG_FUNCS; k++) {
+            uint8_t body[8];
+            size_t b = 0;
+            body[b++] = 0x00; // 0 locals
+            body[b++] = 0x41; // i32.const k
+            b += put_sLEB128(body + b, k);
+            body[b++] = 0x0b; // end
+            s += put_uLEB128(sec + s, (uint32_t)b);
+            memcpy(sec + s, body, b);
+            s += b;
+        }
+        uint8_t sum_body[2048];
+        size_t b = 0;
+        sum_body[b++] = 0x00; // 0 locals
+        sum_body[b++] = 0x10; // call 0 (import)
+        sum_body[b++] = 0x00;
+        for (int k = 1; k <= BIG_FUNCS; k++) {
+            sum_body[b++] = 0x10; // call k
+            b += put_uLEB128(sum_body + b, k);
+            sum_body[b++] = 0x6a; // i32.add
+        }
+        sum_body[b++] = 0x0b; // end
+        s += put_uLEB128(sec + s, (uint32_t)b);
+        memcpy(sec + s, sum_body, b);
+        s += b;
+        n = put_section(big_module, n, 10, sec, s);
+
+        // [0] インタプリタ, [1] パース時に全関数をコンパイル (VM_JIT のときのみ)
+        int32_t big_sum[2] = {-1, -1}, big_e79 = -1;
         memset(&vm, 0, sizeof(vm));
-        vm.code = wasm_wasi_code;
-        vm.size = wasm_wasi_size;
-
-        // 読み込んだバイト列をダンプ
-        dump_wasm_code(vm.code, vm.size);
-
-        // 1. モジュールをパース
+        vm.code = big_module;
+        vm.size = n;
         parse_sections(&vm);
-
-        // --- ADD: 実行開始前のプロローグ処理 ---
-        ExportFunc *f_wasi_main = find_export(&vm, "_start");
-        if (f_wasi_main) {
-            printf("Executing exported function '_start'...\n");
-            vm.pc = vm.func_pcs[f_wasi_main->func_idx];
-
-            // 関数のプロローグ: ローカル変数宣言をパース
-            uint32_t local_groups = read_uLEB128(vm.code, &vm.pc);
-            for (uint32_t i = 0; i < local_groups; i++) {
-                (void)read_uLEB128(vm.code, &vm.pc); // num_locals
-                (void)vm.code[vm.pc++]; // type
+        vm_register_import(&vm, "env", long_name, imported_seven);
+        printf("types: %zu, functions: %zu, exports: %zu, import name: %zu chars (expected 70, 302, 81, 300)\n",
+               vm.func_type_count, vm.func_count, vm.export_func_count,
+               vm.import_func_count ? strlen(vm.import_funcs[0].field_name) : 0);
+        ExportFunc *f_sum = find_export(&vm, "sum");
+        ExportFunc *f_e79 = find_export(&vm, "e79");
+        vm.sp = 0;
+        vm.frame_base = 0;
+        vm.call_sp = 0;
+        vm.pc = f_sum ? vm.func_frames[f_sum->func_idx].body_pc : 0;
+        if (f_sum) run(&vm);
+        if (vm.sp > 0) big_sum[0] = vm.stack[vm.sp - 1];
+        vm.sp = 0;
+        vm.call_sp = 0;
+        vm.pc = f_e79 ? vm.func_frames[f_e79->func_idx].body_pc : 0;
+        if (f_e79) run(&vm);
+        if (vm.sp > 0) big_e79 = vm.stack[vm.sp - 1];
+        vm_teardown(&vm);
+        printf("sum() = %d, e79() = %d (expected 44857, 79)\n", big_sum[0], big_e79);
+#if VM_JIT
+        memset(&vm, 0, sizeof(vm));
+        vm.code = big_module;
+        vm.size = n;
+        vm.jit = 2;
+        parse_sections(&vm);
+        vm_register_import(&vm, "env", long_name, imported_seven);
+        f_sum = find_export(&vm, "sum");
+        if (f_sum && vm.func_frames[f_sum->func_idx].native) jit_invoke(&vm, f_sum->func_idx, NULL, &big_sum[1]);
+        printf("native sum() = %d, compiled: %u (expected 44857, 301)\n", big_sum[1], vm.jit_compiled);
+        vm_teardown(&vm);
+#endif
+
+        // 名前の長さに上限はなくなったが、セクションに収まらない長さ (0x7fffffff) の名前は読まない
+        static const uint8_t long_export_module[] = {
+            0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+            0x01, 0x04, 0x01, 0x60, 0x00, 0x00, // type 0: () -> ()
+            0x03, 0x02, 0x01, 0x00, // 1 function: type 0
+            0x07, 0x09, 0x01, 0xff, 0xff, 0xff, 0xff, 0x07, 0x78, 0x00, 0x00, // export (length 0x7fffffff) "x" -> func 0
+            0x0a, 0x04, 0x01, 0x02, 0x00, 0x0b, // func 0: nop
+        };
+        static const uint8_t long_import_module[] = {
+            0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+            0x01, 0x04, 0x01, 0x60, 0x00, 0x00, // type 0: () -> ()
+            0x02, 0x0b, 0x01, 0xff, 0xff, 0xff, 0xff, 0x07, 0x65, 0x01, 0x66, 0x00, 0x00, // import (length 0x7fffffff) "e"."f"
+        };
+        // モジュールの末尾より後ろを読めば ASan で止まるように、ちょうどの大きさの領域に写して読む
+        size_t long_counts[2] = {99, 99};
+        const uint8_t *long_modules[2] = {long_export_module, long_import_module};
+        size_t long_sizes[2] = {sizeof(long_export_module), sizeof(long_import_module)};
+        for (int k = 0; k < 2; k++) {
+            uint8_t *bytes = malloc(long_sizes[k]);
+            if (bytes == NULL) break;
+            memcpy(bytes, long_modules[k], long_sizes[k]);
+            memset(&vm, 0, sizeof(vm));
+            vm.code = bytes;
+            vm.size = long_sizes[k];
+            parse_sections(&vm);
+            long_counts[k] = k == 0 ? vm.export_func_count : vm.import_func_count;
+            vm_teardown(&vm);
+            free(bytes);
+        }
+        printf("exports with a 0x7fffffff-byte name: %zu, imports: %zu (expected 0, 0)\n", long_counts[0], long_counts[1]);
+    }
+    printf("--- Test Case 25: Batched export invocation ---\n");
+    uint8_t wasm_batch_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x07, // section size 7
+        0x01, // 1 types
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x02, // section size 2
+        0x01, // 1 functions
+        0x00, // func 0: type 0
+        // Section 7: Export
+        0x07, 0x09, // section size 9
+        0x01, // 1 exports
+        0x05, 0x73, 0x63, 0x6f, 0x72, 0x65, 0x00, 0x00, // export "score" -> func 0
+        // Section 10: Code
+        0x0a, 0x0f, // section size 15
+        0x01, // 1 function bodies
+        // func 0: score(a, b) = a * 3 + b / a (a = 0 でトラップ)
+        0x0d, // body size 13
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x41, 0x03,             // i32.const 3
+            0x6c,                   // i32.mul
+            0x20, 0x01,             // local.get 1
+            0x20, 0x00,             // local.get 0
+            0x6d,                   // i32.div_s
+            0x6a,                   // i32.add
+            0x0b,                   // end
+    };
+    {
+        enum { BATCH_CALLS = 200, BATCH_VMS = 4 };
+        // 引数は (a, b) の組を詰めて並べる。a = 0 の組 (i % 50 == 25) はゼロ除算でトラップする
+        int32_t batch_args[BATCH_CALLS * 2], batch_results[BATCH_CALLS], batch_expected[BATCH_CALLS];
+        for (int i = 0; i < BATCH_CALLS; i++) {
+            int32_t a = i % 50 == 25 ? 0 : i + 1, b = i * 7 - 300;
+            batch_args[i * 2] = a;
+            batch_args[i * 2 + 1] = b;
+            batch_expected[i] = a ? a * 3 + b / a : 0;
+        }
+        // [0] 1つのインスタンス, [1] 4つのインスタンスに分けて並列, [2] ネイティブコード (VM_JIT のときのみ)
+        int batch_failed[3] = {-1, -1, -1}, batch_mismatch[3] = {0, 0, 0};
+        WasmVM *batch_vms = calloc(BATCH_VMS, sizeof(WasmVM));
+        WasmVM *batch_pool[BATCH_VMS];
+        for (int k = 0; k < BATCH_VMS; k++) {
+            batch_vms[k].code = wasm_batch_module;
+            batch_vms[k].size = sizeof(wasm_batch_module);
+            parse_sections(&batch_vms[k]);
+            batch_pool[k] = &batch_vms[k];
+        }
+        ExportFunc *f_score = find_export(&batch_vms[0], "score");
+        for (int mode = 0; mode < 3 && f_score; mode++) {
+            memset(batch_results, 0xff, sizeof(batch_results));
+            if (mode == 0) {
+                batch_failed[0] = vm_invoke_batch(&batch_vms[0], f_score, batch_args, batch_results, BATCH_CALLS);
+            } else if (mode == 1) {
+                batch_failed[1] = vm_invoke_batch_pool(batch_pool, BATCH_VMS, f_score, batch_args, batch_results, BATCH_CALLS);
+            } else {
+#if VM_JIT
+                batch_vms[0].jit = 2;
+                jit_compile(&batch_vms[0], f_score->func_idx);
+                batch_failed[2] = vm_invoke_batch(&batch_vms[0], f_score, batch_args, batch_results, BATCH_CALLS);
+#endif
+            }
+            for (int i = 0; i < BATCH_CALLS; i++) {
+                if (batch_results[i] != batch_expected[i]) batch_mismatch[mode]++;
             }
         }
-        // --- END ADD ---
+        for (int k = 0; k < BATCH_VMS; k++) vm_teardown(&batch_vms[k]);
+        free(batch_vms);
+        printf("batch: %d trapped, %d mismatches (expected 4, 0)\n", batch_failed[0], batch_mismatch[0]);
+        printf("pool of %d: %d trapped, %d mismatches (expected 4, 0)\n", BATCH_VMS, batch_failed[1], batch_mismatch[1]);
+#if VM_JIT
+        printf("native batch: %d trapped, %d mismatches (expected 4, 0)\n", batch_failed[2], batch_mismatch[2]);
+#endif
+    }
+    printf("--------------------\n");
 
-        // 2. ホスト関数を登録
-        vm_register_import(&vm, "wasi_snapshot_preview1", "fd_write", wasi_fd_write);
+    printf("--- Test Case 26: Public embedding API (wasmvm.h) ---\n");
+    uint8_t wasm_api_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x10, // section size 16
+        0x03, // 3 types
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 0: (i32 i32) -> (i32)
+        0x60, 0x00, 0x01, 0x7f, // type 1: () -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x00, // type 2: (i32 i32) -> ()
+        // Section 2: Import
+        0x02, 0x10, // section size 16
+        0x01, // 1 imports
+        0x03, 0x65, 0x6e, 0x76, 0x08, 0x63, 0x68, 0x65, 0x63, 0x6b, 0x73, 0x75, 0x6d, 0x00, 0x00, // import "env"."checksum" (func)
+        // Section 3: Function
+        0x03, 0x03, // section size 3
+        0x02, // 2 functions
+        0x01, // func 1: type 1
+        0x02, // func 2: type 2
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
+        // Section 7: Export
+        0x07, 0x0f, // section size 15
+        0x02, // 2 exports
+        0x03, 0x72, 0x75, 0x6e, 0x00, 0x01, // export "run" -> func 1
+        0x05, 0x73, 0x74, 0x6f, 0x72, 0x65, 0x00, 0x02, // export "store" -> func 2
+        // Section 10: Code
+        0x0a, 0x14, // section size 20
+        0x02, // 2 function bodies
+        // func 1: run() = env.checksum(16, 5)
+        0x08, // body size 8
+        0x00, // 0 locals
+            0x41, 0x10,             // i32.const 16
+            0x41, 0x05,             // i32.const 5
+            0x10, 0x00,             // call 0
+            0x0b,                   // end
+        // func 2: store(addr, v)
+        0x09, // body size 9
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x36, 0x02, 0x00,       // i32.store
+            0x0b,                   // end
+        // Section 11: Data
+        0x0b, 0x0b, // section size 11
+        0x01, // 1 data segments
+        0x00, 0x41, 0x10, 0x0b, 0x05, 0x68, 0x65, 0x6c, 0x6c, 0x6f, // data at 16: "hello"
+    };
+    {
+        wasmvm_module *api_module = wasmvm_module_load(wasm_api_module, sizeof(wasm_api_module));
+        wasmvm_instance *api_inst = api_module ? wasmvm_instantiate(api_module, 0) : NULL;
+        int32_t api_run = -1, api_stored = 0, api_batch[3] = {0, 0, 0};
+        int api_registered[2] = {0, 0}, api_bad_argc = 0, api_out_of_range = 0, api_batch_failed = -1;
+        if (api_inst) {
+            api_registered[0] = wasmvm_register_host(api_inst, "env", "checksum", api_checksum);
+            api_registered[1] = wasmvm_register_host(api_inst, "env", "missing", api_checksum);
+            wasmvm_export *f_run = wasmvm_find_export(api_inst, "run");
+            wasmvm_export *f_store = wasmvm_find_export(api_inst, "store");
+            if (f_run) wasmvm_invoke(api_inst, f_run, NULL, 0, &api_run);
+            int32_t store_args[2] = {100, 0x12345678};
+            if (f_store) {
+                wasmvm_invoke(api_inst, f_store, store_args, 2, NULL);
+                api_bad_argc = wasmvm_invoke(api_inst, f_store, store_args, 1, NULL);
+            }
+            wasmvm_memory_read(api_inst, 100, &api_stored, sizeof(api_stored));
+            size_t api_mem_size;
+            wasmvm_memory(api_inst, &api_mem_size);
+            uint8_t tail[4];
+            api_out_of_range = wasmvm_memory_read(api_inst, (uint32_t)api_mem_size - 2, tail, sizeof(tail));
+            // メモリの "hello" を書き換えてから、同じ関数をまとめて呼ぶ
+            wasmvm_memory_write(api_inst, 16, "HELLO", 5);
+            if (f_run) api_batch_failed = wasmvm_invoke_batch(api_inst, f_run, NULL, api_batch, 3);
+        }
+        printf("run() = %d, registered: %d / %d (expected 532, 0 / -1)\n", api_run, api_registered[0], api_registered[1]);
+        printf("stored 0x%08x, bad argc: %d, out of range read: %d (expected 0x12345678, -1, -1)\n",
+               (unsigned)api_stored, api_bad_argc, api_out_of_range);
+        printf("batch after write: %d %d %d, trapped %d (expected 372 372 372, 0)\n",
+               api_batch[0], api_batch[1], api_batch[2], api_batch_failed);
+        wasmvm_instance_free(api_inst);
+        wasmvm_module_free(api_module);
+    }
+    // ホスト関数が wasmvm_caller() で同じインスタンスを呼び直す。戻った後も外側の呼び出しのスタック
+    // (1000 と cb の戻り値)・ローカル変数・pc がそのまま続き、その後のトラップも外側の呼び出しに届くこと
+    uint8_t wasm_reenter_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x02, 0x0a, 0x01, 0x03, 0x65, 0x6e, 0x76, 0x02, 0x63, 0x62, 0x00, 0x00, // import "env"."cb" (func)
+        0x03, 0x03, 0x02, 0x00, 0x00, // 2 functions: type 0
+        0x05, 0x03, 0x01, 0x00, 0x01, // memory: min 1
+        0x07, 0x11, 0x02, // 2 exports
+        0x05, 0x6f, 0x75, 0x74, 0x65, 0x72, 0x00, 0x01, // export "outer" -> func 1
+        0x05, 0x69, 0x6e, 0x6e, 0x65, 0x72, 0x00, 0x02, // export "inner" -> func 2
+        0x0a, 0x1a, 0x02, // 2 function bodies
+        0x10, 0x00, // func 1: 1000 + cb(n) + i32.load(n)
+            0x41, 0xe8, 0x07, 0x20, 0x00, 0x10, 0x00, 0x6a, 0x20, 0x00, 0x28, 0x02, 0x00, 0x6a, 0x0b,
+        0x07, 0x00, 0x20, 0x00, 0x41, 0x01, 0x6a, 0x0b, // func 2: n + 1
+    };
+    {
+        // cb(n) は inner(n + 7) = n + 8 を返す。メモリは 0 なので outer(8) = 1000 + 16 + 0、
+        // outer(70000) は i32.load が範囲外でトラップする
+        static const int reenter_options[3] = {0, WASMVM_INTERP_TOS, WASMVM_JIT_EAGER};
+        int32_t reenter_r[3][3];
+        int reenter_ok[3] = {0, 0, 0}, reenter_tiers = VM_JIT ? 3 : 2;
+        wasmvm_module *reenter_m = wasmvm_module_load(wasm_reenter_module, sizeof(wasm_reenter_module));
+        for (int t = 0; t < reenter_tiers; t++) {
+            int32_t reenter_args[3] = {8, 70000, 8};
+            int reenter_rc[3] = {-1, -1, -1};
+            wasmvm_instance *ri = reenter_m ? wasmvm_instantiate(reenter_m, reenter_options[t]) : NULL;
+            wasmvm_export *rf = ri ? wasmvm_find_export(ri, "outer") : NULL;
+            if (rf && wasmvm_register_host(ri, "env", "cb", api_reenter_host) == 0) {
+                for (int k = 0; k < 3; k++) reenter_rc[k] = wasmvm_invoke(ri, rf, &reenter_args[k], 1, &reenter_r[t][k]);
+            }
+            reenter_ok[t] = reenter_rc[0] == 0 && reenter_r[t][0] == 1016 && reenter_rc[1] != 0 &&
+                            reenter_rc[2] == 0 && reenter_r[t][2] == 1016;
+            wasmvm_instance_free(ri);
+        }
+        wasmvm_module_free(reenter_m);
+        printf("reentered outer(8), outer(70000) traps, outer(8) again: interpreter %s, TOS %s, JIT %s (expected ok, ok, %s)\n",
+               reenter_ok[0] ? "ok" : "wrong", reenter_ok[1] ? "ok" : "wrong",
+               VM_JIT ? (reenter_ok[2] ? "ok" : "wrong") : "skipped", VM_JIT ? "ok" : "skipped");
+    }
+    printf("--------------------\n");
 
-        // 3. エクスポートされた関数を探して実行
-        ExportFunc *f_wasi = find_export(&vm, "_start");
-        if (f_wasi) {
-            // 実行開始PCはプロローグ処理で設定済み
-            run(&vm);
-            printf("Execution finished.\n");
-        } else {
-            printf("Export function '_start' not found.\n");
+    printf("--- Test Case 27: Top-of-stack caching interpreter ---\n");
+    uint8_t wasm_tos_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        // Section 1: Type
+        0x01, 0x0c, // section size 12
+        0x02, // 2 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x60, 0x02, 0x7f, 0x7f, 0x01, 0x7f, // type 1: (i32 i32) -> (i32)
+        // Section 3: Function
+        0x03, 0x07, // section size 7
+        0x06, // 6 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        0x01, // func 2: type 1
+        0x01, // func 3: type 1
+        0x00, // func 4: type 0
+        0x00, // func 5: type 0
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
+        // Section 7: Export
+        0x07, 0x27, // section size 39
+        0x06, // 6 exports
+        0x03, 0x6d, 0x69, 0x78, 0x00, 0x00, // export "mix" -> func 0
+        0x03, 0x66, 0x69, 0x62, 0x00, 0x01, // export "fib" -> func 1
+        0x03, 0x64, 0x69, 0x76, 0x00, 0x02, // export "div" -> func 2
+        0x03, 0x72, 0x65, 0x6d, 0x00, 0x03, // export "rem" -> func 3
+        0x04, 0x70, 0x65, 0x65, 0x6b, 0x00, 0x04, // export "peek" -> func 4
+        0x04, 0x70, 0x6f, 0x6b, 0x65, 0x00, 0x05, // export "poke" -> func 5
+        // Section 10: Code
+        0x0a, 0xb9, 0x01, // section size 185
+        0x06, // 6 function bodies
+        // func 0: mix(n) — ループ・メモリ・br_table・呼び出し・if を混ぜた計算
+        0x73, // body size 115
+        0x01, 0x02, 0x7f, // 1 local groups
+            0x02, 0x40,             // block
+            0x03, 0x40,             //   loop
+            0x20, 0x01,             //     local.get 1
+            0x20, 0x00,             //     local.get 0
+            0x4e,                   //     i32.ge_s
+            0x0d, 0x01,             //     br_if 1
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x04,             //     i32.const 4
+            0x6c,                   //     i32.mul
+            0x20, 0x01,             //     local.get 1
+            0x20, 0x01,             //     local.get 1
+            0x6c,                   //     i32.mul
+            0x36, 0x02, 0x00,       //     i32.store
+            0x20, 0x02,             //     local.get 2
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x04,             //     i32.const 4
+            0x6c,                   //     i32.mul
+            0x28, 0x02, 0x00,       //     i32.load
+            0x6a,                   //     i32.add
+            0x21, 0x02,             //     local.set 2
+            0x02, 0x40,             //     block
+            0x02, 0x40,             //       block
+            0x02, 0x40,             //         block
+            0x20, 0x01,             //           local.get 1
+            0x41, 0x03,             //           i32.const 3
+            0x70,                   //           i32.rem_u
+            0x0e, 0x02, 0x00, 0x01, 0x02,//           br_table 0 1 2
+            0x0b,                   //         end
+            0x20, 0x02,             //         local.get 2
+            0x41, 0x01,             //         i32.const 1
+            0x6a,                   //         i32.add
+            0x21, 0x02,             //         local.set 2
+            0x0c, 0x01,             //         br 1
+            0x0b,                   //       end
+            0x20, 0x02,             //       local.get 2
+            0x20, 0x01,             //       local.get 1
+            0x41, 0x0a,             //       i32.const 10
+            0x70,                   //       i32.rem_u
+            0x10, 0x01,             //       call 1
+            0x6b,                   //       i32.sub
+            0x21, 0x02,             //       local.set 2
+            0x0b,                   //     end
+            0x20, 0x02,             //     local.get 2
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x02,             //     i32.const 2
+            0x70,                   //     i32.rem_u
+            0x04, 0x7f,             //     if i32
+            0x41, 0x03,             //       i32.const 3
+            0x05,                   //     else
+            0x41, 0x01,             //       i32.const 1
+            0x0b,                   //     end
+            0x6c,                   //     i32.mul
+            0x20, 0x01,             //     local.get 1
+            0x6a,                   //     i32.add
+            0x21, 0x02,             //     local.set 2
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x01,             //     i32.const 1
+            0x6a,                   //     i32.add
+            0x21, 0x01,             //     local.set 1
+            0x0c, 0x00,             //     br 0
+            0x0b,                   //   end
+            0x0b,                   // end
+            0x20, 0x02,             // local.get 2
+            0x0b,                   // end
+        // func 1: fib(n)
+        0x1c, // body size 28
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x41, 0x02,             // i32.const 2
+            0x48,                   // i32.lt_s
+            0x04, 0x7f,             // if i32
+            0x20, 0x00,             //   local.get 0
+            0x05,                   // else
+            0x20, 0x00,             //   local.get 0
+            0x41, 0x01,             //   i32.const 1
+            0x6b,                   //   i32.sub
+            0x10, 0x01,             //   call 1
+            0x20, 0x00,             //   local.get 0
+            0x41, 0x02,             //   i32.const 2
+            0x6b,                   //   i32.sub
+            0x10, 0x01,             //   call 1
+            0x6a,                   //   i32.add
+            0x0b,                   // end
+            0x0b,                   // end
+        // func 2: div(a, b) = a / b (b = 0 でトラップ)
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6d,                   // i32.div_s
+            0x0b,                   // end
+        // func 3: rem(a, b) = a % b
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x20, 0x01,             // local.get 1
+            0x6f,                   // i32.rem_s
+            0x0b,                   // end
+        // func 4: peek(a) = memory[a + 8]
+        0x07, // body size 7
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x08,       // i32.load 8
+            0x0b,                   // end
+        // func 5: poke(a) — memory[a + 8] = 7 の後で memory[0] を返す
+        0x0e, // body size 14
+        0x00, // 0 locals
+            0x20, 0x00,             // local.get 0
+            0x41, 0x07,             // i32.const 7
+            0x36, 0x02, 0x08,       // i32.store 8
+            0x41, 0x00,             // i32.const 0
+            0x28, 0x02, 0x00,       // i32.load 0
+            0x0b,                   // end
+    };
+    {
+        // 同じ呼び出しを run_loop ([0]) と run_loop_tos ([1]) で実行して比べる。div(7, 0) はゼロ除算でトラップする。
+        // peek(-8) と poke(-8) は a + 8 が 2^32 を越える (32 ビットで足すと memory[0] に折り返す) のでトラップする
+        static const struct { const char *name; int32_t args[2]; } tos_calls[8] = {
+            {"mix", {20, 0}}, {"fib", {15, 0}}, {"div", {-9, 2}}, {"div", {7, 0}},
+            {"rem", {INT32_MIN, -1}}, {"rem", {-7, 2}}, {"peek", {-8, 0}}, {"poke", {-8, 0}},
+        };
+        int32_t tos_results[2][8];
+        int tos_returned[2][8];
+        for (int t = 0; t < 2; t++) {
+            memset(&vm, 0, sizeof(vm));
+            vm.code = wasm_tos_module;
+            vm.size = sizeof(wasm_tos_module);
+            vm.tos_cache = t;
+            parse_sections(&vm);
+            for (int i = 0; i < 8; i++) {
+                ExportFunc *f = find_export(&vm, tos_calls[i].name);
+                vm.sp = 0;
+                vm.call_sp = 0;
+                vm.frame_base = 0;
+                vm.returned = 0;
+                memset(vm.locals, 0, sizeof(vm.locals));
+                memcpy(vm.locals, tos_calls[i].args, sizeof(tos_calls[i].args));
+                if (f) {
+                    vm.pc = vm.func_frames[f->func_idx].body_pc;
+                    run(&vm);
+                }
+                tos_returned[t][i] = vm.returned;
+                tos_results[t][i] = vm.returned && vm.sp > 0 ? vm.stack[vm.sp - 1] : 0;
+            }
+            vm_teardown(&vm);
         }
-        free(wasm_wasi_code);
+        printf("mix(20) = %d / %d, fib(15) = %d / %d (expected 1094752 / 1094752, 610 / 610)\n",
+               tos_results[0][0], tos_results[1][0], tos_results[0][1], tos_results[1][1]);
+        printf("div(-9, 2) = %d / %d, div(7, 0) returned: %d / %d (expected -4 / -4, 0 / 0)\n",
+               tos_results[0][2], tos_results[1][2], tos_returned[0][3], tos_returned[1][3]);
+        printf("rem(INT32_MIN, -1) = %d / %d, rem(-7, 2) = %d / %d (expected 0 / 0, -1 / -1)\n",
+               tos_results[0][4], tos_results[1][4], tos_results[0][5], tos_results[1][5]);
+        printf("peek(-8) returned: %d / %d, poke(-8) returned: %d / %d (expected 0 / 0, 0 / 0)\n",
+               tos_returned[0][6], tos_returned[1][6], tos_returned[0][7], tos_returned[1][7]);
     }
     printf("--------------------\n");
 
-    // --- テストケース11: 再帰呼び出しによるフィボナッチ数の計算 ---
-    printf("--- Test Case 11: Recursive Fibonacci from file ---\n");
-    uint8_t wasm_fib_module[] = {
-        // Magic + Version
-        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    printf("--- Test Case 28: Bounds-checked memory (merged / versioned checks) and guard pages ---\n");
+#if VM_JIT
+    uint8_t wasm_bounds_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
         // Section 1: Type
-        0x01, 0x07, 0x01, // Section size 7, 1 type
-        // type 0: (i32) -> i32
-        0x60, 0x01, 0x7f, 0x01, 0x7f,
+        0x01, 0x06, // section size 6
+        0x01, // 1 types
+        0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
         // Section 3: Function
-        0x03, 0x02, 0x01, 0x00, // Section size 2, 1 function, type_idx 0
+        0x03, 0x03, // section size 3
+        0x02, // 2 functions
+        0x00, // func 0: type 0
+        0x00, // func 1: type 0
+        // Section 5: Memory
+        0x05, 0x03, // section size 3
+        0x01, // 1 memory
+        0x00, 0x01, // flags 0, min 1
         // Section 7: Export
-        0x07, 0x07, 0x01, // Section size 7, 1 export
-        // export "fib" -> func_idx 0
-        0x03, 'f', 'i', 'b', 0x00, 0x00,
+        0x07, 0x0f, // section size 15
+        0x02, // 2 exports
+        0x04, 0x66, 0x69, 0x6c, 0x6c, 0x00, 0x00, // export "fill" -> func 0
+        0x04, 0x73, 0x75, 0x6d, 0x33, 0x00, 0x01, // export "sum3" -> func 1
         // Section 10: Code
-        0x0a, 0x1c, 0x01, // Section size 28, 1 function body
-        // func body 0 (fib):
-        0x1a, // body size 26
+        0x0a, 0x3f, // section size 63
+        0x02, // 2 function bodies
+        // func 0: fill(n) — memory[i*4] = i + 1 (i < n)。n が大きすぎると途中の i でトラップする
+        0x29, // body size 41
+        0x01, 0x01, 0x7f, // 1 local groups
+            0x02, 0x40,             // block
+            0x03, 0x40,             //   loop
+            0x20, 0x01,             //     local.get 1
+            0x20, 0x00,             //     local.get 0
+            0x4e,                   //     i32.ge_s
+            0x0d, 0x01,             //     br_if 1
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x04,             //     i32.const 4
+            0x6c,                   //     i32.mul
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x01,             //     i32.const 1
+            0x6a,                   //     i32.add
+            0x36, 0x02, 0x00,       //     i32.store 0
+            0x20, 0x01,             //     local.get 1
+            0x41, 0x01,             //     i32.const 1
+            0x6a,                   //     i32.add
+            0x21, 0x01,             //     local.set 1
+            0x0c, 0x00,             //     br 0
+            0x0b,                   //   end
+            0x0b,                   // end
+            0x20, 0x01,             // local.get 1
+            0x0b,                   // end
+        // func 1: sum3(p) — memory[p] + memory[p+4] + memory[p+8] (3つのアクセスの検査を1回にまとめる)
+        0x13, // body size 19
         0x00, // 0 locals
-        // if (n <= 1) return n;
-        0x20, 0x00,       // local.get 0
-        0x41, 0x01,       // i32.const 1
-        0x4d,             // i32.le_u (or 4c for le_s)
-        0x04, 0x7f,       // if (result i32)
-        0x20, 0x00,       //   local.get 0
-        // else return fib(n-1) + fib(n-2);
-        0x05,             // else
-        0x20, 0x00,       //   local.get 0
-        0x41, 0x01,       //   i32.const 1
-        0x6b,             //   i32.sub
-        0x10, 0x00,       //   call 0 (fib)
-        0x20, 0x00,       //   local.get 0
-        0x41, 0x02,       //   i32.const 2
-        0x6b,             //   i32.sub
-        0x10, 0x00,       //   call 0 (fib)
-        0x6a,             //   i32.add
-        0x0b,             // end
-        0x0b              // end of function
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x00,       // i32.load 0
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x04,       // i32.load 4
+            0x6a,                   // i32.add
+            0x20, 0x00,             // local.get 0
+            0x28, 0x02, 0x08,       // i32.load 8
+            0x6a,                   // i32.add
+            0x0b,                   // end
     };
+    {
+        // [0] インタプリタ, [1] ネイティブコード (境界検査あり), [2] ネイティブコード (ガードページ)。
+        // fill(20000) は i = 16384 の store でトラップし、それまでの store は残る。
+        // sum3(-4) は base + 4 と base + offset が 2^32 を越える (32 ビットで足すと先頭に折り返す)
+        static const struct { const char *name; int32_t arg; } bounds_calls[5] = {
+            {"fill", 1000}, {"fill", 20000}, {"sum3", 65524}, {"sum3", 65528}, {"sum3", -4},
+        };
+        int32_t bounds_results[3][5], bounds_last[3];
+        int bounds_trapped[3][5], bounds_guarded = 0;
+        uint32_t bounds_checks[3] = {0, 0, 0}, bounds_removed[3] = {0, 0, 0}, bounds_versioned[3] = {0, 0, 0};
+        for (int mode = 0; mode < 3; mode++) {
+            memset(&vm, 0, sizeof(vm));
+            vm.code = wasm_bounds_module;
+            vm.size = sizeof(wasm_bounds_module);
+            vm.jit = mode ? 2 : 0;
+            vm.mem_policy = mode == 2 ? VM_MEM_GUARD : 0;
+            parse_sections(&vm);
+            for (int i = 0; i < 5; i++) {
+                ExportFunc *f = find_export(&vm, bounds_calls[i].name);
+                int32_t arg[1] = {bounds_calls[i].arg};
+                bounds_results[mode][i] = 0;
+                bounds_trapped[mode][i] = 1;
+                if (f == NULL) continue;
+                if (vm.func_frames[f->func_idx].native) {
+                    bounds_trapped[mode][i] = jit_invoke(&vm, f->func_idx, arg, &bounds_results[mode][i]) < 0;
+                } else {
+                    vm.sp = 0;
+                    vm.call_sp = 0;
+                    vm.frame_base = 0;
+                    vm.returned = 0;
+                    memset(vm.locals, 0, sizeof(vm.locals));
+                    vm.locals[0] = arg[0];
+                    vm.pc = vm.func_frames[f->func_idx].body_pc;
+                    run(&vm);
+                    bounds_trapped[mode][i] = !vm.returned;
+                    if (vm.returned && vm.sp > 0) bounds_results[mode][i] = vm.stack[vm.sp - 1];
+                }
+            }
+            memcpy(&bounds_last[mode], vm.memory + VM_MEMORY_SIZE - 4, 4);
+            bounds_checks[mode] = vm.jit_checks;
+            bounds_removed[mode] = vm.jit_checks_removed;
+            bounds_versioned[mode] = vm.jit_loops_versioned;
+            if (mode == 2) bounds_guarded = vm.memory_reserve_size != 0;
+            vm_teardown(&vm);
+        }
+        printf("fill(1000) = %d / %d / %d, fill(20000) trapped: %d / %d / %d (expected 1000 / 1000 / 1000, 1 / 1 / 1)\n",
+               bounds_results[0][0], bounds_results[1][0], bounds_results[2][0],
+               bounds_trapped[0][1], bounds_trapped[1][1], bounds_trapped[2][1]);
+        printf("last word after the trap = %d / %d / %d (expected 16384 / 16384 / 16384)\n",
+               bounds_last[0], bounds_last[1], bounds_last[2]);
+        printf("sum3(65524) = %d / %d / %d, sum3(65528) trapped: %d / %d / %d (expected 49149 / 49149 / 49149, 1 / 1 / 1)\n",
+               bounds_results[0][2], bounds_results[1][2], bounds_results[2][2],
+               bounds_trapped[0][3], bounds_trapped[1][3], bounds_trapped[2][3]);
+        printf("sum3(-4) trapped: %d / %d / %d (expected 1 / 1 / 1)\n",
+               bounds_trapped[0][4], bounds_trapped[1][4], bounds_trapped[2][4]);
+        printf("checked: %u loop versioned, %u of %u checks removed (expected 1, 3 of 5)\n",
+               bounds_versioned[1], bounds_removed[1], bounds_checks[1]);
+        printf("guard pages: %s, %u of %u checks removed (expected yes, 4 of 4)\n",
+               bounds_guarded ? "yes" : "no", bounds_removed[2], bounds_checks[2]);
+    }
+#else
+    printf("skipped (VM_JIT=0)\n");
+#endif
+    printf("--------------------\n");
 
-    memset(&vm, 0, sizeof(vm));
-    vm.code = wasm_fib_module;
-    vm.size = sizeof(wasm_fib_module);
+    printf("--- Test Case 29: Bounded LEB128 decoding ---\n");
+    {
+        // 1〜5バイトの境界の値を、後ろに8バイト以上ある位置 (ctz で長さを求める経路) と
+        // バッファの末尾ちょうど (1バイトずつ読む経路) の両方で read_uLEB128 / read_sLEB128 と比べる
+        static const uint32_t uvals[] = {0, 63, 64, 127, 128, 8191, 8192, 16383, 16384, 2097151, 2097152,
+                                         268435455, 268435456, 0x7FFFFFFF, 0xFFFFFFFF};
+        static const int32_t svals[] = {0, 1, -1, 63, -64, 64, -65, 8191, -8192, 8192, -8193,
+                                        1048575, -1048576, INT32_MAX, INT32_MIN};
+        int leb_cases = 0, leb_mismatches = 0;
+        for (int k = 0; k < 15; k++) {
+            for (int at_end = 0; at_end < 2; at_end++) {
+                uint8_t buf[16] = {0};
+                size_t len = put_uLEB128(buf, uvals[k]), end = at_end ? len : sizeof(buf);
+                size_t p1 = 0, p2 = 0, p3;
+                uint32_t u = read_uLEB128_bounded(buf, &p1, end);
+                p3 = skip_LEB128_bounded(buf, 0, end);
+                leb_mismatches += u != read_uLEB128(buf, &p2) || p1 != p2 || p3 != p2;
+                len = put_sLEB128(buf, svals[k]);
+                end = at_end ? len : sizeof(buf);
+                p1 = p2 = 0;
+                int32_t s = read_sLEB128_bounded(buf, &p1, end);
+                leb_mismatches += s != read_sLEB128(buf, &p2) || s != svals[k] || p1 != p2;
+                leb_cases += 2;
+            }
+        }
+        // 終わる前に end に届く値 (16384 は3バイト) と、5バイトより長い値は不正
+        uint8_t cut[8] = {0x80, 0x80, 0x01};
+        size_t cut_pc = 0;
+        uint32_t cut_value = read_uLEB128_bounded(cut, &cut_pc, 2);
+        uint8_t longer[16] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+        size_t long_pc = 0;
+        uint32_t long_value = read_uLEB128_bounded(longer, &long_pc, sizeof(longer));
+        printf("%d mismatches in %d cases (expected 0 in 60)\n", leb_mismatches, leb_cases);
+        printf("truncated: %u, pc = %zu; too long: %u, pc = %zu (expected 0, 2; 0, 16)\n",
+               cut_value, cut_pc, long_value, long_pc);
+
+        // 途中で切ったモジュールと1バイトを 0x80 / 0xff に壊したモジュールを読み込む。
+        // セクション・関数本体・名前・data セグメントが宣言どおりの大きさになくても、
+        // モジュールの外を読まずにエラーにすること (ASan でビルドすると外を読めば止まる)
+        struct { const uint8_t *bytes; size_t size; } fuzz_fixtures[] = {
+            { wasm_module, sizeof(wasm_module) }, { wasm_table_module, sizeof(wasm_table_module) },
+            { wasm_global_module, sizeof(wasm_global_module) }, { wasm_snapshot_module, sizeof(wasm_snapshot_module) },
+            { wasm_reenter_module, sizeof(wasm_reenter_module) }, { wasm_api_module, sizeof(wasm_api_module) },
+        };
+        int fuzz_truncated = 0, fuzz_corrupted = 0;
+        for (size_t k = 0; k < sizeof(fuzz_fixtures) / sizeof(fuzz_fixtures[0]); k++) {
+            size_t n = fuzz_fixtures[k].size;
+            uint8_t *bytes = malloc(n);
+            if (bytes == NULL) break;
+            for (size_t cut = 8; cut < n + 2 * (n - 8); cut++) {
+                memcpy(bytes, fuzz_fixtures[k].bytes, n);
+                size_t size = n;
+                if (cut < n) {
+                    size = cut;
+                    fuzz_truncated++;
+                } else {
+                    bytes[8 + (cut - n) / 2] = (cut - n) % 2 ? 0xff : 0x80;
+                    fuzz_corrupted++;
+                }
+                wasmvm_module *fm = wasmvm_module_load(bytes, size);
+                wasmvm_instance_free(fm ? wasmvm_instantiate(fm, WASMVM_OPTIMIZE) : NULL);
+                wasmvm_module_free(fm);
+            }
+            free(bytes);
+        }
+        printf("loaded %d truncated and %d corrupted modules (expected 568 and 1136)\n", fuzz_truncated, fuzz_corrupted);
+    }
+    printf("--------------------\n");
 
-    // 1. モジュールをパース
-    parse_sections(&vm);
+    printf("--- Test Case 30: Copy-on-write mapping of data segments ---\n");
+    {
+        // 3ページと100バイトの data セグメントを線形メモリの 8192 に置くモジュールをファイルに書き、
+        // コピーしたインスタンスとファイルからマップしたインスタンスを比べる
+        uint32_t seg_size = 3 * 4096 + 100;
+        uint8_t *seg = malloc(seg_size), *data_module = malloc(seg_size + 8192);
+        char data_path[] = "/tmp/wasmvm-data-XXXXXX";
+        int data_fd = mkstemp(data_path);
+        if (seg == NULL || data_module == NULL || data_fd < 0) {
+            printf("setup failed\n");
+        } else {
+            for (uint32_t i = 0; i < seg_size; i++) seg[i] = (uint8_t)(i * 7 + 1);
+            size_t dn = put_data_module(data_module, 8192, seg, seg_size);
+            int write_ok = write(data_fd, data_module, dn) == (ssize_t)dn;
+            WasmVM copy_vm, map_vm;
+            memset(&copy_vm, 0, sizeof(copy_vm));
+            copy_vm.code = data_module;
+            copy_vm.size = dn;
+            parse_sections(&copy_vm);
+            memset(&map_vm, 0, sizeof(map_vm));
+            map_vm.code = data_module;
+            map_vm.size = dn;
+            map_vm.data_fd = data_fd;
+            map_vm.data_fd_valid = write_ok;
+            parse_sections(&map_vm);
+            int same = memcmp(copy_vm.memory, map_vm.memory, VM_MEMORY_SIZE) == 0;
+            printf("mapped pages: %u, same memory as copy: %s (expected 3, yes)\n",
+                   map_vm.data_pages_mapped, same ? "yes" : "no");
+            // マップしたページに書いても、ファイルと別のインスタンスには見えない
+            map_vm.memory[8192] = 0xAA;
+            WasmVM other_vm;
+            memset(&other_vm, 0, sizeof(other_vm));
+            other_vm.code = data_module;
+            other_vm.size = dn;
+            other_vm.data_fd = data_fd;
+            other_vm.data_fd_valid = write_ok;
+            parse_sections(&other_vm);
+            uint8_t on_disk = 0;
+            if (pread(data_fd, &on_disk, 1, (off_t)(dn - seg_size)) != 1) on_disk = 0;
+            printf("after write: this %#x, other instance %#x, file %#x (expected 0xaa, 0x1, 0x1)\n",
+                   map_vm.memory[8192], other_vm.memory[8192], on_disk);
+            vm_teardown(&other_vm);
+            // vm_reset で書いたページを捨てるとファイルの内容に戻る
+            int reset_ok = vm_snapshot(&map_vm) == 0 && (map_vm.memory[8193] = 0, vm_reset(&map_vm) == 0);
+            printf("after reset: %#x, %#x, ok: %d (expected 0xaa, 0x8, 1)\n",
+                   map_vm.memory[8192], map_vm.memory[8193], reset_ok);
+            vm_teardown(&map_vm);
+            vm_teardown(&copy_vm);
+            // 線形メモリ側がページ境界にそろっていなければコピーする
+            dn = put_data_module(data_module, 8200, seg, seg_size);
+            int rewrite_ok = ftruncate(data_fd, 0) == 0 && pwrite(data_fd, data_module, dn, 0) == (ssize_t)dn;
+            memset(&map_vm, 0, sizeof(map_vm));
+            map_vm.code = data_module;
+            map_vm.size = dn;
+            map_vm.data_fd = data_fd;
+            map_vm.data_fd_valid = rewrite_ok;
+            parse_sections(&map_vm);
+            printf("unaligned offset: mapped pages: %u, same as segment: %s (expected 0, yes)\n",
+                   map_vm.data_pages_mapped, memcmp(map_vm.memory + 8200, seg, seg_size) == 0 ? "yes" : "no");
+            vm_teardown(&map_vm);
+            // 公開 API: wasmvm_module_load_file で読んだモジュールのインスタンスはマップする
+            dn = put_data_module(data_module, 8192, seg, seg_size);
+            rewrite_ok = ftruncate(data_fd, 0) == 0 && pwrite(data_fd, data_module, dn, 0) == (ssize_t)dn;
+            wasmvm_module *dm = rewrite_ok ? wasmvm_module_load_file(data_path) : NULL;
+            wasmvm_instance *di = dm ? wasmvm_instantiate(dm, 0) : NULL;
+            wasmvm_export *peek = di ? wasmvm_find_export(di, "peek") : NULL;
+            int32_t peek_arg = 8192 + 4096, peek_result = 0;
+            if (peek) wasmvm_invoke(di, peek, &peek_arg, 1, &peek_result);
+            printf("API: peek(12288) = %#x, mapped pages: %u (expected 0x160f0801, 3)\n",
+                   (uint32_t)peek_result, di ? ((WasmVM *)di)->data_pages_mapped : 0);
+            wasmvm_instance_free(di);
+            wasmvm_module_free(dm);
+            // モジュール (ファイル) の末尾より後ろを指すセグメントはマップせず 0 を返す
+            memset(&map_vm, 0, sizeof(map_vm));
+            map_vm.code = data_module;
+            map_vm.size = dn;
+            map_vm.data_fd = data_fd;
+            map_vm.data_fd_valid = rewrite_ok;
+            size_t past_end = (dn + 4095) & ~(size_t)4095, past_mapped = 1;
+            if (vm_init_memory(&map_vm) == 0) past_mapped = vm_map_data_segment(&map_vm, 0, past_end, 4096);
+            printf("segment past the end of the module: mapped %zu, memory[0] = %d (expected 0, 0)\n",
+                   past_mapped, map_vm.memory ? map_vm.memory[0] : -1);
+            vm_teardown(&map_vm);
+        }
+        if (data_fd >= 0) {
+            close(data_fd);
+            unlink(data_path);
+        }
+        free(seg);
+        free(data_module);
+    }
+    printf("--------------------\n");
 
-    // --- ADD: 実行開始前のプロローグ処理 ---
-    ExportFunc *f_fib_main = find_export(&vm, "fib");
-    if (f_fib_main) {
-        printf("Executing exported function 'fib(5)'...\n");
-        vm.pc = vm.func_pcs[f_fib_main->func_idx];
-        vm.stack[vm.sp++] = 5; // 引数として 5 をスタックに積む
+    printf("--- Test Case 31: Worker pool with per-worker instance caches ---\n");
+    {
+        // peek(8192) がモジュールごとに違う値 (data セグメントの先頭の i32) を返すモジュール A・B・C
+        uint8_t *pool_bytes = malloc(4096 + 8192);
+        wasmvm_module *pool_mods[3] = {NULL, NULL, NULL};
+        for (int k = 0; k < 3 && pool_bytes; k++) {
+            uint8_t word[4096];
+            for (int i = 0; i < 4096; i++) word[i] = (uint8_t)(k * 16 + i);
+            size_t pn = put_data_module(pool_bytes, 8192, word, sizeof(word));
+            pool_mods[k] = wasmvm_module_load(pool_bytes, pn);
+        }
+        free(pool_bytes);
+        static const int32_t pool_expected[3] = {0x03020100, 0x13121110, 0x23222120};
+        int32_t peek_addr = 8192;
+        // ワーカー2つ・キャッシュ1つずつで A A B B A A B B と呼ぶ。振り分けると A と B が
+        // 別のワーカーに住みつき、順番に回すと毎回もう一方のモジュールのインスタンスを捨てる
+        for (int route = 1; route >= 0; route--) {
+            wasmvm_pool *pool = wasmvm_pool_create(2, 1, route ? WASMVM_POOL_PIN | WASMVM_POOL_ROUTE : 0, 0, NULL);
+            int wrong = 0;
+            for (int i = 0; i < 8 && pool; i++) {
+                int k = (i / 2) % 2;
+                int32_t r = 0;
+                if (wasmvm_pool_invoke(pool, pool_mods[k], "peek", &peek_addr, 1, &r) != 0 || r != pool_expected[k]) wrong++;
+            }
+            size_t hits = 0, misses = 0;
+            if (pool) wasmvm_pool_stats(pool, &hits, &misses);
+            int pinned = 0;
+            for (int i = 0; pool && i < pool->nworkers; i++) pinned += pool->workers[i].cpu >= 0;
+            if (route) {
+                printf("routed: %zu hits, %zu misses, %d wrong, %d workers pinned (expected 6, 2, 0, 2)\n",
+                       hits, misses, wrong, pinned);
+            } else {
+                printf("round robin: %zu hits, %zu misses, %d wrong (expected 0, 8, 0)\n", hits, misses, wrong);
+            }
+            wasmvm_pool_free(pool);
+        }
+        // 4スレッドから3つのモジュールを同時に呼ぶ
+        wasmvm_pool *pool = wasmvm_pool_create(2, 2, WASMVM_POOL_PIN | WASMVM_POOL_ROUTE, 0, NULL);
+        int pool_wrong = 0, pool_calls = 0;
+        if (pool) {
+            PoolClient clients[4];
+            for (int t = 0; t < 4; t++) {
+                clients[t] = (PoolClient){ pool, pool_mods, pool_expected, t, 50, 0 };
+                if (pthread_create(&clients[t].thread, NULL, pool_client_main, &clients[t]) != 0) clients[t].calls = 0;
+            }
+            for (int t = 0; t < 4; t++) {
+                if (clients[t].calls) pthread_join(clients[t].thread, NULL);
+                pool_wrong += clients[t].wrong;
+                pool_calls += clients[t].calls;
+            }
+            size_t hits = 0, misses = 0;
+            wasmvm_pool_stats(pool, &hits, &misses);
+            printf("4 threads: %d calls, %d wrong, hits + misses = %zu (expected 200, 0, 200)\n",
+                   pool_calls, pool_wrong, hits + misses);
+            wasmvm_pool_free(pool);
+        }
+        for (int k = 0; k < 3; k++) wasmvm_module_free(pool_mods[k]);
+    }
+    printf("--------------------\n");
 
-        // 関数のプロローグ: 引数をローカル変数へ
-        FuncType *ftype = &vm.func_types[vm.func_type_indices[f_fib_main->func_idx]];
-        for (int i = ftype->param_count - 1; i >= 0; i--) {
-            vm.locals[i] = vm.stack[--vm.sp];
+    printf("--- Test Case 32: WASI I/O ---\n");
+    {
+        uint8_t wasi_bytes[1024];
+        size_t wn = put_wasi_module(wasi_bytes);
+        strcpy(wasi_test_dir, "/tmp/wasmvm-wasi-XXXXXX");
+        wasmvm_module *wm = mkdtemp(wasi_test_dir) ? wasmvm_module_load(wasi_bytes, wn) : NULL;
+        wasmvm_instance *wi = wm ? wasmvm_instantiate(wm, 0) : NULL;
+        if (wi && wasmvm_wasi_enable(wi, wasi_test_dir) == 0) {
+            int32_t zero = 0, eight = 8;
+            // out.txt を作って "hello, wasi\n" を2つの iovec で書き、先頭を "HELLO" で上書きして読み戻す
+            int32_t open_args[9] = {3, 1, 100, 7, 1 | 8, WASI_RIGHT_FD_READ | WASI_RIGHT_FD_WRITE, 0, 0, 0};
+            int32_t open_errno = wasi_test_call(wi, "open", open_args, 9);
+            int32_t fd = wasi_test_call(wi, "peek", &zero, 1);
+            int32_t write_args[4] = {fd, 324, 2, 8}, pwrite_args[5] = {fd, 308, 1, 0, 8}, pread_args[5] = {fd, 316, 1, 0, 8};
+            int32_t write_errno = wasi_test_call(wi, "write", write_args, 4);
+            int32_t written = wasi_test_call(wi, "peek", &eight, 1);
+            int32_t pwrite_errno = wasi_test_call(wi, "pwrite", pwrite_args, 5);
+            int32_t pwritten = wasi_test_call(wi, "peek", &eight, 1);
+            int32_t pread_errno = wasi_test_call(wi, "pread", pread_args, 5);
+            int32_t nread = wasi_test_call(wi, "peek", &eight, 1);
+            printf("open: errno %d, fd %d (expected 0, 4)\n", open_errno, fd);
+            printf("write: errno %d, %d bytes; pwrite: errno %d, %d bytes (expected 0, 12; 0, 5)\n",
+                   write_errno, written, pwrite_errno, pwritten);
+            printf("pread: errno %d, %d bytes, \"%.11s\" (expected 0, 12, \"HELLO, wasi\")\n",
+                   pread_errno, nread, (const char *)wasmvm_memory(wi, NULL) + 512);
+            int32_t close_errno = wasi_test_call(wi, "close", &fd, 1);
+            int32_t close_again = wasi_test_call(wi, "close", &fd, 1);
+            printf("close: errno %d, again %d (expected 0, 8)\n", close_errno, close_again);
+            // 起点のディレクトリの外は開けない
+            int32_t escape_args[9] = {3, 1, 120, 4, 0, WASI_RIGHT_FD_READ, 0, 0, 0};
+            printf("open ../x: errno %d (expected 76)\n", wasi_test_call(wi, "open", escape_args, 9));
+            int32_t stdout_args[4] = {1, 300, 1, 8};
+            int32_t stdout_errno = wasi_test_call(wi, "write", stdout_args, 4);
+            printf("stdout: errno %d (expected hello, wasi above, then 0)\n", stdout_errno);
+        } else {
+            printf("WASI setup failed\n");
         }
-        // 関数のプロローグ: ローカル変数宣言をパース
-        uint32_t local_groups = read_uLEB128(vm.code, &vm.pc);
-        for (uint32_t i = 0; i < local_groups; i++) {
-            (void)read_uLEB128(vm.code, &vm.pc); // num_locals
-            (void)vm.code[vm.pc++]; // type
+        wasmvm_instance_free(wi);
+#if VM_IO_URING
+        // FIFO を読む呼び出しと書く呼び出しを、1つのワーカーの io_uring で同時に進める。
+        // 同期 I/O のワーカーだと読む側の read で止まり、書く側が実行されない。
+        // io_uring の open はまず O_NONBLOCK で試すので (読む側がいない FIFO の書き込み用の open は ENXIO)、
+        // ホスト側でも FIFO を O_RDWR で開いておく
+        char fifo_path[96], out_path[96];
+        snprintf(fifo_path, sizeof(fifo_path), "%s/fifo", wasi_test_dir);
+        wasmvm_module *wm2 = wm ? wasmvm_module_load(wasi_bytes, wn) : NULL;
+        wasmvm_pool *pool = wm2 && mkfifo(fifo_path, 0600) == 0 ?
+            wasmvm_pool_create(1, 2, WASMVM_POOL_ROUTE | WASMVM_POOL_IO_URING, 0, wasi_test_setup) : NULL;
+        int fifo_hold = pool ? open(fifo_path, O_RDWR | O_CLOEXEC) : -1;
+        if (pool && pool->workers[0].ring.fd >= 0 && fifo_hold >= 0) {
+            WasiFifoReader rd = { pool, wm, -1, -1, 0, 0, 0 };
+            int started = pthread_create(&rd.thread, NULL, wasi_fifo_reader_main, &rd) == 0;
+            int32_t open_args[9] = {3, 1, 110, 4, 0, WASI_RIGHT_FD_WRITE, 0, 0, 4}, four = 4, fd = -1, eight = 8;
+            int32_t open_errno = -1, write_errno = -1, close_errno = -1, written = 0;
+            wasmvm_pool_invoke(pool, wm2, "open", open_args, 9, &open_errno);
+            wasmvm_pool_invoke(pool, wm2, "peek", &four, 1, &fd);
+            int32_t write_args[4] = {fd, 300, 1, 8};
+            wasmvm_pool_invoke(pool, wm2, "write", write_args, 4, &write_errno);
+            wasmvm_pool_invoke(pool, wm2, "peek", &eight, 1, &written);
+            wasmvm_pool_invoke(pool, wm2, "close", &fd, 1, &close_errno);
+            if (written != 12 && write(fifo_hold, "hello, wasi\n", 12) < 0) perror("fifo"); // 読む側を止めたままにしない
+            if (started) pthread_join(rd.thread, NULL);
+            printf("fifo writer: errno %d, %d, %d, %d bytes (expected 0, 0, 0, 12)\n",
+                   open_errno, write_errno, close_errno, written);
+            printf("fifo reader: errno %d, %d, %d bytes, head 0x%x (expected 0, 0, 12, 0x6c6c6568)\n",
+                   rd.open_errno, rd.read_errno, rd.nread, (unsigned)rd.head);
+            printf("io_uring ops > 0: %d (expected 1)\n", pool->workers[0].io_ops > 0);
+        } else {
+            printf("io_uring unavailable, fifo test skipped\n");
         }
+        if (fifo_hold >= 0) close(fifo_hold);
+        wasmvm_pool_free(pool);
+        wasmvm_module_free(wm2);
+        unlink(fifo_path);
+        snprintf(out_path, sizeof(out_path), "%s/out.txt", wasi_test_dir);
+        unlink(out_path);
+#endif
+        wasmvm_module_free(wm);
+        rmdir(wasi_test_dir);
     }
-    // --- END ADD ---
+    printf("--------------------\n");
 
-    // 2. エクスポートされた関数を探して実行
-    ExportFunc *f_fib = find_export(&vm, "fib");
-    if (f_fib) {
+#if VM_OPSTATS
+    // peek(addr) (local.get 0; i32.load; end) を3回呼ぶ。end と次の呼び出しの local.get はペアにならない
+    uint8_t wasm_peek_module[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, // magic + version
+        0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f, // type 0: (i32) -> (i32)
+        0x03, 0x02, 0x01, 0x00, // 1 function: type 0
+        0x05, 0x03, 0x01, 0x00, 0x01, // memory: min 1
+        0x07, 0x08, 0x01, 0x04, 0x70, 0x65, 0x65, 0x6b, 0x00, 0x00, // export "peek" -> func 0
+        0x0a, 0x09, 0x01, 0x07, 0x00, 0x20, 0x00, 0x28, 0x02, 0x00, 0x0b, // func 0: i32.load (addr)
+    };
+    memset(&vm, 0, sizeof(vm));
+    vm.code = wasm_peek_module;
+    vm.size = sizeof(wasm_peek_module);
+    parse_sections(&vm);
+    ExportFunc *f_peek = find_export(&vm, "peek");
+    for (int k = 0; f_peek && k < 3; k++) {
+        vm.sp = 0;
+        vm.call_sp = 0;
+        vm.locals[0] = 0;
+        vm.pc = vm.func_pcs[f_peek->func_idx] + 1; // ローカル変数宣言 (0個) の後から
         run(&vm);
-        printf("fib(5) = %d (expected 5)\n", vm.stack[vm.sp-1]);
+    }
+    if (f_peek && vm.opstats) {
+        OpStats *st = vm.opstats;
+        printf("pairs: local.get -> i32.load %llu, i32.load -> end %llu, end -> local.get %llu (expected 3, 3, 0)\n",
+               (unsigned long long)st->pair[0x20][0x28], (unsigned long long)st->pair[0x28][0x0B],
+               (unsigned long long)st->pair[0x0B][0x20]);
     } else {
-        printf("Export function 'fib' not found.\n");
+        printf("opstats setup failed\n");
     }
-    printf("--------------------\n");
+    vm_teardown(&vm);
+
+    FILE *stats_csv = fopen("opstats.csv", "w");
+    FILE *stats_json = fopen("opstats.json", "w");
+    if (stats_csv) { opstats_write(&opstats_total, stats_csv, 0); fclose(stats_csv); }
+    if (stats_json) { opstats_write(&opstats_total, stats_json, 1); fclose(stats_json); }
+    printf("opstats written to opstats.csv / opstats.json\n");
+#endif
 
     return 0;
 
 }
+#endif // !VM_LIBRARY
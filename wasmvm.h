@@ -0,0 +1,150 @@
+// wasmvm.h — Wasm VM を組み込むための公開 API
+//
+// libwasmvm.a / libwasmvm.so (make lib) とリンクして使う。ここにある型と関数だけが公開されていて、
+// VM の内部の構造体はこのヘッダからは見えない (互換性を保つのはこのヘッダの範囲だけ)。
+//
+//   wasmvm_module *m = wasmvm_module_load_file("main.wasm");
+//   wasmvm_instance *inst = wasmvm_instantiate(m, 0);
+//   wasmvm_register_host(inst, "env", "add", my_add);
+//   wasmvm_export *f = wasmvm_find_export(inst, "main");
+//   int32_t args[2] = {1, 2}, result;
+//   if (wasmvm_invoke(inst, f, args, 2, &result) == 0) ...
+//   wasmvm_instance_free(inst);
+//   wasmvm_module_free(m);
+//
+// 1つのインスタンスは同時に1つのスレッドからしか使えない。スレッドごとにインスタンスを作る。
+#ifndef WASMVM_H
+#define WASMVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define WASMVM_API __attribute__((visibility("default")))
+#else
+#define WASMVM_API
+#endif
+
+#define WASMVM_API_VERSION 1
+
+typedef struct wasmvm_module wasmvm_module;     // 読み込んだモジュール (バイト列を持つ)
+typedef struct wasmvm_instance wasmvm_instance; // インスタンス (線形メモリ・グローバル変数・実行状態)
+typedef struct wasmvm_export wasmvm_export;     // エクスポート関数 (インスタンスが生きている間有効)
+typedef struct wasmvm_pool wasmvm_pool;         // ワーカースレッドとそれぞれのインスタンスのキャッシュ
+
+// ホスト関数。args に argc 個の i32 の引数が並び、戻り値が Wasm 側への戻り値になる。
+// 呼び出し中のインスタンスは wasmvm_caller() で取れる
+typedef int32_t (*wasmvm_host_func)(int32_t *args, int argc);
+
+// wasmvm_instantiate のオプション (OR で組み合わせる)
+#define WASMVM_OPTIMIZE  0x01 // ロード時に関数本体へ覗き穴最適化をかける
+#define WASMVM_LAZY      0x02 // 関数の準備を最初の呼び出しまで遅らせる
+#define WASMVM_JIT       0x04 // ホットな関数をネイティブコードにコンパイルする (x86-64 のみ)
+#define WASMVM_JIT_EAGER 0x08 // インスタンス化のときに全関数をコンパイルする (x86-64 のみ)
+#define WASMVM_MEM_THP   0x10 // 線形メモリに透過的ヒュージページを使う
+#define WASMVM_MEM_NUMA  0x20 // 線形メモリを実行するスレッドの NUMA ノードに置く
+#define WASMVM_INTERP_TOS 0x40 // スタックトップをレジスタに置く版のインタプリタで実行する
+#define WASMVM_MEM_GUARD 0x80 // 線形メモリの後ろにガードページ (約 4GB の予約) を置き、ネイティブコードの
+                              // 境界検査を省く (SIGSEGV のハンドラを入れる)。予約できなければ
+                              // (RLIMIT_AS など) 境界検査をするいつものメモリになる
+
+// バイト列からモジュールを読み込む。バイト列はコピーするので、呼び出し後に解放してよい。
+// Wasm のヘッダでなければ NULL
+WASMVM_API wasmvm_module *wasmvm_module_load(const uint8_t *bytes, size_t size);
+// ファイルから読んだモジュールはファイルを開いたままにし、ページ境界にそろった data セグメントを
+// インスタンスの線形メモリへコピーせずにマップする (モジュールを解放するまでファイルを書き換えないこと)
+WASMVM_API wasmvm_module *wasmvm_module_load_file(const char *path);
+// モジュールから作ったインスタンスを全部解放してから呼ぶ
+WASMVM_API void wasmvm_module_free(wasmvm_module *m);
+
+// インスタンスを作る。失敗したら NULL
+WASMVM_API wasmvm_instance *wasmvm_instantiate(wasmvm_module *m, int options);
+WASMVM_API void wasmvm_instance_free(wasmvm_instance *inst);
+
+// インポートにホスト関数・値を割り当てる。モジュールがその名前をインポートしていなければ -1
+WASMVM_API int wasmvm_register_host(wasmvm_instance *inst, const char *mod, const char *field, wasmvm_host_func func);
+WASMVM_API int wasmvm_register_global(wasmvm_instance *inst, const char *mod, const char *field, int32_t value);
+// ホスト関数の中から、そのホスト関数を呼んでいるインスタンスを返す (それ以外では NULL)
+WASMVM_API wasmvm_instance *wasmvm_caller(void);
+
+// エクスポート関数を名前で探す。なければ NULL
+WASMVM_API wasmvm_export *wasmvm_find_export(wasmvm_instance *inst, const char *name);
+// エクスポート関数のパラメータと戻り値の数
+WASMVM_API int wasmvm_export_signature(wasmvm_instance *inst, wasmvm_export *f, int *param_count, int *result_count);
+
+// エクスポート関数を呼び出す。戻り値がなければ *result は 0。
+// トラップしたか引数の数が合わなければ -1
+WASMVM_API int wasmvm_invoke(wasmvm_instance *inst, wasmvm_export *f, const int32_t *args, int argc, int32_t *result);
+// 同じ関数を count 組の引数 (1組ずつパラメータ数だけ詰めて並べる) で続けて呼び出し、
+// 戻り値を results に書く。トラップした組の戻り値は 0 にし、その数を返す (呼び出せなければ -1)
+WASMVM_API int wasmvm_invoke_batch(wasmvm_instance *inst, wasmvm_export *f, const int32_t *args, int32_t *results, size_t count);
+
+// 線形メモリの先頭と大きさ。ポインタはインスタンスが生きている間有効
+WASMVM_API uint8_t *wasmvm_memory(wasmvm_instance *inst, size_t *size);
+// 線形メモリの [offset, offset + len) を読み書きする。範囲外なら何もせず -1
+WASMVM_API int wasmvm_memory_read(wasmvm_instance *inst, uint32_t offset, void *dst, size_t len);
+WASMVM_API int wasmvm_memory_write(wasmvm_instance *inst, uint32_t offset, const void *src, size_t len);
+
+// --- ワーカープール ---
+// ワーカースレッドごとに、モジュールごとの実行できる状態のインスタンスを cache_size 個まで持ち
+// (古いものから捨てる)、呼び出しをそのワーカーのスレッドで実行する。インスタンスは作ったワーカーの
+// スレッドでしか使わないので、別のコアへ移ってキャッシュから落ちることがない。
+// モジュールはプールを解放するまで解放しないこと
+
+// wasmvm_pool_create のフラグ (OR で組み合わせる)
+#define WASMVM_POOL_PIN   0x01 // ワーカーを1つずつ CPU に固定する (pthread_setaffinity_np)
+#define WASMVM_POOL_ROUTE 0x02 // モジュールのインスタンスをすでに持つワーカーへ優先して送る (なければ順番に回す)
+#define WASMVM_POOL_IO_URING 0x04 // WASI の I/O をワーカーの io_uring に出し、完了を待つ間は同じワーカーで別の呼び出しを
+                                  // 進める (同時に進むのはワーカーあたり cache_size まで)。使えなければ I/O をその場で待つ
+
+// プールがインスタンスを作るたびに、最初の呼び出しの前にワーカーのスレッドで呼ばれる (ホスト関数の登録など)
+typedef void (*wasmvm_instance_setup)(wasmvm_instance *inst);
+
+// workers 個のワーカーを立てる。options は wasmvm_instantiate に渡す。失敗したら NULL
+WASMVM_API wasmvm_pool *wasmvm_pool_create(int workers, int cache_size, int flags, int options, wasmvm_instance_setup setup);
+// キャッシュのインスタンスを全部解放してワーカーを止める (実行中の呼び出しは終わるまで待つ)
+WASMVM_API void wasmvm_pool_free(wasmvm_pool *p);
+// m のエクスポート関数 export_name をどれかのワーカーで呼び出し、終わるまで待つ。複数のスレッドから
+// 同時に呼んでよい。戻り値は wasmvm_invoke と同じ (インスタンスを作れないか関数がなければ -1)
+WASMVM_API int wasmvm_pool_invoke(wasmvm_pool *p, wasmvm_module *m, const char *export_name,
+                                  const int32_t *args, int argc, int32_t *result);
+// 全ワーカーの合計で、キャッシュのインスタンスを使えた呼び出しと作り直した呼び出しの数
+WASMVM_API void wasmvm_pool_stats(wasmvm_pool *p, size_t *hits, size_t *misses);
+
+// --- サンプリングプロファイラ ---
+// make profile (VM_PROFILE=1) でビルドしたときだけ使える (それ以外は何もせず -1)。
+// 測れるのはプロセスで同時に1つのインスタンスだけで、インタプリタで実行している間の関数と呼び出し元を
+// CPU 時間で hz 回/秒 (0 以下なら 1000) 記録する
+WASMVM_API int wasmvm_profile_start(wasmvm_instance *inst, int hz);
+WASMVM_API void wasmvm_profile_stop(void);
+// 記録を flame graph 用の folded-stack 形式 ("caller;callee;op_0xNN 回数" の行) で path に書き、行数を返す。
+// 書けなければ -1
+WASMVM_API int wasmvm_profile_dump(wasmvm_instance *inst, const char *path);
+
+// --- フライトレコーダー ---
+// 関数の出入り・ホスト関数の呼び出し・トラップ・線形メモリの確保と、sample_interval 命令ごと (0 = 記録しない)
+// の PC を、capacity 件 (2の冪に切り上げる) のリングバッファに記録し始める。trap_fd >= 0 ならトラップのたびに
+// そこへ書き出す。VM_FLIGHT=0 のビルドや確保できなければ -1
+WASMVM_API int wasmvm_flight_enable(wasmvm_instance *inst, uint32_t capacity, uint32_t sample_interval, int trap_fd);
+// 直近のイベントを fd に書き出す (make flightdump のデコーダで読める)。実行中のスレッドを止めずに、
+// 別のスレッドやシグナルハンドラから呼んでよい。書けないか、ほかの書き出しの途中なら -1
+WASMVM_API int wasmvm_flight_dump(wasmvm_instance *inst, int fd);
+// シグナル sig を受けたら inst の記録を fd に書き出す (プロセスで1つのインスタンスだけ)
+WASMVM_API int wasmvm_flight_dump_on_signal(wasmvm_instance *inst, int sig, int fd);
+
+// --- WASI ---
+// インスタンスに wasi_snapshot_preview1 の fd_read・fd_write・fd_pread・fd_pwrite・path_open・fd_close を
+// 登録する。ゲストの fd 0〜2 は標準入出力、preopen_dir (NULL = なし) は fd 3 で、path_open はその下だけを
+// 開ける。読み書きはゲストの iovec が指す線形メモリへ直接行う。i64 の引数 (オフセットなど) は下位 32 ビット
+// だけを使う。ディレクトリを開けなければ -1
+WASMVM_API int wasmvm_wasi_enable(wasmvm_instance *inst, const char *preopen_dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WASMVM_H